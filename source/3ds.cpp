@@ -1,10 +1,18 @@
 
-#include <fstream>
+#include <string.h>
 #include "3ds.h"
+#include "lib/system/cpu.h"
+#include "lib/system/mapped_file.h"
+#include "lib/system/thread.h"
+#ifdef CPU_X86
+#include <immintrin.h>
+#endif // CPU_X86
 
 
 using namespace _3ds;
 
+static const unsigned long K_CHUNK_HEADER_SIZE	= 6;	//!< チャンクの id (2 バイト)と長さ(4 バイト)
+
 unsigned long ReadMemory(char* value, const void* mem, unsigned long num)
 {
 	const unsigned long bytes = sizeof(char) * num;
@@ -33,9 +41,9 @@ unsigned long ReadMemory(unsigned short* value, const void* mem, unsigned long n
 	return bytes;
 }
 
-unsigned long ReadMemory(unsigned long* value, const void* mem, unsigned long num)
+unsigned long ReadMemory(unsigned int* value, const void* mem, unsigned long num)
 {
-	const unsigned long bytes = sizeof(unsigned long) * num;
+	const unsigned long bytes = sizeof(unsigned int) * num;
 	memcpy((void*)value, mem, bytes);
 	return bytes;
 }
@@ -47,61 +55,84 @@ unsigned long ReadMemory(float* value, const void* mem, unsigned long num)
 	return bytes;
 }
 
-struct Counter
-{
-	unsigned short num_materials;
-	unsigned short num_meshs;
-};
+#ifdef CONVERT_CM_TO_M
+static const float K_POSITION_SCALE	= 0.01f;
+#else
+static const float K_POSITION_SCALE	= 1.0f;
+#endif // CONVERT_CM_TO_M
 
-void Count(Counter& counter, const char* mem, unsigned long length)
+/*!
+	@brief		座標の配列の変換(スカラー)
+	@param[o]	out: 変換後の座標
+	@param[i]	src: ファイル中の座標(float 3 つずつ詰めたもの、アラインメントは問わない)
+	@param[i]	num: 座標の数
+	@note		CONVERT_LFCS なら y と z を入れ替え、CONVERT_CM_TO_M なら m 単位にする
+ */
+static void convert_positions_scalar(Vector3* out, const char* src, unsigned long num)
 {
-	counter.num_materials = 0;
-	counter.num_meshs = 0;
-
-	unsigned long pos = 0;
-	unsigned long end = length;
-	while(pos < end)
+	for(unsigned long i = 0; i < num; i++)
 	{
-		unsigned short chunk_id;
-		unsigned long chunk_length;
-		pos += ReadMemory(&chunk_id, (const void*)&mem[pos], 1);
-		pos += ReadMemory(&chunk_length, (const void*)&mem[pos], 1);
+		float e[3];
+		memcpy(e, &src[sizeof(float) * 3 * i], sizeof(float) * 3);
+ #ifdef CONVERT_LFCS
+		out[i].set(e[0], e[2], e[1]);
+ #else
+		out[i].set(e[0], e[1], e[2]);
+ #endif // CONVERT_LFCS
+		Vec3Scale(&out[i], &out[i], K_POSITION_SCALE);
+	}
+}
 
-		switch(chunk_id)
-		{
-		// MAIN CHUNK
-		case 0x4D4D:
-		// 3D EDITOR CHUNK
-		case 0x3D3D:
-			break;
-		// MATERIAL BLOCK
-		case 0xAFFF:
-			counter.num_materials++;
-			pos += chunk_length - 6;
-			break;
-		// OBJECT BLOCK
-		case 0x4000:
-			{
-				char c;
-				do
-				{
-					pos += ReadMemory(&c, (const void*)&mem[pos], 1);
-				}while(c != '\0');
-			}
-			break;
-		// TRIANGULAR MESH
-		case 0x4100:
-			counter.num_meshs++;
-			pos += chunk_length - 6;
-			break;
-		// SKIP
-		default:
-			pos += chunk_length - 6;
-			break;
-		}
+#ifdef CPU_X86
+/*!
+	@brief		座標の配列の変換(SSE4)
+	@note		4 頂点(float 12 個)を 3 レジスタで読み、シャッフルで y と z を入れ替える
+				Vector3 は float 3 つを詰めた 12 バイトなので、そのまま 3 レジスタで書き込める
+ */
+TARGET_SSE4 static void convert_positions_sse4(Vector3* out, const char* src, unsigned long num)
+{
+	const __m128 scale = _mm_set1_ps(K_POSITION_SCALE);
+	float* dst = (float*)out;
+	const float* p = (const float*)src;
+	const unsigned long num4 = num & ~3ul;
+	for(unsigned long i = 0; i < num4; i += 4, p += 12, dst += 12)
+	{
+		// a = (x0 y0 z0 x1), b = (y1 z1 x2 y2), c = (z2 x3 y3 z3)
+		const __m128 a = _mm_loadu_ps(p);
+		const __m128 b = _mm_loadu_ps(p + 4);
+		const __m128 c = _mm_loadu_ps(p + 8);
+ #ifdef CONVERT_LFCS
+		// (x0 z0 y0 x1), (z1 y1 x2 z2), (y2 x3 z3 y3)
+		const __m128 o0 = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 1, 2, 0));
+		const __m128 t1 = _mm_shuffle_ps(b, c, _MM_SHUFFLE(0, 0, 2, 2));
+		const __m128 o1 = _mm_shuffle_ps(b, t1, _MM_SHUFFLE(2, 0, 0, 1));
+		const __m128 t2 = _mm_shuffle_ps(b, c, _MM_SHUFFLE(1, 1, 3, 3));
+		const __m128 o2 = _mm_shuffle_ps(t2, c, _MM_SHUFFLE(2, 3, 2, 0));
+ #else
+		const __m128 o0 = a;
+		const __m128 o1 = b;
+		const __m128 o2 = c;
+ #endif // CONVERT_LFCS
+		_mm_storeu_ps(dst, _mm_mul_ps(o0, scale));
+		_mm_storeu_ps(dst + 4, _mm_mul_ps(o1, scale));
+		_mm_storeu_ps(dst + 8, _mm_mul_ps(o2, scale));
 	}
+	convert_positions_scalar(&out[num4], (const char*)p, num - num4);
 }
+#endif // CPU_X86
 
+typedef void (*ConvertPositions)(Vector3* out, const char* src, unsigned long num);
+
+static ConvertPositions get_convert_positions()
+{
+ #ifdef CPU_X86
+	if(cpu_has_sse4())
+		return convert_positions_sse4;
+ #endif // CPU_X86
+	return convert_positions_scalar;
+}
+
+static const ConvertPositions convert_positions = get_convert_positions();
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -113,6 +144,10 @@ Mesh::Mesh()
 	coords = NULL;
 	num_faces = 0;
 	faces = NULL;
+	local_x.set(1.0f, 0.0f, 0.0f);
+	local_y.set(0.0f, 1.0f, 0.0f);
+	local_z.set(0.0f, 0.0f, 1.0f);
+	center.set(0.0f, 0.0f, 0.0f);
 }
 
 Mesh::~Mesh()
@@ -137,39 +172,28 @@ Geometry::~Geometry()
 	Release();
 }
 
-bool Geometry::Load(const std::string& filename)
+/*!
+	@brief		読み込み
+	@param[i]	filename: ファイル名
+	@param[i]	max_thread: 法線の算出に使うスレッド数(0 ならハードウェアの並列数)
+	@note		ファイルはメモリに割り当てて直接読むので、ファイル全体を読み込むバッファは確保しない
+				頂点や面の配列はチャンクからメッシュの配列へ 1 度で変換する
+ */
+bool Geometry::Load(const std::string& filename, std::size_t max_thread)
 {
 	Release();
 
-	std::ifstream ifs;
-	ifs.open(filename.c_str(), std::ios::in | std::ios::binary);
-	if(!ifs)
+	MappedFile file;
+	if(!file.open(filename.c_str()))
 		return false;
 
-	ifs.seekg(0, std::ios_base::end);
-	const unsigned long length = ifs.tellg();
-	memory = new char[length];
-	if(!memory)
-	{
-		ifs.close();
-		return false;
-	}
-	ifs.seekg(0, std::ios_base::beg);
-	ifs.read(memory, length);
-	ifs.close();
-
-	Counter counter;
-	Count(counter, memory, length);
-	materials.reserve(counter.num_materials);
-	meshes.reserve(counter.num_meshs);
-
-	Read(length);
-
-	delete[] memory;
+	memory = file.data();
+	Read((unsigned long)file.size());
 	memory = NULL;
+	file.close();
 
 	const float smoothing_angle = PI / 4;	// 暫定で 45 度
-	CalcNormal(smoothing_angle);
+	CalcNormal(smoothing_angle, max_thread);
 
 	return true;
 }
@@ -187,23 +211,17 @@ void Geometry::Release()
 		delete (*it);
 	}
 	mesh_array().swap(meshes);
-
-	if(memory)
-	{
-		delete[] memory;
-		memory = NULL;
-	}
 }
 
-unsigned long Geometry::Read(unsigned long length)
+void Geometry::Read(unsigned long length)
 {
 	unsigned long pos = 0;
 	unsigned long end = length;
 	std::string name;
-	while(pos < end)
+	while(pos + K_CHUNK_HEADER_SIZE <= end)
 	{
 		unsigned short chunk_id;
-		unsigned long chunk_length;
+		unsigned int chunk_length;
 		pos += ReadMemory(&chunk_id, (const void*)&memory[pos], 1);
 		pos += ReadMemory(&chunk_length, (const void*)&memory[pos], 1);
 
@@ -232,11 +250,18 @@ unsigned long Geometry::Read(unsigned long length)
 		// TRIANGULAR MESH
 		case 0x4100:
 			{
+				// 中身がチャンクに収まっていないメッシュは捨てる
 				Mesh* mesh = new Mesh;
-				memset((void*)mesh, 0, sizeof(Mesh));
 				mesh->name = name;
-				meshes.push_back(mesh);
-				pos = ReadMesh(*mesh, pos, chunk_length-6);
+				if((chunk_length >= K_CHUNK_HEADER_SIZE) && (chunk_length - K_CHUNK_HEADER_SIZE <= end - pos) && ReadMesh(*mesh, pos, chunk_length-6))
+				{
+					meshes.push_back(mesh);
+				}
+				else
+				{
+					delete mesh;
+				}
+				pos += chunk_length - 6;
 			}
 			break;
 		// SKIP
@@ -245,16 +270,15 @@ unsigned long Geometry::Read(unsigned long length)
 			break;
 		}
 	}
-	return 0;
 }
 
 unsigned long Geometry::ReadMaterial(Material& material, unsigned long pos, unsigned long length)
 {
 	unsigned long end = pos + length;
-	while(pos < end)
+	while(pos + K_CHUNK_HEADER_SIZE <= end)
 	{
 		unsigned short chunk_id;
-		unsigned long chunk_length;
+		unsigned int chunk_length;
 		pos += ReadMemory(&chunk_id, (const void*)&memory[pos], 1);
 		pos += ReadMemory(&chunk_length, (const void*)&memory[pos], 1);
 
@@ -297,15 +321,37 @@ unsigned long Geometry::ReadMaterial(Material& material, unsigned long pos, unsi
 	return pos;
 }
 
-unsigned long Geometry::ReadMesh(Mesh& mesh, unsigned long pos, unsigned long length)
+/*!
+	@brief	memory[pos] から size バイトが end までに収まるか
+	@param[i]	pos		読み出し位置(end 以下であること)
+	@param[i]	size	読み出すバイト数
+	@param[i]	end		読み出せる範囲の終端
+	@return	収まれば true
+ */
+static inline bool fits(unsigned long pos, unsigned long size, unsigned long end)
+{
+	return size <= end - pos;
+}
+
+/*!
+	@return	サブチャンクや要素の並びがメッシュのチャンクに収まっていなければ false
+ */
+bool Geometry::ReadMesh(Mesh& mesh, unsigned long pos, unsigned long length)
 {
 	const unsigned long end = pos + length;
-	while(pos < end)
+	while(pos + K_CHUNK_HEADER_SIZE <= end)
 	{
+		const unsigned long chunk_begin = pos;
 		unsigned short chunk_id;
-		unsigned long chunk_length;
+		unsigned int chunk_length;
 		pos += ReadMemory(&chunk_id, (const void*)&memory[pos], 1);
 		pos += ReadMemory(&chunk_length, (const void*)&memory[pos], 1);
+		if((chunk_length < K_CHUNK_HEADER_SIZE) || !fits(chunk_begin, chunk_length, end))
+		{
+			return false;
+		}
+		// 面リストは面材質などのサブチャンクを含むので、その終端まで読める
+		const unsigned long chunk_end = chunk_begin + chunk_length;
 
 		switch(chunk_id)
 		{
@@ -313,7 +359,15 @@ unsigned long Geometry::ReadMesh(Mesh& mesh, unsigned long pos, unsigned long le
 		case 0x4110:
 			{
 				unsigned short num_vertices;
+				if(!fits(pos, sizeof(num_vertices), chunk_end))
+				{
+					return false;
+				}
 				pos += ReadMemory(&num_vertices, (const void*)&memory[pos], 1);
+				if(!fits(pos, sizeof(float) * 3 * num_vertices, chunk_end))
+				{
+					return false;
+				}
 				mesh.num_vertices = num_vertices;
 				if(num_vertices == 0)
 				{
@@ -321,26 +375,23 @@ unsigned long Geometry::ReadMesh(Mesh& mesh, unsigned long pos, unsigned long le
 					break;
 				}
 				mesh.vertices = new Vector3[num_vertices];
-				for(unsigned short i = 0; i < num_vertices; i++)
-				{
-					float e[3];
-					pos += ReadMemory(e, (const void*)&memory[pos], 3);
- #ifdef CONVERT_LFCS
-					mesh.vertices[i].set(e[0], e[2], e[1]);
-  #ifdef CONVERT_CM_TO_M
-					Vec3Scale(&mesh.vertices[i], &mesh.vertices[i], 0.01f);
-  #endif // CONVERT_CM_TO_M
- #else
-					mesh.vertices[i].set(e[0], e[1], e[2]);
- #endif // CONVERT_LFCS
-				}
+				convert_positions(mesh.vertices, &memory[pos], num_vertices);
+				pos += sizeof(float) * 3 * num_vertices;
 			}
 			break;
 		// FACES DESCRIPTION
 		case 0x4120:
 			{
 				unsigned short num_faces;
+				if(!fits(pos, sizeof(num_faces), chunk_end))
+				{
+					return false;
+				}
 				pos += ReadMemory(&num_faces, (const void*)&memory[pos], 1);
+				if(!fits(pos, sizeof(unsigned short) * 4 * num_faces, chunk_end))
+				{
+					return false;
+				}
 				mesh.num_faces = num_faces;
 				if(num_faces == 0)
 				{
@@ -349,20 +400,24 @@ unsigned long Geometry::ReadMesh(Mesh& mesh, unsigned long pos, unsigned long le
 				}
 				mesh.faces = new Face[num_faces];
 				memset((void*)mesh.faces, 0, sizeof(Face)*num_faces);
+				const char* src = &memory[pos];
 				for(unsigned short i = 0; i < num_faces; i++)
 				{
+					// a, b, c, フラグ
 					unsigned short e[4];
-					pos += ReadMemory(e, (const void*)&memory[pos], 4);
+					memcpy(e, &src[sizeof(e) * i], sizeof(e));
+					Face& face = mesh.faces[i];
  #ifdef CONVERT_LFCS
-					mesh.faces[i].a = e[0];
-					mesh.faces[i].b = e[2];
-					mesh.faces[i].c = e[1];
+					face.a = e[0];
+					face.b = e[2];
+					face.c = e[1];
  #else
-					mesh.faces[i].a = e[0];
-					mesh.faces[i].b = e[1];
-					mesh.faces[i].c = e[2];
+					face.a = e[0];
+					face.b = e[1];
+					face.c = e[2];
  #endif // CONVERT_LFCS
 				}
+				pos += sizeof(unsigned short) * 4 * num_faces;
 			}
 			break;
 		// FACE MATERIAL
@@ -382,12 +437,20 @@ unsigned long Geometry::ReadMesh(Mesh& mesh, unsigned long pos, unsigned long le
 				}
 
 				unsigned short num_faces;
+				if((pos > chunk_end) || !fits(pos, sizeof(num_faces), chunk_end))
+				{
+					return false;
+				}
 				pos += ReadMemory(&num_faces, (const void*)&memory[pos], 1);
+				if(!fits(pos, sizeof(unsigned short) * num_faces, chunk_end))
+				{
+					return false;
+				}
 				for(unsigned short i = 0; i < num_faces; i++)
 				{
 					unsigned short face_id;
 					pos += ReadMemory(&face_id, (const void*)&memory[pos], 1);
-					if(i == face_id)
+					if((i == face_id) && (i < mesh.num_faces))
 					{
 						mesh.faces[i].mtrl_id = mtrl_id;
 					}
@@ -405,23 +468,23 @@ unsigned long Geometry::ReadMesh(Mesh& mesh, unsigned long pos, unsigned long le
 					mesh.coords = NULL;
 					break;
 				}
+				// ファイル中も float 2 つずつなので、そのまま写す
 				mesh.coords = new Coord[num_coords];
-				for(unsigned short i = 0; i < num_coords; i++)
-				{
-					float coord[2];
-					pos += ReadMemory(coord, (const void*)&memory[pos], 2);
-					mesh.coords[i].u = coord[0];
-					mesh.coords[i].v = coord[1];
-				}
+				memcpy((void*)mesh.coords, &memory[pos], sizeof(Coord) * num_coords);
+				pos += sizeof(Coord) * num_coords;
 			}
 			break;
 		// FACE SMOOTHING GROUP
 		case 0x4150:
 			{
 				const unsigned short num_faces = mesh.num_faces;
+				if(!fits(pos, sizeof(unsigned int) * num_faces, chunk_end))
+				{
+					return false;
+				}
 				for(unsigned short i = 0; i < num_faces; i++)
 				{
-					unsigned long sg;
+					unsigned int sg;
 					pos += ReadMemory(&sg, (const void*)&memory[pos], 1);
 					mesh.faces[i].sg = sg;
 				}
@@ -430,15 +493,18 @@ unsigned long Geometry::ReadMesh(Mesh& mesh, unsigned long pos, unsigned long le
 		// LOCAL AXIS
 		case 0x4160:
 			{
-				float e[3];
-				pos += ReadMemory(e, (const void*)&memory[pos], 3);
-				mesh.local_x.set(e[0], e[1], e[2]);
-				pos += ReadMemory(e, (const void*)&memory[pos], 3);
-				mesh.local_y.set(e[0], e[1], e[2]);
-				pos += ReadMemory(e, (const void*)&memory[pos], 3);
-				mesh.local_z.set(e[0], e[1], e[2]);
-				pos += ReadMemory(e, (const void*)&memory[pos], 3);
-				mesh.center.set(e[0], e[1], e[2]);
+				// 頂点と同じ変換をかけて、変換後の頂点に対するローカル座標系にする
+				Vector3 axes[4];
+				if(!fits(pos, sizeof(float) * 3 * 4, chunk_end))
+				{
+					return false;
+				}
+				convert_positions_scalar(axes, &memory[pos], 4);
+				pos += sizeof(float) * 3 * 4;
+				mesh.local_x = axes[0];
+				mesh.local_y = axes[1];
+				mesh.local_z = axes[2];
+				mesh.center = axes[3];
 			}
 			break;
 		// SKIP
@@ -447,13 +513,13 @@ unsigned long Geometry::ReadMesh(Mesh& mesh, unsigned long pos, unsigned long le
 			break;
 		}
 	}
-	return pos;
+	return true;
 }
 
 unsigned long Geometry::ReadColor(Color& color, unsigned long pos)
 {
 	unsigned short chunk_id;
-	unsigned long chunk_length;
+	unsigned int chunk_length;
 	pos += ReadMemory(&chunk_id, (const void*)&memory[pos], 1);
 	pos += ReadMemory(&chunk_length, (const void*)&memory[pos], 1);
 
@@ -491,7 +557,7 @@ unsigned long Geometry::ReadColor(Color& color, unsigned long pos)
 unsigned long Geometry::ReadQuantity(float& q, unsigned long pos)
 {
 	unsigned short chunk_id;
-	unsigned long chunk_length;
+	unsigned int chunk_length;
 	pos += ReadMemory(&chunk_id, (const void*)&memory[pos], 1);
 	pos += ReadMemory(&chunk_length, (const void*)&memory[pos], 1);
 
@@ -523,72 +589,165 @@ unsigned long Geometry::ReadQuantity(float& q, unsigned long pos)
 
 unsigned long Geometry::ReadName(std::string& name, unsigned long pos)
 {
-	char c;
-	do
-	{
-		pos += ReadMemory(&c, (const void*)&memory[pos], 1);
-		name.append(1, c);
-	}while(c != '\0');
-
-	return pos;
+	// 終端の '\0' も名前に含める
+	const unsigned long length = (unsigned long)strlen(&memory[pos]) + 1;
+	name.append(&memory[pos], length);
+	return pos + length;
 }
 
 /*!
-	@brief		法線ベクトルの算出
-	@param[i]	angle: スムージングアングル [rad]
+	@brief	頂点から面を引く表
+	@note	頂点 v を共有する面は faces[offsets[v]] から faces[offsets[v+1]] の手前まで
  */
-void Geometry::CalcNormal(float angle)
+struct VertexFaces
 {
-	// 面法線
-	for(mesh_array::iterator it = meshes.begin(); it != meshes.end(); it++)
+	std::vector<unsigned int>	offsets;
+	std::vector<unsigned int>	faces;
+};
+
+/*!
+	@brief	面法線と頂点の隣接の算出用ワーク
+	@class	FaceNormalWork
+	@note	メッシュ 1 つ分
+ */
+class FaceNormalWork : public Work
+{
+public:
+	FaceNormalWork(Mesh* mesh, VertexFaces* adjacency) : mesh(mesh), adjacency(adjacency) {}
+
+	void execute(std::size_t)
 	{
-		const Vector3* vertices = (*it)->vertices;
-		const unsigned short num_faces = (*it)->num_faces;
-		for(unsigned short i = 0; i < num_faces; i++)
+		const Vector3* vertices = mesh->vertices;
+		Face* faces = mesh->faces;
+		const unsigned int num_faces = mesh->num_faces;
+		for(unsigned int i = 0; i < num_faces; i++)
 		{
-			Face* face = &(*it)->faces[i];
+			Face& face = faces[i];
 			Vector3 e0, e1, n;
-			Vec3Subtract(&e0, &vertices[face->b], &vertices[face->a]);
-			Vec3Subtract(&e1, &vertices[face->c], &vertices[face->a]);
+			Vec3Subtract(&e0, &vertices[face.b], &vertices[face.a]);
+			Vec3Subtract(&e1, &vertices[face.c], &vertices[face.a]);
 			Vec3OuterProduct(&n, &e0, &e1);
 			Vec3Normalize(&n, &n);
-			face->n  = n;
+			face.n = n;
+		}
+
+		// 頂点毎の面の数を数えて累積し、面の番号を詰める
+		std::vector<unsigned int>& offsets = adjacency->offsets;
+		offsets.assign(mesh->num_vertices + 1, 0);
+		for(unsigned int i = 0; i < num_faces; i++)
+		{
+			offsets[faces[i].a + 1]++;
+			offsets[faces[i].b + 1]++;
+			offsets[faces[i].c + 1]++;
+		}
+		for(std::size_t v = 0; v < mesh->num_vertices; v++)
+			offsets[v + 1] += offsets[v];
+		std::vector<unsigned int> fill(offsets.begin(), offsets.end() - 1);
+		adjacency->faces.resize(offsets.back());
+		for(unsigned int i = 0; i < num_faces; i++)
+		{
+			adjacency->faces[fill[faces[i].a]++] = i;
+			adjacency->faces[fill[faces[i].b]++] = i;
+			adjacency->faces[fill[faces[i].c]++] = i;
 		}
 	}
-	// 頂点法線
-	for(mesh_array::iterator it = meshes.begin(); it != meshes.end(); it++)
+
+private:
+	Mesh*			mesh;
+	VertexFaces*	adjacency;
+};
+
+/*!
+	@brief	頂点法線の算出用ワーク
+	@class	VertexNormalWork
+	@note	メッシュの [begin, end) の面
+			書き込むのは担当する面の頂点法線だけなので、同じメッシュを分けても競合しない
+ */
+class VertexNormalWork : public Work
+{
+public:
+	VertexNormalWork(Mesh* mesh, const VertexFaces* adjacency, float cos_angle, unsigned int begin, unsigned int end)
+		: mesh(mesh), adjacency(adjacency), cos_angle(cos_angle), begin(begin), end(end)
+	{
+	}
+
+	void execute(std::size_t)
 	{
-		Face* faces = (*it)->faces;
-		const unsigned short num_faces = (*it)->num_faces;
-		for(unsigned short i = 0; i < num_faces; i++)
+		const Face* faces = mesh->faces;
+		for(unsigned int i = begin; i < end; i++)
 		{
-			Vector3 n0, n1, n2;
-			n0 = faces[i].n;
-			n1 = faces[i].n;
-			n2 = faces[i].n;
-			for(unsigned short j = 0; j < num_faces; j++)
+			Face& face = mesh->faces[i];
+			const unsigned short corners[3] = { face.a, face.b, face.c };
+			Vector3* normals[3] = { &face.n0, &face.n1, &face.n2 };
+			for(int k = 0; k < 3; k++)
 			{
-				if((i == j) || (faces[i].sg != faces[j].sg))
-					continue;
-				if((faces[i].a == faces[j].a) || (faces[i].a == faces[j].b) || (faces[i].a == faces[j].c))
-				{
-					if(acosf(Vec3InnerProduct(&faces[i].n, &faces[j].n)) <= angle)
-						Vec3Add(&n0, &n0, &faces[j].n);
-				}
-				if((faces[i].b == faces[j].a) || (faces[i].b == faces[j].b) || (faces[i].b == faces[j].c))
-				{
-					if(acosf(Vec3InnerProduct(&faces[i].n, &faces[j].n)) <= angle)
-						Vec3Add(&n1, &n1, &faces[j].n);
-				}
-				if((faces[i].c == faces[j].a) || (faces[i].c == faces[j].b) || (faces[i].c == faces[j].c))
+				// 滑らかにつなぐのはスムージンググループを共有し、面法線のなす角が閾値以下の面
+				Vector3 n = face.n;
+				const unsigned int* it = adjacency->faces.data() + adjacency->offsets[corners[k]];
+				const unsigned int* it_end = adjacency->faces.data() + adjacency->offsets[corners[k] + 1];
+				for(; it != it_end; it++)
 				{
-					if(acosf(Vec3InnerProduct(&faces[i].n, &faces[j].n)) <= angle)
-						Vec3Add(&n1, &n1, &faces[j].n);
+					const Face& other = faces[*it];
+					if((*it == i) || ((face.sg & other.sg) == 0))
+						continue;
+					if(Vec3InnerProduct(&face.n, &other.n) >= cos_angle)
+						Vec3Add(&n, &n, &other.n);
 				}
+				Vec3Normalize(normals[k], &n);
 			}
-			Vec3Normalize(&faces[i].n0, &n0);
-			Vec3Normalize(&faces[i].n1, &n1);
-			Vec3Normalize(&faces[i].n2, &n2);
 		}
 	}
+
+private:
+	Mesh*				mesh;
+	const VertexFaces*	adjacency;
+	float				cos_angle;
+	unsigned int		begin;
+	unsigned int		end;
+};
+
+/*!
+	@brief		法線ベクトルの算出
+	@param[i]	angle: スムージングアングル [rad]
+	@param[i]	max_thread: スレッド数(0 ならハードウェアの並列数)
+	@note		頂点から面を引く表を作り、各頂点で共有する面だけを調べるので面の数に比例する
+				面法線と表はメッシュ毎に、頂点法線は面を K_FACES_PER_WORK ずつに分けて並列に求める
+				スムージンググループはビットマスクで、共通のビットを持つ面どうしを滑らかにつなぐ
+ */
+void Geometry::CalcNormal(float angle, std::size_t max_thread)
+{
+	static const unsigned int K_FACES_PER_WORK	= 4096;
+
+	std::vector<VertexFaces> adjacency(meshes.size());
+	std::vector<Work*> works;
+	WorkPile pile(max_thread);
+
+	// 面法線
+	for(std::size_t i = 0; i < meshes.size(); i++)
+	{
+		if(meshes[i]->num_faces == 0)
+			continue;
+		works.push_back(new FaceNormalWork(meshes[i], &adjacency[i]));
+		pile.request(works.back());
+	}
+	pile.run();
+	for(std::size_t i = 0; i < works.size(); i++)
+		delete works[i];
+	works.clear();
+
+	// 頂点法線
+	const float cos_angle = cosf(angle);
+	for(std::size_t i = 0; i < meshes.size(); i++)
+	{
+		const unsigned int num_faces = meshes[i]->num_faces;
+		for(unsigned int begin = 0; begin < num_faces; begin += K_FACES_PER_WORK)
+		{
+			const unsigned int end = (begin + K_FACES_PER_WORK < num_faces)? begin + K_FACES_PER_WORK : num_faces;
+			works.push_back(new VertexNormalWork(meshes[i], &adjacency[i], cos_angle, begin, end));
+			pile.request(works.back());
+		}
+	}
+	pile.run();
+	for(std::size_t i = 0; i < works.size(); i++)
+		delete works[i];
 }
@@ -69,7 +69,7 @@ public:
 	Coord*			coords;
 	unsigned short	num_faces;
 	Face*			faces;
-	Vector3			local_x;
+	Vector3			local_x;	//!< ローカル座標系(頂点と同じ変換済み)
 	Vector3			local_y;
 	Vector3			local_z;
 	Vector3			center;
@@ -86,25 +86,25 @@ class Geometry
 public:
 	Geometry();
 	~Geometry();
-	bool Load(const std::string& filename);
+	bool Load(const std::string& filename, std::size_t max_thread = 0);
 	void Release();
 
 	material_array& GetMaterials(){ return materials; }
 	mesh_array& GetMeshes(){ return meshes; }
 
 private:
-	unsigned long Read(unsigned long length);
+	void Read(unsigned long length);
 	unsigned long ReadMaterial(Material& material, unsigned long pos, unsigned long length);
-	unsigned long ReadMesh(Mesh& mesh, unsigned long pos, unsigned long length);
+	bool ReadMesh(Mesh& mesh, unsigned long pos, unsigned long length);
 	unsigned long ReadColor(Color& color, unsigned long pos);
 	unsigned long ReadQuantity(float& q, unsigned long pos);
 	unsigned long ReadName(std::string& name, unsigned long pos);
-	void CalcNormal(float angle);
+	void CalcNormal(float angle, std::size_t max_thread);
 
 private:
 	material_array	materials;
 	mesh_array		meshes;
-	char*			memory;
+	const char*		memory;	//!< 読み込み中のファイルの割り当て先(Load() の間だけ有効)
 };
 
 }
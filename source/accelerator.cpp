@@ -0,0 +1,117 @@
+#include "config.h"
+#include "accelerator.h"
+#include "kdtree.h"
+#include "bvh.h"
+#include "wide_bvh.h"
+
+
+/*!
+	@brief		同じ象限の光線を K_STREAM_GROUP 本ずつに分ける
+	@param[io]	rays: 光線の列(番号を象限順に並べる)
+	@param[i]	func: 1 組毎に呼ぶ void(const unsigned int* group, std::size_t num)
+ */
+template <class Func>
+static void for_each_group(RayBatch& rays, Func func)
+{
+	rays.SortByOctant();
+	const std::vector<unsigned int>& order = rays.GetOrder();
+	std::size_t first = 0;
+	while(first < order.size())
+	{
+		const unsigned int octant = rays.GetOctant(order[first]);
+		std::size_t last = first + 1;
+		while((last < order.size()) && (last - first < K_STREAM_GROUP) && (rays.GetOctant(order[last]) == octant))
+			last++;
+		func(&order[first], last - first);
+		first = last;
+	}
+}
+
+/*!
+	@brief		作成
+	@param[i]	type: 種類
+	@note		種類毎の設定(kd 木の深さや構築方法)もここで済ませる
+ */
+Accelerator* Accelerator::Create(Type type)
+{
+	switch(type)
+	{
+	case Type_Bvh:
+		return new Bvh();
+	case Type_WideBvh:
+		return CreateWideBvh();
+	default:
+		break;
+	}
+
+	KdTree* kdtree = new KdTree();
+	if(kdtree)
+	{
+		kdtree->SetMaxDepth(MAX_KDTREE_DEPTH);
+ #ifdef USE_KDTREE_BINNED
+		kdtree->SetBuildMode(KdTree::BuildMode_Binned);
+ #endif // USE_KDTREE_BINNED
+	}
+	return kdtree;
+}
+
+/*!
+	@brief		光線の列の最も近い交差を探す
+	@param[io]	rays: 光線の列(判定の順に番号を並べ替える)
+	@param[o]	hits: 光線毎の交差
+	@note		方向の符号が揃った光線をまとめて走査すると、同じノードを続けて辿るのでノードの読み込みを共有できる
+ */
+void Accelerator::IntersectStream(RayBatch& rays, HitBatch& hits) const
+{
+	hits.Resize(rays.size());
+	for_each_group(rays, [&](const unsigned int* group, std::size_t num){ IntersectGroup(rays, group, num, hits); });
+}
+
+/*!
+	@brief		光線の列の遮蔽物の有無
+	@param[io]	rays: 光線の列(判定の順に番号を並べ替える)
+	@param[o]	hits: 光線毎の遮蔽の有無(found のみ)
+ */
+void Accelerator::OccludedStream(RayBatch& rays, HitBatch& hits) const
+{
+	hits.Resize(rays.size());
+	for_each_group(rays, [&](const unsigned int* group, std::size_t num){ OccludedGroup(rays, group, num, hits); });
+}
+
+/*!
+	@brief		同じ象限の光線の最も近い交差を探す
+	@param[i]	rays: 光線の列
+	@param[i]	group: 判定する光線の番号
+	@param[i]	num: 光線の数(K_STREAM_GROUP 以下)
+	@param[o]	hits: 光線毎の交差
+	@note		まとめて走査しない構造は 1 本ずつ判定する
+ */
+void Accelerator::IntersectGroup(const RayBatch& rays, const unsigned int* group, std::size_t num, HitBatch& hits) const
+{
+	Ray ray;
+	for(std::size_t i = 0; i < num; i++)
+	{
+		const unsigned int n = group[i];
+		rays.GetRay(ray, n);
+		hits.found[n] = Traverse(hits.id[n], hits.param[n], ray)? 1 : 0;
+	}
+}
+
+/*!
+	@brief		同じ象限の光線の遮蔽物の有無
+	@param[i]	rays: 光線の列
+	@param[i]	group: 判定する光線の番号
+	@param[i]	num: 光線の数(K_STREAM_GROUP 以下)
+	@param[o]	hits: 光線毎の遮蔽の有無(found のみ)
+	@note		まとめて走査しない構造は 1 本ずつ判定する
+ */
+void Accelerator::OccludedGroup(const RayBatch& rays, const unsigned int* group, std::size_t num, HitBatch& hits) const
+{
+	Ray ray;
+	for(std::size_t i = 0; i < num; i++)
+	{
+		const unsigned int n = group[i];
+		rays.GetRay(ray, n);
+		hits.found[n] = Occluded(ray, rays.t_max[n])? 1 : 0;
+	}
+}
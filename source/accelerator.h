@@ -0,0 +1,84 @@
+//==============================================================================
+/*!
+	@file	accelerator.h
+	@brief	交差判定の高速化構造
+ */
+//==============================================================================
+#ifndef __ACCELERATOR_H_
+#define __ACCELERATOR_H_
+
+#include "primitive.h"
+#include "cache.h"
+#include "ray_batch.h"
+
+static const float K_REFIT_LIMIT	= 1.5f;	//!< Refit() で SAH コストが構築時のこの倍率を超えたら作り直す
+static const std::size_t K_STREAM_GROUP	= 16;	//!< IntersectStream() で IntersectGroup() にまとめて渡す光線の数(Bvh が光線をビットで持ち 8 本ずつ SIMD で判定するので 8 の倍数で 32 未満)
+
+/*!
+	@brief	交差判定の高速化構造
+	@class	Accelerator
+	@note	abstract class
+			Renderer は FindNearest() と FindOccluder() からこのインターフェースだけを使う
+			IntersectStream() と OccludedStream() は光線を方向の象限順に並べ、K_STREAM_GROUP 本ずつ
+			IntersectGroup(), OccludedGroup() に渡す(既定の実装は 1 本ずつ Traverse(), Occluded() する)
+			Bvh は 1 つのグループでノードを 1 度だけ辿る
+ */
+class Accelerator
+{
+public:
+	enum Type
+	{
+		Type_KdTree,
+		Type_Bvh,
+		Type_WideBvh,	//!< 4/8 分岐 BVH
+		Type_Max
+	};
+
+public:
+	Accelerator() : prims(NULL), max_thread(0) {}
+	virtual ~Accelerator(){}
+
+	static Accelerator* Create(Type type);
+
+	void SetMaxThread(std::size_t thread){ max_thread = thread; }
+
+	virtual void Build(const PrimitiveArray& prims, const AABB& aabb) = 0;
+	virtual bool Traverse(PrimitiveArray::Id& id, Primitive::Param& param, const Ray& ray) const = 0;
+	virtual bool Occluded(const Ray& ray, float t_max) const = 0;
+
+	void IntersectStream(RayBatch& rays, HitBatch& hits) const;
+	void OccludedStream(RayBatch& rays, HitBatch& hits) const;
+
+	/*!
+		@brief		移動したプリミティブに合わせた境界の更新
+		@param[i]	ids: 境界が変わったプリミティブ
+		@retval		false: 更新できない、または更新で SAH コストが悪化したので Build() し直すこと
+		@note		ノードの構成は変えずに、ids を含むリーフから根までの境界だけを計算し直す
+					対応しない構造はこの既定の実装で常に false を返す
+	 */
+	virtual bool Refit(const std::vector<PrimitiveArray::Id>& /*ids*/){ return false; }
+
+	/*!
+		@brief		キャッシュへの書き出し
+		@note		Build() 済みであること
+	 */
+	virtual void Save(CacheWriter& writer) const = 0;
+	/*!
+		@brief		キャッシュからの読み込み
+		@param[io]	reader: キャッシュ
+		@param[i]	prims: Save() したときと同じ内容のプリミティブ
+		@retval		false: 内容が合わない
+		@note		配列はキャッシュの領域を直接参照するので、reader の元のファイルを閉じるまで有効
+	 */
+	virtual bool Load(CacheReader& reader, const PrimitiveArray& prims) = 0;
+
+protected:
+	virtual void IntersectGroup(const RayBatch& rays, const unsigned int* group, std::size_t num, HitBatch& hits) const;
+	virtual void OccludedGroup(const RayBatch& rays, const unsigned int* group, std::size_t num, HitBatch& hits) const;
+
+protected:
+	const PrimitiveArray*	prims;		//!< Build() で渡されたプリミティブ(リーフは Id で参照する)
+	std::size_t			max_thread;	//!< 構築に使うスレッド数(0 ならハードウェアの並列数)
+};
+
+#endif // !__ACCELERATOR_H_
@@ -0,0 +1,858 @@
+
+#include <algorithm>
+#include "bvh.h"
+#include "lib/system/cpu.h"
+#ifdef CPU_X86
+#include <immintrin.h>
+#endif // CPU_X86
+
+
+static const float K_TRAVERSAL_COST		= 1.0f;		//!< 節を 1 つ辿るコスト
+static const float K_INTERSECTION_COST	= 1.5f;		//!< プリミティブ 1 つとの交差判定のコスト
+static const std::size_t K_NUM_BINS			= 16;
+static const std::size_t K_MAX_LEAF_PRIMS	= 8;	//!< これを超えるリーフは SAH によらず分割する
+static const std::size_t K_MAX_DEPTH		= 64;	//!< 走査スタックの大きさ
+static const std::size_t K_MEDIAN_DEPTH		= 32;	//!< これ以降の深度は SAH によらず中央で分ける
+static const unsigned int K_NO_LEAF			= 0xffffffff;
+static const unsigned int K_GROUP_SCALAR	= 2;	//!< 境界を調べる光線がこの本数以下ならまとめずに 1 本ずつ判定する
+
+/*!
+	@brief		空の境界
+	@param[o]	aabb: 境界
+ */
+static void aabb_empty(AABB& aabb)
+{
+	aabb.min.set( FLT_MAX, FLT_MAX, FLT_MAX);
+	aabb.max.set(-FLT_MAX,-FLT_MAX,-FLT_MAX);
+}
+
+/*!
+	@brief		境界の結合
+	@param[io]	out: 境界
+	@param[i]	in: 結合する境界
+ */
+static void aabb_merge(AABB& out, const AABB& in)
+{
+	Vec3Minimize(&out.min, &out.min, &in.min);
+	Vec3Maximize(&out.max, &out.max, &in.max);
+}
+
+/*!
+	@brief		境界が等しいか
+	@param[i]	a: 境界
+	@param[i]	b: 境界
+ */
+static bool aabb_equal(const AABB& a, const AABB& b)
+{
+	return (a.min.x == b.min.x) && (a.min.y == b.min.y) && (a.min.z == b.min.z) &&
+		   (a.max.x == b.max.x) && (a.max.y == b.max.y) && (a.max.z == b.max.z);
+}
+
+/*!
+	@brief		ノードの SAH コストの重み
+	@param[i]	node: ノード
+	@note		ノードの表面積に掛けて足したものをルートの表面積で割ると、構築時に評価している SAH コストになる
+ */
+static float node_weight(const BvhNode& node)
+{
+	return node.IsLeaf()? K_INTERSECTION_COST * (float)node.GetNumPrims() : K_TRAVERSAL_COST;
+}
+
+/*!
+	@brief		光線とノードの境界の交差
+	@param[i]	aabb: 境界
+	@param[i]	org: 光線の基点
+	@param[i]	inv_dir: 光線の向きの逆数
+	@param[i]	t_max: 調べる区間の終点
+	@note		スラブ法
+ */
+static bool ray_aabb(const AABB& aabb, const Vector3& org, const Vector3& inv_dir, float t_max)
+{
+	float t_min = 0.0f;
+	for(int axis = Axis_X; axis < Axis_Max; axis++)
+	{
+		float t0 = (aabb.min.v[axis] - org.v[axis]) * inv_dir.v[axis];
+		float t1 = (aabb.max.v[axis] - org.v[axis]) * inv_dir.v[axis];
+		if(t0 > t1)
+			std::swap(t0, t1);
+		if(t0 > t_min)
+			t_min = t0;
+		if(t1 < t_max)
+			t_max = t1;
+		if(t_min > t_max)
+			return false;
+	}
+	return true;
+}
+
+/*!
+	@brief		光線の向きの逆数
+	@param[o]	inv_dir: 逆数
+	@param[i]	dir: 光線の向き
+	@note		軸に平行な成分はスラブと交わらないので十分大きな値にしておく
+ */
+static void calc_inv_dir(Vector3& inv_dir, const Vector3& dir)
+{
+	for(int axis = Axis_X; axis < Axis_Max; axis++)
+		inv_dir.v[axis] = (dir.v[axis] != 0.0f)? 1.0f / dir.v[axis] : FLT_MAX;
+}
+
+/*!
+	@brief		まとめて辿る光線の初期化
+	@param[o]	out: 光線
+	@param[i]	rays: 光線の列
+	@param[i]	group: まとめる光線の番号(全て同じ象限)
+	@param[i]	num: 光線の数(K_STREAM_GROUP 以下)
+	@param[i]	use_t_max: 区間の終点に rays の t_max を使う(false なら無限遠)
+	@note		使わない光線は区間を負にして、どの境界とも交わらないようにする
+ */
+static void init_group(Bvh::RayGroup& out, const RayBatch& rays, const unsigned int* group, std::size_t num, bool use_t_max)
+{
+	for(std::size_t i = 0; i < K_STREAM_GROUP; i++)
+	{
+		for(int axis = Axis_X; axis < Axis_Max; axis++)
+		{
+			out.org[axis][i] = 0.0f;
+			out.inv_dir[axis][i] = 0.0f;
+		}
+		out.t_max[i] = -1.0f;
+	}
+	for(std::size_t i = 0; i < num; i++)
+	{
+		const unsigned int n = group[i];
+		for(int axis = Axis_X; axis < Axis_Max; axis++)
+		{
+			const float dir = rays.dir[axis][n];
+			out.org[axis][i] = rays.org[axis][n];
+			out.inv_dir[axis][i] = (dir != 0.0f)? 1.0f / dir : FLT_MAX;
+		}
+		out.t_max[i] = use_t_max? rays.t_max[n] : FLT_MAX;
+	}
+	out.octant = rays.GetOctant(group[0]);
+}
+
+/*!
+	@brief		1 本の光線とノードの境界の交差
+	@param[i]	group: 光線
+	@param[i]	i: 光線の番号
+	@param[i]	near_plane: 軸毎の入り側の面
+	@param[i]	far_plane: 軸毎の出側の面
+	@note		ray_aabb() と同じ比較なので、向きの逆数との積が非数になる軸は無視する
+ */
+static bool group_lane_test(const Bvh::RayGroup& group, std::size_t i, const float* near_plane, const float* far_plane)
+{
+	float t0 = 0.0f;
+	float t1 = group.t_max[i];
+	for(int axis = Axis_X; axis < Axis_Max; axis++)
+	{
+		const float t_in = (near_plane[axis] - group.org[axis][i]) * group.inv_dir[axis][i];
+		const float t_out = (far_plane[axis] - group.org[axis][i]) * group.inv_dir[axis][i];
+		if(t_in > t0)
+			t0 = t_in;
+		if(t_out < t1)
+			t1 = t_out;
+	}
+	return t0 <= t1;
+}
+
+/*!
+	@brief		まとめた光線とノードの境界の交差(スカラー)
+	@param[i]	group: 光線
+	@param[i]	near_plane: 軸毎の入り側の面
+	@param[i]	far_plane: 軸毎の出側の面
+	@return		交わる光線のビット
+ */
+static unsigned int group_test_scalar(const Bvh::RayGroup& group, const float* near_plane, const float* far_plane)
+{
+	unsigned int mask = 0;
+	for(std::size_t i = 0; i < K_STREAM_GROUP; i++)
+	{
+		if(group_lane_test(group, i, near_plane, far_plane))
+			mask |= 1u << i;
+	}
+	return mask;
+}
+
+#ifdef CPU_X86
+/*!
+	@brief		まとめた光線とノードの境界の交差(SSE4, 4 本ずつ)
+	@note		max, min は第 2 引数を返す側を累積にして、非数の軸を無視する
+ */
+TARGET_SSE4 static unsigned int group_test_sse4(const Bvh::RayGroup& group, const float* near_plane, const float* far_plane)
+{
+	unsigned int mask = 0;
+	for(std::size_t i = 0; i < K_STREAM_GROUP; i += 4)
+	{
+		__m128 t0 = _mm_setzero_ps();
+		__m128 t1 = _mm_loadu_ps(&group.t_max[i]);
+		for(int axis = Axis_X; axis < Axis_Max; axis++)
+		{
+			const __m128 org = _mm_loadu_ps(&group.org[axis][i]);
+			const __m128 inv_dir = _mm_loadu_ps(&group.inv_dir[axis][i]);
+			const __m128 t_in = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(near_plane[axis]), org), inv_dir);
+			const __m128 t_out = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(far_plane[axis]), org), inv_dir);
+			t0 = _mm_max_ps(t_in, t0);
+			t1 = _mm_min_ps(t_out, t1);
+		}
+		mask |= (unsigned int)_mm_movemask_ps(_mm_cmple_ps(t0, t1)) << i;
+	}
+	return mask;
+}
+
+/*!
+	@brief		まとめた光線とノードの境界の交差(AVX2, 8 本ずつ)
+ */
+TARGET_AVX2 static unsigned int group_test_avx2(const Bvh::RayGroup& group, const float* near_plane, const float* far_plane)
+{
+	unsigned int mask = 0;
+	for(std::size_t i = 0; i < K_STREAM_GROUP; i += 8)
+	{
+		__m256 t0 = _mm256_setzero_ps();
+		__m256 t1 = _mm256_loadu_ps(&group.t_max[i]);
+		for(int axis = Axis_X; axis < Axis_Max; axis++)
+		{
+			const __m256 org = _mm256_loadu_ps(&group.org[axis][i]);
+			const __m256 inv_dir = _mm256_loadu_ps(&group.inv_dir[axis][i]);
+			const __m256 t_in = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(near_plane[axis]), org), inv_dir);
+			const __m256 t_out = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(far_plane[axis]), org), inv_dir);
+			t0 = _mm256_max_ps(t_in, t0);
+			t1 = _mm256_min_ps(t_out, t1);
+		}
+		mask |= (unsigned int)_mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ)) << i;
+	}
+	return mask;
+}
+#endif // CPU_X86
+
+////////////////////////////////////////////////////////////////////////////////
+
+Bvh::Bvh() : group_test(group_test_scalar), sah_cost(0.0), build_cost(0.0)
+{
+ #ifdef CPU_X86
+	if(cpu_has_avx2())
+		group_test = group_test_avx2;
+	else if(cpu_has_sse4())
+		group_test = group_test_sse4;
+ #endif // CPU_X86
+}
+
+Bvh::~Bvh()
+{
+}
+
+/*!
+	@brief		構築
+	@param[i]	prims: プリミティブ
+	@param[i]	aabb: シーンの境界(BVH はプリミティブの境界から求めるので使わない)
+ */
+void Bvh::Build(const PrimitiveArray& prims, const AABB&)
+{
+	this->prims = &prims;
+	nodes.release();
+	indices.release();
+	std::vector<unsigned int>().swap(parents);
+	std::vector<unsigned int>().swap(instance_leaves);
+
+	const std::size_t num_prims = prims.size();
+	if(num_prims == 0)
+		return;
+
+	BuildPrimList build_list(num_prims);
+	for(std::size_t i = 0; i < num_prims; i++)
+	{
+		BuildPrim& bp = build_list[i];
+		bp.id = prims.GetId(i);
+		for(int axis = Axis_X; axis < Axis_Max; axis++)
+			prims.CalcRange(bp.aabb.min.v[axis], bp.aabb.max.v[axis], (Axis)axis, bp.id);
+		Vec3Lerp(&bp.center, &bp.aabb.min, &bp.aabb.max, 0.5f);
+	}
+
+	nodes.reserve(num_prims * 2);
+	SubDivide(build_list, 0, num_prims, 0);
+
+	// リーフは build_list の並びを参照している
+	indices.resize(num_prims);
+	for(std::size_t i = 0; i < num_prims; i++)
+		indices[i] = build_list[i].id;
+}
+
+/*!
+	@brief		分割
+	@param[io]	list: 構築用のプリミティブ情報(左右に並べ替える)
+	@param[i]	begin: ノードの範囲
+	@param[i]	end: ノードの範囲
+	@param[i]	depth: 深度
+	@note		ノードは深さ優先で配列に追加していくので、左の子は常に直後に並ぶ
+ */
+void Bvh::SubDivide(BuildPrimList& list, std::size_t begin, std::size_t end, std::size_t depth)
+{
+	const unsigned int node = (unsigned int)nodes.size();
+	nodes.push_back(BvhNode());
+
+	// ノードの境界と中心の範囲
+	AABB aabb, center_aabb;
+	aabb_empty(aabb);
+	aabb_empty(center_aabb);
+	for(std::size_t i = begin; i < end; i++)
+	{
+		aabb_merge(aabb, list[i].aabb);
+		Vec3Minimize(&center_aabb.min, &center_aabb.min, &list[i].center);
+		Vec3Maximize(&center_aabb.max, &center_aabb.max, &list[i].center);
+	}
+
+	const std::size_t num_prims = end - begin;
+	if((num_prims == 1) || (depth + 1 >= K_MAX_DEPTH))
+	{
+		MakeLeaf(list, node, aabb, begin, end);
+		return;
+	}
+
+	// 偏った分割が続いて深度の上限に近づいたら、中心の広がりが最大の軸の中央で分ける
+	// 上限で作るリーフの大きさが抑えられ、BvhNode のプリミティブ数に収まる
+	if(depth >= K_MEDIAN_DEPTH)
+	{
+		const Vector3 center_size = center_aabb.GetSize();
+		int axis = Axis_X;
+		if(center_size.v[Axis_Y] > center_size.v[axis])
+			axis = Axis_Y;
+		if(center_size.v[Axis_Z] > center_size.v[axis])
+			axis = Axis_Z;
+		const std::size_t mid = begin + num_prims / 2;
+		std::nth_element(&list[0] + begin, &list[0] + mid, &list[0] + end, [axis](const BuildPrim& a, const BuildPrim& b){ return a.center.v[axis] < b.center.v[axis]; });
+		nodes[node].InitInterior(aabb, (Axis)axis);
+		SubDivide(list, begin, mid, depth+1);
+		nodes[node].SetRight((unsigned int)nodes.size());
+		SubDivide(list, mid, end, depth+1);
+		return;
+	}
+
+	// 全軸についてビンの境界で SAH を評価する
+	const float area = aabb.GetSurfaceArea();
+	const float inv_area = (area > 0.0f)? 1.0f / area : 0.0f;
+	const Vector3 center_size = center_aabb.GetSize();
+	float best_cost = FLT_MAX;
+	int best_axis = -1;
+	std::size_t best_bin = 0;
+	for(int axis = Axis_X; axis < Axis_Max; axis++)
+	{
+		if(center_size.v[axis] <= 0.0f)
+			continue;
+		const float scale = (float)K_NUM_BINS / center_size.v[axis];
+
+		AABB bin_aabbs[K_NUM_BINS];
+		std::size_t bin_counts[K_NUM_BINS] = { 0 };
+		for(std::size_t b = 0; b < K_NUM_BINS; b++)
+			aabb_empty(bin_aabbs[b]);
+		for(std::size_t i = begin; i < end; i++)
+		{
+			std::size_t b = (std::size_t)((list[i].center.v[axis] - center_aabb.min.v[axis]) * scale);
+			if(b >= K_NUM_BINS)
+				b = K_NUM_BINS - 1;
+			bin_counts[b]++;
+			aabb_merge(bin_aabbs[b], list[i].aabb);
+		}
+
+		// 右側の表面積と数は後ろから累積しておく
+		float r_areas[K_NUM_BINS];
+		std::size_t r_counts[K_NUM_BINS];
+		AABB r_aabb;
+		aabb_empty(r_aabb);
+		std::size_t r_count = 0;
+		for(std::size_t b = K_NUM_BINS - 1; b > 0; b--)
+		{
+			aabb_merge(r_aabb, bin_aabbs[b]);
+			r_count += bin_counts[b];
+			r_areas[b] = (r_count > 0)? r_aabb.GetSurfaceArea() : 0.0f;
+			r_counts[b] = r_count;
+		}
+
+		AABB l_aabb;
+		aabb_empty(l_aabb);
+		std::size_t l_count = 0;
+		for(std::size_t b = 1; b < K_NUM_BINS; b++)
+		{
+			aabb_merge(l_aabb, bin_aabbs[b-1]);
+			l_count += bin_counts[b-1];
+			if((l_count == 0) || (r_counts[b] == 0))
+				continue;
+			const float cost = K_TRAVERSAL_COST + K_INTERSECTION_COST * (l_aabb.GetSurfaceArea() * (float)l_count + r_areas[b] * (float)r_counts[b]) * inv_area;
+			if(cost < best_cost)
+			{
+				best_cost = cost;
+				best_axis = axis;
+				best_bin = b;
+			}
+		}
+	}
+
+	std::size_t mid;
+	if(best_axis < 0)
+	{
+		// 中心が全て重なっているので分けられない
+		if(num_prims <= K_MAX_LEAF_PRIMS)
+		{
+			MakeLeaf(list, node, aabb, begin, end);
+			return;
+		}
+		best_axis = Axis_X;
+		mid = begin + num_prims / 2;
+	}
+	else
+	{
+		if((best_cost >= K_INTERSECTION_COST * (float)num_prims) && (num_prims <= K_MAX_LEAF_PRIMS))
+		{
+			MakeLeaf(list, node, aabb, begin, end);
+			return;
+		}
+		const int axis = best_axis;
+		const float min = center_aabb.min.v[axis];
+		const float scale = (float)K_NUM_BINS / center_size.v[axis];
+		BuildPrim* it = std::partition(&list[0] + begin, &list[0] + end, [axis, min, scale, best_bin](const BuildPrim& bp)
+		{
+			std::size_t b = (std::size_t)((bp.center.v[axis] - min) * scale);
+			if(b >= K_NUM_BINS)
+				b = K_NUM_BINS - 1;
+			return b < best_bin;
+		});
+		mid = it - &list[0];
+	}
+
+	nodes[node].InitInterior(aabb, (Axis)best_axis);
+
+	// 子ノードの分割
+	SubDivide(list, begin, mid, depth+1);
+	nodes[node].SetRight((unsigned int)nodes.size());
+	SubDivide(list, mid, end, depth+1);
+}
+
+/*!
+	@brief		リーフの作成
+	@param[io]	list: 構築用のプリミティブ情報
+	@param[i]	node: ノード
+	@param[i]	aabb: ノードの境界
+	@param[i]	begin: リーフの範囲
+	@param[i]	end: リーフの範囲
+	@note		走査時に種類毎にまとめて判定できるよう、リーフ内を Id 順に並べる
+ */
+void Bvh::MakeLeaf(BuildPrimList& list, unsigned int node, const AABB& aabb, std::size_t begin, std::size_t end)
+{
+	ASSERT_MSG(end - begin <= BvhNode::K_MAX_NODE_PRIMS, "Bvh::MakeLeaf(): too many primitives");
+	std::sort(&list[0] + begin, &list[0] + end, [](const BuildPrim& a, const BuildPrim& b){ return a.id < b.id; });
+	nodes[node].InitLeaf(aabb, (unsigned int)begin, (unsigned int)(end - begin));
+}
+
+/*!
+	@brief		移動したプリミティブに合わせた境界の更新
+	@param[i]	ids: 境界が変わったプリミティブ(インスタンスのみ)
+	@retval		false: インスタンス以外を含む、または SAH コストが構築時の K_REFIT_LIMIT 倍を超えた
+	@note		親は子より前に並ぶので、番号の大きいノードから順に処理すれば子の境界は確定している
+				境界が変わらなかったノードより上は辿らないので、静止した部分のコストはかからない
+ */
+bool Bvh::Refit(const std::vector<PrimitiveArray::Id>& ids)
+{
+	if(nodes.empty())
+		return false;
+	if(parents.empty())
+		InitRefit();
+
+	std::vector<unsigned int> heap;
+	heap.reserve(ids.size());
+	for(std::size_t i = 0; i < ids.size(); i++)
+	{
+		const std::size_t index = PrimitiveArray::GetIndex(ids[i]);
+		if((PrimitiveArray::GetType(ids[i]) != PrimitiveArray::Type_Instance) ||
+		   (index >= instance_leaves.size()) || (instance_leaves[index] == K_NO_LEAF))
+			return false;
+		heap.push_back(instance_leaves[index]);
+	}
+	std::make_heap(heap.begin(), heap.end());
+
+	const MappedArray<BvhNode>& const_nodes = nodes;
+	const MappedArray<PrimitiveArray::Id>& const_indices = indices;
+	while(!heap.empty())
+	{
+		const unsigned int node = heap.front();
+		do
+		{
+			std::pop_heap(heap.begin(), heap.end());
+			heap.pop_back();
+		}while(!heap.empty() && (heap.front() == node));
+
+		const BvhNode& n = const_nodes[node];
+		AABB aabb;
+		if(n.IsLeaf())
+		{
+			aabb_empty(aabb);
+			const unsigned int end = n.GetOffset() + n.GetNumPrims();
+			for(unsigned int i = n.GetOffset(); i < end; i++)
+			{
+				AABB box;
+				for(int axis = Axis_X; axis < Axis_Max; axis++)
+					prims->CalcRange(box.min.v[axis], box.max.v[axis], (Axis)axis, const_indices[i]);
+				aabb_merge(aabb, box);
+			}
+		}
+		else
+		{
+			aabb = const_nodes[node + 1].GetAABB();
+			aabb_merge(aabb, const_nodes[n.GetRight()].GetAABB());
+		}
+		if(aabb_equal(aabb, n.GetAABB()))
+			continue;
+		SetNodeAABB(node, aabb);
+		if(node > 0)
+		{
+			heap.push_back(parents[node]);
+			std::push_heap(heap.begin(), heap.end());
+		}
+	}
+
+	const float area = const_nodes[0].GetAABB().GetSurfaceArea();
+	return (area > 0.0f) && (sah_cost / area <= build_cost * K_REFIT_LIMIT);
+}
+
+/*!
+	@brief		Refit() の準備
+	@note		親ノード、インスタンス毎のリーフ、更新前の SAH コストを求める
+				構築や読み込みの後、最初の Refit() でだけ呼ぶので、アニメーションしない場合の負担にならない
+ */
+void Bvh::InitRefit()
+{
+	const MappedArray<BvhNode>& const_nodes = nodes;
+	const MappedArray<PrimitiveArray::Id>& const_indices = indices;
+	parents.assign(const_nodes.size(), 0);
+	instance_leaves.assign(prims->GetInstances().size(), K_NO_LEAF);
+	sah_cost = 0.0;
+	for(unsigned int i = 0; i < const_nodes.size(); i++)
+	{
+		const BvhNode& n = const_nodes[i];
+		sah_cost += node_weight(n) * n.GetAABB().GetSurfaceArea();
+		if(n.IsLeaf())
+		{
+			const unsigned int end = n.GetOffset() + n.GetNumPrims();
+			for(unsigned int j = n.GetOffset(); j < end; j++)
+			{
+				if(PrimitiveArray::GetType(const_indices[j]) == PrimitiveArray::Type_Instance)
+					instance_leaves[PrimitiveArray::GetIndex(const_indices[j])] = i;
+			}
+		}
+		else
+		{
+			parents[i + 1] = i;
+			parents[n.GetRight()] = i;
+		}
+	}
+	const float area = const_nodes[0].GetAABB().GetSurfaceArea();
+	build_cost = (area > 0.0f)? sah_cost / area : 0.0;
+}
+
+/*!
+	@brief		ノードの境界の更新
+	@param[i]	node: ノード
+	@param[i]	aabb: 新しい境界
+	@note		SAH コストの和も差分で更新する
+ */
+void Bvh::SetNodeAABB(unsigned int node, const AABB& aabb)
+{
+	BvhNode& n = nodes[node];
+	sah_cost += node_weight(n) * (aabb.GetSurfaceArea() - n.GetAABB().GetSurfaceArea());
+	n.SetAABB(aabb);
+}
+
+/*!
+	@brief		最も近い交差を探す
+	@param[o]	id: 交差したプリミティブ
+	@param[o]	param: 交差情報
+	@param[i]	ray: 光線
+	@note		固定長スタックを使った反復走査
+				分割軸について光線の向きに近い側の子から辿り、交差距離より遠いノードは境界の判定で省く
+ */
+bool Bvh::Traverse(PrimitiveArray::Id& id, Primitive::Param& param, const Ray& ray) const
+{
+	if(nodes.empty())
+		return false;
+
+	Vector3 inv_dir;
+	calc_inv_dir(inv_dir, ray.dir);
+
+	unsigned int stack[K_MAX_DEPTH];
+	std::size_t top = 0;
+	unsigned int node = 0;
+	float t_hit = FLT_MAX;
+	bool found = false;
+	for(;;)
+	{
+		const BvhNode& n = nodes[node];
+		if(ray_aabb(n.GetAABB(), ray.org, inv_dir, t_hit))
+		{
+			if(!n.IsLeaf())
+			{
+				const unsigned int left = node + 1;
+				const unsigned int right = n.GetRight();
+				if(ray.dir.v[n.GetAxis()] < 0.0f)
+				{
+					stack[top++] = left;
+					node = right;
+				}
+				else
+				{
+					stack[top++] = right;
+					node = left;
+				}
+				continue;
+			}
+
+			const PrimitiveArray::Id* it = indices.data() + n.GetOffset();
+			if(prims->IntersectNearest(id, param, t_hit, it, it + n.GetNumPrims(), ray))
+				found = true;
+		}
+		if(top == 0)
+			break;
+		node = stack[--top];
+	}
+	return found;
+}
+
+/*!
+	@brief		遮蔽物の有無
+	@param[i]	ray: 光線
+	@param[i]	t_max: 調べる区間の終点(光源までの距離など)
+	@retval		true: [0, t_max] に交差がある
+	@note		最も近い交差は求めず、最初に見つかった時点で戻る
+ */
+bool Bvh::Occluded(const Ray& ray, float t_max) const
+{
+	if(nodes.empty())
+		return false;
+
+	Vector3 inv_dir;
+	calc_inv_dir(inv_dir, ray.dir);
+
+	unsigned int stack[K_MAX_DEPTH];
+	std::size_t top = 0;
+	unsigned int node = 0;
+	for(;;)
+	{
+		const BvhNode& n = nodes[node];
+		if(ray_aabb(n.GetAABB(), ray.org, inv_dir, t_max))
+		{
+			if(!n.IsLeaf())
+			{
+				stack[top++] = n.GetRight();
+				node = node + 1;
+				continue;
+			}
+
+			const PrimitiveArray::Id* it = indices.data() + n.GetOffset();
+			if(prims->IntersectAny(it, it + n.GetNumPrims(), ray, t_max))
+				return true;
+		}
+		if(top == 0)
+			break;
+		node = stack[--top];
+	}
+	return false;
+}
+
+/*!
+	@brief		まとめた光線とノードの境界の交差
+	@param[i]	group: 光線
+	@param[i]	aabb: 境界
+	@param[i]	mask: 調べる光線のビット
+	@return		mask のうち交わる光線のビット
+	@note		象限が同じなので軸毎の入り側の面は全ての光線で共通になる
+				調べる光線が少なければまとめずに 1 本ずつ判定する
+ */
+unsigned int Bvh::IntersectGroupAABB(const RayGroup& group, const AABB& aabb, unsigned int mask) const
+{
+	float near_plane[Axis_Max], far_plane[Axis_Max];
+	for(int axis = Axis_X; axis < Axis_Max; axis++)
+	{
+		const bool negative = (group.octant & (1u << axis)) != 0;
+		near_plane[axis] = negative? aabb.max.v[axis] : aabb.min.v[axis];
+		far_plane[axis]  = negative? aabb.min.v[axis] : aabb.max.v[axis];
+	}
+
+	// K_GROUP_SCALAR 本分のビットを落としても残れば SIMD でまとめて判定する
+	unsigned int rest = mask;
+	for(unsigned int i = 0; i < K_GROUP_SCALAR; i++)
+		rest &= rest - 1;
+	if(rest)
+		return group_test(group, near_plane, far_plane) & mask;
+
+	unsigned int hit = 0;
+	for(unsigned int m = mask; m; m &= m - 1)
+	{
+		unsigned int i = 0;
+		while(!(m & (1u << i)))
+			i++;
+		if(group_lane_test(group, i, near_plane, far_plane))
+			hit |= 1u << i;
+	}
+	return hit;
+}
+
+/*!
+	@brief		同じ象限の光線の最も近い交差を探す
+	@param[i]	rays: 光線の列
+	@param[i]	group: 判定する光線の番号
+	@param[i]	num: 光線の数(K_STREAM_GROUP 以下)
+	@param[o]	hits: 光線毎の交差
+	@note		ノードを 1 度だけ読んで、その境界に交わる光線をビットで持って辿る
+				光線は全て同じ象限を向くので子の順は 1 本ずつ辿るときと同じになり、結果も Traverse() と一致する
+ */
+void Bvh::IntersectGroup(const RayBatch& rays, const unsigned int* group, std::size_t num, HitBatch& hits) const
+{
+	struct StackEntry
+	{
+		unsigned int	node;
+		unsigned int	mask;	//!< 境界を調べる光線
+	};
+
+	for(std::size_t i = 0; i < num; i++)
+		hits.found[group[i]] = 0;
+	if(nodes.empty() || (num == 0))
+		return;
+
+	RayGroup lanes;
+	init_group(lanes, rays, group, num, false);
+	Ray ray[K_STREAM_GROUP];
+	for(std::size_t i = 0; i < num; i++)
+		rays.GetRay(ray[i], group[i]);
+
+	StackEntry stack[K_MAX_DEPTH];
+	std::size_t top = 0;
+	unsigned int node = 0;
+	unsigned int mask = (1u << num) - 1;
+	for(;;)
+	{
+		const BvhNode& n = nodes[node];
+		const unsigned int active = IntersectGroupAABB(lanes, n.GetAABB(), mask);
+		if(active)
+		{
+			if(!n.IsLeaf())
+			{
+				const unsigned int left = node + 1;
+				const unsigned int right = n.GetRight();
+				stack[top].mask = active;
+				if(lanes.octant & (1u << n.GetAxis()))
+				{
+					stack[top++].node = left;
+					node = right;
+				}
+				else
+				{
+					stack[top++].node = right;
+					node = left;
+				}
+				mask = active;
+				continue;
+			}
+
+			const PrimitiveArray::Id* it = indices.data() + n.GetOffset();
+			for(std::size_t i = 0; i < num; i++)
+			{
+				const unsigned int r = group[i];
+				if((active & (1u << i)) && prims->IntersectNearest(hits.id[r], hits.param[r], lanes.t_max[i], it, it + n.GetNumPrims(), ray[i]))
+					hits.found[r] = 1;
+			}
+		}
+		if(top == 0)
+			break;
+		--top;
+		node = stack[top].node;
+		mask = stack[top].mask;
+	}
+}
+
+/*!
+	@brief		同じ象限の光線の遮蔽物の有無
+	@param[i]	rays: 光線の列
+	@param[i]	group: 判定する光線の番号
+	@param[i]	num: 光線の数(K_STREAM_GROUP 以下)
+	@param[o]	hits: 光線毎の遮蔽の有無(found のみ)
+	@note		遮蔽物が見つかった光線は区間を負にして以降の境界判定から外し、全て見つかった時点で戻る
+ */
+void Bvh::OccludedGroup(const RayBatch& rays, const unsigned int* group, std::size_t num, HitBatch& hits) const
+{
+	struct StackEntry
+	{
+		unsigned int	node;
+		unsigned int	mask;	//!< 境界を調べる光線
+	};
+
+	for(std::size_t i = 0; i < num; i++)
+		hits.found[group[i]] = 0;
+	if(nodes.empty() || (num == 0))
+		return;
+
+	RayGroup lanes;
+	init_group(lanes, rays, group, num, true);
+	Ray ray[K_STREAM_GROUP];
+	for(std::size_t i = 0; i < num; i++)
+		rays.GetRay(ray[i], group[i]);
+
+	StackEntry stack[K_MAX_DEPTH];
+	std::size_t top = 0;
+	unsigned int node = 0;
+	unsigned int mask = (1u << num) - 1;
+	unsigned int pending = mask;	// まだ遮蔽物が見つかっていない光線
+	for(;;)
+	{
+		const BvhNode& n = nodes[node];
+		const unsigned int active = IntersectGroupAABB(lanes, n.GetAABB(), mask);
+		if(active)
+		{
+			if(!n.IsLeaf())
+			{
+				stack[top].node = n.GetRight();
+				stack[top++].mask = active;
+				node = node + 1;
+				mask = active;
+				continue;
+			}
+
+			const PrimitiveArray::Id* it = indices.data() + n.GetOffset();
+			for(std::size_t i = 0; i < num; i++)
+			{
+				const unsigned int r = group[i];
+				if((active & (1u << i)) && prims->IntersectAny(it, it + n.GetNumPrims(), ray[i], rays.t_max[r]))
+				{
+					hits.found[r] = 1;
+					lanes.t_max[i] = -1.0f;
+					pending &= ~(1u << i);
+				}
+			}
+			if(pending == 0)
+				return;
+		}
+		if(top == 0)
+			break;
+		--top;
+		node = stack[top].node;
+		mask = stack[top].mask;
+	}
+}
+
+/*!
+	@brief		キャッシュへの書き出し
+	@param[io]	writer: キャッシュ
+ */
+void Bvh::Save(CacheWriter& writer) const
+{
+	writer.WriteArray(nodes);
+	writer.WriteArray(indices);
+}
+
+/*!
+	@brief		キャッシュからの読み込み
+	@param[io]	reader: キャッシュ
+	@param[i]	prims: プリミティブ
+ */
+bool Bvh::Load(CacheReader& reader, const PrimitiveArray& prims)
+{
+	this->prims = &prims;
+	std::vector<unsigned int>().swap(parents);
+	std::vector<unsigned int>().swap(instance_leaves);
+	return reader.ReadArray(nodes) && reader.ReadArray(indices);
+}
@@ -0,0 +1,112 @@
+
+#ifndef __BVH_H_
+#define __BVH_H_
+
+#include <vector>
+#include "accelerator.h"
+
+
+/*!
+	@brief	BVH ノード
+	@class	BvhNode
+	@note	32 バイトに収めている
+			左の子は必ず直後に配置するので持たない
+			offset は節ならば右の子のインデックス、リーフならばインデックス配列の開始位置
+ */
+class BvhNode
+{
+public:
+	static const unsigned int K_MAX_NODE_PRIMS = 0xffff;	//!< リーフに入るプリミティブ数の上限
+
+public:
+	void SetAABB(const AABB& aabb){ this->aabb = aabb; }
+	void InitLeaf(const AABB& aabb, unsigned int offset, unsigned int num){ this->aabb = aabb; this->offset = offset; num_prims = (unsigned short)num; axis = 0; }
+	void InitInterior(const AABB& aabb, Axis axis){ this->aabb = aabb; offset = 0; num_prims = 0; this->axis = (unsigned short)axis; }
+	void SetRight(unsigned int index){ offset = index; }
+
+	bool IsLeaf() const { return num_prims > 0; }
+	const AABB& GetAABB() const { return aabb; }
+	Axis GetAxis() const { return (Axis)axis; }
+	unsigned int GetRight() const { return offset; }
+	unsigned int GetOffset() const { return offset; }
+	unsigned int GetNumPrims() const { return num_prims; }
+
+private:
+	AABB			aabb;
+	unsigned int	offset;
+	unsigned short	num_prims;	//!< 0 なら節
+	unsigned short	axis;		//!< 分割軸(節)
+};
+
+/*!
+	@brief	BVH
+	@class	Bvh
+	@note	プリミティブの中心をビンに分けて SAH で分割する
+			kd 木と違ってプリミティブを複数のリーフに重複して登録しないので、
+			密なメッシュでもインデックス配列はプリミティブ数で収まる
+			IntersectGroup(), OccludedGroup() は K_STREAM_GROUP 本の境界判定を SSE4 / AVX2 でまとめ、使えなければスカラーで判定する
+ */
+class Bvh : public Accelerator
+{
+public:
+	/*!
+		@brief	まとめて辿る同じ象限の光線
+		@note	成分毎に並べて、ノードの境界を全ての光線と分岐せずに判定する
+	 */
+	struct RayGroup
+	{
+		float			org[Axis_Max][K_STREAM_GROUP];
+		float			inv_dir[Axis_Max][K_STREAM_GROUP];
+		float			t_max[K_STREAM_GROUP];	//!< 調べる区間の終点(使わない光線は負)
+		unsigned int	octant;
+	};
+	typedef unsigned int (*GroupTest)(const RayGroup& group, const float* near_plane, const float* far_plane);
+
+public:
+	Bvh();
+	~Bvh();
+
+	void Build(const PrimitiveArray& prims, const AABB& aabb);
+	bool Traverse(PrimitiveArray::Id& id, Primitive::Param& param, const Ray& ray) const;
+	bool Occluded(const Ray& ray, float t_max) const;
+	bool Refit(const std::vector<PrimitiveArray::Id>& ids);
+
+	void Save(CacheWriter& writer) const;
+	bool Load(CacheReader& reader, const PrimitiveArray& prims);
+
+	const MappedArray<BvhNode>& GetNodes() const { return nodes; }
+	const MappedArray<PrimitiveArray::Id>& GetIndices() const { return indices; }
+
+protected:
+	void IntersectGroup(const RayBatch& rays, const unsigned int* group, std::size_t num, HitBatch& hits) const;
+	void OccludedGroup(const RayBatch& rays, const unsigned int* group, std::size_t num, HitBatch& hits) const;
+
+private:
+	/*!
+		@brief	構築用のプリミティブ情報
+	 */
+	struct BuildPrim
+	{
+		AABB				aabb;
+		Vector3				center;
+		PrimitiveArray::Id	id;
+	};
+	typedef std::vector<BuildPrim> BuildPrimList;
+
+	void SubDivide(BuildPrimList& list, std::size_t begin, std::size_t end, std::size_t depth);
+	void MakeLeaf(BuildPrimList& list, unsigned int node, const AABB& aabb, std::size_t begin, std::size_t end);
+	void InitRefit();
+	void SetNodeAABB(unsigned int node, const AABB& aabb);
+	unsigned int IntersectGroupAABB(const RayGroup& group, const AABB& aabb, unsigned int mask) const;
+
+private:
+	MappedArray<BvhNode>			nodes;		//!< 0 番がルート
+	MappedArray<PrimitiveArray::Id>	indices;	//!< リーフが参照するプリミティブ(リーフ内は種類順)
+	GroupTest						group_test;
+	std::vector<unsigned int>		parents;	//!< Refit() 用の親ノード(最初の Refit() で作る)
+	std::vector<unsigned int>		instance_leaves;	//!< Refit() 用のインスタンス毎のリーフ
+	double							sah_cost;	//!< 面積で重み付けしたノードのコストの和
+	double							build_cost;	//!< Refit() する前の SAH コスト(sah_cost / ルートの面積)
+};
+
+#endif // !__BVH_H_
@@ -0,0 +1,216 @@
+#include "cache.h"
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif // _WIN32
+
+
+/*!
+	@brief	ファイルの先頭
+ */
+struct CacheHeader
+{
+	char				magic[4];
+	unsigned int		version;
+	unsigned int		endian;		//!< K_ENDIAN を書いた値
+	unsigned int		pointer_size;
+	unsigned long long	key;		//!< 入力と構築設定のハッシュ
+	unsigned long long	size;		//!< ファイル全体のバイト数(書き込みが最後まで終わったか)
+};
+
+/*!
+	@brief	値や配列の前に置く情報
+ */
+struct CacheRecord
+{
+	unsigned long long	num;
+	unsigned int		elem_size;
+	unsigned int		reserved;
+};
+
+static const char K_MAGIC[4]		= { 'R', 'C', 'H', 'E' };
+static const unsigned int K_ENDIAN	= 0x01020304;
+
+/*!
+	@brief		境界に揃えた位置
+	@param[i]	offset: 位置
+	@param[i]	align: 境界(2 の累乗)
+ */
+static unsigned long long align_offset(unsigned long long offset, std::size_t align)
+{
+	return (offset + align - 1) & ~(unsigned long long)(align - 1);
+}
+
+unsigned long long CacheHash(const void* data, std::size_t size, unsigned long long hash)
+{
+	const unsigned char* p = (const unsigned char*)data;
+	for(std::size_t i = 0; i < size; i++)
+	{
+		hash ^= p[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+CacheWriter::CacheWriter() : fp(NULL), key(0), offset(0), error(false)
+{
+}
+
+CacheWriter::~CacheWriter()
+{
+	if(fp)
+	{
+		fclose(fp);
+		remove(temp.c_str());
+	}
+}
+
+/*!
+	@brief		書き出しの開始
+	@param[i]	filename: キャッシュファイル名
+	@param[i]	key: 入力と構築設定のハッシュ
+	@note		一時ファイル名にプロセス ID を付けて、同時に書き出すプロセス同士がぶつからないようにする
+ */
+bool CacheWriter::Open(const std::string& filename, unsigned long long key)
+{
+	char pid[32];
+ #ifdef _WIN32
+	sprintf(pid, ".%d.tmp", _getpid());
+ #else
+	sprintf(pid, ".%d.tmp", (int)getpid());
+ #endif // _WIN32
+	this->filename = filename;
+	this->key = key;
+	temp = filename + pid;
+	offset = 0;
+	error = false;
+	fp = fopen(temp.c_str(), "wb");
+	if(!fp)
+		return false;
+
+	// 大きさは Close() で書き直す
+	CacheHeader header;
+	memset(&header, 0, sizeof(header));
+	WriteBytes(&header, sizeof(header));
+	return !error;
+}
+
+/*!
+	@brief		書き出しの終了
+	@retval		false: 途中で失敗した(一時ファイルは消し、既存のキャッシュはそのまま)
+ */
+bool CacheWriter::Close()
+{
+	if(!fp)
+		return false;
+
+	CacheHeader header;
+	memcpy(header.magic, K_MAGIC, sizeof(K_MAGIC));
+	header.version = K_CACHE_VERSION;
+	header.endian = K_ENDIAN;
+	header.pointer_size = sizeof(void*);
+	header.key = key;
+	header.size = offset;
+	if(!error)
+		error = (fseek(fp, 0, SEEK_SET) != 0) || (fwrite(&header, sizeof(header), 1, fp) != 1);
+	error |= (fclose(fp) != 0);
+	fp = NULL;
+	if(!error)
+	{
+ #ifdef _WIN32
+		// 置き換え先があると rename() は失敗する
+		remove(filename.c_str());
+ #endif // _WIN32
+		error = (rename(temp.c_str(), filename.c_str()) != 0);
+	}
+	if(error)
+		remove(temp.c_str());
+	return !error;
+}
+
+void CacheWriter::WriteRecord(const void* data, std::size_t elem_size, std::size_t num)
+{
+	static const char K_ZERO[K_CACHE_ALIGN] = { 0 };
+
+	CacheRecord record;
+	record.num = num;
+	record.elem_size = (unsigned int)elem_size;
+	record.reserved = 0;
+	WriteBytes(K_ZERO, (std::size_t)(align_offset(offset, sizeof(record)) - offset));
+	WriteBytes(&record, sizeof(record));
+	WriteBytes(K_ZERO, (std::size_t)(align_offset(offset, K_CACHE_ALIGN) - offset));
+	WriteBytes(data, elem_size * num);
+}
+
+void CacheWriter::WriteBytes(const void* data, std::size_t size)
+{
+	if(!fp || error || (size == 0))
+		return;
+	error = (fwrite(data, size, 1, fp) != 1);
+	offset += size;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*!
+	@brief		読み込みの開始
+	@param[i]	data: キャッシュファイルの内容(K_CACHE_ALIGN 以上の境界に揃っていること)
+	@param[i]	size: バイト数
+	@param[i]	key: 入力と構築設定のハッシュ
+	@retval		false: 形式、版、キーのいずれかが合わない、または書き込みが途中で終わっている
+ */
+bool CacheReader::Open(const char* data, std::size_t size, unsigned long long key)
+{
+	this->data = NULL;
+	this->size = size;
+	offset = sizeof(CacheHeader);
+	if(!data || (size < sizeof(CacheHeader)) || ((std::size_t)data & (K_CACHE_ALIGN - 1)))
+		return false;
+
+	CacheHeader header;
+	memcpy(&header, data, sizeof(header));
+	if((memcmp(header.magic, K_MAGIC, sizeof(K_MAGIC)) != 0) ||
+	   (header.version != K_CACHE_VERSION) ||
+	   (header.endian != K_ENDIAN) ||
+	   (header.pointer_size != sizeof(void*)) ||
+	   (header.key != key) ||
+	   (header.size != size))
+		return false;
+	this->data = data;
+	return true;
+}
+
+/*!
+	@brief		値や配列を 1 つ読む
+	@param[i]	elem_size: 要素の大きさ
+	@param[o]	num: 要素数
+	@return		要素の先頭(失敗したら NULL)
+ */
+const void* CacheReader::ReadRecord(std::size_t elem_size, std::size_t& num)
+{
+	if(!data)
+		return NULL;
+
+	CacheRecord record;
+	const unsigned long long head = align_offset(offset, sizeof(record));
+	if(head + sizeof(record) > size)
+	{
+		Fail();
+		return NULL;
+	}
+	memcpy(&record, data + head, sizeof(record));
+	const unsigned long long begin = align_offset(head + sizeof(record), K_CACHE_ALIGN);
+	if((record.elem_size != elem_size) ||
+	   (begin > size) ||
+	   (record.num > (size - begin) / elem_size))
+	{
+		Fail();
+		return NULL;
+	}
+	num = (std::size_t)record.num;
+	offset = (std::size_t)(begin + elem_size * num);
+	return data + begin;
+}
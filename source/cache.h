@@ -0,0 +1,133 @@
+//==============================================================================
+/*!
+	@file	cache.h
+	@brief	構築済みシーンのキャッシュファイル
+	@note	ヘッダの後に値と配列を書いた順に並べるだけの形式で、ポインタを含まないので
+			どのアドレスに割り当てても読める
+			配列の先頭は K_CACHE_ALIGN に揃えるので、メモリマップドファイルの領域をそのまま参照できる
+ */
+//==============================================================================
+#ifndef __CACHE_H_
+#define __CACHE_H_
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "lib/system/mapped_array.h"
+
+static const unsigned int K_CACHE_VERSION	= 1;	//!< 形式や書き出す内容を変えたら上げる
+static const std::size_t K_CACHE_ALIGN		= 64;
+
+/*!
+	@brief		64 ビットの FNV-1a ハッシュ
+	@param[i]	data: 先頭
+	@param[i]	size: バイト数
+	@param[i]	hash: 続けて計算する場合は前回の値
+ */
+unsigned long long CacheHash(const void* data, std::size_t size, unsigned long long hash = 14695981039346656037ULL);
+
+/*!
+	@brief	キャッシュの書き出し
+	@class	CacheWriter
+	@note	一時ファイルに書いてから Close() で置き換えるので、途中で失敗しても既存のキャッシュは壊れない
+			書き込みに失敗しても続けて呼んでよく、Close() がまとめて false を返す
+ */
+class CacheWriter
+{
+public:
+	CacheWriter();
+	~CacheWriter();
+
+	bool Open(const std::string& filename, unsigned long long key);
+	bool Close();
+
+	template <class T>
+	void Write(const T& value){ WriteArray(&value, 1); }
+	template <class T>
+	void WriteArray(const T* data, std::size_t num){ WriteRecord(data, sizeof(T), num); }
+	template <class T>
+	void WriteArray(const MappedArray<T>& a){ WriteArray(a.data(), a.size()); }
+	template <class T>
+	void WriteArray(const std::vector<T>& v){ WriteArray(v.empty()? (const T*)NULL : &v[0], v.size()); }
+
+private:
+	CacheWriter(const CacheWriter&);
+	CacheWriter& operator = (const CacheWriter&);
+
+	void WriteRecord(const void* data, std::size_t elem_size, std::size_t num);
+	void WriteBytes(const void* data, std::size_t size);
+
+private:
+	FILE*				fp;
+	std::string			filename;
+	std::string			temp;		//!< 書き込み中の一時ファイル
+	unsigned long long	key;
+	unsigned long long	offset;		//!< 書き込んだバイト数
+	bool				error;
+};
+
+/*!
+	@brief	キャッシュの読み込み
+	@class	CacheReader
+	@note	要素の大きさや範囲が合わないときは false を返し、それ以降の読み込みも全て失敗する
+ */
+class CacheReader
+{
+public:
+	CacheReader() : data(NULL), size(0), offset(0) {}
+
+	bool Open(const char* data, std::size_t size, unsigned long long key);
+
+	template <class T>
+	bool Read(T& value)
+	{
+		std::size_t num = 0;
+		const void* p = ReadRecord(sizeof(T), num);
+		if(!p || (num != 1))
+		{
+			Fail();
+			return false;
+		}
+		memcpy((void*)&value, p, sizeof(T));
+		return true;
+	}
+
+	//! 領域をコピーせずに参照する
+	template <class T>
+	bool ReadArray(MappedArray<T>& a)
+	{
+		std::size_t num = 0;
+		const void* p = ReadRecord(sizeof(T), num);
+		if(!p)
+			return false;
+		a.attach((const T*)p, num);
+		return true;
+	}
+
+	template <class T>
+	bool ReadArray(std::vector<T>& v)
+	{
+		std::size_t num = 0;
+		const void* p = ReadRecord(sizeof(T), num);
+		if(!p)
+			return false;
+		v.resize(num);
+		if(num)
+			memcpy((void*)&v[0], p, sizeof(T) * num);
+		return true;
+	}
+
+	bool IsEnd() const { return data && (offset == size); }
+
+private:
+	const void* ReadRecord(std::size_t elem_size, std::size_t& num);
+	void Fail(){ data = NULL; }
+
+private:
+	const char*	data;
+	std::size_t	size;
+	std::size_t	offset;	//!< 次に読む位置
+};
+
+#endif // !__CACHE_H_
@@ -1,5 +1,4 @@
 
-#include "lib/math/random.h"
 #include "config.h"
 #include "camera.h"
 
@@ -15,11 +14,12 @@ static const float K_FILM_ASPECT_RATIO = 1.5f;
 	@param[o]	u: u 座標
 	@param[o]	v: v 座標
 	@param[i]	aperture: 口径
+	@param[i]	rng: 乱数生成器
  */
-static void GetLensUV(float& u, float&v, float aperture)
+static void GetLensUV(float& u, float&v, float aperture, Random& rng)
 {
-	const float theta = PI2 * (float)genrand_real1();
-	const float r = aperture * (float)genrand_real1() * 0.5f;
+	const float theta = PI2 * rng.gen_real1();
+	const float r = aperture * rng.gen_real1() * 0.5f;
 	u = r * cosf(theta);
 	v = r * sinf(theta);
 }
@@ -45,8 +45,9 @@ Camera::~Camera()
 	@param[o]	ray: 光線
 	@param[i]	sx: スクリーン x 座標[0..1]
 	@param[i]	sy: スクリーン y 座標[0..1]
+	@param[i]	rng: 乱数生成器
  */
-void Camera::ShootRay(Ray& ray, float sx, float sy)
+void Camera::ShootRay(Ray& ray, float sx, float sy, Random& rng)
 {
 	const float theta = - (2.0f * sy - 1.0f) * half_fov_v;
 	const float phi   =   (2.0f * sx - 1.0f) * half_fov_h * (fb.aspect_ratio() / K_FILM_ASPECT_RATIO);
@@ -63,7 +64,7 @@ void Camera::ShootRay(Ray& ray, float sx, float sy)
 
 	// レンズ上の位置
 	Vector3 org;
-	GetLensUV(org.x, org.y, aperture);
+	GetLensUV(org.x, org.y, aperture, rng);
 	org.z = 0.0f;
 
 	// 合焦面上の位置 - レンズ上の位置 = 方向
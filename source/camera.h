@@ -10,6 +10,7 @@
 #define __CAMERA_H_
 
 #include "lib/math/matrix.h"
+#include "lib/math/random.h"
 #include "framebuffer_fp32.h"
 #include "ray.h"
 
@@ -19,7 +20,7 @@ public:
 	Camera();
 	~Camera();
 
-	void ShootRay(Ray& ray, float sx, float sy);
+	void ShootRay(Ray& ray, float sx, float sy, Random& rng);
 	Matrix44& GetPosture(){ return posture; }
 	FrameBufferFP32& GetFrameBuffer(){ return fb; }
 
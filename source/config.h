@@ -13,15 +13,27 @@
 #define USE_LOCAL_ILLUMINATION
 #define USE_GLOBAL_ILLUMINATION
 #define USE_PERF_CHECK
-#define USE_KDTREE
+#define USE_ACCELERATOR
+#define USE_KDTREE_BINNED
 #define USE_OCCLUSION_TEST
+#define USE_MIS			// 発光三角形の直接照明と反射方向のサンプリングを MIS で合成する
+//#define USE_WAVEFRONT	// 経路を幅優先に辿る(反射の段毎に光線をまとめて交差判定し、材質順に陰影計算する)
 #define USE_DOF_BLUR
 #define USE_ENV_FILE
+#define USE_SCENE_CACHE	// 構築済みのシーンを <入力ファイル名>.cache に保存して次回から読み込む
+//#define USE_COMPACT_VERTEX	// メッシュの法線を 32 ビットに圧縮する
 
 #define SCR_WIDTH			360
 #define SCR_HEIGHT			240
 #define MAX_DEPTH			3
+#define RR_DEPTH			3	// この深度からはスループットに比例する確率で経路を打ち切る
 #define MAX_SAMPLING		300
-#define MAX_KDTREE_DEPTH	5
+#define MAX_KDTREE_DEPTH	0	// 0: プリミティブ数から決める
+#define ACCEL_TYPE			0	// 0: kd 木, 1: BVH, 2: 4/8 分岐 BVH
+#define MAX_THREAD			0	// 0: ハードウェアの並列数
+#define RANDOM_SEED			0	// 乱数の種(同じ種なら同じ画像になる)
+#define TILE_SIZE			16
+#define MIS_HEURISTIC		1	// 0: バランスヒューリスティック, 1: パワーヒューリスティック
+#define WAVEFRONT_SIZE		4096	// USE_WAVEFRONT で 1 度に辿る経路の数
 
 #endif // !__CONFIG_H_
\ No newline at end of file
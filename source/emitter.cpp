@@ -0,0 +1,215 @@
+#include <algorithm>
+#include "emitter.h"
+#include "lib/math/vecmat.h"
+#include "object.h"
+
+
+/*!
+	@brief		変換が鏡映を含むか
+	@param[i]	m: 変換行列
+	@note		左上 3x3 の行列式が負なら向きが反転する
+ */
+static bool is_mirrored(const Matrix44& m)
+{
+	const Vector3 r0 = m.row_vector3(0);
+	const Vector3 r1 = m.row_vector3(1);
+	const Vector3 r2 = m.row_vector3(2);
+	Vector3 c;
+	Vec3OuterProduct(&c, &r1, &r2);
+	return Vec3InnerProduct(&r0, &c) < 0.0f;
+}
+
+/*!
+	@brief		発光する三角形を集める
+	@param[o]	out: プリミティブと同じ座標系の三角形
+	@param[i]	prims: プリミティブ
+	@note		インスタンスの中は辿らない(Object::Build() でオブジェクト毎に 1 度だけ集める)
+ */
+void EmitterTable::Collect(EmitterList& out, const PrimitiveArray& prims)
+{
+	out.clear();
+	const std::size_t num_tris = prims.GetTriangles().size();
+	const std::size_t num_faces = prims.GetMesh().GetFaces().size();
+	for(std::size_t i = 0; i < num_tris + num_faces; i++)
+	{
+		const PrimitiveArray::Id id = (i < num_tris)?
+			PrimitiveArray::MakeId(PrimitiveArray::Type_Triangle, i) :
+			PrimitiveArray::MakeId(PrimitiveArray::Type_Mesh, i - num_tris);
+		const Material* mtrl = (i < num_tris)? prims.GetTriangles()[i].GetMaterial() : prims.GetMesh().GetMaterial(i - num_tris);
+		if(ColorLuminance(&mtrl->e) <= 0.0f)
+			continue;
+
+		const Vector3* p[3];
+		prims.GetTrianglePoints(p, id);
+		Emitter emitter;
+		emitter.p = *p[0];
+		Vec3Subtract(&emitter.e1, p[1], p[0]);
+		Vec3Subtract(&emitter.e2, p[2], p[0]);
+		Vec3OuterProduct(&emitter.n, &emitter.e1, &emitter.e2);
+		const float len = Vec3Length(&emitter.n);
+		if(len <= 0.0f)
+			continue;
+		Vec3Scale(&emitter.n, &emitter.n, 1.0f / len);
+		emitter.e = mtrl->e;
+		out.push_back(emitter);
+	}
+}
+
+/*!
+	@brief		表の作成
+	@param[i]	prims: シーンのプリミティブ
+	@note		インスタンスは配置毎に別の三角形として加える
+ */
+void EmitterTable::Build(const PrimitiveArray& prims)
+{
+	Clear();
+	Collect(emitters, prims);
+	powers.resize(emitters.size());
+	for(std::size_t i = 0; i < emitters.size(); i++)
+	{
+		const Emitter& emitter = emitters[i];
+		Vector3 n;
+		Vec3OuterProduct(&n, &emitter.e1, &emitter.e2);
+		powers[i] = ColorLuminance(&emitter.e) * Vec3Length(&n) * 0.5f;
+	}
+
+	const std::vector<Instance>& instances = prims.GetInstances();
+	inst_offsets.resize(instances.size() + 1);
+	for(std::size_t i = 0; i < instances.size(); i++)
+	{
+		inst_offsets[i] = emitters.size();
+		const EmitterList& locals = instances[i].GetBaseObject()->GetEmitters();
+		const bool mirrored = is_mirrored(instances[i].GetWorld());
+		for(std::size_t j = 0; j < locals.size(); j++)
+			Add(locals[j], instances[i].GetWorld(), mirrored);
+	}
+	inst_offsets.back() = emitters.size();
+	Accumulate(0);
+}
+
+/*!
+	@brief		移動したインスタンスの三角形の更新
+	@param[i]	prims: シーンのプリミティブ(Build() と同じ構成であること)
+	@param[i]	ids: 移動したインスタンス(重複してもよい)
+	@note		三角形の並びは変わらないので、移動したインスタンスの区間だけを変換し直す
+ */
+void EmitterTable::Update(const PrimitiveArray& prims, const std::vector<PrimitiveArray::Id>& ids)
+{
+	const std::vector<Instance>& instances = prims.GetInstances();
+	std::size_t first = emitters.size();
+	for(std::size_t i = 0; i < ids.size(); i++)
+	{
+		const std::size_t index = PrimitiveArray::GetIndex(ids[i]);
+		const std::size_t begin = inst_offsets[index];
+		const std::size_t end = inst_offsets[index + 1];
+		if(begin == end)
+			continue;
+
+		// 区間の終わりまで追加してから元の位置に移す
+		const EmitterList& locals = instances[index].GetBaseObject()->GetEmitters();
+		const bool mirrored = is_mirrored(instances[index].GetWorld());
+		const std::size_t num = emitters.size();
+		for(std::size_t j = 0; j < locals.size(); j++)
+			Add(locals[j], instances[index].GetWorld(), mirrored);
+		std::copy(emitters.begin() + num, emitters.end(), emitters.begin() + begin);
+		std::copy(powers.begin() + num, powers.end(), powers.begin() + begin);
+		emitters.resize(num);
+		powers.resize(num);
+		first = std::min(first, begin);
+	}
+	if(first < emitters.size())
+		Accumulate(first);
+}
+
+/*!
+	@brief		全て破棄
+ */
+void EmitterTable::Clear()
+{
+	EmitterList().swap(emitters);
+	std::vector<float>().swap(powers);
+	std::vector<float>().swap(cdf);
+	std::vector<std::size_t>().swap(inst_offsets);
+	total_power = 0.0f;
+}
+
+/*!
+	@brief		ワールド座標に変換した三角形の追加
+	@param[i]	local: ローカル座標の三角形
+	@param[i]	world: ローカル座標からワールド座標への変換
+	@param[i]	mirrored: world が鏡映を含む
+	@note		鏡映を含む変換では辺の外積が表面と逆を向くので、法線を反転する
+ */
+void EmitterTable::Add(const Emitter& local, const Matrix44& world, bool mirrored)
+{
+	Vector3 v[3];
+	Vec3Transform(&v[0], &local.p, &world);
+	Vec3Add(&v[1], &local.p, &local.e1);
+	Vec3Transform(&v[1], &v[1], &world);
+	Vec3Add(&v[2], &local.p, &local.e2);
+	Vec3Transform(&v[2], &v[2], &world);
+
+	Emitter emitter;
+	emitter.p = v[0];
+	Vec3Subtract(&emitter.e1, &v[1], &v[0]);
+	Vec3Subtract(&emitter.e2, &v[2], &v[0]);
+	Vec3OuterProduct(&emitter.n, &emitter.e1, &emitter.e2);
+	const float len = Vec3Length(&emitter.n);
+	if(len > 0.0f)
+		Vec3Scale(&emitter.n, &emitter.n, (mirrored? -1.0f : 1.0f) / len);
+	emitter.e = local.e;
+	emitters.push_back(emitter);
+	powers.push_back(ColorLuminance(&emitter.e) * len * 0.5f);
+}
+
+/*!
+	@brief		放射束の累積
+	@param[i]	first: 累積し直す先頭(これより前は変わっていないこと)
+ */
+void EmitterTable::Accumulate(std::size_t first)
+{
+	cdf.resize(powers.size());
+	float sum = (first > 0)? cdf[first - 1] : 0.0f;
+	for(std::size_t i = first; i < powers.size(); i++)
+	{
+		sum += powers[i];
+		cdf[i] = sum;
+	}
+	total_power = sum;
+}
+
+/*!
+	@brief		発光面上の点を選ぶ
+	@param[o]	p: 選んだ点
+	@param[i]	rng: 乱数生成器
+	@return		点を含む三角形
+	@note		表が空でないこと
+ */
+const EmitterTable::Emitter& EmitterTable::Sample(Vector3& p, Random& rng) const
+{
+	ASSERT_MSG(!emitters.empty(), "EmitterTable::Sample(): empty");
+	// 累積は正規化していないので全放射束を掛けて比べる(丸めで範囲外を選ばないように末尾で止める)
+	const float u = rng.gen_real2() * total_power;
+	const std::size_t index = std::min((std::size_t)(std::upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin()), emitters.size() - 1);
+	const Emitter& emitter = emitters[index];
+
+	// 重心座標を一様に選ぶ
+	const float su = sqrtf(rng.gen_real1());
+	const float b1 = su * (1.0f - rng.gen_real1());
+	const float b2 = su - b1;
+	Vector3 t1, t2;
+	Vec3Scale(&t1, &emitter.e1, b1);
+	Vec3Scale(&t2, &emitter.e2, b2);
+	Vec3Add(&p, &emitter.p, &t1);
+	Vec3Add(&p, &p, &t2);
+	return emitter;
+}
+
+/*!
+	@brief		Sample() で点を選ぶ面積当たりの確率密度
+	@param[i]	e: 点を含む三角形の発光輝度
+ */
+float EmitterTable::CalcPdf(const Color& e) const
+{
+	return (total_power > 0.0f)? ColorLuminance(&e) / total_power : 0.0f;
+}
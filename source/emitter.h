@@ -0,0 +1,69 @@
+//==============================================================================
+/*!
+	@file	emitter.h
+	@brief	発光する三角形の表
+	@note	直接照明で発光面上の点を選ぶための表で、Scene::Build() で作る
+ */
+//==============================================================================
+#ifndef __EMITTER_H_
+#define __EMITTER_H_
+
+#include <vector>
+#include "lib/math/vector.h"
+#include "lib/math/matrix.h"
+#include "lib/math/random.h"
+#include "lib/color/color.h"
+#include "primitive.h"
+
+/*!
+	@brief	発光する三角形の表
+	@class	EmitterTable
+	@note	材質の発光が 0 でない三角形(メッシュの面、インスタンス内の三角形を含む)をワールド座標で持つ
+			三角形は放射束(輝度 x 面積)に比例する確率で選び、その上の点は面積に対して一様に選ぶので
+			選んだ点の面積当たりの確率密度は発光輝度 / 全放射束になり、三角形によらない
+			三角形は裏から光線が当たらないので、面法線の側だけが光るものとして扱う
+			球は対象にしないので、球の発光は間接照明の光線が当たったときだけ数える
+			インスタンスの分は Object が Collect() しておいたローカル座標の三角形を変換するだけで作り、
+			インスタンス毎に連続して並べるので、移動したインスタンスの分だけを Update() で置き換えられる
+ */
+class EmitterTable
+{
+public:
+	struct Emitter
+	{
+		Vector3	p;		//!< 1 つ目の頂点
+		Vector3	e1;		//!< 1 つ目から 2 つ目の頂点への辺
+		Vector3	e2;		//!< 1 つ目から 3 つ目の頂点への辺
+		Vector3	n;		//!< 面法線
+		Color	e;		//!< emittance
+	};
+	typedef std::vector<Emitter> EmitterList;
+
+public:
+	EmitterTable() : total_power(0.0f) {}
+
+	void Build(const PrimitiveArray& prims);
+	void Update(const PrimitiveArray& prims, const std::vector<PrimitiveArray::Id>& ids);
+	void Clear();
+
+	bool empty() const { return emitters.empty(); }
+	std::size_t size() const { return emitters.size(); }
+
+	const Emitter& Sample(Vector3& p, Random& rng) const;
+	float CalcPdf(const Color& e) const;
+
+	static void Collect(EmitterList& out, const PrimitiveArray& prims);
+
+private:
+	void Add(const Emitter& local, const Matrix44& world, bool mirrored);
+	void Accumulate(std::size_t first);
+
+private:
+	EmitterList					emitters;
+	std::vector<float>			powers;			//!< 三角形毎の輝度 x 面積
+	std::vector<float>			cdf;			//!< powers の累積(最後が total_power)
+	std::vector<std::size_t>	inst_offsets;	//!< インスタンス毎の emitters の開始位置(最後は終端)
+	float						total_power;	//!< 全ての三角形の輝度 x 面積の和
+};
+
+#endif // !__EMITTER_H_
@@ -10,8 +10,11 @@ bool LoadEnvironmentFile(Environment* env, const std::string& filename)
 	if(!ifs)
 		return false;
 
+	// 古い形式のファイルは末尾の項目を含まないので呼び出し元の値を残す
 	ifs.seekg(0, std::ios_base::end);
-	const unsigned long length = ifs.tellg();
+	unsigned long length = ifs.tellg();
+	if(length > sizeof(Environment))
+		length = sizeof(Environment);
 	ifs.seekg(0, std::ios_base::beg);
 	ifs.read((char*)env, length);
 	ifs.close();
@@ -25,6 +25,9 @@ struct Environment
 	unsigned long	flag;
 	float			eye_x, eye_y, eye_z;
 	float			at_x, at_y, at_z;
+	unsigned long	thread;		//!< 0: ハードウェアの並列数
+	unsigned long	accel;		//!< 0: kd 木, 1: BVH, 2: 4/8 分岐 BVH
+	unsigned long	seed;		//!< 乱数の種(同じ種なら同じ画像になる)
 };
 
 bool LoadEnvironmentFile(Environment* env, const std::string& filename);
@@ -39,6 +39,7 @@ public:
 	bool Intersect(float& t_near, float& t_far, const Vector3& org, const Vector3& dir) const;
 	bool Contains(const Vector3& pos) const;
 	Vector3 GetSize() const { return max - min; }
+	float GetSurfaceArea() const { Vector3 size = max - min; return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x); }
 
 public:
 	Vector3 min;
@@ -1,370 +1,914 @@
 
+#include <algorithm>
+#include <iterator>
 #include "kdtree.h"
+#include "lib/system/thread.h"
 
 
-KdMemory::~KdMemory()
+static const float K_TRAVERSAL_COST		= 1.0f;		//!< 節を 1 つ辿るコスト
+static const float K_INTERSECTION_COST	= 1.5f;		//!< プリミティブ 1 つとの交差判定のコスト
+static const float K_EMPTY_BONUS		= 0.8f;		//!< 空のノードを切り出す分断面の優遇率
+static const std::size_t K_NUM_BINS			= 32;
+static const std::size_t K_MAX_DEPTH			= 64;	//!< 走査スタックの大きさ
+static const std::size_t K_BINNED_THRESHOLD	= 1024;	//!< これ以下のノードはイベント走査に切り替える
+static const std::size_t K_PARALLEL_THRESHOLD	= 4096;	//!< これ以上のノードの子は別のワークで構築する
+static const unsigned int K_NO_INDEX			= 0xffffffff;
+
+/*!
+	@brief		分断面の SAH コスト
+	@param[i]	aabb: ノードの境界
+	@param[i]	inv_area: ノードの表面積の逆数
+	@param[i]	axis: 分断軸
+	@param[i]	pos: 分断面
+	@param[i]	nl: 左のプリミティブ数
+	@param[i]	nr: 右のプリミティブ数
+	@note		C = λ(Ct + Ci(Pl*Nl + Pr*Nr))
+				片側が空になるなら λ で優遇する
+ */
+static float calc_sah(const AABB& aabb, float inv_area, int axis, float pos, std::size_t nl, std::size_t nr)
 {
-	SAFE_DELETE_ARRAY(kd_array);
-	SAFE_DELETE_ARRAY(obj_array);
+	const Vector3 size = aabb.GetSize();
+	const int axis1 = (axis + 1) % Axis_Max;
+	const int axis2 = (axis + 2) % Axis_Max;
+	const float cross = size.v[axis1] * size.v[axis2];
+	const float perimeter = size.v[axis1] + size.v[axis2];
+	const float pl = 2.0f * (cross + (pos - aabb.min.v[axis]) * perimeter) * inv_area;
+	const float pr = 2.0f * (cross + (aabb.max.v[axis] - pos) * perimeter) * inv_area;
+	const float lambda = ((nl == 0) || (nr == 0))? K_EMPTY_BONUS : 1.0f;
+	return lambda * (K_TRAVERSAL_COST + K_INTERSECTION_COST * (pl * (float)nl + pr * (float)nr));
 }
 
 /*!
-	@brief		メモリ確保
-	@param[i]	kd_capacity: kd ノードの許容量
-	@param[i]	obj_capacity: obj リストの許容量
-	@note		32 バイト境界に合わせている点に注意
+	@brief	kd 木構築用ワーク
+	@class	KdTree::BuildWork
+	@note	部分木 1 つ分を自前のノード配列とインデックス配列に構築する
+			大きなノードの子は別のワークとして要求し、全て完了してから Gather() でつなぎ直す
+			つなぎ直す順番は木の形だけで決まるので、スレッド数や実行順によらず同じ木になる
+			イベントのプリミティブ番号はワーク内の通し番号(ids の添字)にしておき、
+			分配時の振り分け先の作業領域をワークのプリミティブ数で確保して、完了したら解放する
  */
-void KdMemory::Alloc(std::size_t kd_capacity, std::size_t obj_capacity)
+class KdTree::BuildWork : public Work
 {
-	unsigned long addr;
-	// kd
-	kd_array = (char*)(new KdTreeNode[kd_capacity+5]);
-	ASSERT_MSG(kd_array != NULL, "KdMemory::Alloc(): alloc failed");
-	addr = (unsigned long)kd_array;
-	kd_head = (KdTreeNode*)((addr + 32) & (0xffffffff - 31));
-	// obj
-	obj_array = (char*)(new ObjectList[obj_capacity+5]);
-	ASSERT_MSG(obj_array != NULL, "KdMemory::Alloc(): alloc failed");
-	addr = (unsigned long)obj_array;
-	obj_head = (ObjectList*)((addr + 32) & (0xffffffff - 31));
-	
-	ObjectList* node = obj_head;
-	for(std::size_t i = 0; i < obj_capacity-1; i++)
+public:
+	struct Child
+	{
+		unsigned int	node;		//!< 子を別のワークに任せた節
+		BuildWork*		left;
+		BuildWork*		right;
+	};
+
+public:
+	BuildWork(KdTree* tree, WorkPile* pile, const AABB& aabb, std::size_t depth)
+		: tree(tree), pile(pile), aabb(aabb), depth(depth), num_prims(0), binned(false)
 	{
-		node->SetNext(node+1);
-		node++;
 	}
-	node->SetNext(NULL);
-
-	capacity = kd_capacity;
-}
+	~BuildWork()
+	{
+		for(std::size_t i = 0; i < children.size(); i++)
+		{
+			delete children[i].left;
+			delete children[i].right;
+		}
+	}
 
-void KdMemory::Free()
-{
-	SAFE_DELETE_ARRAY(kd_array);
-	SAFE_DELETE_ARRAY(obj_array);
-	kd_head = NULL;
-	obj_head = NULL;
-	capacity = 0;
-}
+	void execute(std::size_t)
+	{
+		if(binned)
+		{
+			tree->SubDivide(*this, boxes, aabb, depth);
+		}
+		else
+		{
+			sides.assign(ids.size(), Side_Both);
+			tree->SubDivide(*this, events, num_prims, aabb, depth);
+		}
+		std::vector<unsigned int>().swap(ids);
+		std::vector<unsigned char>().swap(sides);
+	}
 
-ObjectList* KdMemory::NewObjectList()
-{
-	if(!obj_head)
-		return NULL;
+	/*!
+		@brief		イベントのプリミティブ番号をこのワーク内の通し番号に付け替える
+		@param[io]	events: イベント(番号は parent_ids の添字)
+		@param[i]	parent_ids: events の番号からプリミティブ番号への対応
+	 */
+	void Localize(EventList& events, const std::vector<unsigned int>& parent_ids)
+	{
+		std::vector<unsigned int> remap(parent_ids.size(), K_NO_INDEX);
+		ids.clear();
+		for(std::size_t i = 0; i < events.size(); i++)
+		{
+			Event& e = events[i];
+			if(remap[e.index] == K_NO_INDEX)
+			{
+				remap[e.index] = (unsigned int)ids.size();
+				ids.push_back(parent_ids[e.index]);
+			}
+			e.index = remap[e.index];
+		}
+	}
 
-	ObjectList* node;
-	node = obj_head;
-	obj_head = obj_head->GetNext();
-	node->SetNext(NULL);
-	node->SetPrimitive(NULL);
-	return node;
-}
+	BuildWork* Fork(const AABB& aabb, std::size_t depth)
+	{
+		BuildWork* work = new BuildWork(tree, pile, aabb, depth);
+		ASSERT_MSG(work != NULL, "KdTree::BuildWork::Fork(): alloc failed");
+		return work;
+	}
 
-void KdMemory::FreeObjectList(ObjectList* list)
-{
-	ObjectList* node = list;
-	while(node->GetNext())
-		node = node->GetNext();
-	node->SetNext( obj_head );
-	obj_head = list;
-}
+	void Spawn(unsigned int node, BuildWork* left, BuildWork* right)
+	{
+		Child child = { node, left, right };
+		children.push_back(child);
+		pile->request(left);
+		pile->request(right);
+	}
 
-KdTreeNode* KdMemory::NewKdTreeNodePair()
-{ 
-	if(capacity < 2)
+	const Child* FindChild(unsigned int node) const
+	{
+		for(std::size_t i = 0; i < children.size(); i++)
+		{
+			if(children[i].node == node)
+				return &children[i];
+		}
 		return NULL;
+	}
 
-	unsigned long* tmp = (unsigned long*)kd_head;
-	tmp[1] = tmp[3] = 0x6;
-	KdTreeNode* node = kd_head;
-	kd_head += 2;		// 配列で連続して確保しているから可能
-	capacity-= 2;
-	return node;
-}
+public:
+	KdTree*			tree;
+	WorkPile*		pile;
+	AABB			aabb;
+	std::size_t		depth;
+	EventList		events;
+	PrimBoxList		boxes;
+	std::size_t		num_prims;
+	bool			binned;		//!< boxes から構築する
+	std::vector<unsigned int>	ids;	//!< イベントの番号からプリミティブ番号への対応
+	std::vector<unsigned char>	sides;	//!< 分配時のイベントの番号毎の振り分け先(実行中だけ確保する)
+
+	std::vector<KdTreeNode>			nodes;
+	std::vector<PrimitiveArray::Id>	indices;
+	std::vector<Child>				children;
+};
 
 ////////////////////////////////////////////////////////////////////////////////
 
-KdTree::KdTree() : root(NULL), work(NULL), max_depth(0)
+KdTree::KdTree() : depth_limit(0), max_depth(0), mode(BuildMode_Sweep)
 {
 }
 
 KdTree::~KdTree()
 {
-	mem.Free();
-	SAFE_DELETE(root);
 }
 
-void KdTree::Build(const PrimitiveList& list, const AABB& aabb, std::size_t depth)
+/*!
+	@brief		構築
+	@param[i]	prims: プリミティブ
+	@param[i]	aabb: シーンの境界
+	@note		構築中はプリミティブを通し番号で扱い、リーフを作るときに Id に変える
+ */
+void KdTree::Build(const PrimitiveArray& prims, const AABB& aabb)
 {
-	mem.Free();
-	std::size_t kd_capacity = 0;
-	for(std::size_t i = 0; i < (depth+1); i++)
+	this->prims = &prims;
+	nodes.release();
+	indices.release();
+	this->aabb = aabb;
+
+	const std::size_t num_prims = prims.size();
+	std::size_t depth = depth_limit;
+	if(depth == 0)
+		depth = (std::size_t)(8.0f + 1.3f * logf((float)(num_prims + 1)) / logf(2.0f));
+	if(depth > K_MAX_DEPTH)
+		depth = K_MAX_DEPTH;
+	max_depth = depth;
+
+	WorkPile pile(max_thread);
+	BuildWork root(this, &pile, aabb, 0);
+	if((mode == BuildMode_Binned) && (num_prims > K_BINNED_THRESHOLD))
+	{
+		root.binned = true;
+		root.boxes.reserve(num_prims);
+		for(std::size_t i = 0; i < num_prims; i++)
+		{
+			PrimBox box;
+			if(!prims.CalcClippedAABB(box.aabb, aabb, prims.GetId(i)))
+				continue;
+			box.index = (unsigned int)i;
+			root.boxes.push_back(box);
+		}
+	}
+	else
 	{
-		kd_capacity += (std::size_t)powf(2.0f, (float)(depth+1));
+		root.events.reserve(num_prims * 6);
+		for(std::size_t i = 0; i < num_prims; i++)
+		{
+			AABB box;
+			if(!prims.CalcClippedAABB(box, aabb, prims.GetId(i)))
+				continue;
+			AddEvents(root.events, box, (unsigned int)root.ids.size());
+			root.ids.push_back((unsigned int)i);
+		}
+		root.num_prims = root.ids.size();
+		std::sort(root.events.begin(), root.events.end());
 	}
-	std::size_t obj_capacity = list.size();
-//	mem.Alloc(kd_capacity, obj_capacity*obj_capacity);	// 分断面を共有する可能性があるため余分に確保
-	mem.Alloc(kd_capacity, obj_capacity*10);	// 分断面を共有する可能性があるため余分に確保
-	max_depth = depth;
+	pile.request(&root);
+	pile.run();
+
+	// 部分木をつなぐ
+	if(root.children.empty())
+	{
+		nodes.swap(root.nodes);
+		indices.swap(root.indices);
+	}
+	else
+	{
+		Gather(root, 0);
+	}
+}
 
-	SAFE_DELETE(root);
-	root = new KdTreeNode();
-	ASSERT_MSG(root != NULL, "KdTree::Build(): alloc failed");
-	for(PrimitiveList::const_iterator it = list.begin(); it != list.end(); it++)
-		Add(root, (*it));
-
-	// 分断面の候補は三角形で最大 3、球で最大 2 となることから三角形に合わせる
-	split_list.Alloc(obj_capacity * 3);
-	work = new Work[obj_capacity];
-	ASSERT_MSG(work != NULL, "KdTree::Build(): alloc failed");
-	// 分割
-	SubDivide(root, aabb, 0, obj_capacity);
-	// 解放
-	delete[] work;
-	split_list.Free();
+/*!
+	@brief		部分木をつなぐ
+	@param[i]	work: 部分木を構築したワーク
+	@param[i]	node: ワーク内のノード番号
+	@note		深さ優先で追加し直すので、左の子が直後に並ぶ配置は保たれる
+ */
+void KdTree::Gather(const BuildWork& work, unsigned int node)
+{
+	const KdTreeNode& n = work.nodes[node];
+	const unsigned int index = (unsigned int)nodes.size();
+	if(n.IsLeaf())
+	{
+		nodes.push_back(KdTreeNode());
+		nodes[index].InitLeaf((unsigned int)indices.size(), n.GetNumPrims());
+		indices.insert(indices.end(), work.indices.begin() + n.GetOffset(), work.indices.begin() + n.GetOffset() + n.GetNumPrims());
+		return;
+	}
 
-	this->aabb = aabb;
+	nodes.push_back(n);
+	const BuildWork::Child* child = work.FindChild(node);
+	if(child)
+	{
+		Gather(*child->left, 0);
+		nodes[index].SetRight((unsigned int)nodes.size());
+		Gather(*child->right, 0);
+	}
+	else
+	{
+		Gather(work, node + 1);
+		nodes[index].SetRight((unsigned int)nodes.size());
+		Gather(work, n.GetRight());
+	}
 }
 
-void KdTree::SubDivide(KdTreeNode* node, const AABB& aabb, std::size_t depth, std::size_t num_prims)
+/*!
+	@brief		イベントの追加
+	@param[o]	events: イベントリスト
+	@param[i]	aabb: プリミティブの境界
+	@param[i]	index: プリミティブ番号
+ */
+void KdTree::AddEvents(EventList& events, const AABB& aabb, unsigned int index)
 {
-	split_list.Clear();
-
-	// 分断軸を決める(デフォルトは z 軸)
-	Vector3 size = aabb.GetSize();
-	if((size.x >= size.y) && (size.x >= size.z))
-		node->SetAxis(Axis_X);
-	else if((size.y >= size.x) && (size.y >= size.z))
-		node->SetAxis(Axis_Y);
-	const Axis axis = node->GetAxis(); 
-
-	// 分断候補リストの作成
-	ObjectList* list = node->GetList();
-	const float min = aabb.min.v[axis];
-	const float max = aabb.max.v[axis];
-	int idx = 0;
-	while(list)
+	Event e;
+	e.index = index;
+	for(int axis = Axis_X; axis < Axis_Max; axis++)
 	{
-		Work* w = &work[idx];
-		w->ref_prim = list->GetPrimitive();
-		w->right = true;
-		w->ref_prim->CalcRange(w->min, w->max, axis);
-		idx++;
-	
-		const std::size_t num_points = w->ref_prim->GetNumPoints();
-		for(std::size_t i = 0; i < num_points; i++)
+		e.axis = (unsigned char)axis;
+		if(aabb.min.v[axis] == aabb.max.v[axis])
 		{
-			float split = w->ref_prim->GetPoint(axis, i);
-			if((split >= min) && (split <= max))
-				split_list.Insert(split);
+			e.pos = aabb.min.v[axis];
+			e.type = Event::Type_Planar;
+			events.push_back(e);
+		}
+		else
+		{
+			e.pos = aabb.min.v[axis];
+			e.type = Event::Type_Start;
+			events.push_back(e);
+			e.pos = aabb.max.v[axis];
+			e.type = Event::Type_End;
+			events.push_back(e);
 		}
-		list = list->GetNext();
+	}
+}
+
+/*!
+	@brief		分割(イベント走査)
+	@param[io]	work: 構築中のワーク
+	@param[i]	events: ノードのイベント(ソート済み、呼び出し後は空になる)
+	@param[i]	num_prims: ノードのプリミティブ数
+	@param[i]	aabb: ノードの境界
+	@param[i]	depth: 深度
+	@note		ノードは深さ優先で配列に追加していくので、左の子は常に直後に並ぶ
+ */
+void KdTree::SubDivide(BuildWork& work, EventList& events, std::size_t num_prims, const AABB& aabb, std::size_t depth)
+{
+	std::vector<KdTreeNode>& nodes = work.nodes;
+	const unsigned int node = (unsigned int)nodes.size();
+	nodes.push_back(KdTreeNode());
+
+	Plane plane;
+	if((depth >= max_depth)
+	 || !FindPlane(plane, events, num_prims, aabb)
+	 || (plane.cost >= K_INTERSECTION_COST * (float)num_prims))
+	{
+		MakeLeaf(work, node, events);
+		return;
 	}
 
-	// 分断面の左右のカウント
-	SplitListNode* snode = split_list.GetHead();
 	AABB l_aabb = aabb;
 	AABB r_aabb = aabb;
-	while(snode)
+	l_aabb.max.v[plane.axis] = plane.pos;
+	r_aabb.min.v[plane.axis] = plane.pos;
+
+	EventList l_events, r_events;
+	std::size_t l_count, r_count;
+	SplitEvents(work, l_events, r_events, l_count, r_count, events, plane, l_aabb, r_aabb);
+	EventList().swap(events);
+	nodes[node].InitInterior(plane.axis, plane.pos);
+
+	// 大きなノードの子は並列に分割する
+	if(num_prims >= K_PARALLEL_THRESHOLD)
 	{
-		l_aabb.max.v[axis] = snode->GetSplitPos();
-		r_aabb.min.v[axis] = snode->GetSplitPos();
-		std::size_t l_count = 0;
-		std::size_t r_count = 0;
-		for(std::size_t i = 0; i < num_prims; i++)
-		{
-			Work* w = &work[i];
-			if(w->right)
-			{
-				if((w->min <= l_aabb.max.v[axis]) && (w->max >= l_aabb.min.v[axis]))
-				{
-					if(w->ref_prim->Intersect(l_aabb))
-						l_count++;
-				}
-				if((w->min <= r_aabb.max.v[axis]) && (w->max >= r_aabb.min.v[axis]))
-				{
-					if(w->ref_prim->Intersect(r_aabb))
-						r_count++;
-					else
-						w->right = false;
-				}
-			}
-			else
-			{
-				l_count++;
-			}
-		}
-		snode->SetLeftCount(l_count);
-		snode->SetRightCount(r_count);
-		snode = snode->GetNext();
+		BuildWork* l_work = work.Fork(l_aabb, depth+1);
+		BuildWork* r_work = work.Fork(r_aabb, depth+1);
+		l_work->events.swap(l_events);
+		l_work->num_prims = l_count;
+		l_work->Localize(l_work->events, work.ids);
+		r_work->events.swap(r_events);
+		r_work->num_prims = r_count;
+		r_work->Localize(r_work->events, work.ids);
+		work.Spawn(node, l_work, r_work);
+		return;
 	}
-	// 最適な分断面を決定する
-	const float SAV = 1.0f / (size.x * size.z + size.x * size.y + size.z * size.y);
-	const float Cleaf = (float)num_prims;
-	float low_cost = FLT_MAX;
-	float best_pos = 0.0f;
-	snode = split_list.GetHead();
-	while(snode)
+
+	// 子ノードの分割
+	SubDivide(work, l_events, l_count, l_aabb, depth+1);
+	nodes[node].SetRight((unsigned int)nodes.size());
+	SubDivide(work, r_events, r_count, r_aabb, depth+1);
+}
+
+/*!
+	@brief		分割(ビン分割)
+	@param[io]	work: 構築中のワーク
+	@param[i]	boxes: ノードのプリミティブ(呼び出し後は空になる)
+	@param[i]	aabb: ノードの境界
+	@param[i]	depth: 深度
+ */
+void KdTree::SubDivide(BuildWork& work, PrimBoxList& boxes, const AABB& aabb, std::size_t depth)
+{
+	const std::size_t num_prims = boxes.size();
+	if(num_prims <= K_BINNED_THRESHOLD)
 	{
-		l_aabb.max.v[axis] = snode->GetSplitPos();
-		r_aabb.min.v[axis] = snode->GetSplitPos();
-		Vector3 l_size = l_aabb.GetSize();
-		Vector3 r_size = r_aabb.GetSize();
-		float SAL = l_size.x * l_size.z + l_size.x * l_size.y + l_size.z * l_size.y;
-		float SAR = r_size.x * r_size.z + r_size.x * r_size.y + r_size.z * r_size.y;
-		// ToDo: 後ほど見直す
-		float cost = SAL * SAV * snode->GetLeftCount() + SAR * SAV * snode->GetRightCount();
-		if(cost < low_cost)
+		// 小さなノードはイベント走査に切り替える(番号はこのノードの中の通し番号にする)
+		EventList events;
+		events.reserve(num_prims * 6);
+		work.ids.resize(num_prims);
+		for(std::size_t i = 0; i < num_prims; i++)
 		{
-			low_cost = cost;
-			best_pos = snode->GetSplitPos();
+			AddEvents(events, boxes[i].aabb, (unsigned int)i);
+			work.ids[i] = boxes[i].index;
 		}
-		snode = snode->GetNext();
+		PrimBoxList().swap(boxes);
+		std::sort(events.begin(), events.end());
+		work.sides.assign(num_prims, Side_Both);
+		SubDivide(work, events, num_prims, aabb, depth);
+		return;
 	}
-	if(low_cost > Cleaf)
+
+	std::vector<KdTreeNode>& nodes = work.nodes;
+	const unsigned int node = (unsigned int)nodes.size();
+	nodes.push_back(KdTreeNode());
+
+	Plane plane;
+	if((depth >= max_depth)
+	 || !FindPlane(plane, boxes, aabb)
+	 || (plane.cost >= K_INTERSECTION_COST * (float)num_prims))
+	{
+		MakeLeaf(work, node, boxes);
 		return;
-	node->SetSplitPos(best_pos);
-	mem.FreeObjectList(node->GetList());
-
-	// 子ノードの構築
-	KdTreeNode* l_node = mem.NewKdTreeNodePair();
-	ASSERT_MSG(l_node != NULL, "KdTree::SubDivide(): alloc failed");
-	l_aabb.max.v[axis] = node->GetSplitPos();
-	r_aabb.min.v[axis] = node->GetSplitPos();
-	std::size_t l_count = 0;
-	std::size_t r_count = 0;
+	}
+
+	AABB l_aabb = aabb;
+	AABB r_aabb = aabb;
+	l_aabb.max.v[plane.axis] = plane.pos;
+	r_aabb.min.v[plane.axis] = plane.pos;
+
+	// 振り分け(またがるものはクリップし直す)
+	PrimBoxList l_boxes, r_boxes;
 	for(std::size_t i = 0; i < num_prims; i++)
 	{
-		Work* w = &work[i];
-		if((w->min <= l_aabb.max.v[axis]) && (w->max >= l_aabb.min.v[axis]))
+		const PrimBox& box = boxes[i];
+		const float min = box.aabb.min.v[plane.axis];
+		const float max = box.aabb.max.v[plane.axis];
+		if(max <= plane.pos)
 		{
-			if(w->ref_prim->Intersect(l_aabb))
-			{
-				Add(l_node, w->ref_prim);
-				l_count++;
-			}
+			l_boxes.push_back(box);
 		}
-		if((w->min <= r_aabb.max.v[axis]) && (w->max >= r_aabb.min.v[axis]))
+		else
+		if(min >= plane.pos)
 		{
-			if(w->ref_prim->Intersect(r_aabb))
-			{
-				Add((l_node+1), w->ref_prim);
-				r_count++;
-			}
+			r_boxes.push_back(box);
+		}
+		else
+		{
+			PrimBox clipped;
+			clipped.index = box.index;
+			if(prims->CalcClippedAABB(clipped.aabb, l_aabb, prims->GetId(box.index)))
+				l_boxes.push_back(clipped);
+			if(prims->CalcClippedAABB(clipped.aabb, r_aabb, prims->GetId(box.index)))
+				r_boxes.push_back(clipped);
 		}
 	}
-	node->SetLeft(l_node);
-	node->SetLeaf(false);
+	PrimBoxList().swap(boxes);
+	nodes[node].InitInterior(plane.axis, plane.pos);
 
-	// 子ノードの分割
-	if(depth < max_depth)
+	// 大きなノードの子は並列に分割する
+	if(num_prims >= K_PARALLEL_THRESHOLD)
 	{
-		if(l_count > 2)	SubDivide(l_node,     l_aabb, depth+1, l_count);
-		if(r_count > 2)	SubDivide((l_node+1), r_aabb, depth+1, r_count);
+		BuildWork* l_work = work.Fork(l_aabb, depth+1);
+		BuildWork* r_work = work.Fork(r_aabb, depth+1);
+		l_work->boxes.swap(l_boxes);
+		l_work->binned = true;
+		r_work->boxes.swap(r_boxes);
+		r_work->binned = true;
+		work.Spawn(node, l_work, r_work);
+		return;
 	}
+
+	// 子ノードの分割
+	SubDivide(work, l_boxes, l_aabb, depth+1);
+	nodes[node].SetRight((unsigned int)nodes.size());
+	SubDivide(work, r_boxes, r_aabb, depth+1);
 }
 
-void KdTree::Add(KdTreeNode* node, Primitive* prim)
+/*!
+	@brief		最適な分断面を探す(イベント走査)
+	@param[o]	plane: 分断面
+	@param[i]	events: ノードのイベント(ソート済み)
+	@param[i]	num_prims: ノードのプリミティブ数
+	@param[i]	aabb: ノードの境界
+	@retval		false: 候補なし
+	@note		同じ位置のイベントを終点、平面、始点の順にまとめて処理しながら
+				軸毎の左、平面上、右のプリミティブ数を更新していく
+ */
+bool KdTree::FindPlane(Plane& plane, const EventList& events, std::size_t num_prims, const AABB& aabb) const
 {
-	ObjectList* obj_node = mem.NewObjectList();
-	if(obj_node == NULL)
+	const float area = aabb.GetSurfaceArea();
+	if(area <= 0.0f)
+		return false;
+	const float inv_area = 1.0f / area;
+
+	std::size_t nl[Axis_Max] = { 0, 0, 0 };
+	std::size_t np[Axis_Max] = { 0, 0, 0 };
+	std::size_t nr[Axis_Max] = { num_prims, num_prims, num_prims };
+	bool found = false;
+	plane.cost = FLT_MAX;
+
+	const std::size_t num_events = events.size();
+	std::size_t i = 0;
+	while(i < num_events)
 	{
-		int a ;
-		a = 0;
+		const float pos = events[i].pos;
+		const int axis = events[i].axis;
+		std::size_t num_end = 0;
+		std::size_t num_planar = 0;
+		std::size_t num_start = 0;
+		while((i < num_events) && (events[i].axis == axis) && (events[i].pos == pos) && (events[i].type == Event::Type_End))
+		{
+			num_end++;
+			i++;
+		}
+		while((i < num_events) && (events[i].axis == axis) && (events[i].pos == pos) && (events[i].type == Event::Type_Planar))
+		{
+			num_planar++;
+			i++;
+		}
+		while((i < num_events) && (events[i].axis == axis) && (events[i].pos == pos) && (events[i].type == Event::Type_Start))
+		{
+			num_start++;
+			i++;
+		}
+
+		np[axis] = num_planar;
+		nr[axis] -= num_planar + num_end;
+		// ノードの境界上の分断面は意味がない
+		if((pos > aabb.min.v[axis]) && (pos < aabb.max.v[axis]))
+		{
+			const float l_cost = calc_sah(aabb, inv_area, axis, pos, nl[axis] + np[axis], nr[axis]);
+			const float r_cost = calc_sah(aabb, inv_area, axis, pos, nl[axis], nr[axis] + np[axis]);
+			if(l_cost < plane.cost)
+			{
+				plane.axis = (Axis)axis;
+				plane.pos = pos;
+				plane.planar_left = true;
+				plane.cost = l_cost;
+				found = true;
+			}
+			if(r_cost < plane.cost)
+			{
+				plane.axis = (Axis)axis;
+				plane.pos = pos;
+				plane.planar_left = false;
+				plane.cost = r_cost;
+				found = true;
+			}
+		}
+		nl[axis] += num_start + num_planar;
+		np[axis] = 0;
 	}
-	ASSERT_MSG(obj_node != NULL, "KdTree::Add(): alloc failed");
-	obj_node->SetPrimitive(prim);
-	obj_node->SetNext(node->GetList());
-	node->SetList(obj_node);
+	return found;
 }
 
-bool KdTree::Traverse(Primitive** prim, Primitive::Param& param, const Ray& ray) const
+/*!
+	@brief		最適な分断面を探す(ビン分割)
+	@param[o]	plane: 分断面
+	@param[i]	boxes: ノードのプリミティブ
+	@param[i]	aabb: ノードの境界
+	@retval		false: 候補なし
+	@note		ビンの境界だけを候補とし、始点と終点のヒストグラムの累積から左右の数を求める
+ */
+bool KdTree::FindPlane(Plane& plane, const PrimBoxList& boxes, const AABB& aabb) const
 {
-	float t_near;
-	float t_far;
-	if(!aabb.Intersect(t_near, t_far, ray.org, ray.dir))
+	const float area = aabb.GetSurfaceArea();
+	if(area <= 0.0f)
 		return false;
+	const float inv_area = 1.0f / area;
+	const Vector3 size = aabb.GetSize();
+	const std::size_t num_prims = boxes.size();
+	bool found = false;
+	plane.cost = FLT_MAX;
 
-	Vector3 entry_pos, exit_pos;
-	Vec3Scale(&entry_pos, &ray.dir, t_near);
-	Vec3Add(&entry_pos, &ray.org, &entry_pos);
-	Vec3Scale(&exit_pos, &ray.dir, t_far);
-	Vec3Add(&exit_pos, &ray.org, &exit_pos);
+	for(int axis = Axis_X; axis < Axis_Max; axis++)
+	{
+		if(size.v[axis] <= 0.0f)
+			continue;
+		const float scale = (float)K_NUM_BINS / size.v[axis];
+		std::size_t min_bins[K_NUM_BINS] = { 0 };
+		std::size_t max_bins[K_NUM_BINS] = { 0 };
+		for(std::size_t i = 0; i < num_prims; i++)
+		{
+			int min = (int)((boxes[i].aabb.min.v[axis] - aabb.min.v[axis]) * scale);
+			int max = (int)((boxes[i].aabb.max.v[axis] - aabb.min.v[axis]) * scale);
+			min = (min < 0)? 0 : ((min >= (int)K_NUM_BINS)? (int)K_NUM_BINS-1 : min);
+			max = (max < 0)? 0 : ((max >= (int)K_NUM_BINS)? (int)K_NUM_BINS-1 : max);
+			min_bins[min]++;
+			max_bins[max]++;
+		}
 
-	(*prim) = NULL;
-	return Traverse(prim, param, ray, root, entry_pos, exit_pos);
+		std::size_t nl = 0;
+		std::size_t nr = num_prims;
+		for(std::size_t b = 1; b < K_NUM_BINS; b++)
+		{
+			nl += min_bins[b-1];
+			nr -= max_bins[b-1];
+			const float pos = aabb.min.v[axis] + size.v[axis] * (float)b / (float)K_NUM_BINS;
+			const float cost = calc_sah(aabb, inv_area, axis, pos, nl, nr);
+			if(cost < plane.cost)
+			{
+				plane.axis = (Axis)axis;
+				plane.pos = pos;
+				plane.planar_left = true;
+				plane.cost = cost;
+				found = true;
+			}
+		}
+	}
+	return found;
 }
 
-bool KdTree::Traverse(Primitive** prim, Primitive::Param& param, const Ray& ray, const KdTreeNode* node, const Vector3& entry_pos, const Vector3& exit_pos) const
+/*!
+	@brief		イベントの分配
+	@param[io]	work: 構築中のワーク(振り分け先の作業領域は呼び出し前後で全て Side_Both)
+	@param[o]	l_events: 左の子のイベント
+	@param[o]	r_events: 右の子のイベント
+	@param[o]	l_count: 左の子のプリミティブ数
+	@param[o]	r_count: 右の子のプリミティブ数
+	@param[i]	events: ノードのイベント
+	@param[i]	plane: 分断面
+	@param[i]	l_aabb: 左の子の境界
+	@param[i]	r_aabb: 右の子の境界
+	@note		片側だけのイベントは順序を保ったまま振り分けるのでソートし直す必要はない
+				両側にまたがるプリミティブだけクリップし直してソートし、マージする
+ */
+void KdTree::SplitEvents(BuildWork& work, EventList& l_events, EventList& r_events, std::size_t& l_count, std::size_t& r_count, const EventList& events, const Plane& plane, const AABB& l_aabb, const AABB& r_aabb) const
 {
-	if(node->IsLeaf())
+	std::vector<unsigned char>& sides = work.sides;
+	const std::size_t num_events = events.size();
+
+	// 分断軸のイベントから振り分け先を決める(既定は両側)
+	for(std::size_t i = 0; i < num_events; i++)
+	{
+		const Event& e = events[i];
+		if(e.axis != plane.axis)
+			continue;
+		if((e.type == Event::Type_End) && (e.pos <= plane.pos))
+		{
+			sides[e.index] = Side_Left;
+		}
+		else
+		if((e.type == Event::Type_Start) && (e.pos >= plane.pos))
+		{
+			sides[e.index] = Side_Right;
+		}
+		else
+		if(e.type == Event::Type_Planar)
+		{
+			if((e.pos < plane.pos) || ((e.pos == plane.pos) && plane.planar_left))
+				sides[e.index] = Side_Left;
+			else
+				sides[e.index] = Side_Right;
+		}
+	}
+
+	// 片側だけのもの
+	EventList l_both, r_both;
+	l_count = r_count = 0;
+	for(std::size_t i = 0; i < num_events; i++)
 	{
-		// ToDo: 交差判定の実装
-		Primitive::Param temp;
-		float t = FLT_MAX;
-		ObjectList* obj_node = const_cast<ObjectList*>(node->GetList());
-		while(obj_node)
+		const Event& e = events[i];
+		const bool first = (e.axis == Axis_X) && (e.type != Event::Type_End);	// プリミティブ毎に 1 つだけ
+		switch(sides[e.index])
 		{
-			Primitive* p = obj_node->GetPrimitive();
-			if(p->Intersect(temp, ray))
+		case Side_Left:
+			l_events.push_back(e);
+			if(first) l_count++;
+			break;
+		case Side_Right:
+			r_events.push_back(e);
+			if(first) r_count++;
+			break;
+		default:
+			if(first)
 			{
-				if(temp.t < t)
+				AABB box;
+				const PrimitiveArray::Id id = prims->GetId(work.ids[e.index]);
+				if(prims->CalcClippedAABB(box, l_aabb, id))
+				{
+					AddEvents(l_both, box, e.index);
+					l_count++;
+				}
+				if(prims->CalcClippedAABB(box, r_aabb, id))
 				{
-					(*prim) = p;
-					param = temp;
-					t = temp.t;
+					AddEvents(r_both, box, e.index);
+					r_count++;
 				}
 			}
-			obj_node = obj_node->GetNext();
+			break;
 		}
-		return (*prim)? true : false;
 	}
+	// 振り分け先を戻しておく
+	for(std::size_t i = 0; i < num_events; i++)
+		sides[events[i].index] = Side_Both;
+
+	// またがるもののマージ
+	std::sort(l_both.begin(), l_both.end());
+	std::sort(r_both.begin(), r_both.end());
+	EventList temp;
+	temp.reserve(l_events.size() + l_both.size());
+	std::merge(l_events.begin(), l_events.end(), l_both.begin(), l_both.end(), std::back_inserter(temp));
+	l_events.swap(temp);
+	temp.clear();
+	temp.reserve(r_events.size() + r_both.size());
+	std::merge(r_events.begin(), r_events.end(), r_both.begin(), r_both.end(), std::back_inserter(temp));
+	r_events.swap(temp);
+}
 
-	const float split = node->GetSplitPos();
-	const Axis axis = node->GetAxis();
+/*!
+	@brief		リーフの作成
+	@param[io]	work: 構築中のワーク
+	@param[i]	node: ノード番号
+	@param[i]	events: ノードのイベント
+	@note		走査時に種類毎にまとめて判定できるよう、リーフ内を Id 順に並べる
+ */
+void KdTree::MakeLeaf(BuildWork& work, unsigned int node, const EventList& events)
+{
+	std::vector<PrimitiveArray::Id>& indices = work.indices;
+	const unsigned int offset = (unsigned int)indices.size();
+	const std::size_t num_events = events.size();
+	for(std::size_t i = 0; i < num_events; i++)
+	{
+		const Event& e = events[i];
+		if((e.axis == Axis_X) && (e.type != Event::Type_End))
+			indices.push_back(prims->GetId(work.ids[e.index]));
+	}
+	std::sort(indices.begin() + offset, indices.end());
+	work.nodes[node].InitLeaf(offset, (unsigned int)indices.size() - offset);
+}
 
-	if(entry_pos.v[axis] <= split)
+/*!
+	@brief		リーフの作成
+	@param[io]	work: 構築中のワーク
+	@param[i]	node: ノード番号
+	@param[i]	boxes: ノードのプリミティブ
+ */
+void KdTree::MakeLeaf(BuildWork& work, unsigned int node, const PrimBoxList& boxes)
+{
+	std::vector<PrimitiveArray::Id>& indices = work.indices;
+	const unsigned int offset = (unsigned int)indices.size();
+	const std::size_t num_prims = boxes.size();
+	for(std::size_t i = 0; i < num_prims; i++)
+		indices.push_back(prims->GetId(boxes[i].index));
+	std::sort(indices.begin() + offset, indices.end());
+	work.nodes[node].InitLeaf(offset, (unsigned int)num_prims);
+}
+
+/*!
+	@brief		最も近い交差を探す
+	@param[o]	id: 交差したプリミティブ
+	@param[o]	param: 交差情報
+	@param[i]	ray: 光線
+	@note		(ノード, t_min, t_max) の固定長スタックを使った反復走査
+				光線の区間を分断面でクリップしながら基点側の子から辿り、
+				セル内で交差が見つかった時点で打ち切る
+				セルの外で見つかった交差は候補として残し、より近いセルで見つからなければ採用する
+ */
+bool KdTree::Traverse(PrimitiveArray::Id& id, Primitive::Param& param, const Ray& ray) const
+{
+	struct StackEntry
 	{
-		if(exit_pos.v[axis] <= split)
+		unsigned int	node;
+		float			t_min;
+		float			t_max;
+	};
+
+	if(nodes.empty())
+		return false;
+
+	float t_min;
+	float t_max;
+	if(!aabb.Intersect(t_min, t_max, ray.org, ray.dir))
+		return false;
+
+	// 軸に平行な光線は分断面と交わらないので十分大きな値にしておく
+	Vector3 inv_dir;
+	for(int axis = Axis_X; axis < Axis_Max; axis++)
+		inv_dir.v[axis] = (ray.dir.v[axis] != 0.0f)? 1.0f / ray.dir.v[axis] : FLT_MAX;
+
+	StackEntry stack[K_MAX_DEPTH];
+	std::size_t top = 0;
+	unsigned int node = 0;
+	float t_hit = FLT_MAX;
+	bool found = false;
+	for(;;)
+	{
+		// 節をたどってリーフを探す
+		const KdTreeNode* n = &nodes[node];
+		while(!n->IsLeaf())
 		{
-			return Traverse(prim, param, ray, node->GetLeft(), entry_pos, exit_pos);
+			const Axis axis = n->GetAxis();
+			const float split = n->GetSplitPos();
+			const float t_split = (split - ray.org.v[axis]) * inv_dir.v[axis];
+			const bool below = (ray.org.v[axis] < split) || ((ray.org.v[axis] == split) && (ray.dir.v[axis] <= 0.0f));
+			const unsigned int near_node = below? (node + 1) : n->GetRight();
+			const unsigned int far_node = below? n->GetRight() : (node + 1);
+			if((t_split > t_max) || (t_split <= 0.0f))
+			{
+				node = near_node;
+			}
+			else
+			if(t_split < t_min)
+			{
+				node = far_node;
+			}
+			else
+			{
+				// 遠い側は分断面から先の区間だけを積む
+				stack[top].node = far_node;
+				stack[top].t_min = t_split;
+				stack[top].t_max = t_max;
+				top++;
+				node = near_node;
+				t_max = t_split;
+			}
+			n = &nodes[node];
 		}
-		Vector3 split_pos;
-		CalcSplitPos(split_pos, entry_pos, exit_pos, split, axis);
-		// exit_pos を修正(分断面でクリップ)
-		if(Traverse(prim, param, ray, node->GetLeft(), entry_pos, split_pos))
-			return true;
-		// entry_pos を修正(分断面でクリップ)
-		if(Traverse(prim, param, ray, node->GetRight(), split_pos, exit_pos))
-			return true;
+
+		// リーフ内の交差判定
+		const PrimitiveArray::Id* it = indices.data() + n->GetOffset();
+		if(prims->IntersectNearest(id, param, t_hit, it, it + n->GetNumPrims(), ray))
+			found = true;
+
+		// セル内の交差ならこれより近いものはない
+		if(t_hit <= t_max)
+			break;
+		if(top == 0)
+			break;
+		top--;
+		node = stack[top].node;
+		t_min = stack[top].t_min;
+		t_max = stack[top].t_max;
+		// 候補がこのセルより手前にあれば打ち切る
+		if(t_hit < t_min)
+			break;
 	}
-	else
+	return found;
+}
+
+/*!
+	@brief		遮蔽物の有無
+	@param[i]	ray: 光線
+	@param[i]	t_max: 調べる区間の終点(光源までの距離など)
+	@retval		true: [0, t_max] に交差がある
+	@note		影の判定用なので最も近い交差は求めず、最初に見つかった時点で戻る
+ */
+bool KdTree::Occluded(const Ray& ray, float t_max) const
+{
+	struct StackEntry
 	{
-		if(exit_pos.v[axis] > split)
+		unsigned int	node;
+		float			t_min;
+		float			t_max;
+	};
+
+	if(nodes.empty())
+		return false;
+
+	float t_min;
+	float t_far;
+	if(!aabb.Intersect(t_min, t_far, ray.org, ray.dir))
+		return false;
+	const float t_limit = t_max;
+	if(t_far < t_max)
+		t_max = t_far;
+	if(t_min > t_max)
+		return false;
+
+	Vector3 inv_dir;
+	for(int axis = Axis_X; axis < Axis_Max; axis++)
+		inv_dir.v[axis] = (ray.dir.v[axis] != 0.0f)? 1.0f / ray.dir.v[axis] : FLT_MAX;
+
+	StackEntry stack[K_MAX_DEPTH];
+	std::size_t top = 0;
+	unsigned int node = 0;
+	for(;;)
+	{
+		const KdTreeNode* n = &nodes[node];
+		while(!n->IsLeaf())
 		{
-			return Traverse(prim, param, ray, node->GetRight(), entry_pos, exit_pos);
+			const Axis axis = n->GetAxis();
+			const float split = n->GetSplitPos();
+			const float t_split = (split - ray.org.v[axis]) * inv_dir.v[axis];
+			const bool below = (ray.org.v[axis] < split) || ((ray.org.v[axis] == split) && (ray.dir.v[axis] <= 0.0f));
+			const unsigned int near_node = below? (node + 1) : n->GetRight();
+			const unsigned int far_node = below? n->GetRight() : (node + 1);
+			if((t_split > t_max) || (t_split <= 0.0f))
+			{
+				node = near_node;
+			}
+			else
+			if(t_split < t_min)
+			{
+				node = far_node;
+			}
+			else
+			{
+				stack[top].node = far_node;
+				stack[top].t_min = t_split;
+				stack[top].t_max = t_max;
+				top++;
+				node = near_node;
+				t_max = t_split;
+			}
+			n = &nodes[node];
 		}
-		Vector3 split_pos;
-		CalcSplitPos(split_pos, entry_pos, exit_pos, split, axis);
-		// exit_pos を修正(分断面でクリップ)
-		if(Traverse(prim, param, ray, node->GetRight(), entry_pos, exit_pos))
-			return true;
-		// entry_pos を修正(分断面でクリップ)
-		if(Traverse(prim, param, ray, node->GetLeft(), entry_pos, exit_pos))
+
+		const PrimitiveArray::Id* it = indices.data() + n->GetOffset();
+		if(prims->IntersectAny(it, it + n->GetNumPrims(), ray, t_limit))
 			return true;
+
+		if(top == 0)
+			break;
+		top--;
+		node = stack[top].node;
+		t_min = stack[top].t_min;
+		t_max = stack[top].t_max;
 	}
-	return false;	// まずここにはこない
+	return false;
+}
+
+/*!
+	@brief		キャッシュへの書き出し
+	@param[io]	writer: キャッシュ
+ */
+void KdTree::Save(CacheWriter& writer) const
+{
+	const unsigned long long depth = max_depth;
+	writer.Write(depth);
+	writer.Write(aabb);
+	writer.WriteArray(nodes);
+	writer.WriteArray(indices);
 }
 
-void KdTree::CalcSplitPos(Vector3& split_pos, const Vector3& entry_pos, const Vector3& exit_pos, float split, Axis axis) const
+/*!
+	@brief		キャッシュからの読み込み
+	@param[io]	reader: キャッシュ
+	@param[i]	prims: プリミティブ
+ */
+bool KdTree::Load(CacheReader& reader, const PrimitiveArray& prims)
 {
-	Vector3 sub;
-	Vec3Subtract(&sub, &exit_pos, &entry_pos);
-	float t = (split - entry_pos.v[axis]) / sub.v[axis];
-	Axis prev_axis = (Axis)((axis+2) % Axis_Max);
-	Axis next_axis = (Axis)((axis+1) % Axis_Max);
-	split_pos.v[prev_axis] = entry_pos.v[prev_axis] + sub.v[prev_axis] * t;
-	split_pos.v[next_axis] = entry_pos.v[next_axis] + sub.v[next_axis] * t;
-	split_pos.v[axis] = split;
+	this->prims = &prims;
+	unsigned long long depth = 0;
+	if(!reader.Read(depth) || (depth > K_MAX_DEPTH) || !reader.Read(aabb) ||
+	   !reader.ReadArray(nodes) || !reader.ReadArray(indices))
+		return false;
+	max_depth = (std::size_t)depth;
+	return true;
 }
@@ -2,131 +2,152 @@
 #ifndef __KDTREE_H_
 #define __KDTREE_H_
 
-#include "primitive.h"
-#include "splitlist.h"
+#include <vector>
+#include "accelerator.h"
 
 
-/*!
-	@brief	オブジェクトリスト
-	@class	ObjectList
-	@note	kd 木で使用する
- */
-class ObjectList
-{
-public:
-	ObjectList() : ref_prim(NULL), next(NULL) {}
-
-	void SetPrimitive(Primitive* prim){ ref_prim = prim; }
-	Primitive* GetPrimitive(){ return ref_prim; }
-	void SetNext(ObjectList* node){ next = node; }
-	ObjectList* GetNext(){ return next; }
-	
-private:
-	Primitive*	ref_prim;
-	ObjectList*	next;
-};
-
 /*!
 	@brief	kd 木ノード
 	@class	KdTreeNode
-	@note	data の bit 割り振りは以下
-				0- 1: 軸
-				2- 2: リーフかどうかを示す
-				3-31: アドレス 
-			Left と Right は連続していることに注意
-			リーフとそうでない場合に振る舞いが異なる点に注意
+	@note	8 バイトに収めている
+			flags の bit 割り振りは以下
+				0- 1: 軸(3 ならリーフ)
+				2-31: 節ならば右の子のインデックス、リーフならばプリミティブ数
+			左の子は必ず直後に配置するので持たない
+			リーフは分断面の代わりにインデックス配列の開始位置を持つ
  */
-#define MASK_AXIS	0x3
-#define MASK_LEAF	0x4
-#define MASK_DATA	(MASK_LEAF | MASK_AXIS)
-#define MASK_ADDR	0xfffffff8
- 
+#define KD_LEAF		0x3
+#define KD_SHIFT	2
+
 class KdTreeNode
 {
 public:
-	KdTreeNode() : data(0x6) {}
+	void InitLeaf(unsigned int offset, unsigned int num){ this->offset = offset; flags = KD_LEAF | (num << KD_SHIFT); }
+	void InitInterior(Axis axis, float split){ this->split = split; flags = axis; }
+	void SetRight(unsigned int index){ flags = (flags & KD_LEAF) | (index << KD_SHIFT); }
 
-	void SetSplitPos(float split){ this->split = split; }
+	bool IsLeaf() const { return (flags & KD_LEAF) == KD_LEAF; }
+	Axis GetAxis() const { return (Axis)(flags & KD_LEAF); }
 	float GetSplitPos() const { return split; }
-	
-	void SetAxis(Axis axis){ data = (data & ~MASK_AXIS) + axis; }
-	Axis GetAxis() const { return (Axis)(data & MASK_AXIS); }
-
-	void SetLeft(KdTreeNode* node){ data = (unsigned long)node + (data & MASK_DATA); }
-	KdTreeNode* GetLeft(){ return (KdTreeNode*)(data & MASK_ADDR); }
-	KdTreeNode* GetRight(){ return GetLeft() + 1; }
-	const KdTreeNode* GetLeft() const { return (KdTreeNode*)(data & MASK_ADDR); }
-	const KdTreeNode* GetRight() const { return GetLeft() + 1; }
-
-	bool IsLeaf() const { return (data & MASK_LEAF)? true : false; }
-	void SetLeaf(bool leaf){ data = (leaf)? (data | MASK_LEAF) : (data & ~MASK_LEAF); }
-
-	void SetList(ObjectList* list){ data = (unsigned long)list + (data & MASK_DATA); }
-	ObjectList* GetList(){ return (ObjectList*)(data & MASK_ADDR); }
-	const ObjectList* GetList() const { return (ObjectList*)(data & MASK_ADDR); }
-	
-private:
-	float			split;
-	unsigned long 	data;
-};
-
-/*!
-	@brief	kd 木用のメモリ管理クラス
-	@class	KdMemory
- */
-class KdMemory
-{
-public:
-	KdMemory() : kd_array(NULL), obj_array(NULL), kd_head(NULL), obj_head(NULL), capacity(0) {}
-	~KdMemory();
-
-	void Alloc(std::size_t kd_capacity, std::size_t obj_capacity);
-	void Free();
-
-	ObjectList* NewObjectList();
-	void FreeObjectList(ObjectList* list);
-	KdTreeNode* NewKdTreeNodePair();
+	unsigned int GetRight() const { return flags >> KD_SHIFT; }
+	unsigned int GetOffset() const { return offset; }
+	unsigned int GetNumPrims() const { return flags >> KD_SHIFT; }
 
 private:
-	char*		kd_array;
-	char*		obj_array;
-	KdTreeNode*	kd_head;
-	ObjectList*	obj_head;
-	std::size_t capacity;
+	union
+	{
+		float			split;		//!< 分断面(節)
+		unsigned int	offset;		//!< インデックス配列の開始位置(リーフ)
+	};
+	unsigned int	flags;
 };
 
 /*!
 	@brief	kd 木
 	@class	KdTree
+	@note	"On building fast kd-Trees for Ray Tracing, and on doing that in O(N log N)"
+			Ingo Wald, Vlastimil Havran
+			軸毎のイベント(プリミティブ境界の始点、終点、平面)をソート済みのまま分配していくことで
+			全 3 軸の SAH を O(N log N) で評価する
+			BuildMode_Binned は大きなノードをビン分割で近似し、小さくなったらイベント走査に切り替える
+			大きなノードの子は WorkPile で並列に構築する
  */
-class KdTree
+class KdTree : public Accelerator
 {
+public:
+	enum BuildMode
+	{
+		BuildMode_Sweep,	//!< イベント走査
+		BuildMode_Binned,	//!< ビン分割 + イベント走査
+	};
+
 public:
 	KdTree();
 	~KdTree();
 
-	void Build(const PrimitiveList& list, const AABB& aabb, std::size_t depth);
-	bool Traverse(Primitive** prim, Primitive::Param& param, const Ray& ray) const;
+	void SetBuildMode(BuildMode mode){ this->mode = mode; }
+	void SetMaxDepth(std::size_t depth){ depth_limit = depth; }
+	void Build(const PrimitiveArray& prims, const AABB& aabb);
+	bool Traverse(PrimitiveArray::Id& id, Primitive::Param& param, const Ray& ray) const;
+	bool Occluded(const Ray& ray, float t_max) const;
+	void Save(CacheWriter& writer) const;
+	bool Load(CacheReader& reader, const PrimitiveArray& prims);
 
 private:
-	void SubDivide(KdTreeNode* node, const AABB& aabb, std::size_t depth, std::size_t num_prims);
-	void Add(KdTreeNode* node, Primitive* prim);
-	bool Traverse(Primitive** prim, Primitive::Param& param, const Ray& ray, const KdTreeNode* node, const Vector3& entry_pos, const Vector3& exit_pos) const;
-	void CalcSplitPos(Vector3& split_pos, const Vector3& enrty_pos, const Vector3& exit_pos, float split, Axis axis) const;
+	class BuildWork;
+
+	/*!
+		@brief	分断候補となるイベント
+		@note	位置、軸、種類の順でソートする
+	 */
+	struct Event
+	{
+		enum Type
+		{
+			Type_End,
+			Type_Planar,
+			Type_Start,
+		};
+		float			pos;
+		unsigned int	index;		//!< プリミティブ番号(構築中のワーク内の通し番号)
+		unsigned char	axis;
+		unsigned char	type;
+
+		bool operator < (const Event& e) const
+		{
+			if(pos != e.pos) return pos < e.pos;
+			if(axis != e.axis) return axis < e.axis;
+			return type < e.type;
+		}
+	};
+	typedef std::vector<Event> EventList;
+
+	/*!
+		@brief	クリップ済みの境界付きプリミティブ(ビン分割用)
+	 */
+	struct PrimBox
+	{
+		AABB			aabb;
+		unsigned int	index;
+	};
+	typedef std::vector<PrimBox> PrimBoxList;
+
+	/*!
+		@brief	分断面
+	 */
+	struct Plane
+	{
+		Axis	axis;
+		float	pos;
+		bool	planar_left;	//!< 分断面上のプリミティブを左に含めるか
+		float	cost;
+	};
+
+	enum Side
+	{
+		Side_Both,
+		Side_Left,
+		Side_Right,
+	};
+
+	void SubDivide(BuildWork& work, EventList& events, std::size_t num_prims, const AABB& aabb, std::size_t depth);
+	void SubDivide(BuildWork& work, PrimBoxList& boxes, const AABB& aabb, std::size_t depth);
+	bool FindPlane(Plane& plane, const EventList& events, std::size_t num_prims, const AABB& aabb) const;
+	bool FindPlane(Plane& plane, const PrimBoxList& boxes, const AABB& aabb) const;
+	void SplitEvents(BuildWork& work, EventList& l_events, EventList& r_events, std::size_t& l_count, std::size_t& r_count, const EventList& events, const Plane& plane, const AABB& l_aabb, const AABB& r_aabb) const;
+	void MakeLeaf(BuildWork& work, unsigned int node, const EventList& events);
+	void MakeLeaf(BuildWork& work, unsigned int node, const PrimBoxList& boxes);
+	void Gather(const BuildWork& work, unsigned int node);
+
+	static void AddEvents(EventList& events, const AABB& aabb, unsigned int index);
 
 private:
-	KdTreeNode* root;		//!< root node
+	MappedArray<KdTreeNode>			nodes;		//!< 0 番がルート
+	MappedArray<PrimitiveArray::Id>	indices;	//!< リーフが参照するプリミティブ(リーフ内は種類順)
+	std::size_t depth_limit;	//!< 0 ならプリミティブ数から決める
 	std::size_t max_depth;
-	KdMemory	mem;
-	SplitList	split_list;
-	struct Work
-	{
-		float		min;
-		float		max;
-		Primitive*	ref_prim;
-		bool		right;
-	} *work;
+	BuildMode	mode;
 	AABB		aabb;
 };
 
-#endif // !__KDTREE_H_
\ No newline at end of file
+#endif // !__KDTREE_H_
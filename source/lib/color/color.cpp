@@ -64,6 +64,17 @@ Color* ColorScale3(Color* out, const Color* c, float s)
 	return out;
 }
 
+//------------------------------------------------------------------------------
+/*!
+	@brief		輝度
+	@param[i]	c: 線形 RGB(ITU-R BT.709)
+ */
+//------------------------------------------------------------------------------
+float ColorLuminance(const Color* c)
+{
+	return 0.2126f * c->r + 0.7152f * c->g + 0.0722f * c->b;
+}
+
 //------------------------------------------------------------------------------
 /*!
 	@brief		重みつき変換
@@ -36,6 +36,7 @@ Color* ColorSubtract3(Color* out, const Color* c0, const Color* c1);
 Color* ColorLerp3(Color* out, const Color* c0, const Color* c1, float s);
 Color* ColorModulate3(Color* out, const Color* c0, const Color* c1);
 Color* ColorScale3(Color* out, const Color* c, float s);
+float ColorLuminance(const Color* c);
 
 void ColorConv(Color* out, const Color* c, const float weights[3][3]);
 void ColorConvXYZtoYxy(Color* out, const Color* c);
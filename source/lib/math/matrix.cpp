@@ -579,6 +579,47 @@ Matrix44* Mtx44Inverse(Matrix44* out, const Matrix44* m)
 	return out;
 }
 
+//----------------------------------------------------------------------------------
+/*!
+	@brief		アフィン変換の逆行列
+	@param[o]	out: 出力
+	@param[i]	m: 4 列目が (0, 0, 0, 1) の行列
+	@retval		out と同じ(逆行列がなければ NULL)
+	@note		Mtx44Inverse() はピボットを選ばないので、回転で対角成分が 0 になる行列を扱えない
+				3x3 部分を余因子で反転し、平行移動はそれで戻す
+*/
+//----------------------------------------------------------------------------------
+Matrix44* Mtx44InverseAffine(Matrix44* out, const Matrix44* m)
+{
+	ASSERT_MSG(out != m, "Mtx44InverseAffine()");
+
+	const float c00 = m->_22 * m->_33 - m->_23 * m->_32;
+	const float c01 = m->_23 * m->_31 - m->_21 * m->_33;
+	const float c02 = m->_21 * m->_32 - m->_22 * m->_31;
+	const float det = m->_11 * c00 + m->_12 * c01 + m->_13 * c02;
+	if(det < FLT_MIN && det > -FLT_MIN)
+		return NULL;
+	const float inv_det = 1.0f / det;
+
+	out->_11 = c00 * inv_det;
+	out->_12 = (m->_13 * m->_32 - m->_12 * m->_33) * inv_det;
+	out->_13 = (m->_12 * m->_23 - m->_13 * m->_22) * inv_det;
+	out->_21 = c01 * inv_det;
+	out->_22 = (m->_11 * m->_33 - m->_13 * m->_31) * inv_det;
+	out->_23 = (m->_13 * m->_21 - m->_11 * m->_23) * inv_det;
+	out->_31 = c02 * inv_det;
+	out->_32 = (m->_12 * m->_31 - m->_11 * m->_32) * inv_det;
+	out->_33 = (m->_11 * m->_22 - m->_12 * m->_21) * inv_det;
+	out->_14 = out->_24 = out->_34 = 0.0f;
+
+	// 行ベクトルなので p = l * R + t から l = (p - t) * R^-1
+	out->_41 = -(m->_41 * out->_11 + m->_42 * out->_21 + m->_43 * out->_31);
+	out->_42 = -(m->_41 * out->_12 + m->_42 * out->_22 + m->_43 * out->_32);
+	out->_43 = -(m->_41 * out->_13 + m->_42 * out->_23 + m->_43 * out->_33);
+	out->_44 = 1.0f;
+	return out;
+}
+
 //----------------------------------------------------------------------------------
 /*!
 	@brief		平行移動行列
@@ -203,6 +203,7 @@ Matrix44* Mtx44Mul(Matrix44* out, const Matrix44* m1, const Matrix44* m2);
 Matrix44* Mtx44Scale(Matrix44* out, const Matrix44* m, float s);
 Matrix44* Mtx44Transpose(Matrix44* out, const Matrix44* m);
 Matrix44* Mtx44Inverse(Matrix44* out, const Matrix44* m);
+Matrix44* Mtx44InverseAffine(Matrix44* out, const Matrix44* m);
 Matrix44* Mtx44Translation(Matrix44* out, float x, float y, float z);
 Matrix44* Mtx44Scaling(Matrix44* out, float x, float y, float z);
 Matrix44* Mtx44RotationX(Matrix44* out, float theta);
@@ -2,7 +2,8 @@
 /*!
 	@file	random.h
 	@brief	乱数生成
-	@note	メルセンヌツイスター
+	@note	メルセンヌツイスター(グローバルな状態を持つ)
+			状態を持ち運べる PCG32 の Random
  */
 //==============================================================================
 #ifndef __RANDOM_H_
@@ -34,4 +35,59 @@ double genrand_real3(void);
 /* generates a random number on [0,1) with 53-bit resolution*/
 double genrand_res53(void);
 
+/*!
+	@brief	乱数生成器
+	@class	Random
+	@note	PCG32 (permuted congruential generator)
+			"PCG: A Family of Simple Fast Space-Efficient Statistically Good Algorithms for Random Number Generation"
+			Melissa E. O'Neill
+			http://www.pcg-random.org/
+			状態が 16 バイトで済むのでスレッド毎、画素毎に持たせられる
+			同じ seed でも stream が異なれば独立した系列になる
+ */
+class Random
+{
+public:
+	Random(){ init(0, 0); }
+	Random(unsigned long long seed, unsigned long long stream){ init(seed, stream); }
+
+	/*!
+		@brief		初期化
+		@param[i]	seed: 種
+		@param[i]	stream: 系列番号
+	 */
+	void init(unsigned long long seed, unsigned long long stream)
+	{
+		state = 0;
+		inc = (stream << 1) | 1;
+		gen_uint32();
+		state += seed;
+		gen_uint32();
+	}
+	/*!
+		@brief		[0,0xffffffff] の乱数
+	 */
+	unsigned int gen_uint32()
+	{
+		const unsigned long long old = state;
+		state = old * 6364136223846793005ULL + inc;
+		const unsigned int xorshifted = (unsigned int)(((old >> 18) ^ old) >> 27);
+		const unsigned int rot = (unsigned int)(old >> 59);
+		return (xorshifted >> rot) | (xorshifted << ((0u - rot) & 31));
+	}
+	/*!
+		@brief		[0,1] の乱数
+	 */
+	float gen_real1(){ return (float)(gen_uint32() * (1.0 / 4294967295.0)); }
+	/*!
+		@brief		[0,1) の乱数
+		@note		float の仮数部に収まる 24 bit だけ使う(1.0f に丸められないように)
+	 */
+	float gen_real2(){ return (gen_uint32() >> 8) * (1.0f / 16777216.0f); }
+
+private:
+	unsigned long long state;
+	unsigned long long inc;
+};
+
 #endif // !__RANDOM_H_
\ No newline at end of file
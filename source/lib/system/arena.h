@@ -0,0 +1,97 @@
+//==================================================================================
+/*!
+	@file	arena.h
+    @brief  まとめて解放する領域
+	@note	オブジェクトをブロック単位で確保した連続領域に順に置き、個別には解放しない
+			clear() で全てのデストラクタを呼んでからブロックだけを解放するので、
+			数が多くても確保と解放はブロックの数しか起きない
+ */
+//==================================================================================
+#ifndef __ARENA_H_
+#define __ARENA_H_
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+/*!
+	@brief	まとめて解放する領域
+	@class	Arena
+	@note	create() が返すポインタは clear() するまで動かない
+ */
+template <class T>
+class Arena
+{
+public:
+	static const std::size_t K_BLOCK_SIZE = 256;	//!< reserve() しない場合に 1 度に確保する要素数
+
+public:
+	Arena() : num(0) {}
+	~Arena(){ clear(); }
+
+	T* create(){ T* p = new(next()) T(); commit(); return p; }
+	T* create(const T& src){ T* p = new(next()) T(src); commit(); return p; }
+
+	/*!
+		@brief		確保済みの領域を増やす
+		@param[i]	size: 追加で create() する数
+		@note		今のブロックに収まらなければ size 個分のブロックを 1 つ確保するので、数が分かっていれば連続して並ぶ
+	 */
+	void reserve(std::size_t size)
+	{
+		const std::size_t rest = blocks.empty()? 0 : blocks.back().capacity - blocks.back().used;
+		if(size > rest)
+			add_block(size);
+	}
+
+	//! 作成した順にデストラクタを呼んで全てのブロックを解放する
+	void clear()
+	{
+		for(std::size_t i = 0; i < blocks.size(); i++)
+		{
+			T* p = blocks[i].data;
+			for(std::size_t j = 0; j < blocks[i].used; j++)
+				p[j].~T();
+			::operator delete(p);
+		}
+		blocks.clear();
+		num = 0;
+	}
+
+	std::size_t size() const { return num; }
+
+private:
+	struct Block
+	{
+		T*			data;
+		std::size_t	capacity;
+		std::size_t	used;
+	};
+
+	Arena(const Arena&);
+	Arena& operator = (const Arena&);
+
+	//! 次に置く位置(コンストラクタが終わってから commit() する)
+	void* next()
+	{
+		if(blocks.empty() || (blocks.back().used == blocks.back().capacity))
+			add_block(K_BLOCK_SIZE);
+		return blocks.back().data + blocks.back().used;
+	}
+	void commit(){ blocks.back().used++; num++; }
+
+	void add_block(std::size_t capacity)
+	{
+		Block block;
+		block.data = (T*)::operator new(sizeof(T) * capacity);
+		block.capacity = capacity;
+		block.used = 0;
+		blocks.push_back(block);
+	}
+
+private:
+	std::vector<Block>	blocks;
+	std::size_t			num;
+};
+
+#endif // !__ARENA_H_
@@ -0,0 +1,47 @@
+#include "cpu.h"
+#if defined(CPU_X86) && defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+
+/*!
+	@brief		SSE4.1 が使えるか
+ */
+bool cpu_has_sse4()
+{
+#if defined(CPU_X86) && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	return (info[2] & (1 << 19)) != 0;
+#elif defined(CPU_X86)
+	return __builtin_cpu_supports("sse4.1") != 0;
+#else
+	return false;
+#endif
+}
+
+/*!
+	@brief		AVX2 が使えるか
+	@note		OS が YMM レジスタを保存するかどうかも確認する
+ */
+bool cpu_has_avx2()
+{
+#if defined(CPU_X86) && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if(info[0] < 7)
+		return false;
+	__cpuid(info, 1);
+	const bool osxsave = (info[2] & (1 << 27)) != 0;
+	const bool avx = (info[2] & (1 << 28)) != 0;
+	if(!osxsave || !avx || ((_xgetbv(0) & 0x6) != 0x6))
+		return false;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#elif defined(CPU_X86)
+	return __builtin_cpu_supports("avx2") != 0;
+#else
+	return false;
+#endif
+}
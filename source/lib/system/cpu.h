@@ -0,0 +1,27 @@
+//==================================================================================
+/*!
+	@file	cpu.h
+    @brief  CPU の機能判定
+	@note	SIMD 命令を使う関数は TARGET_SSE4 / TARGET_AVX2 を付けて定義し、
+			実行時に cpu_has_sse4() / cpu_has_avx2() で呼び分ける
+ */
+//==================================================================================
+#ifndef __CPU_H_
+#define __CPU_H_
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define CPU_X86
+#endif
+
+#if defined(CPU_X86) && !defined(_MSC_VER)
+#define TARGET_SSE4		__attribute__((target("sse4.1")))
+#define TARGET_AVX2		__attribute__((target("avx2")))
+#else
+#define TARGET_SSE4
+#define TARGET_AVX2
+#endif
+
+bool cpu_has_sse4();
+bool cpu_has_avx2();
+
+#endif // !__CPU_H_
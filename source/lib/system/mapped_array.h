@@ -0,0 +1,125 @@
+//==================================================================================
+/*!
+	@file	mapped_array.h
+    @brief  割り当てた領域を参照できる配列
+	@note	普段は std::vector と同じように要素を持つが、attach() するとメモリマップドファイルなどの
+			外部の読み込み専用の領域をコピーせずに参照する
+			参照中に変更しようとすると、その時点で自前の領域にコピーしてから変更する
+ */
+//==================================================================================
+#ifndef __MAPPED_ARRAY_H_
+#define __MAPPED_ARRAY_H_
+
+#include <cstddef>
+#include <algorithm>
+#include <vector>
+
+/*!
+	@brief	割り当てた領域を参照できる配列
+	@class	MappedArray
+	@note	要素は memcpy で複製できる型であること
+			参照する領域は attach() してから配列を破棄するか変更するまで有効であること
+ */
+template <class T>
+class MappedArray
+{
+public:
+	typedef T			value_type;
+	typedef T*			iterator;
+	typedef const T*	const_iterator;
+
+public:
+	MappedArray() : ptr(NULL), num(0), mapped(false) {}
+	MappedArray(const MappedArray& a) : vec(a.begin(), a.end()), mapped(false) { update(); }
+
+	MappedArray& operator = (const MappedArray& a)
+	{
+		if(this != &a)
+		{
+			std::vector<T>(a.begin(), a.end()).swap(vec);
+			mapped = false;
+			update();
+		}
+		return *this;
+	}
+
+	/*!
+		@brief		外部の領域を参照する
+		@param[i]	data: 先頭
+		@param[i]	size: 要素数
+	 */
+	void attach(const T* data, std::size_t size)
+	{
+		std::vector<T>().swap(vec);
+		ptr = const_cast<T*>(data);
+		num = size;
+		mapped = true;
+	}
+	bool is_mapped() const { return mapped; }
+
+	std::size_t size() const { return num; }
+	bool empty() const { return num == 0; }
+
+	T& operator [] (std::size_t i){ own(); return ptr[i]; }
+	const T& operator [] (std::size_t i) const { return ptr[i]; }
+	T* data(){ own(); return ptr; }
+	const T* data() const { return ptr; }
+	iterator begin(){ own(); return ptr; }
+	iterator end(){ own(); return ptr + num; }
+	const_iterator begin() const { return ptr; }
+	const_iterator end() const { return ptr + num; }
+	T& back(){ own(); return ptr[num - 1]; }
+	const T& back() const { return ptr[num - 1]; }
+
+	void push_back(const T& value){ own(); vec.push_back(value); update(); }
+	void resize(std::size_t size){ own(); vec.resize(size); update(); }
+	void resize(std::size_t size, const T& value){ own(); vec.resize(size, value); update(); }
+	void reserve(std::size_t size){ own(); vec.reserve(size); update(); }
+	void assign(std::size_t size, const T& value){ mapped = false; vec.assign(size, value); update(); }
+	void clear(){ mapped = false; vec.clear(); update(); }
+
+	template <class It>
+	void insert(iterator pos, It first, It last)
+	{
+		const std::size_t offset = pos - ptr;
+		own();
+		vec.insert(vec.begin() + offset, first, last);
+		update();
+	}
+
+	void swap(MappedArray& a)
+	{
+		vec.swap(a.vec);
+		std::swap(ptr, a.ptr);
+		std::swap(num, a.num);
+		std::swap(mapped, a.mapped);
+	}
+	void swap(std::vector<T>& v){ own(); vec.swap(v); update(); }
+
+	//! 領域を解放する
+	void release(){ std::vector<T>().swap(vec); mapped = false; update(); }
+
+private:
+	//! 参照中なら自前の領域にコピーする
+	void own()
+	{
+		if(!mapped)
+			return;
+		std::vector<T>(ptr, ptr + num).swap(vec);
+		mapped = false;
+		update();
+	}
+	void update()
+	{
+		ptr = vec.empty()? NULL : &vec[0];
+		num = vec.size();
+	}
+
+private:
+	std::vector<T>	vec;
+	T*				ptr;	//!< vec の先頭か、参照している領域
+	std::size_t		num;
+	bool			mapped;	//!< 外部の領域を参照している
+};
+
+#endif // !__MAPPED_ARRAY_H_
@@ -0,0 +1,101 @@
+#include "mapped_file.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif // _WIN32
+
+
+MappedFile::MappedFile() : memory(NULL), length(0)
+{
+ #ifdef _WIN32
+	file = INVALID_HANDLE_VALUE;
+	mapping = NULL;
+ #endif // _WIN32
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+/*!
+	@brief		ファイルを開いて割り当てる
+	@param[i]	filename: ファイル名
+	@param[i]	sequential: 先頭から順に読むことを OS に伝えて先読みさせる
+	@retval		false: 開けなかった(空のファイルも含む)
+	@note		読む順序が決まっていない場合は sequential を false にして、読んだページがすぐに捨てられないようにする
+ */
+bool MappedFile::open(const char* filename, bool sequential)
+{
+	close();
+
+ #ifdef _WIN32
+	file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | (sequential? FILE_FLAG_SEQUENTIAL_SCAN : 0), NULL);
+	if(file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER file_size;
+	if(!GetFileSizeEx(file, &file_size) || (file_size.QuadPart == 0))
+	{
+		close();
+		return false;
+	}
+	mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if(!mapping)
+	{
+		close();
+		return false;
+	}
+	memory = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if(!memory)
+	{
+		close();
+		return false;
+	}
+	length = (std::size_t)file_size.QuadPart;
+ #else
+	const int fd = ::open(filename, O_RDONLY);
+	if(fd < 0)
+		return false;
+	struct stat st;
+	if((fstat(fd, &st) != 0) || (st.st_size == 0))
+	{
+		::close(fd);
+		return false;
+	}
+	void* p = mmap(NULL, (std::size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);	// 割り当てはファイルを閉じても残る
+	if(p == MAP_FAILED)
+		return false;
+	if(sequential)
+		madvise(p, (std::size_t)st.st_size, MADV_SEQUENTIAL);
+	memory = (const char*)p;
+	length = (std::size_t)st.st_size;
+ #endif // _WIN32
+	return true;
+}
+
+/*!
+	@brief		割り当ての解除
+ */
+void MappedFile::close()
+{
+ #ifdef _WIN32
+	if(memory)
+		UnmapViewOfFile(memory);
+	if(mapping)
+		CloseHandle(mapping);
+	if(file != INVALID_HANDLE_VALUE)
+		CloseHandle(file);
+	file = INVALID_HANDLE_VALUE;
+	mapping = NULL;
+ #else
+	if(memory)
+		munmap((void*)memory, length);
+ #endif // _WIN32
+	memory = NULL;
+	length = 0;
+}
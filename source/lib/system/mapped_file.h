@@ -0,0 +1,44 @@
+//==================================================================================
+/*!
+	@file	mapped_file.h
+    @brief  メモリマップドファイル
+	@note	読み込み専用でファイル全体をアドレス空間に割り当てる
+			ページはアクセスしたときに OS が読み込むので、ファイル全体を読むバッファを確保しない
+ */
+//==================================================================================
+#ifndef __MAPPED_FILE_H_
+#define __MAPPED_FILE_H_
+
+#include <cstddef>
+
+/*!
+	@brief	読み込み専用のメモリマップドファイル
+	@class	MappedFile
+	@note	data() の指す領域は close() するかデストラクタが呼ばれるまで有効
+ */
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile();
+
+	bool open(const char* filename, bool sequential = true);
+	void close();
+
+	const char* data() const { return memory; }
+	std::size_t size() const { return length; }
+
+private:
+	MappedFile(const MappedFile&);
+	MappedFile& operator = (const MappedFile&);
+
+private:
+	const char*	memory;
+	std::size_t	length;
+ #ifdef _WIN32
+	void*		file;		//!< ファイルのハンドル
+	void*		mapping;	//!< ファイルマッピングオブジェクトのハンドル
+ #endif // _WIN32
+};
+
+#endif // !__MAPPED_FILE_H_
@@ -1,124 +1,149 @@
-
+#include <thread>
 #include "thread.h"
 
 
-bool Thread::create(unsigned (__stdcall* func)(void*), void* arg)
+namespace
 {
-	if(handle)
-		return false;
-	handle = (HANDLE)::_beginthreadex(NULL, 0, func, arg, CREATE_SUSPENDED, &id);
-	return (handle)? true : false;
+	//! 実行中のスレッドが属する WorkPile とその番号
+	thread_local WorkPile*		current_pile = NULL;
+	thread_local std::size_t	current_id = 0;
 }
 
-bool Thread::close()
+/*!
+	@brief		コンストラクタ
+	@param[i]	max_thread: スレッド数(0 ならハードウェアの並列数)
+ */
+WorkPile::WorkPile(std::size_t max_thread) : left(0), next(0)
 {
-	if(!handle)
-		return false;
-	return (::CloseHandle(handle))? true : false;
+	if(max_thread == 0)
+		max_thread = get_hardware_concurrency();
+	this->max_thread = max_thread;
+
+	queues.resize(max_thread);
+	for(std::size_t i = 0; i < max_thread; i++)
+		queues[i] = new Queue();
 }
 
-bool Thread::join(unsigned long msec)
+WorkPile::~WorkPile()
 {
-	if(!handle)
-		return false;
-	if(::WaitForSingleObject(handle, msec) != WAIT_OBJECT_0)
-		return false;
-	count = 1;
-	return true;
+	for(std::size_t i = 0; i < queues.size(); i++)
+		delete queues[i];
 }
 
-bool Thread::resume()
+/*!
+	@brief		作業の要求
+	@param[i]	work: 作業
+	@note		ワーカースレッドからの要求は自分のキューに、それ以外は順番に振り分ける
+ */
+void WorkPile::request(Work* work)
 {
-	if(!handle || ((count - 1) != 0))
-		return false;
-	::ResumeThread(handle);
-	count--;
-	return true;
+	std::size_t id;
+	if(current_pile == this)
+	{
+		id = current_id;
+	}
+	else
+	{
+		id = next;
+		next = (next + 1) % max_thread;
+	}
+	work->set_status(Work::Status_NotStarted);
+	left++;
+
+	Queue* q = queues[id];
+	std::lock_guard<std::mutex> lock(q->mutex);
+	q->works.push_back(work);
 }
 
-bool Thread::suspend()
+/*!
+	@brief		ワーカースレッドの起動
+	@note		呼び出したスレッドも 0 番として作業に参加し、全ての作業が完了したら戻る
+ */
+void WorkPile::run()
 {
-	if(!handle || ((count + 1) != 1))
-		return false;
-	::SuspendThread(handle);
-	count++;
-	return true;
-}
+	std::vector<std::thread> threads;
+	threads.reserve(max_thread - 1);
+	for(std::size_t i = 1; i < max_thread; i++)
+		threads.push_back(std::thread(&WorkPile::worker, this, i));
 
-/////////////////
+	worker(0);
 
-WorkPile::WorkPile() : enable(false), max_thread(0)
-{
- #ifdef USE_THREAD_AFFINITY_MASK
-	SYSTEM_INFO sys_info;
-	GetSystemInfo(&sys_info);
-	max_cpu = sys_info.dwNumberOfProcessors;
- #endif // USE_THREAD_AFFINITY_MASK
+	for(std::size_t i = 0; i < threads.size(); i++)
+		threads[i].join();
 }
 
-WorkPile::~WorkPile()
+std::size_t WorkPile::get_hardware_concurrency()
 {
-	enable = false;
-	for(std::list<Thread*>::iterator it = thread_list.begin(); it != thread_list.end(); it++)
-	{
-		(*it)->join();
-		(*it)->close();
-		delete (*it);
-	}
+	const std::size_t num = std::thread::hardware_concurrency();
+	return (num > 0)? num : 1;
 }
 
 /*!
-	@brief	ワーカースレッドの起動
+	@brief		実行中のワーカースレッド番号
+	@note		ワーカースレッド以外では 0 を返す
  */
-void WorkPile::start(unsigned (__stdcall* worker_thread)(void*), std::size_t max_thread)
+std::size_t WorkPile::get_thread_id()
 {
-	// 生成
-	this->max_thread = max_thread;
+	return current_id;
+}
 
-	for(std::size_t i = 0; i < max_thread; i++)
+void WorkPile::worker(std::size_t thread_id)
+{
+	WorkPile* prev_pile = current_pile;
+	std::size_t prev_id = current_id;
+	current_pile = this;
+	current_id = thread_id;
+
+	while(left > 0)
 	{
-		Thread* thread = new Thread();
-		thread->create(worker_thread, this);
-		thread_list.push_back(thread);
- #ifdef USE_THREAD_AFFINITY_MASK
-		SetThreadAffinityMask(thread->get_handle(), 1<<(i%max_cpu));
- #endif // USE_THREAD_AFFINITY_MASK
+		Work* work = pop(thread_id);
+		if(!work)
+			work = steal(thread_id);
+		if(!work)
+		{
+			std::this_thread::yield();
+			continue;
+		}
+		work->set_status(Work::Status_Start);
+		work->execute(thread_id);
+		work->set_status(Work::Status_Completed);
+		left--;
 	}
-	// 起動させる
-	for(std::list<Thread*>::iterator it = thread_list.begin(); it != thread_list.end(); it++)
-		(*it)->resume();
 
-	enable = true;
+	current_pile = prev_pile;
+	current_id = prev_id;
 }
 
-void WorkPile::request(Work* work)
-{
-	work_queue.push(work);
-	left_work_list.push_back(work);
-}
-
-Work* WorkPile::get_work()
+/*!
+	@brief		自分のキューから取り出す
+	@note		後ろから取り出すことで直前に積んだ作業を優先する
+ */
+Work* WorkPile::pop(std::size_t thread_id)
 {
-	Work* work = NULL;
-	if(!work_queue.empty())
-	{
-		work = work_queue.front();
-		work_queue.pop();
-	}
+	Queue* q = queues[thread_id];
+	std::lock_guard<std::mutex> lock(q->mutex);
+	if(q->works.empty())
+		return NULL;
+	Work* work = q->works.back();
+	q->works.pop_back();
 	return work;
 }
 
-std::size_t WorkPile::get_left_work()
+/*!
+	@brief		他のキューから盗む
+	@note		前から取り出すことで大きな作業を優先して盗む
+ */
+Work* WorkPile::steal(std::size_t thread_id)
 {
-	std::list<Work*>::iterator it = left_work_list.begin();
-	while(it != left_work_list.end())
+	for(std::size_t i = 1; i < max_thread; i++)
 	{
-		if((*it)->get_status() == Work::Status_Completed)
-		{
-			it = left_work_list.erase(it);
+		Queue* q = queues[(thread_id + i) % max_thread];
+		std::unique_lock<std::mutex> lock(q->mutex, std::try_to_lock);
+		if(!lock.owns_lock() || q->works.empty())
 			continue;
-		}
-		it++;
+		Work* work = q->works.front();
+		q->works.pop_front();
+		return work;
 	}
-	return left_work_list.size();
+	return NULL;
 }
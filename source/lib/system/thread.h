@@ -4,70 +4,19 @@
     @brief  スレッド
     @author M.Morimoto
     @date   2010/03/10
-	@note	work pile アルゴリズム
-			Win32 環境依存
-			二重起動されると不味いので対策を考慮すること・・・ mutex とかね
+	@note	work stealing アルゴリズム
+			std::thread ベースなので環境依存なし
+			スレッド毎に両端キューを持ち、自分のキューが空になったら他のキューから盗む
  */
 //==================================================================================
 #ifndef __THREAD_H_
 #define __THREAD_H_
 
-#include <windows.h>
-#include <process.h>
-#include <queue>
-#include <list>
-
-#define USE_THREAD_AFFINITY_MASK
-
-/*!
-	@brief	単純なスレッドラッパークラス
-	@class	Thread
- */
-class Thread
-{
-public:
-	Thread() : handle(NULL), id(0), count(1) {}
-	virtual ~Thread(){}
-
-	bool create(unsigned (__stdcall* func)(void*), void* arg);
-	bool close();
-	bool join(unsigned long msec = INFINITE);
-	bool resume();
-	bool suspend();
-	HANDLE get_handle(){ return handle; }
-	unsigned int get_id(){ return id; }
-
-private:
-	HANDLE			handle;
-	unsigned int	id;
-	int				count;
-};
-
-/*!
-	@brief	クリティカルセクションラッパークラス
-	@class	CriticalSection
- */
-class CriticalSection
-{
-public:
-	CriticalSection(){ InitializeCriticalSection(&cs); }
-	~CriticalSection(){ DeleteCriticalSection(&cs); }
-	void lock(){ EnterCriticalSection(&cs); }
-	void unlock(){ LeaveCriticalSection(&cs); }
-
-private:
-	CRITICAL_SECTION cs;
-};
-
-/*!
-	@brief	スレッド生成失敗時の例外クラス
-	@class	thread_resource_error
- */
-class thread_resource_error : public std::runtime_error
-{
-public:
-	thread_resource_error() : std::runtime_error("error"){}
-};
+#include <cstddef>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <atomic>
 
 /*!
 	@brief	WorkPile 用作業クラス
@@ -87,39 +36,50 @@ public:
 public:
 	Work() : status(Status_NotStarted) {}
 	virtual ~Work(){}
-	Status get_status(){ return status; }
+	virtual void execute(std::size_t thread_id) = 0;
+	Status get_status() const { return status; }
 	void set_status(Status s){ status = s; }
 
 protected:
-	Status status;
+	std::atomic<Status> status;
 };
 
 /*!
-	@brief	WorkPile アルゴリズムによるスレッド
+	@brief	work stealing アルゴリズムによるスレッドプール
 	@class	WorkPile
-	@note	基本的に走りっぱなし
+	@note	run() は全ての作業が完了するまで戻らない
+			作業中に request() された作業は要求したスレッドのキューに積まれる
  */
 class WorkPile
 {
 public:
-	WorkPile();
+	explicit WorkPile(std::size_t max_thread = 0);
 	~WorkPile();
 
-	void start(unsigned (__stdcall* func)(void*), std::size_t max_thread);
 	void request(Work* work);
-	bool is_enable(){ return enable; }
-	Work* get_work();
-	std::size_t get_left_work();
+	void run();
+	std::size_t get_max_thread() const { return max_thread; }
+	std::size_t get_left_work() const { return left; }
+
+	static std::size_t get_hardware_concurrency();
+	static std::size_t get_thread_id();
+
+private:
+	struct Queue
+	{
+		std::mutex			mutex;
+		std::deque<Work*>	works;
+	};
+
+	void worker(std::size_t thread_id);
+	Work* pop(std::size_t thread_id);
+	Work* steal(std::size_t thread_id);
 
 private:
-	bool				enable;
-	std::size_t			max_thread;
-	std::list<Thread*>	thread_list;
-	std::queue<Work*>	work_queue;
-	std::list<Work*>	left_work_list;
- #ifdef USE_THREAD_AFFINITY_MASK
-	DWORD				max_cpu;
- #endif // USE_THREAD_AFFINITY_MASK
+	std::size_t					max_thread;
+	std::vector<Queue*>			queues;
+	std::atomic<std::size_t>	left;		//!< 未完了の作業数
+	std::size_t					next;		//!< 振り分け先のキュー
 };
 
-#endif // !__THREAD_H_
\ No newline at end of file
+#endif // !__THREAD_H_
@@ -9,7 +9,7 @@
 #ifndef __LIGHT_H_
 #define __LIGHT_H_
 
-#include <list>
+#include <vector>
 #include "lib/math/vector.h"
 #include "lib/color/color.h"
 #include "material.h"
@@ -34,6 +34,6 @@ public:
 	Color	intensity;
 };
 
-typedef std::list<Light*> LightList;
+typedef std::vector<Light*> LightList;
 
 #endif // !__LIGHT_H_
\ No newline at end of file
@@ -1,8 +1,12 @@
 
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <sstream>
+#include <algorithm>
+#include <ctype.h>
+#include <sys/stat.h>
 #include "lib/math/vecmat.h"
-#include "lib/math/random.h"
 #include "renderer.h"
 #include "config.h"
 #ifdef USE_PERF_CHECK 
@@ -10,9 +14,184 @@
 #include <mmsystem.h>	// winmm.lib リンクすること
 #endif // USE_PERF_CHECK
 #include "3ds.h"
+#include "obj.h"
+#include "ply.h"
 #include "environment.h"
 
 
+/*!
+	@brief		3DS のメッシュを TriangleMesh に追加
+	@param[io]	dst: 追加先
+	@param[i]	src: 3DS のメッシュ
+	@param[i]	mtrls: 3DS の材質番号に対応する材質
+	@param[i]	world: NULL でなければこの座標系のローカル座標に変換して追加する
+	@note		位置はそのまま共有し、頂点毎の法線は同じ位置で値(圧縮する場合は圧縮後の値)の等しいものを 1 つにまとめる
+ */
+void AppendMesh(TriangleMesh& dst, const _3ds::Mesh& src, Material* const* mtrls, const Matrix44* world)
+{
+	static const unsigned int K_NONE = 0xffffffff;
+
+	MappedArray<Vector3>& positions = dst.GetPositions();
+	MappedArray<TriangleMesh::Normal>& normals = dst.GetNormals();
+	MappedArray<TriangleMesh::Face>& faces = dst.GetFaces();
+	const unsigned int p_base = (unsigned int)positions.size();
+	const unsigned int n_base = (unsigned int)normals.size();
+	positions.insert(positions.end(), src.vertices, src.vertices + src.num_vertices);
+	Matrix44 inv_world;
+	if(world)
+	{
+		Mtx44InverseAffine(&inv_world, world);
+		for(unsigned short i = 0; i < src.num_vertices; i++)
+			Vec3Transform(&positions[p_base + i], &positions[p_base + i], &inv_world);
+	}
+
+	// 位置毎に法線の連結リストを作って重複を探す
+	std::vector<unsigned int> head(src.num_vertices, K_NONE);
+	std::vector<unsigned int> next;
+	unsigned short last_mtrl_id = 0;
+	unsigned int last_mtrl = src.num_faces? dst.AddMaterial(mtrls[src.faces[0].mtrl_id]) : 0;
+	for(unsigned short i = 0; i < src.num_faces; i++)
+	{
+		const _3ds::Face& face = src.faces[i];
+		const unsigned short index[3] = { face.a, face.b, face.c };
+		const Vector3* normal[3] = { &face.n0, &face.n1, &face.n2 };
+		TriangleMesh::Face f;
+		for(int j = 0; j < 3; j++)
+		{
+			Vector3 ln = *normal[j];
+			if(world)
+			{
+				// 法線は逆変換の逆転置、つまり world の転置で戻す
+				const Matrix44& m = *world;
+				ln.set(ln.x * m._11 + ln.y * m._12 + ln.z * m._13,
+					   ln.x * m._21 + ln.y * m._22 + ln.z * m._23,
+					   ln.x * m._31 + ln.y * m._32 + ln.z * m._33);
+				Vec3Normalize(&ln, &ln);
+			}
+			TriangleMesh::Normal n;
+			TriangleMesh::EncodeNormal(n, ln);
+			unsigned int k = head[index[j]];
+			while((k != K_NONE) && !(normals[n_base + k] == n))
+				k = next[k];
+			if(k == K_NONE)
+			{
+				k = (unsigned int)next.size();
+				next.push_back(head[index[j]]);
+				head[index[j]] = k;
+				normals.push_back(n);
+			}
+			f.p[j] = p_base + index[j];
+			f.n[j] = n_base + k;
+		}
+		if(face.mtrl_id != last_mtrl_id)
+		{
+			last_mtrl_id = face.mtrl_id;
+			last_mtrl = dst.AddMaterial(mtrls[face.mtrl_id]);
+		}
+		f.mtrl = last_mtrl;
+		faces.push_back(f);
+	}
+}
+
+/*!
+	@brief		3DS のメッシュのローカル座標系
+	@param[o]	world: ローカル座標からワールド座標への変換(行ベクトル)
+	@param[i]	src: メッシュ
+	@note		鏡像になる座標系では交差判定の裏面の向きが逆になるので z 軸を反転しておく
+ */
+void GetMeshWorld(Matrix44& world, const _3ds::Mesh& src)
+{
+	const Vector3& x = src.local_x;
+	const Vector3& y = src.local_y;
+	Vector3 z = src.local_z;
+	Vector3 xy;
+	Vec3OuterProduct(&xy, &x, &y);
+	if(Vec3InnerProduct(&xy, &z) < 0.0f)
+		Vec3Scale(&z, &z, -1.0f);
+	world = Matrix44(x.x, x.y, x.z, 0.0f,
+					 y.x, y.y, y.z, 0.0f,
+					 z.x, z.y, z.z, 0.0f,
+					 src.center.x, src.center.y, src.center.z, 1.0f);
+}
+
+/*!
+	@brief		同じ形状のメッシュをまとめる
+	@param[o]	groups: 形状毎のメッシュ番号(先頭が代表)
+	@param[i]	meshes: メッシュ
+	@param[i]	worlds: 各メッシュのローカル座標系
+	@note		頂点と面の数でふるい分けてから、面の並びと材質が等しく、
+				ローカル座標の頂点が境界の大きさの 1e-4 以内で一致するものを同じ形状とみなす
+ */
+void GroupMeshes(std::vector<std::vector<std::size_t> >& groups, const _3ds::mesh_array& meshes, const std::vector<Matrix44>& worlds)
+{
+	const std::size_t num_meshes = meshes.size();
+	std::vector<std::vector<Vector3> > locals(num_meshes);
+	std::vector<float> tolerances(num_meshes, 0.0f);
+	for(std::size_t i = 0; i < num_meshes; i++)
+	{
+		Matrix44 inv_world;
+		if(!Mtx44InverseAffine(&inv_world, &worlds[i]))
+			continue;
+		const _3ds::Mesh& src = *meshes[i];
+		std::vector<Vector3>& local = locals[i];
+		local.resize(src.num_vertices);
+		AABB aabb;
+		aabb.min.set( FLT_MAX, FLT_MAX, FLT_MAX);
+		aabb.max.set(-FLT_MAX,-FLT_MAX,-FLT_MAX);
+		for(unsigned short j = 0; j < src.num_vertices; j++)
+		{
+			Vec3Transform(&local[j], &src.vertices[j], &inv_world);
+			Vec3Minimize(&aabb.min, &aabb.min, &local[j]);
+			Vec3Maximize(&aabb.max, &aabb.max, &local[j]);
+		}
+		const Vector3 size = aabb.GetSize();
+		tolerances[i] = 1e-4f * Vec3Length(&size);
+	}
+
+	std::map<std::pair<unsigned short, unsigned short>, std::vector<std::size_t> > buckets;
+	for(std::size_t i = 0; i < num_meshes; i++)
+	{
+		const _3ds::Mesh& src = *meshes[i];
+		if(locals[i].empty())
+		{
+			groups.push_back(std::vector<std::size_t>(1, i));
+			continue;
+		}
+		std::vector<std::size_t>& bucket = buckets[std::make_pair(src.num_vertices, src.num_faces)];
+		bool found = false;
+		for(std::size_t b = 0; (b < bucket.size()) && !found; b++)
+		{
+			std::vector<std::size_t>& group = groups[bucket[b]];
+			const std::size_t rep = group[0];
+			const _3ds::Mesh& other = *meshes[rep];
+			bool same = true;
+			for(unsigned short j = 0; (j < src.num_faces) && same; j++)
+			{
+				const _3ds::Face& f0 = src.faces[j];
+				const _3ds::Face& f1 = other.faces[j];
+				same = (f0.a == f1.a) && (f0.b == f1.b) && (f0.c == f1.c) && (f0.mtrl_id == f1.mtrl_id);
+			}
+			const float tolerance = (tolerances[i] > tolerances[rep])? tolerances[i] : tolerances[rep];
+			for(unsigned short j = 0; (j < src.num_vertices) && same; j++)
+			{
+				Vector3 d;
+				Vec3Subtract(&d, &locals[i][j], &locals[rep][j]);
+				same = (Vec3Length(&d) <= tolerance);
+			}
+			if(same)
+			{
+				group.push_back(i);
+				found = true;
+			}
+		}
+		if(!found)
+		{
+			bucket.push_back(groups.size());
+			groups.push_back(std::vector<std::size_t>(1, i));
+		}
+	}
+}
+
 /*!
 	@brief		リファレンスシーンの初期化
 	@param[o]	renderer:
@@ -24,199 +203,156 @@ bool InitReferenceScene(Renderer& renderer, const Environment& env)
 	renderer.Init();
 	renderer.SetMaxDepth(env.depth);
 	renderer.SetMaxSampling(env.sample);
+	renderer.SetMaxThread(env.thread);
+	renderer.SetSeed(env.seed);
 
 	// initialize scene
 	Scene* scn = renderer.GetScene();
 	ColorSet(&scn->GetBGColor(), env.bg_r, env.bg_g, env.bg_b);
+	scn->Reserve(5, 0, 0);
+	scn->GetPrimitiveArray().Reserve(PrimitiveArray::Type_Sphere, 3);
+	scn->GetPrimitiveArray().Reserve(PrimitiveArray::Type_Triangle, 14);
 	{
 		// material
 		Material* mtrl[5];
 
-		mtrl[0] = new Material;
+		mtrl[0] = scn->CreateMaterial();
 		ColorSet(&mtrl[0]->pd, 1.0f, 0.5f, 0.5f);
 		ColorSet(&mtrl[0]->ps, 0.5f, 0.5f, 0.5f);
 		ColorSet(&mtrl[0]->e, 0.0f, 0.0f, 0.0f);
 		mtrl[0]->kd = 0.8f;
 		mtrl[0]->ks = 0.2f;
 		mtrl[0]->shine = 25.0f;
-		scn->GetMaterialList().push_back(mtrl[0]);
 
-		mtrl[1] = new Material;
+		mtrl[1] = scn->CreateMaterial();
 		ColorSet(&mtrl[1]->pd, 0.5f, 1.0f, 0.5f);
 		ColorSet(&mtrl[1]->ps, 0.5f, 0.5f, 0.5f);
 		ColorSet(&mtrl[1]->e, 0.0f, 0.0f, 0.0f);
 		mtrl[1]->kd = 0.8f;
 		mtrl[1]->ks = 0.2f;
 		mtrl[1]->shine = 25.0f;
-		scn->GetMaterialList().push_back(mtrl[1]);
 
-		mtrl[2] = new Material;
+		mtrl[2] = scn->CreateMaterial();
 		ColorSet(&mtrl[2]->pd, 0.5f, 0.5f, 1.0f);
 		ColorSet(&mtrl[2]->ps, 0.5f, 0.5f, 0.5f);
 		ColorSet(&mtrl[2]->e, 0.0f, 0.0f, 0.0f);
 		mtrl[2]->kd = 0.8f;
 		mtrl[2]->ks = 0.2f;
 		mtrl[2]->shine = 25.0f;
-		scn->GetMaterialList().push_back(mtrl[2]);
 
-		mtrl[3] = new Material;
+		mtrl[3] = scn->CreateMaterial();
 		ColorSet(&mtrl[3]->pd, 0.3f, 0.3f, 0.3f);
 		ColorSet(&mtrl[3]->ps, 0.0f, 0.0f, 0.0f);
 		ColorSet(&mtrl[3]->e, 0.0f, 0.0f, 0.0f);
 		mtrl[3]->kd = 1.0f;
 		mtrl[3]->ks = 0.0f;
 		mtrl[3]->shine = 0.0f;
-		scn->GetMaterialList().push_back(mtrl[3]);
 
-		mtrl[4] = new Material;
+		mtrl[4] = scn->CreateMaterial();
 		ColorSet(&mtrl[4]->pd, 0.0f, 0.0f, 0.0f);
 		ColorSet(&mtrl[4]->ps, 0.0f, 0.0f, 0.0f);
 		ColorSet(&mtrl[4]->e, 100.0f, 100.0f, 100.0f);
 		mtrl[4]->kd = 0.0f;
 		mtrl[4]->ks = 0.0f;
 		mtrl[4]->shine = 0.0f;
-		scn->GetMaterialList().push_back(mtrl[4]);
 
 		// primitive
 		Sphere* sph;
-		sph = new Sphere();
+		sph = scn->GetPrimitiveArray().AddSphere();
 		sph->p.set(-2.0f, 1.0f, 0.0f);
 		sph->r = 1.0f;
 		sph->SetMaterial(mtrl[0]);
-		scn->GetPrimitiveList().push_back(sph);
 
-		sph = new Sphere();
+		sph = scn->GetPrimitiveArray().AddSphere();
 		sph->p.set(0.0f, 1.0f, 1.0f);
 		sph->r = 1.0f;
 		sph->SetMaterial(mtrl[1]);
-		scn->GetPrimitiveList().push_back(sph);
 
-		sph = new Sphere();
+		sph = scn->GetPrimitiveArray().AddSphere();
 		sph->p.set( 2.0f, 1.0f, 0.0f);
 		sph->r = 1.0f;
 		sph->SetMaterial(mtrl[2]);
-		scn->GetPrimitiveList().push_back(sph);
 
 		// 床
 		Triangle* tri;
-		tri = new Triangle();
+		tri = scn->GetPrimitiveArray().AddTriangle();
 		tri->v[0].p.set(-3.0f, 0.0f, 3.0f); tri->v[1].p.set( 3.0f, 0.0f, 3.0f); tri->v[2].p.set(-3.0f, 0.0f,-3.0f);
 		tri->v[0].n.set( 0.0f, 1.0f, 0.0f); tri->v[1].n.set( 0.0f, 1.0f, 0.0f); tri->v[2].n.set( 0.0f, 1.0f, 0.0f);
-		tri->n.set( 0.0f, 1.0f, 0.0f);
 		tri->SetMaterial(mtrl[3]);
-		scn->GetPrimitiveList().push_back(tri);
 
-		tri = new Triangle();
+		tri = scn->GetPrimitiveArray().AddTriangle();
 		tri->v[0].p.set( 3.0f, 0.0f, 3.0f); tri->v[1].p.set( 3.0f, 0.0f,-3.0f); tri->v[2].p.set(-3.0f, 0.0f,-3.0f);
 		tri->v[0].n.set( 0.0f, 1.0f, 0.0f); tri->v[1].n.set( 0.0f, 1.0f, 0.0f); tri->v[2].n.set( 0.0f, 1.0f, 0.0f);
-		tri->n.set( 0.0f, 1.0f, 0.0f);
 		tri->SetMaterial(mtrl[3]);
-		scn->GetPrimitiveList().push_back(tri);
 
 		// 左
-		tri = new Triangle();
+		tri = scn->GetPrimitiveArray().AddTriangle();
 		tri->v[0].p.set(-3.0f, 6.0f,-3.0f); tri->v[1].p.set(-3.0f, 6.0f, 3.0f); tri->v[2].p.set(-3.0f, 0.0f,-3.0f);
 		tri->v[0].n.set(1.0f, 0.0f, 0.0f);  tri->v[1].n.set(1.0f, 0.0f, 0.0f);  tri->v[2].n.set(1.0f, 0.0f, 0.0f);
-		tri->n.set(1.0f, 0.0f, 0.0f);
 		tri->SetMaterial(mtrl[3]);
-		scn->GetPrimitiveList().push_back(tri);
 
-		tri = new Triangle();
+		tri = scn->GetPrimitiveArray().AddTriangle();
 		tri->v[0].p.set(-3.0f, 6.0f, 3.0f); tri->v[1].p.set(-3.0f, 0.0f, 3.0f); tri->v[2].p.set(-3.0f, 0.0f,-3.0f);
 		tri->v[0].n.set(1.0f, 0.0f, 0.0f); 	tri->v[1].n.set(1.0f, 0.0f, 0.0f); 	tri->v[2].n.set(1.0f, 0.0f, 0.0f);
-		tri->n.set(1.0f, 0.0f, 0.0f);
 		tri->SetMaterial(mtrl[3]);
-		scn->GetPrimitiveList().push_back(tri);
 
 		// 右
-		tri = new Triangle();
+		tri = scn->GetPrimitiveArray().AddTriangle();
 		tri->v[0].p.set(3.0f, 6.0f, 3.0f);  tri->v[1].p.set(3.0f, 6.0f,-3.0f);  tri->v[2].p.set(3.0f, 0.0f, 3.0f);
 		tri->v[0].n.set(-1.0f, 0.0f, 0.0f); tri->v[1].n.set(-1.0f, 0.0f, 0.0f); tri->v[2].n.set(-1.0f, 0.0f, 0.0f);
-		tri->n.set(-1.0f, 0.0f, 0.0f);
 		tri->SetMaterial(mtrl[3]);
-		scn->GetPrimitiveList().push_back(tri);
 
-		tri = new Triangle();
+		tri = scn->GetPrimitiveArray().AddTriangle();
 		tri->v[0].p.set(3.0f, 6.0f,-3.0f); 	tri->v[1].p.set(3.0f, 0.0f,-3.0f); 	tri->v[2].p.set(3.0f, 0.0f, 3.0f);
 		tri->v[0].n.set(-1.0f, 0.0f, 0.0f); tri->v[1].n.set(-1.0f, 0.0f, 0.0f); tri->v[2].n.set(-1.0f, 0.0f, 0.0f);
-		tri->n.set(-1.0f, 0.0f, 0.0f);
 		tri->SetMaterial(mtrl[3]);
-		scn->GetPrimitiveList().push_back(tri);
 
 		// 奥
-		tri = new Triangle();
+		tri = scn->GetPrimitiveArray().AddTriangle();
 		tri->v[0].p.set(-3.0f, 6.0f, 3.0f); tri->v[1].p.set( 3.0f, 6.0f, 3.0f); tri->v[2].p.set(-3.0f, 0.0f, 3.0f);
 		tri->v[0].n.set(0.0f, 0.0f,-1.0f);  tri->v[1].n.set(0.0f, 0.0f,-1.0f); 	tri->v[2].n.set(0.0f, 0.0f,-1.0f);
-		tri->n.set(0.0f, 0.0f,-1.0f);
 		tri->SetMaterial(mtrl[3]);
-		scn->GetPrimitiveList().push_back(tri);
 
-		tri = new Triangle();
+		tri = scn->GetPrimitiveArray().AddTriangle();
 		tri->v[0].p.set( 3.0f, 6.0f, 3.0f); tri->v[1].p.set( 3.0f, 0.0f, 3.0f); tri->v[2].p.set(-3.0f, 0.0f, 3.0f);
 		tri->v[0].n.set(0.0f, 0.0f,-1.0f);  tri->v[1].n.set(0.0f, 0.0f,-1.0f);  tri->v[2].n.set(0.0f, 0.0f,-1.0f);
-		tri->n.set(0.0f, 0.0f,-1.0f);
 		tri->SetMaterial(mtrl[3]);
-		scn->GetPrimitiveList().push_back(tri);
 
 		// 天井
-		tri = new Triangle();
+		tri = scn->GetPrimitiveArray().AddTriangle();
 		tri->v[0].p.set(-3.0f, 6.0f,-3.0f); tri->v[1].p.set( 3.0f, 6.0f,-3.0f); tri->v[2].p.set(-3.0f, 6.0f, 3.0f);
 		tri->v[0].n.set(0.0f, -1.0f, 0.0f); tri->v[1].n.set(0.0f, -1.0f, 0.0f); tri->v[2].n.set(0.0f, -1.0f, 0.0f);
-		tri->n.set(0.0f, -1.0f, 0.0f);
 		tri->SetMaterial(mtrl[3]);
-		scn->GetPrimitiveList().push_back(tri);
 
-		tri = new Triangle();
+		tri = scn->GetPrimitiveArray().AddTriangle();
 		tri->v[0].p.set( 3.0f, 6.0f,-3.0f); tri->v[1].p.set( 3.0f, 6.0f, 3.0f); tri->v[2].p.set(-3.0f, 6.0f, 3.0f);
 		tri->v[0].n.set(0.0f, -1.0f, 0.0f); tri->v[1].n.set(0.0f, -1.0f, 0.0f); tri->v[2].n.set(0.0f, -1.0f, 0.0f);
-		tri->n.set(0.0f, 0.0f,-1.0f);
 		tri->SetMaterial(mtrl[3]);
-		scn->GetPrimitiveList().push_back(tri);
 
 		// 手前
-		tri = new Triangle();
+		tri = scn->GetPrimitiveArray().AddTriangle();
 		tri->v[0].p.set( 3.0f, 6.0f,-3.0f); tri->v[1].p.set(-3.0f, 6.0f,-3.0f); tri->v[2].p.set( 3.0f, 0.0f,-3.0f);
 		tri->v[0].n.set(0.0f, 0.0f, 1.0f);  tri->v[1].n.set(0.0f, 0.0f, 1.0f);  tri->v[2].n.set(0.0f, 0.0f, 1.0f);
-		tri->n.set(0.0f, 0.0f, 1.0f);
 		tri->SetMaterial(mtrl[3]);
-		scn->GetPrimitiveList().push_back(tri);
 
-		tri = new Triangle();
+		tri = scn->GetPrimitiveArray().AddTriangle();
 		tri->v[0].p.set(-3.0f, 6.0f,-3.0f); tri->v[1].p.set(-3.0f, 0.0f,-3.0f); tri->v[2].p.set( 3.0f, 0.0f,-3.0f);
 		tri->v[0].n.set(0.0f, 0.0f, 1.0f);  tri->v[1].n.set(0.0f, 0.0f, 1.0f);  tri->v[2].n.set(0.0f, 0.0f, 1.0f);
-		tri->n.set(0.0f, 0.0f, 1.0f);
 		tri->SetMaterial(mtrl[3]);
-		scn->GetPrimitiveList().push_back(tri);
 
 		// 天井(光源)
-		tri = new Triangle();
+		tri = scn->GetPrimitiveArray().AddTriangle();
 		tri->v[0].p.set(-1.0f, 5.9f,-1.0f); tri->v[1].p.set( 1.0f, 5.9f,-1.0f); tri->v[2].p.set(-1.0f, 5.9f, 1.0f);
 		tri->v[0].n.set(0.0f, -1.0f, 0.0f); tri->v[1].n.set(0.0f, -1.0f, 0.0f); tri->v[2].n.set(0.0f, -1.0f, 0.0f);
-		tri->n.set(0.0f, -1.0f, 0.0f);
 		tri->SetMaterial(mtrl[4]);
-		scn->GetPrimitiveList().push_back(tri);
 
-		tri = new Triangle();
+		tri = scn->GetPrimitiveArray().AddTriangle();
 		tri->v[0].p.set( 1.0f, 5.9f,-1.0f); tri->v[1].p.set( 1.0f, 5.9f, 1.0f); tri->v[2].p.set(-1.0f, 5.9f, 1.0f);
 		tri->v[0].n.set(0.0f, -1.0f, 0.0f); tri->v[1].n.set(0.0f, -1.0f, 0.0f); tri->v[2].n.set(0.0f, -1.0f, 0.0f);
-		tri->n.set(0.0f, 0.0f,-1.0f);
 		tri->SetMaterial(mtrl[4]);
-		scn->GetPrimitiveList().push_back(tri);
 	}
-	Light* lig;
-	lig = new Light();
-#if 1
-	lig->type = Light::Type_Point;
-	lig->pos.set(0.0f, 5.8f, 0.0f);
-#else
-	lig->type = Light::Type_Directional;
-	lig->dir.set(0.0f,-1.0f,-1.0f);
-	Vec3Normalize(&lig->dir, &lig->dir);
-#endif
-	ColorSet(&lig->intensity, 100.0f, 100.0f, 100.0f);
-	scn->GetLightList().push_back(lig);
-
-	scn->Build();
+	// 天井の光源は発光三角形として直接照明で選ぶので、点光源は置かない
+	scn->Build((Accelerator::Type)env.accel, env.thread);
 
 	// initialize camera
 	Vector3 at, eye, up;
@@ -250,24 +386,176 @@ bool InitReferenceScene(Renderer& renderer, const Environment& env)
 }
 
 /*!
-	@brief		シーンの初期化
-	@param[o]	renderer:
-	@param[i]	filename:
-	@param[i]	env:
+	@brief		光源の初期化
+	@param[o]	sce: シーン
+	@param[i]	filename: ファイル名
  */
-bool Init(Renderer& renderer, const std::string& filename, const Environment& env)
+void InitLight(Scene& scn, const std::string& filename)
 {
-	// initialize renderer
-	renderer.Init();
-	renderer.SetMaxDepth(env.depth);
-	renderer.SetMaxSampling(env.sample);
+	std::ifstream ifs;
+	ifs.open(filename.c_str(), std::ios::in | std::ios::binary);
+	if(!ifs)
+	{
+		Light* lig;
+		lig = scn.CreateLight();
+ #if 0
+		lig->type = Light::Type_Point;
+		lig->pos.set(0.0f,100.0f,-100.0f);
+	//	lig->pos.set(0.0f, 5.8f, 0.0f);
+ #else
+		lig->type = Light::Type_Directional;
+		lig->dir.set(0.0f,-1.0f,-1.0f);
+		Vec3Normalize(&lig->dir, &lig->dir);
+ #endif
+		ColorSet(&lig->intensity, 100.0f, 100.0f, 100.0f);
+	}
+	else
+	{
+		struct LightInfo
+		{
+			unsigned long enbale;
+			unsigned long type;
+			Vector3	pos;
+			Vector3	rot;
+			Vector3 col;
+		}info;
 
-	// initialize scene
-	Scene* scn = renderer.GetScene();
-	ColorSet(&scn->GetBGColor(), 0.0f, 0.0f, 0.0f); 
+		ifs.seekg(0, std::ios_base::end);
+		const unsigned long length = ifs.tellg();
+		const unsigned long num = length / sizeof(Light);
+		ifs.seekg(0, std::ios_base::beg);
+		scn.Reserve(0, num, 0);
+		for(unsigned long i = 0; i < num; i++)
+		{
+			ifs.read((char*)&info, sizeof(LightInfo));
+			if(!info.enbale)
+				continue;
+
+			Light* lig = scn.CreateLight();
+			if(info.type == 0)
+			{
+				lig->type = Light::Type_Point;
+				lig->pos = info.pos;
+			}
+			else
+			{
+				lig->type = Light::Type_Directional;
+
+				Vector3 dir;
+				dir.set(0.0f, 0.0f, 1.0f);
+				Matrix44 mat;
+				info.rot.x = DegToRad(info.rot.x);
+				info.rot.y = DegToRad(info.rot.y);
+				info.rot.z = DegToRad(info.rot.z);
+				Mtx44RotationYawPitchRoll(&mat, info.rot.y, info.rot.x, info.rot.z);
+				Vec3Transform(&lig->dir, &dir, &mat);
+			}
+			ColorSet(&lig->intensity, info.col.x, info.col.y, info.col.z);
+		}
+		ifs.close();
+	}
+}
+
+/*!
+	@brief		ファイルの識別情報をハッシュに加える
+	@param[i]	hash: これまでのハッシュ
+	@param[i]	filename: ファイル名
+	@note		中身を読むと暖かい起動でもファイル全体を辿ることになるので、名前、大きさ、更新時刻で識別する
+				同じ秒に同じ大きさで書き直されても区別できるよう、取れる環境では更新時刻のナノ秒と i-node も加える
+ */
+unsigned long long HashFileStat(unsigned long long hash, const std::string& filename)
+{
+	struct stat st;
+	long long info[4] = { -1, -1, -1, -1 };
+	if(stat(filename.c_str(), &st) == 0)
+	{
+		info[0] = (long long)st.st_size;
+		info[1] = (long long)st.st_mtime;
+ #if defined(__APPLE__)
+		info[2] = (long long)st.st_mtimespec.tv_nsec;
+		info[3] = (long long)st.st_ino;
+ #elif !defined(_WIN32)
+		info[2] = (long long)st.st_mtim.tv_nsec;
+		info[3] = (long long)st.st_ino;
+ #endif // __APPLE__
+	}
+	hash = CacheHash(filename.c_str(), filename.size() + 1, hash);
+	return CacheHash(info, sizeof(info), hash);
+}
+
+/*!
+	@brief		シーンのキャッシュのキー
+	@param[i]	filename: 形状のファイル名
+	@param[i]	light_filename: 光源のファイル名
+	@param[i]	env: 設定
+	@note		入力ファイルと、構築結果を変える設定やデータ構造の大きさをまとめる
+ */
+unsigned long long CalcCacheKey(const std::string& filename, const std::string& light_filename, const Environment& env)
+{
+	const unsigned int settings[] =
+	{
+		K_CACHE_VERSION,
+		(unsigned int)env.accel,
+		MAX_KDTREE_DEPTH,
+ #ifdef USE_KDTREE_BINNED
+		1,
+ #else
+		0,
+ #endif // USE_KDTREE_BINNED
+ #ifdef USE_COMPACT_VERTEX
+		1,
+ #else
+		0,
+ #endif // USE_COMPACT_VERTEX
+		sizeof(Material),
+		sizeof(Light),
+		sizeof(TriangleMesh::Normal),
+		sizeof(TriangleMesh::Face),
+	};
+	unsigned long long hash = CacheHash(settings, sizeof(settings));
+	hash = HashFileStat(hash, filename);
+	return HashFileStat(hash, light_filename);
+}
+
+/*!
+	@brief		シーンの読み込み
+	@param[o]	scn: シーン
+	@param[i]	filename: ファイル名
+	@param[i]	env: 設定
+	@note		形状、材質、光源を読み込んで構築する
+ */
+bool LoadScene(Scene* scn, const std::string& filename, const Environment& env)
+{
+	std::size_t max_thread = env.thread;
+ #ifndef USE_MULTI_THREAD
+	max_thread = 1;
+ #endif // !USE_MULTI_THREAD
+	// OBJ と PLY は材質を読まないので、全ての面に既定の材質を使う
+	std::string ext = filename.substr(filename.rfind('.') + 1);
+	for(std::size_t i = 0; i < ext.size(); i++)
+		ext[i] = (char)tolower(ext[i]);
+	if((ext == "obj") || (ext == "ply"))
+	{
+		Material* mtrl = scn->CreateMaterial();
+		ColorSet(&mtrl->pd, 0.75f, 0.75f, 0.75f);
+		ColorSet(&mtrl->ps, 0.0f, 0.0f, 0.0f);
+		ColorSet(&mtrl->e, 0.0f, 0.0f, 0.0f);
+		mtrl->kd = 1.0f;
+		mtrl->ks = 0.0f;
+		mtrl->shine = 0.0f;
+
+		TriangleMesh& mesh = scn->GetPrimitiveArray().GetMesh();
+		const bool loaded = (ext == "obj")? _obj::Load(mesh, mtrl, filename, max_thread) : _ply::Load(mesh, mtrl, filename, max_thread);
+		if(!loaded)
+		{
+			std::cout << "Load failed" << std::endl;
+			return false;
+		}
+	}
+	else
 	{
 		_3ds::Geometry geom;
-		if(!geom.Load(filename))
+		if(!geom.Load(filename, max_thread))
 		{
 			std::cout << "Load failed" << std::endl;
 			return false;
@@ -276,9 +564,10 @@ bool Init(Renderer& renderer, const std::string& filename, const Environment& en
 		const _3ds::material_array& materials = geom.GetMaterials();
 		Material** mtrls = new Material*[materials.size()];
 		int counter = 0;
+		scn->Reserve(materials.size(), 0, 0);
 		for(_3ds::material_array::const_iterator it = materials.begin(); it != materials.end(); it++)
 		{
-			Material* mtrl = mtrls[counter] = new Material;
+			Material* mtrl = mtrls[counter] = scn->CreateMaterial();
 			counter++;
 			ColorSet(&mtrl->pd, (*it)->diffuse.r,  (*it)->diffuse.g,  (*it)->diffuse.b);
 			ColorSet(&mtrl->ps, (*it)->specular.r, (*it)->specular.g, (*it)->specular.b);
@@ -288,32 +577,90 @@ bool Init(Renderer& renderer, const std::string& filename, const Environment& en
 			mtrl->kd = d / (d + s);
 			mtrl->ks = s / (d + s);
 			mtrl->shine = (*it)->shininess;
-			scn->GetMaterialList().push_back(mtrl);
 		}
 
 		const _3ds::mesh_array& meshes = geom.GetMeshes();
-		for(_3ds::mesh_array::const_iterator it = meshes.begin(); it != meshes.end(); it++)
+		std::vector<Matrix44> worlds(meshes.size());
+		for(std::size_t i = 0; i < meshes.size(); i++)
+			GetMeshWorld(worlds[i], *meshes[i]);
+		std::vector<std::vector<std::size_t> > groups;
+		GroupMeshes(groups, meshes, worlds);
+
+		// 1 度しか現れない形状はワールド座標のまま 1 つのメッシュにまとめる
+		TriangleMesh& mesh = scn->GetPrimitiveArray().GetMesh();
+		std::size_t num_vertices = 0, num_faces = 0, num_objs = 0, num_instances = 0;
+		for(std::size_t g = 0; g < groups.size(); g++)
 		{
-			const Vector3* vertices = (*it)->vertices;
-			const unsigned short num_faces = (*it)->num_faces;
-			for(unsigned short i = 0; i < num_faces; i++)
+			if(groups[g].size() > 1)
 			{
-				Triangle* tri = new Triangle;
-				tri->v[0].p = vertices[(*it)->faces[i].a];
-				tri->v[1].p = vertices[(*it)->faces[i].b];
-				tri->v[2].p = vertices[(*it)->faces[i].c];
-				tri->v[0].n = (*it)->faces[i].n0;
-				tri->v[1].n = (*it)->faces[i].n1;
-				tri->v[2].n = (*it)->faces[i].n2;
-				tri->n = (*it)->faces[i].n;
-				tri->SetMaterial(mtrls[(*it)->faces[i].mtrl_id]);
-				scn->GetPrimitiveList().push_back(tri);
+				num_objs++;
+				num_instances += groups[g].size();
+				continue;
 			}
+			num_vertices += meshes[groups[g][0]]->num_vertices;
+			num_faces += meshes[groups[g][0]]->num_faces;
+		}
+		mesh.Reserve(mesh.GetPositions().size() + num_vertices, mesh.GetNormals().size() + num_vertices, mesh.GetFaces().size() + num_faces);
+		scn->Reserve(0, 0, num_objs);
+		scn->GetPrimitiveArray().Reserve(PrimitiveArray::Type_Instance, scn->GetPrimitiveArray().GetInstances().size() + num_instances);
+		for(std::size_t g = 0; g < groups.size(); g++)
+		{
+			if(groups[g].size() == 1)
+				AppendMesh(mesh, *meshes[groups[g][0]], mtrls, NULL);
+		}
+
+		// 繰り返し現れる形状はローカル座標で 1 度だけ持ち、インスタンスとして配置する
+		for(std::size_t g = 0; g < groups.size(); g++)
+		{
+			const std::vector<std::size_t>& group = groups[g];
+			if(group.size() == 1)
+				continue;
+			Object* obj = scn->CreateObject();
+			AppendMesh(obj->GetPrimitiveArray().GetMesh(), *meshes[group[0]], mtrls, &worlds[group[0]]);
+			for(std::size_t i = 0; i < group.size(); i++)
+				scn->GetPrimitiveArray().AddInstance()->Init(obj, worlds[group[i]]);
 		}
 		delete[] mtrls;
 	}
 
-	scn->Build();
+	InitLight(*scn, "lig.dat");
+	scn->Build((Accelerator::Type)env.accel, env.thread);
+	return true;
+}
+
+/*!
+	@brief		シーンの初期化
+	@param[o]	renderer:
+	@param[i]	filename:
+	@param[i]	env:
+ */
+bool Init(Renderer& renderer, const std::string& filename, const Environment& env)
+{
+	// initialize renderer
+	renderer.Init();
+	renderer.SetMaxDepth(env.depth);
+	renderer.SetMaxSampling(env.sample);
+	renderer.SetMaxThread(env.thread);
+	renderer.SetSeed(env.seed);
+
+	// initialize scene
+	Scene* scn = renderer.GetScene();
+	ColorSet(&scn->GetBGColor(), 0.0f, 0.0f, 0.0f); 
+ #ifdef USE_SCENE_CACHE
+	// 入力と設定が同じなら前回構築したシーンを割り当てるだけで済ませる
+	const std::string cache_name = filename + ".cache";
+	const unsigned long long cache_key = CalcCacheKey(filename, "lig.dat", env);
+	if(!scn->LoadCache(cache_name, cache_key))
+	{
+		if(!LoadScene(scn, filename, env))
+			return false;
+		if(!scn->SaveCache(cache_name, cache_key))
+			std::cout << "Cache save failed" << std::endl;
+	}
+ #else
+	if(!LoadScene(scn, filename, env))
+		return false;
+ #endif // USE_SCENE_CACHE
 
 	// initialize camera
 	Vector3 at, eye, up;
@@ -347,76 +694,178 @@ bool Init(Renderer& renderer, const std::string& filename, const Environment& en
 }
 
 /*!
-	@brief		光源の初期化
-	@param[o]	sce: シーン
-	@param[i]	filename: ファイル名
+	@brief		1 枚の描画と保存
+	@param[io]	renderer: 初期化済みのレンダラー
+	@param[i]	ofilename: 出力ファイル名
  */
-void InitLight(Scene& scn, const std::string& filename)
+void RenderFrame(Renderer& renderer, const std::string& ofilename)
 {
-	std::ifstream ifs;
-	ifs.open(filename.c_str(), std::ios::in | std::ios::binary);
-	if(!ifs)
+	// render
 	{
-		Light* lig;
-		lig = new Light();
- #if 0
-		lig->type = Light::Type_Point;
-		lig->pos.set(0.0f,100.0f,-100.0f);
-	//	lig->pos.set(0.0f, 5.8f, 0.0f);
- #else
-		lig->type = Light::Type_Directional;
-		lig->dir.set(0.0f,-1.0f,-1.0f);
-		Vec3Normalize(&lig->dir, &lig->dir);
- #endif
-		ColorSet(&lig->intensity, 100.0f, 100.0f, 100.0f);
-		scn.GetLightList().push_back(lig);
+		std::cout << ">>> render start" << std::endl;
+ #ifdef USE_PERF_CHECK
+		DWORD begin_time = timeGetTime();
+ #endif // USE_PERF_CHECK
+		renderer.Render();
+ #ifdef USE_PERF_CHECK
+		DWORD time = (timeGetTime() - begin_time);
+		std::cout << "lapsed time[ms] = " << time << std::endl;
+ #endif // USE_PERF_CHECK
+		std::cout << "<<< render end" << std::endl;
 	}
-	else
+	// post process
 	{
-		struct LightInfo
+		std::cout << ">>> post process start" << std::endl;
+ #ifdef USE_PERF_CHECK
+		DWORD begin_time = timeGetTime();
+ #endif // USE_PERF_CHECK
+		Camera* cam = renderer.GetCamera();
+		FrameBufferFP32& fb = cam->GetFrameBuffer();
+		fb.Exposure(0.2f);
+		fb.Saturate();
+		fb.GammaCorrection();
+		fb.WriteBmpFile(ofilename);
+ #ifdef USE_PERF_CHECK
+		DWORD time = (timeGetTime() - begin_time);
+		std::cout << "lapsed time[ms] = " << time << std::endl;
+ #endif // USE_PERF_CHECK
+		std::cout << "<<< post process end" << std::endl;
+	}
+}
+
+/*!
+	@brief		アニメーションのキー
+	@note		キーのフレームから次に同じ対象のキーが現れるまで値を保つ
+ */
+struct SequenceKey
+{
+	enum Type
+	{
+		Type_Camera,
+		Type_Instance,
+	};
+	std::size_t	frame;
+	Type		type;
+	std::size_t	index;		//!< インスタンスの番号
+	Matrix44	world;		//!< インスタンスのローカル座標からワールド座標への変換(行ベクトル)
+	Vector3		eye;		//!< カメラの位置
+	Vector3		at;			//!< カメラの注視点
+};
+
+/*!
+	@brief		アニメーションの読み込み
+	@param[o]	num_frames: フレーム数
+	@param[o]	keys: フレーム順のキー
+	@param[i]	filename: ファイル名
+	@retval		false: 開けない、または書式が正しくない
+	@note		1 行に 1 つ、空白区切りで以下を並べる(# から行末まではコメント)
+					frames <フレーム数>
+					camera <フレーム> <位置 x y z> <注視点 x y z>
+					instance <フレーム> <インスタンスの番号> <変換行列の 1 から 4 行目の x y z>
+ */
+bool LoadSequence(std::size_t& num_frames, std::vector<SequenceKey>& keys, const std::string& filename)
+{
+	std::ifstream ifs(filename.c_str());
+	if(!ifs)
+		return false;
+
+	num_frames = 0;
+	keys.clear();
+	std::string line;
+	while(std::getline(ifs, line))
+	{
+		std::istringstream iss(line.substr(0, line.find('#')));
+		std::string command;
+		if(!(iss >> command))
+			continue;
+		if(command == "frames")
 		{
-			unsigned long enbale;
-			unsigned long type;
-			Vector3	pos;
-			Vector3	rot;
-			Vector3 col;
-		}info;
+			if(!(iss >> num_frames))
+				return false;
+			continue;
+		}
 
-		ifs.seekg(0, std::ios_base::end);
-		const unsigned long length = ifs.tellg();
-		const unsigned long num = length / sizeof(Light);
-		ifs.seekg(0, std::ios_base::beg);
-		for(unsigned long i = 0; i < num; i++)
+		SequenceKey key;
+		if(!(iss >> key.frame))
+			return false;
+		if(command == "camera")
 		{
-			ifs.read((char*)&info, sizeof(LightInfo));
-			if(!info.enbale)
-				continue;
+			key.type = SequenceKey::Type_Camera;
+			key.index = 0;
+			iss >> key.eye.x >> key.eye.y >> key.eye.z >> key.at.x >> key.at.y >> key.at.z;
+		}
+		else if(command == "instance")
+		{
+			key.type = SequenceKey::Type_Instance;
+			Mtx44Identity(&key.world);
+			iss >> key.index;
+			for(int row = 0; row < 4; row++)
+				iss >> key.world(row, 0) >> key.world(row, 1) >> key.world(row, 2);
+		}
+		else
+		{
+			return false;
+		}
+		if(!iss)
+			return false;
+		keys.push_back(key);
+	}
+	std::stable_sort(keys.begin(), keys.end(), [](const SequenceKey& a, const SequenceKey& b){ return a.frame < b.frame; });
+	return true;
+}
 
-			Light* lig = new Light();
-			if(info.type == 0)
+/*!
+	@brief		アニメーションの描画
+	@param[io]	renderer: 初期化済みのレンダラー
+	@param[i]	filename: アニメーションのファイル名
+	@param[i]	basename: 出力ファイル名の拡張子を除いた部分(<basename>_<フレーム>.bmp に保存する)
+	@note		シーンの読み込みと構築は 1 度だけで、フレーム毎にはキーの反映と Scene::Update() だけを行う
+ */
+bool RenderSequence(Renderer& renderer, const std::string& filename, const std::string& basename)
+{
+	std::size_t num_frames;
+	std::vector<SequenceKey> keys;
+	if(!LoadSequence(num_frames, keys, filename))
+	{
+		std::cout << "Sequence load failed" << std::endl;
+		return false;
+	}
+
+	Scene* scn = renderer.GetScene();
+	Camera* cam = renderer.GetCamera();
+	std::size_t next = 0;
+	for(std::size_t frame = 0; frame < num_frames; frame++)
+	{
+		std::cout << ">>> update start [" << frame << "]" << std::endl;
+ #ifdef USE_PERF_CHECK
+		DWORD begin_time = timeGetTime();
+ #endif // USE_PERF_CHECK
+		for(; (next < keys.size()) && (keys[next].frame <= frame); next++)
+		{
+			const SequenceKey& key = keys[next];
+			if(key.type == SequenceKey::Type_Camera)
 			{
-				lig->type = Light::Type_Point;
-				lig->pos = info.pos;
+				Vector3 up;
+				up.set(0.0f, 1.0f, 0.0f);
+				Mtx44LookAt(&cam->GetPosture(), &key.eye, &key.at, &up);
 			}
-			else
+			else if(!scn->MoveInstance(key.index, key.world))
 			{
-				lig->type = Light::Type_Directional;
-
-				Vector3 dir;
-				dir.set(0.0f, 0.0f, 1.0f);
-				Matrix44 mat;
-				info.rot.x = DegToRad(info.rot.x);
-				info.rot.y = DegToRad(info.rot.y);
-				info.rot.z = DegToRad(info.rot.z);
-				Mtx44RotationYawPitchRoll(&mat, info.rot.y, info.rot.x, info.rot.z);
-				Vec3Transform(&lig->dir, &dir, &mat);
+				std::cout << "Invalid instance " << key.index << std::endl;
 			}
-			ColorSet(&lig->intensity, info.col.x, info.col.y, info.col.z);
-
-			scn.GetLightList().push_back(lig);
 		}
-		ifs.close();
+		scn->Update();
+ #ifdef USE_PERF_CHECK
+		DWORD time = (timeGetTime() - begin_time);
+		std::cout << "lapsed time[ms] = " << time << std::endl;
+ #endif // USE_PERF_CHECK
+		std::cout << "<<< update end" << std::endl;
+
+		char suffix[32];
+		sprintf(suffix, "_%04d.bmp", (int)frame);
+		RenderFrame(renderer, basename + suffix);
 	}
+	return true;
 }
 
 /*!
@@ -427,6 +876,9 @@ void InitLight(Scene& scn, const std::string& filename)
 int main(int argc, const char* argv[])
 {	
 	Environment env;
+	env.thread		= MAX_THREAD;
+	env.accel		= ACCEL_TYPE;
+	env.seed		= RANDOM_SEED;
  #ifdef USE_ENV_FILE
 	if(!LoadEnvironmentFile(&env, "env.dat"))
 	{
@@ -466,7 +918,6 @@ int main(int argc, const char* argv[])
  #endif // USE_PERF_CHECK
 
 	// initialize
-	genrand_int32();
 	Renderer renderer;
 
 	// Setup
@@ -479,8 +930,6 @@ int main(int argc, const char* argv[])
 		{
 			if(!Init(renderer, argv[1], env))
 				return 0;
-			Scene* scn = renderer.GetScene();
-			InitLight(*scn, "lig.dat");
 		}
 		else
 		{
@@ -492,36 +941,14 @@ int main(int argc, const char* argv[])
  #endif // USE_PERF_CHECK
 		std::cout << "<<< setup end" << std::endl;
 	}
-	// render
+	if(argc > 2)
 	{
-		std::cout << ">>> render start" << std::endl;
- #ifdef USE_PERF_CHECK
-		DWORD begin_time = timeGetTime();
- #endif // USE_PERF_CHECK
-		renderer.Render();
- #ifdef USE_PERF_CHECK
-		DWORD time = (timeGetTime() - begin_time);
-		std::cout << "lapsed time[ms] = " << time << std::endl;
- #endif // USE_PERF_CHECK
-		std::cout << "<<< render end" << std::endl;
+		// アニメーション
+		RenderSequence(renderer, argv[2], ifilename.substr(0, ifilename.rfind('.')));
 	}
-	// post process
+	else
 	{
-		std::cout << ">>> post process start" << std::endl;
- #ifdef USE_PERF_CHECK
-		DWORD begin_time = timeGetTime();
- #endif // USE_PERF_CHECK
-		Camera* cam = renderer.GetCamera();
-		FrameBufferFP32& fb = cam->GetFrameBuffer();
-		fb.Exposure(0.2f);
-		fb.Saturate();
-		fb.GammaCorrection();
-		fb.WriteBmpFile(ofilename);
- #ifdef USE_PERF_CHECK
-		DWORD time = (timeGetTime() - begin_time);
-		std::cout << "lapsed time[ms] = " << time << std::endl;
- #endif // USE_PERF_CHECK
-		std::cout << "<<< post process end" << std::endl;
+		RenderFrame(renderer, ofilename);
 	}
 	// release
 	renderer.Release();
@@ -9,6 +9,7 @@
 #ifndef __MATERIAL_H_
 #define __MATERIAL_H_
 
+#include <vector>
 #include "lib/color/color.h"
 
 /*!
@@ -26,6 +27,6 @@ public:
 	float	shine;
 };
 
-typedef std::list<Material*> MaterialList;
+typedef std::vector<Material*> MaterialList;
 
 #endif // !__MATERIAL_H_
\ No newline at end of file
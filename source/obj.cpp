@@ -0,0 +1,511 @@
+#include <math.h>
+#include <string.h>
+#include "obj.h"
+#include "lib/system/mapped_file.h"
+#include "lib/system/thread.h"
+
+
+namespace _obj
+{
+
+static const std::size_t K_MIN_CHUNK_SIZE	= 1 << 20;	//!< 分割した 1 区間の最小のバイト数
+
+/*!
+	@brief	ファイルの区間
+	@note	行の途中では分けない
+ */
+struct Chunk
+{
+	const char*	begin;
+	const char*	end;
+	std::size_t	num_positions;		//!< 区間内の v の数
+	std::size_t	num_normals;		//!< 区間内の vn の数
+	std::size_t	num_faces;			//!< 区間内の三角形の数(分割後)
+	std::size_t	first_position;		//!< ファイル内でこの区間より前の v の数
+	std::size_t	first_normal;
+	std::size_t	first_face;
+	bool		error;
+};
+
+enum LineType
+{
+	Line_Position,
+	Line_Normal,
+	Line_Face,
+	Line_Other
+};
+
+static bool is_space(char c)
+{
+	return (c == ' ') || (c == '\t') || (c == '\r');
+}
+
+static bool is_digit(char c)
+{
+	return (c >= '0') && (c <= '9');
+}
+
+static const char* skip_space(const char* p, const char* end)
+{
+	while((p < end) && is_space(*p))
+		p++;
+	return p;
+}
+
+/*!
+	@brief		行末を探す
+	@return		'\n' の位置(なければ end)
+ */
+static const char* find_line_end(const char* p, const char* end)
+{
+	const char* q = (const char*)memchr(p, '\n', end - p);
+	return q? q : end;
+}
+
+/*!
+	@brief		行の種類
+	@param[io]	p: 行頭、キーワードの後ろまで進める
+	@param[i]	end: 行末
+ */
+static LineType get_line_type(const char*& p, const char* end)
+{
+	p = skip_space(p, end);
+	if((end - p >= 2) && (p[0] == 'v') && is_space(p[1]))
+	{
+		p += 2;
+		return Line_Position;
+	}
+	if((end - p >= 3) && (p[0] == 'v') && (p[1] == 'n') && is_space(p[2]))
+	{
+		p += 3;
+		return Line_Normal;
+	}
+	if((end - p >= 2) && (p[0] == 'f') && is_space(p[1]))
+	{
+		p += 2;
+		return Line_Face;
+	}
+	return Line_Other;
+}
+
+/*!
+	@brief		f 行の頂点の数
+	@note		空白で区切った語の数で、'#' 以降は数えない
+ */
+static std::size_t count_corners(const char* p, const char* end)
+{
+	std::size_t num = 0;
+	for(;;)
+	{
+		p = skip_space(p, end);
+		if((p == end) || (*p == '#'))
+			return num;
+		num++;
+		while((p < end) && !is_space(*p))
+			p++;
+	}
+}
+
+/*!
+	@brief		整数の解析
+	@return		解析した後ろの位置(数字がなければ p のまま)
+ */
+static const char* parse_int(long long& out, const char* p, const char* end)
+{
+	const char* q = p;
+	bool neg = false;
+	if((q < end) && ((*q == '-') || (*q == '+')))
+		neg = (*q++ == '-');
+	if((q == end) || !is_digit(*q))
+		return p;
+	long long value = 0;
+	while((q < end) && is_digit(*q))
+		value = value * 10 + (*q++ - '0');
+	out = neg? -value : value;
+	return q;
+}
+
+/*!
+	@brief		実数の解析
+	@return		解析した後ろの位置(数字がなければ p のまま)
+	@note		strtod() はロケールに依存して遅いので、仮数を 19 桁まで整数で読み、10 の冪を掛ける
+ */
+static const char* parse_float(float& out, const char* p, const char* end)
+{
+	static const double K_POW10[] =
+	{
+		1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+
+	const char* q = p;
+	bool neg = false;
+	if((q < end) && ((*q == '-') || (*q == '+')))
+		neg = (*q++ == '-');
+
+	unsigned long long mantissa = 0;
+	int digits = 0;
+	int exponent = 0;
+	bool found = false;
+	for(; (q < end) && is_digit(*q); q++)
+	{
+		found = true;
+		if(digits < 19)
+		{
+			mantissa = mantissa * 10 + (*q - '0');
+			if(mantissa)
+				digits++;
+		}
+		else
+		{
+			exponent++;
+		}
+	}
+	if((q < end) && (*q == '.'))
+	{
+		for(q++; (q < end) && is_digit(*q); q++)
+		{
+			found = true;
+			if(digits < 19)
+			{
+				mantissa = mantissa * 10 + (*q - '0');
+				if(mantissa)
+					digits++;
+				exponent--;
+			}
+		}
+	}
+	if(!found)
+		return p;
+	if((q < end) && ((*q == 'e') || (*q == 'E')))
+	{
+		long long e;
+		const char* r = parse_int(e, q + 1, end);
+		if(r != q + 1)
+		{
+			exponent += (int)e;
+			q = r;
+		}
+	}
+
+	double value = (double)mantissa;
+	const int abs_exponent = (exponent < 0)? -exponent : exponent;
+	const double scale = (abs_exponent <= 22)? K_POW10[abs_exponent] : pow(10.0, abs_exponent);
+	value = (exponent < 0)? value / scale : value * scale;
+	out = (float)(neg? -value : value);
+	return q;
+}
+
+/*!
+	@brief		ベクトルの解析
+	@retval		false: 3 つ読めなかった
+	@note		CONVERT_RHCS では z を反転して左手系にする
+ */
+static bool parse_vector(Vector3& out, const char* p, const char* end)
+{
+	float e[3];
+	for(int i = 0; i < 3; i++)
+	{
+		p = skip_space(p, end);
+		const char* q = parse_float(e[i], p, end);
+		if(q == p)
+			return false;
+		p = q;
+	}
+ #ifdef CONVERT_RHCS
+	out.set(e[0], e[1], -e[2]);
+ #else
+	out.set(e[0], e[1], e[2]);
+ #endif // CONVERT_RHCS
+	return true;
+}
+
+/*!
+	@brief		OBJ のインデックスを 0 始まりにする
+	@param[i]	index: 1 始まり、負なら直前からの相対
+	@param[i]	current: この行より前に定義された数
+	@param[i]	num: ファイル全体の数
+	@return		範囲外なら num
+ */
+static std::size_t resolve_index(long long index, std::size_t current, std::size_t num)
+{
+	const long long resolved = (index > 0)? index - 1 : (long long)current + index;
+	if((index == 0) || (resolved < 0) || (resolved >= (long long)num))
+		return num;
+	return (std::size_t)resolved;
+}
+
+/*!
+	@brief	区間の数を数えるワーク
+	@class	CountWork
+ */
+class CountWork : public Work
+{
+public:
+	void Set(Chunk* chunk)
+	{
+		this->chunk = chunk;
+	}
+
+	void execute(std::size_t)
+	{
+		chunk->num_positions = 0;
+		chunk->num_normals = 0;
+		chunk->num_faces = 0;
+		for(const char* p = chunk->begin; p < chunk->end; )
+		{
+			const char* line_end = find_line_end(p, chunk->end);
+			switch(get_line_type(p, line_end))
+			{
+			case Line_Position:
+				chunk->num_positions++;
+				break;
+			case Line_Normal:
+				chunk->num_normals++;
+				break;
+			case Line_Face:
+				{
+					const std::size_t num = count_corners(p, line_end);
+					if(num >= 3)
+						chunk->num_faces += num - 2;
+				}
+				break;
+			default:
+				break;
+			}
+			p = line_end + 1;
+		}
+	}
+
+private:
+	Chunk*	chunk;
+};
+
+/*!
+	@brief	区間を解析してメッシュに書き込むワーク
+	@class	ParseWork
+	@note	書き込み先は CountWork で数えた数から決まるので、他の区間と重ならない
+ */
+class ParseWork : public Work
+{
+public:
+	void Set(Chunk* chunk, TriangleMesh* mesh, unsigned int mtrl, std::size_t p_base, std::size_t n_base, std::size_t f_base, std::size_t num_positions, std::size_t num_normals)
+	{
+		this->chunk = chunk;
+		this->mesh = mesh;
+		this->mtrl = mtrl;
+		this->p_base = p_base;
+		this->n_base = n_base;
+		this->f_base = f_base;
+		this->num_positions = num_positions;
+		this->num_normals = num_normals;
+	}
+
+	void execute(std::size_t)
+	{
+		Vector3* positions = mesh->GetPositions().data();
+		TriangleMesh::Normal* normals = mesh->GetNormals().data();
+		TriangleMesh::Face* faces = mesh->GetFaces().data();
+		std::size_t pos = chunk->first_position;
+		std::size_t nrm = chunk->first_normal;
+		std::size_t face = chunk->first_face;
+		chunk->error = false;
+		for(const char* p = chunk->begin; p < chunk->end; )
+		{
+			const char* line_end = find_line_end(p, chunk->end);
+			switch(get_line_type(p, line_end))
+			{
+			case Line_Position:
+				if(!parse_vector(positions[p_base + pos], p, line_end))
+					chunk->error = true;
+				pos++;
+				break;
+			case Line_Normal:
+				{
+					Vector3 n;
+					if(!parse_vector(n, p, line_end))
+					{
+						chunk->error = true;
+						n.set(0.0f, 1.0f, 0.0f);
+					}
+					Vec3Normalize(&n, &n);
+					TriangleMesh::EncodeNormal(normals[n_base + nrm], n);
+					nrm++;
+				}
+				break;
+			case Line_Face:
+				if(count_corners(p, line_end) >= 3)
+					face = ParseFace(&faces[f_base], face, p, line_end, pos, nrm);
+				break;
+			default:
+				break;
+			}
+			p = line_end + 1;
+		}
+	}
+
+private:
+	/*!
+		@brief		f 行を扇形に分割して書き込む
+		@return		次に書き込む面
+	 */
+	std::size_t ParseFace(TriangleMesh::Face* faces, std::size_t face, const char* p, const char* end, std::size_t pos, std::size_t nrm)
+	{
+		unsigned int first_p = 0, first_n = 0, prev_p = 0, prev_n = 0;
+		for(std::size_t corner = 0; ; corner++)
+		{
+			p = skip_space(p, end);
+			if((p == end) || (*p == '#'))
+				break;
+
+			// v, v/vt, v//vn, v/vt/vn
+			long long index_p = 0, index_t = 0, index_n = 0;
+			p = parse_int(index_p, p, end);
+			if((p < end) && (*p == '/'))
+			{
+				p = parse_int(index_t, p + 1, end);
+				if((p < end) && (*p == '/'))
+					p = parse_int(index_n, p + 1, end);
+			}
+			while((p < end) && !is_space(*p))
+			{
+				chunk->error = true;	// 解析できない文字
+				p++;
+			}
+
+			std::size_t ip = resolve_index(index_p, pos, num_positions);
+			if(ip == num_positions)
+			{
+				chunk->error = true;
+				ip = 0;
+			}
+			unsigned int n = TriangleMesh::K_NO_NORMAL;
+			if(index_n != 0)
+			{
+				const std::size_t in = resolve_index(index_n, nrm, num_normals);
+				if(in == num_normals)
+					chunk->error = true;
+				else
+					n = (unsigned int)(n_base + in);
+			}
+			const unsigned int cur_p = (unsigned int)(p_base + ip);
+
+			if(corner == 0)
+			{
+				first_p = cur_p;
+				first_n = n;
+			}
+			else if(corner >= 2)
+			{
+				TriangleMesh::Face& f = faces[face++];
+ #ifdef CONVERT_RHCS
+				// z を反転したので巻き順も入れ替える
+				f.p[0] = first_p; f.p[1] = cur_p;  f.p[2] = prev_p;
+				f.n[0] = first_n; f.n[1] = n;      f.n[2] = prev_n;
+ #else
+				f.p[0] = first_p; f.p[1] = prev_p; f.p[2] = cur_p;
+				f.n[0] = first_n; f.n[1] = prev_n; f.n[2] = n;
+ #endif // CONVERT_RHCS
+				f.mtrl = mtrl;
+			}
+			prev_p = cur_p;
+			prev_n = n;
+		}
+		return face;
+	}
+
+private:
+	Chunk*			chunk;
+	TriangleMesh*	mesh;
+	unsigned int	mtrl;
+	std::size_t		p_base;			//!< メッシュに元からあった位置の数
+	std::size_t		n_base;
+	std::size_t		f_base;
+	std::size_t		num_positions;	//!< ファイル全体の v の数
+	std::size_t		num_normals;
+};
+
+bool Load(TriangleMesh& mesh, Material* mtrl, const std::string& filename, std::size_t max_thread)
+{
+	MappedFile file;
+	if(!file.open(filename.c_str()))
+		return false;
+
+	// 行の切れ目で分ける
+	WorkPile pile(max_thread);
+	const char* data = file.data();
+	const char* data_end = data + file.size();
+	std::size_t num_chunks = pile.get_max_thread() * 4;
+	if(num_chunks > file.size() / K_MIN_CHUNK_SIZE + 1)
+		num_chunks = file.size() / K_MIN_CHUNK_SIZE + 1;
+	const std::size_t size = file.size() / num_chunks;
+	std::vector<Chunk> chunks;
+	chunks.reserve(num_chunks + 1);
+	for(const char* p = data; p < data_end; )
+	{
+		const char* q = (data_end - p > (std::ptrdiff_t)size)? find_line_end(p + size, data_end) : data_end;
+		Chunk chunk;
+		memset(&chunk, 0, sizeof(chunk));
+		chunk.begin = p;
+		chunk.end = (q < data_end)? q + 1 : data_end;
+		chunks.push_back(chunk);
+		p = chunk.end;
+	}
+
+	std::vector<CountWork> count_works(chunks.size());
+	for(std::size_t i = 0; i < chunks.size(); i++)
+	{
+		count_works[i].Set(&chunks[i]);
+		pile.request(&count_works[i]);
+	}
+	pile.run();
+
+	std::size_t num_positions = 0, num_normals = 0, num_faces = 0;
+	for(std::size_t i = 0; i < chunks.size(); i++)
+	{
+		chunks[i].first_position = num_positions;
+		chunks[i].first_normal = num_normals;
+		chunks[i].first_face = num_faces;
+		num_positions += chunks[i].num_positions;
+		num_normals += chunks[i].num_normals;
+		num_faces += chunks[i].num_faces;
+	}
+	if(num_faces == 0)
+		return false;
+
+	const std::size_t p_base = mesh.GetPositions().size();
+	const std::size_t n_base = mesh.GetNormals().size();
+	const std::size_t f_base = mesh.GetFaces().size();
+	// 面の番号は PrimitiveArray::Id に収まること
+	if(f_base + num_faces > PrimitiveArray::K_INDEX_MASK)
+		return false;
+	const std::size_t m_base = mesh.GetMaterials().size();
+	const unsigned int mtrl_index = mesh.AddMaterial(mtrl);
+	mesh.GetPositions().resize(p_base + num_positions);
+	mesh.GetNormals().resize(n_base + num_normals);
+	mesh.GetFaces().resize(f_base + num_faces);
+
+	std::vector<ParseWork> parse_works(chunks.size());
+	for(std::size_t i = 0; i < chunks.size(); i++)
+	{
+		parse_works[i].Set(&chunks[i], &mesh, mtrl_index, p_base, n_base, f_base, num_positions, num_normals);
+		pile.request(&parse_works[i]);
+	}
+	pile.run();
+	bool error = false;
+	for(std::size_t i = 0; i < chunks.size(); i++)
+		error |= chunks[i].error;
+	if(error)
+	{
+		mesh.GetPositions().resize(p_base);
+		mesh.GetNormals().resize(n_base);
+		mesh.GetFaces().resize(f_base);
+		mesh.GetMaterials().resize(m_base);
+		return false;
+	}
+
+	mesh.CalcMissingNormals(p_base, f_base);
+	return true;
+}
+
+}
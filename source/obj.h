@@ -0,0 +1,32 @@
+//==============================================================================
+/*!
+	@file	obj.h
+	@brief	Wavefront OBJ ファイル操作
+ */
+//==============================================================================
+#ifndef __OBJ_H_
+#define __OBJ_H_
+
+#include <string>
+#include "primitive.h"
+
+#define CONVERT_RHCS	// right handed coordinate system
+
+namespace _obj
+{
+
+/*!
+	@brief		読み込み
+	@param[io]	mesh: 追加先のメッシュ
+	@param[i]	mtrl: 全ての面の材質
+	@param[i]	filename: ファイル名
+	@param[i]	max_thread: スレッド数(0 ならハードウェアの並列数)
+	@retval		false: 開けなかった、または範囲外のインデックスを含む(mesh は呼ぶ前の状態に戻す)
+	@note		v, vn, f だけを読み、多角形は扇形に三角形分割する
+				ファイルを行の切れ目でスレッド数に分け、数を数えてから mesh に直接書き込むので中間の配列を持たない
+ */
+bool Load(TriangleMesh& mesh, Material* mtrl, const std::string& filename, std::size_t max_thread = 0);
+
+}
+
+#endif // __OBJ_H_
@@ -0,0 +1,327 @@
+#include "object.h"
+#include "lib/math/vecmat.h"
+
+
+/*!
+	@brief		方向の変換(平行移動なし)
+	@param[o]	out: 出力
+	@param[i]	v: 方向
+	@param[i]	m: 変換行列
+ */
+static void transform_vector(Vector3& out, const Vector3& v, const Matrix44& m)
+{
+	const float x = v.x * m._11 + v.y * m._21 + v.z * m._31;
+	const float y = v.x * m._12 + v.y * m._22 + v.z * m._32;
+	const float z = v.x * m._13 + v.y * m._23 + v.z * m._33;
+	out.set(x, y, z);
+}
+
+/*!
+	@brief		法線の変換
+	@param[o]	out: 出力
+	@param[i]	n: 法線
+	@param[i]	inv: 変換行列の逆行列
+	@note		逆行列の転置を掛ける
+ */
+static void transform_normal(Vector3& out, const Vector3& n, const Matrix44& inv)
+{
+	const float x = n.x * inv._11 + n.y * inv._12 + n.z * inv._13;
+	const float y = n.x * inv._21 + n.y * inv._22 + n.z * inv._23;
+	const float z = n.x * inv._31 + n.y * inv._32 + n.z * inv._33;
+	out.set(x, y, z);
+}
+
+/*!
+	@brief		変換した点を含むように AABB を広げる
+	@param[io]	aabb: 広げる AABB
+	@param[i]	p: ローカル座標の点
+	@param[i]	m: 変換行列
+ */
+static void expand_aabb(AABB& aabb, const Vector3& p, const Matrix44& m)
+{
+	Vector3 wp;
+	Vec3Transform(&wp, &p, &m);
+	Vec3Minimize(&aabb.min, &aabb.min, &wp);
+	Vec3Maximize(&aabb.max, &aabb.max, &wp);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+Object::Object()
+{
+ #ifdef USE_ACCELERATOR
+	accel = NULL;
+ #endif // USE_ACCELERATOR
+	aabb.min.set(0.0f, 0.0f, 0.0f);
+	aabb.max.set(0.0f, 0.0f, 0.0f);
+}
+
+Object::~Object()
+{
+ #ifdef USE_ACCELERATOR
+	SAFE_DELETE(accel);
+ #endif // USE_ACCELERATOR
+}
+
+/*!
+	@brief		下位構造の構築
+	@param[i]	type: 高速化構造の種類
+	@param[i]	max_thread: 構築に使うスレッド数(0 ならハードウェアの並列数)
+ */
+void Object::Build(Accelerator::Type type, std::size_t max_thread)
+{
+	prim_array.CalcAABB(aabb);
+	EmitterTable::Collect(emitters, prim_array);
+ #ifdef USE_ACCELERATOR
+	SAFE_DELETE(accel);
+	accel = Accelerator::Create(type);
+	ASSERT_MSG(accel != NULL, "Object::Build(): alloc failed");
+	accel->SetMaxThread(max_thread);
+	accel->Build(prim_array, aabb);
+ #endif // USE_ACCELERATOR
+}
+
+/*!
+	@brief		キャッシュへの書き出し
+	@param[io]	writer: キャッシュ
+	@param[i]	mtrls: シーンの材質
+	@note		Build() 済みであること
+ */
+void Object::Save(CacheWriter& writer, const std::vector<Material*>& mtrls) const
+{
+	prim_array.Save(writer, mtrls, std::vector<Object*>());
+	writer.Write(aabb);
+ #ifdef USE_ACCELERATOR
+	accel->Save(writer);
+ #endif // USE_ACCELERATOR
+}
+
+/*!
+	@brief		キャッシュからの読み込み
+	@param[io]	reader: キャッシュ
+	@param[i]	type: 高速化構造の種類
+	@param[i]	mtrls: シーンの材質
+ */
+bool Object::Load(CacheReader& reader, Accelerator::Type type, const std::vector<Material*>& mtrls)
+{
+	if(!prim_array.Load(reader, mtrls, std::vector<Object*>()) || !reader.Read(aabb))
+		return false;
+	EmitterTable::Collect(emitters, prim_array);
+ #ifdef USE_ACCELERATOR
+	SAFE_DELETE(accel);
+	accel = Accelerator::Create(type);
+	ASSERT_MSG(accel != NULL, "Object::Load(): alloc failed");
+	return accel->Load(reader, prim_array);
+ #else
+	return true;
+ #endif // USE_ACCELERATOR
+}
+
+/*!
+	@brief		最も近い交差を探す
+	@param[o]	id: 交差したプリミティブ
+	@param[o]	param: 交差情報
+	@param[i]	ray: ローカル座標の光線
+ */
+bool Object::Traverse(PrimitiveArray::Id& id, Primitive::Param& param, const Ray& ray) const
+{
+ #ifdef USE_ACCELERATOR
+	return accel->Traverse(id, param, ray);
+ #else
+	float t = FLT_MAX;
+	bool found = false;
+	const std::size_t num_prims = prim_array.size();
+	for(std::size_t i = 0; i < num_prims; i++)
+	{
+		const PrimitiveArray::Id n = prim_array.GetId(i);
+		if(prim_array.IntersectNearest(id, param, t, &n, &n + 1, ray))
+			found = true;
+	}
+	return found;
+ #endif // USE_ACCELERATOR
+}
+
+/*!
+	@brief		遮蔽物の有無
+	@param[i]	ray: ローカル座標の光線
+	@param[i]	t_max: 調べる区間の終点
+ */
+bool Object::Occluded(const Ray& ray, float t_max) const
+{
+ #ifdef USE_ACCELERATOR
+	return accel->Occluded(ray, t_max);
+ #else
+	const std::size_t num_prims = prim_array.size();
+	for(std::size_t i = 0; i < num_prims; i++)
+	{
+		const PrimitiveArray::Id n = prim_array.GetId(i);
+		if(prim_array.IntersectAny(&n, &n + 1, ray, t_max))
+			return true;
+	}
+	return false;
+ #endif // USE_ACCELERATOR
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*!
+	@brief		初期化
+	@param[i]	object: 配置するオブジェクト(プリミティブを追加済みであること)
+	@param[i]	world: ローカル座標からワールド座標への変換(行ベクトル)
+	@retval		false: 変換が逆変換を持たない
+	@note		ワールド座標の境界は頂点を変換して求める
+				ローカルの AABB の角を変換するより緩くならないので、シーン全体の境界も平坦化した場合と一致する
+ */
+bool Instance::Init(const Object* object, const Matrix44& world)
+{
+	this->object = object;
+	this->world = world;
+	if(!Mtx44InverseAffine(&inv_world, &world))
+		return false;
+
+	const PrimitiveArray& prims = object->GetPrimitiveArray();
+	aabb.min.set( FLT_MAX, FLT_MAX, FLT_MAX);
+	aabb.max.set(-FLT_MAX,-FLT_MAX,-FLT_MAX);
+	const MappedArray<Vector3>& positions = prims.GetMesh().GetPositions();
+	for(std::size_t i = 0; i < positions.size(); i++)
+		expand_aabb(aabb, positions[i], world);
+	const std::vector<Triangle>& triangles = prims.GetTriangles();
+	for(std::size_t i = 0; i < triangles.size(); i++)
+		for(int j = 0; j < 3; j++)
+			expand_aabb(aabb, triangles[i].v[j].p, world);
+	const std::vector<Sphere>& spheres = prims.GetSpheres();
+	for(std::size_t i = 0; i < spheres.size(); i++)
+	{
+		// 球は変換後に楕円体になるので、ローカルの外接立方体の角で囲む
+		const Sphere& s = spheres[i];
+		for(int j = 0; j < 8; j++)
+		{
+			Vector3 p(s.p.x + ((j & 1)? s.r : -s.r), s.p.y + ((j & 2)? s.r : -s.r), s.p.z + ((j & 4)? s.r : -s.r));
+			expand_aabb(aabb, p, world);
+		}
+	}
+	return true;
+}
+
+/*!
+	@brief		保存しておいた値での初期化
+	@param[i]	object: 配置するオブジェクト
+	@param[i]	world: ローカル座標からワールド座標への変換(行ベクトル)
+	@param[i]	inv_world: world の逆行列
+	@param[i]	aabb: ワールド座標の境界
+	@note		キャッシュから読み込むときに、頂点を辿らずに済ませる
+ */
+void Instance::Init(const Object* object, const Matrix44& world, const Matrix44& inv_world, const AABB& aabb)
+{
+	this->object = object;
+	this->world = world;
+	this->inv_world = inv_world;
+	this->aabb = aabb;
+}
+
+/*!
+	@brief		光線をローカル座標に変換
+	@param[o]	out: ローカル座標の光線(向きは正規化する)
+	@param[i]	ray: ワールド座標の光線
+	@return		ワールド座標での距離 1 に対するローカル座標での距離
+	@note		球の交差判定は向きが単位ベクトルであることを前提にしているので正規化し、
+				距離の比を返して交差距離をワールド座標に戻せるようにする
+ */
+float Instance::ToLocal(Ray& out, const Ray& ray) const
+{
+	Vec3Transform(&out.org, &ray.org, &inv_world);
+	transform_vector(out.dir, ray.dir, inv_world);
+	const float scale = Vec3Length(&out.dir);
+	Vec3Scale(&out.dir, &out.dir, 1.0f / scale);
+	return scale;
+}
+
+bool Instance::Intersect(Primitive::Param& param, const Ray& ray) const
+{
+	float t_near, t_far;
+	if(!aabb.Intersect(t_near, t_far, ray.org, ray.dir))
+		return false;
+
+	Ray local;
+	const float scale = ToLocal(local, ray);
+	PrimitiveArray::Id id;
+	if(!object->Traverse(id, param, local))
+		return false;
+	param.t /= scale;
+	param.prim = id;
+	return true;
+}
+
+bool Instance::Occluded(const Ray& ray, float t_max) const
+{
+	float t_near, t_far;
+	if(!aabb.Intersect(t_near, t_far, ray.org, ray.dir) || (t_near > t_max))
+		return false;
+
+	Ray local;
+	const float scale = ToLocal(local, ray);
+	// t_max が FLT_MAX(平行光源)のときにあふれないように
+	const float t_local = (t_max < FLT_MAX / scale)? t_max * scale : FLT_MAX;
+	return object->Occluded(local, t_local);
+}
+
+/*!
+	@brief		交点の頂点情報
+	@param[o]	v: ワールド座標の頂点
+	@param[i]	param: Intersect() で求めた交差情報
+	@param[i]	ray: ワールド座標の光線
+	@note		ローカル座標で頂点を求めて変換する(法線は逆行列の転置で変換して正規化する)
+ */
+void Instance::CalcVertex(Vertex& v, const Primitive::Param& param, const Ray& ray) const
+{
+	Ray local;
+	const float scale = ToLocal(local, ray);
+	Primitive::Param local_param = param;
+	local_param.t = param.t * scale;
+
+	Vertex lv;
+	object->GetPrimitiveArray().CalcVertex(lv, local_param, local, param.prim);
+	Vec3Transform(&v.p, &lv.p, &world);
+	transform_normal(v.n, lv.n, inv_world);
+	Vec3Normalize(&v.n, &v.n);
+}
+
+Material* Instance::GetMaterial(const Primitive::Param& param) const
+{
+	return object->GetPrimitiveArray().GetMaterial(param, param.prim);
+}
+
+bool Instance::CalcFaceNormal(Vector3& n, const Primitive::Param& param) const
+{
+	Vector3 ln;
+	if(!object->GetPrimitiveArray().CalcFaceNormal(ln, param, param.prim))
+		return false;
+	transform_normal(n, ln, inv_world);
+	Vec3Normalize(&n, &n);
+	return true;
+}
+
+void Instance::CalcRange(float& min, float& max, Axis axis) const
+{
+	min = aabb.min.v[axis];
+	max = aabb.max.v[axis];
+}
+
+/*!
+	@brief		クリップ領域内の境界
+	@param[o]	out: 境界
+	@param[i]	clip: クリップ領域
+	@retval		false: 領域外
+	@note		ワールド座標の境界とクリップ領域の共通部分なので、kd 木の分割には大きめに見積もられる
+ */
+bool Instance::CalcClippedAABB(AABB& out, const AABB& clip) const
+{
+	Vec3Maximize(&out.min, &aabb.min, &clip.min);
+	Vec3Minimize(&out.max, &aabb.max, &clip.max);
+	for(int axis = Axis_X; axis < Axis_Max; axis++)
+	{
+		if(out.min.v[axis] > out.max.v[axis])
+			return false;
+	}
+	return true;
+}
@@ -0,0 +1,50 @@
+//==============================================================================
+/*!
+	@file	object.h
+	@brief	インスタンスで共有する形状
+ */
+//==============================================================================
+#ifndef __OBJECT_H_
+#define __OBJECT_H_
+
+#include <vector>
+#include "config.h"
+#include "primitive.h"
+#include "accelerator.h"
+#include "emitter.h"
+
+/*!
+	@brief	インスタンスで共有する形状
+	@class	Object
+	@note	ローカル座標のプリミティブと、それに対して構築した高速化構造(下位構造)を持つ
+			シーンには Instance として何度でも配置でき、形状のメモリは配置数によらない
+ */
+class Object
+{
+public:
+	Object();
+	~Object();
+
+	PrimitiveArray& GetPrimitiveArray(){ return prim_array; }
+	const PrimitiveArray& GetPrimitiveArray() const { return prim_array; }
+	const AABB& GetAABB() const { return aabb; }
+	const EmitterTable::EmitterList& GetEmitters() const { return emitters; }
+
+	void Build(Accelerator::Type type, std::size_t max_thread);
+	void Save(CacheWriter& writer, const std::vector<Material*>& mtrls) const;
+	bool Load(CacheReader& reader, Accelerator::Type type, const std::vector<Material*>& mtrls);
+	bool Traverse(PrimitiveArray::Id& id, Primitive::Param& param, const Ray& ray) const;
+	bool Occluded(const Ray& ray, float t_max) const;
+
+private:
+	PrimitiveArray	prim_array;
+	AABB			aabb;
+	EmitterTable::EmitterList	emitters;	//!< ローカル座標の発光三角形(インスタンスの配置毎に変換して使う)
+ #ifdef USE_ACCELERATOR
+	Accelerator*	accel;
+ #endif // USE_ACCELERATOR
+};
+
+typedef std::vector<Object*> ObjectList;
+
+#endif // !__OBJECT_H_
@@ -0,0 +1,537 @@
+#include <string.h>
+#include <sstream>
+#include "ply.h"
+#include "lib/system/mapped_file.h"
+#include "lib/system/thread.h"
+
+
+namespace _ply
+{
+
+static const std::size_t K_VERTICES_PER_WORK	= 1 << 16;
+static const std::size_t K_FACES_PER_WORK		= 1 << 16;
+
+enum ValueType
+{
+	Value_Int8,
+	Value_UInt8,
+	Value_Int16,
+	Value_UInt16,
+	Value_Int32,
+	Value_UInt32,
+	Value_Float32,
+	Value_Float64,
+	Value_Invalid
+};
+
+struct Property
+{
+	std::string	name;
+	ValueType	type;		//!< リストなら要素の型
+	ValueType	count_type;	//!< リストの要素数の型(リストでなければ Value_Invalid)
+	std::size_t	offset;		//!< 固定長の要素内での位置
+};
+
+struct Element
+{
+	std::string				name;
+	std::size_t				count;
+	std::vector<Property>	properties;
+	std::size_t				stride;		//!< 固定長ならその大きさ、リストを含むなら 0
+};
+
+/*!
+	@brief	面の区切り
+	@note	K_FACES_PER_WORK 毎にファイル中の位置と、それより前の三角形の数を持つ
+ */
+struct FaceBlock
+{
+	const char*	begin;
+	std::size_t	num_faces;		//!< ブロック内の PLY の面の数
+	std::size_t	first_face;		//!< 三角形分割後の書き込み先
+};
+
+static ValueType get_value_type(const std::string& name)
+{
+	if((name == "char") || (name == "int8"))
+		return Value_Int8;
+	if((name == "uchar") || (name == "uint8"))
+		return Value_UInt8;
+	if((name == "short") || (name == "int16"))
+		return Value_Int16;
+	if((name == "ushort") || (name == "uint16"))
+		return Value_UInt16;
+	if((name == "int") || (name == "int32"))
+		return Value_Int32;
+	if((name == "uint") || (name == "uint32"))
+		return Value_UInt32;
+	if((name == "float") || (name == "float32"))
+		return Value_Float32;
+	if((name == "double") || (name == "float64"))
+		return Value_Float64;
+	return Value_Invalid;
+}
+
+static std::size_t get_value_size(ValueType type)
+{
+	static const std::size_t K_SIZES[] = { 1, 1, 2, 2, 4, 4, 4, 8, 0 };
+	return K_SIZES[type];
+}
+
+/*!
+	@brief		値の読み込み
+	@param[i]	p: 値の位置(アラインメントは問わない)
+	@param[i]	type: 型
+	@param[i]	swap: バイト順を入れ替える
+ */
+static double read_value(const char* p, ValueType type, bool swap)
+{
+	unsigned char bytes[8];
+	const std::size_t size = get_value_size(type);
+	for(std::size_t i = 0; i < size; i++)
+		bytes[i] = (unsigned char)p[swap? size - 1 - i : i];
+
+	switch(type)
+	{
+	case Value_Int8:	return (double)(signed char)bytes[0];
+	case Value_UInt8:	return (double)bytes[0];
+	case Value_Int16:	{ short v;			memcpy(&v, bytes, 2); return (double)v; }
+	case Value_UInt16:	{ unsigned short v;	memcpy(&v, bytes, 2); return (double)v; }
+	case Value_Int32:	{ int v;			memcpy(&v, bytes, 4); return (double)v; }
+	case Value_UInt32:	{ unsigned int v;	memcpy(&v, bytes, 4); return (double)v; }
+	case Value_Float32:	{ float v;			memcpy(&v, bytes, 4); return (double)v; }
+	case Value_Float64:	{ double v;			memcpy(&v, bytes, 8); return v; }
+	default:			return 0.0;
+	}
+}
+
+/*!
+	@brief		ヘッダの解析
+	@param[o]	elements: 要素
+	@param[o]	swap: バイト順を入れ替える必要がある
+	@param[i]	data: ファイルの先頭
+	@param[i]	size: ファイルの大きさ
+	@return		本体の先頭(解析できなければ NULL)
+ */
+static const char* parse_header(std::vector<Element>& elements, bool& swap, const char* data, std::size_t size)
+{
+	static const char K_END_HEADER[] = "end_header";
+
+	const char* end = data + size;
+	const char* p = data;
+	bool binary = false;
+	bool first = true;
+	bool found_end = false;
+	while(p < end)
+	{
+		const char* q = (const char*)memchr(p, '\n', end - p);
+		if(!q)
+			return NULL;
+		std::istringstream line(std::string(p, q));
+		p = q + 1;
+
+		std::string keyword;
+		line >> keyword;
+		if(first)
+		{
+			if(keyword != "ply")
+				return NULL;
+			first = false;
+		}
+		else if(keyword == "format")
+		{
+			std::string format;
+			line >> format;
+			const unsigned short endian_test = 1;
+			const bool little = (*(const unsigned char*)&endian_test == 1);
+			if(format == "binary_little_endian")
+				swap = !little;
+			else if(format == "binary_big_endian")
+				swap = little;
+			else
+				return NULL;	// ascii は扱わない
+			binary = true;
+		}
+		else if(keyword == "element")
+		{
+			Element element;
+			line >> element.name >> element.count;
+			element.stride = 0;
+			elements.push_back(element);
+		}
+		else if(keyword == "property")
+		{
+			if(elements.empty())
+				return NULL;
+			Property prop;
+			std::string type;
+			line >> type;
+			if(type == "list")
+			{
+				std::string count_type, item_type;
+				line >> count_type >> item_type;
+				prop.count_type = get_value_type(count_type);
+				prop.type = get_value_type(item_type);
+				if(prop.count_type == Value_Invalid)
+					return NULL;
+			}
+			else
+			{
+				prop.count_type = Value_Invalid;
+				prop.type = get_value_type(type);
+			}
+			line >> prop.name;
+			if(prop.type == Value_Invalid)
+				return NULL;
+			elements.back().properties.push_back(prop);
+		}
+		else if(keyword == K_END_HEADER)
+		{
+			found_end = true;
+			break;
+		}
+	}
+	if(!binary || !found_end)
+		return NULL;
+
+	// 固定長の要素は各属性の位置を決めておく
+	for(std::size_t i = 0; i < elements.size(); i++)
+	{
+		Element& element = elements[i];
+		std::size_t offset = 0;
+		for(std::size_t j = 0; j < element.properties.size(); j++)
+		{
+			Property& prop = element.properties[j];
+			if(prop.count_type != Value_Invalid)
+			{
+				offset = 0;
+				break;
+			}
+			prop.offset = offset;
+			offset += get_value_size(prop.type);
+		}
+		element.stride = offset;
+	}
+	return p;
+}
+
+/*!
+	@brief		可変長の要素 1 つの大きさ
+	@param[o]	size: 大きさ
+	@param[o]	index_count: index_prop のリストの要素数
+	@param[i]	element: 要素の定義
+	@param[i]	index_prop: 要素数を返すリスト(NULL 可)
+	@param[i]	p: 要素の先頭
+	@param[i]	end: ファイルの終端
+	@retval		false: ファイルの終端を越える
+ */
+static bool get_element_size(std::size_t& size, std::size_t& index_count, const Element& element, const Property* index_prop, const char* p, const char* end, bool swap)
+{
+	const char* q = p;
+	for(std::size_t i = 0; i < element.properties.size(); i++)
+	{
+		const Property& prop = element.properties[i];
+		if(prop.count_type == Value_Invalid)
+		{
+			q += get_value_size(prop.type);
+			continue;
+		}
+		const std::size_t count_size = get_value_size(prop.count_type);
+		if(end - q < (std::ptrdiff_t)count_size)
+			return false;
+		const double count = read_value(q, prop.count_type, swap);
+		if((count < 0.0) || ((double)(end - q - count_size) < count * get_value_size(prop.type)))
+			return false;
+		q += count_size + (std::size_t)count * get_value_size(prop.type);
+		if(&prop == index_prop)
+			index_count = (std::size_t)count;
+	}
+	if(q > end)
+		return false;
+	size = q - p;
+	return true;
+}
+
+/*!
+	@brief	頂点を書き込むワーク
+	@class	VertexWork
+ */
+class VertexWork : public Work
+{
+public:
+	void Set(const char* data, const Element* element, const Property* const* props, bool swap, Vector3* positions, TriangleMesh::Normal* normals, std::size_t begin, std::size_t end)
+	{
+		this->data = data;
+		this->element = element;
+		this->props = props;
+		this->swap = swap;
+		this->positions = positions;
+		this->normals = normals;
+		this->begin = begin;
+		this->end = end;
+	}
+
+	void execute(std::size_t)
+	{
+		for(std::size_t i = begin; i < end; i++)
+		{
+			const char* p = data + element->stride * i;
+			float e[6];
+			for(int k = 0; k < (normals? 6 : 3); k++)
+				e[k] = (float)read_value(p + props[k]->offset, props[k]->type, swap);
+ #ifdef CONVERT_RHCS
+			positions[i].set(e[0], e[1], -e[2]);
+ #else
+			positions[i].set(e[0], e[1], e[2]);
+ #endif // CONVERT_RHCS
+			if(normals)
+			{
+				Vector3 n;
+ #ifdef CONVERT_RHCS
+				n.set(e[3], e[4], -e[5]);
+ #else
+				n.set(e[3], e[4], e[5]);
+ #endif // CONVERT_RHCS
+				if(Vec3Length(&n) > 0.0f)
+					Vec3Normalize(&n, &n);
+				TriangleMesh::EncodeNormal(normals[i], n);
+			}
+		}
+	}
+
+private:
+	const char*				data;	//!< 要素の先頭
+	const Element*			element;
+	const Property* const*	props;	//!< x, y, z, nx, ny, nz
+	bool					swap;
+	Vector3*				positions;
+	TriangleMesh::Normal*	normals;
+	std::size_t				begin;
+	std::size_t				end;
+};
+
+/*!
+	@brief	面を書き込むワーク
+	@class	FaceWork
+	@note	面の大きさは get_element_size() で検証済み
+ */
+class FaceWork : public Work
+{
+public:
+	void Set(const FaceBlock* block, const Element* element, const Property* index_prop, bool swap, TriangleMesh::Face* faces, unsigned int mtrl, std::size_t p_base, std::size_t n_base, bool has_normals, std::size_t num_vertices)
+	{
+		this->block = block;
+		this->element = element;
+		this->index_prop = index_prop;
+		this->swap = swap;
+		this->faces = faces;
+		this->mtrl = mtrl;
+		this->p_base = p_base;
+		this->n_base = n_base;
+		this->has_normals = has_normals;
+		this->num_vertices = num_vertices;
+		error = false;
+	}
+
+	void execute(std::size_t)
+	{
+		const std::size_t item_size = get_value_size(index_prop->type);
+		const char* p = block->begin;
+		std::size_t face = block->first_face;
+		for(std::size_t i = 0; i < block->num_faces; i++)
+		{
+			for(std::size_t j = 0; j < element->properties.size(); j++)
+			{
+				const Property& prop = element->properties[j];
+				if(prop.count_type == Value_Invalid)
+				{
+					p += get_value_size(prop.type);
+					continue;
+				}
+				const std::size_t count = (std::size_t)read_value(p, prop.count_type, swap);
+				p += get_value_size(prop.count_type);
+				if(&prop == index_prop)
+				{
+					unsigned int first = 0, prev = 0;
+					for(std::size_t k = 0; k < count; k++)
+					{
+						const double index = read_value(p + item_size * k, prop.type, swap);
+						unsigned int cur = 0;
+						if((index >= 0.0) && (index < (double)num_vertices))
+							cur = (unsigned int)index;
+						else
+							error = true;
+						if(k == 0)
+						{
+							first = cur;
+						}
+						else if(k >= 2)
+						{
+							TriangleMesh::Face& f = faces[face++];
+ #ifdef CONVERT_RHCS
+							// z を反転したので巻き順も入れ替える
+							const unsigned int index[3] = { first, cur, prev };
+ #else
+							const unsigned int index[3] = { first, prev, cur };
+ #endif // CONVERT_RHCS
+							for(int c = 0; c < 3; c++)
+							{
+								f.p[c] = (unsigned int)(p_base + index[c]);
+								f.n[c] = has_normals? (unsigned int)(n_base + index[c]) : TriangleMesh::K_NO_NORMAL;
+							}
+							f.mtrl = mtrl;
+						}
+						prev = cur;
+					}
+				}
+				p += count * get_value_size(prop.type);
+			}
+		}
+	}
+
+	bool HasError() const { return error; }
+
+private:
+	const FaceBlock*		block;
+	const Element*			element;
+	const Property*			index_prop;
+	bool					swap;
+	TriangleMesh::Face*		faces;
+	unsigned int			mtrl;
+	std::size_t				p_base;
+	std::size_t				n_base;
+	bool					has_normals;	//!< 頂点が法線を持つ(n_base 以降に頂点と同じ順に並んでいる)
+	std::size_t				num_vertices;
+	bool					error;
+};
+
+bool Load(TriangleMesh& mesh, Material* mtrl, const std::string& filename, std::size_t max_thread)
+{
+	MappedFile file;
+	if(!file.open(filename.c_str()))
+		return false;
+
+	std::vector<Element> elements;
+	bool swap = false;
+	const char* p = parse_header(elements, swap, file.data(), file.size());
+	if(!p)
+		return false;
+	const char* end = file.data() + file.size();
+
+	// 要素の位置を決め、面は K_FACES_PER_WORK 毎の区切りを求める
+	const Element* vertex = NULL;
+	const Element* face = NULL;
+	const char* vertex_data = NULL;
+	const Property* vertex_props[6] = { NULL, NULL, NULL, NULL, NULL, NULL };
+	const Property* index_prop = NULL;
+	std::vector<FaceBlock> blocks;
+	std::size_t num_faces = 0;
+	for(std::size_t i = 0; i < elements.size(); i++)
+	{
+		const Element& element = elements[i];
+		if((element.name == "vertex") && !vertex && element.stride)
+		{
+			static const char* const K_NAMES[] = { "x", "y", "z", "nx", "ny", "nz" };
+			vertex = &element;
+			vertex_data = p;
+			for(std::size_t j = 0; j < element.properties.size(); j++)
+			{
+				for(int k = 0; k < 6; k++)
+				{
+					if(element.properties[j].name == K_NAMES[k])
+						vertex_props[k] = &element.properties[j];
+				}
+			}
+		}
+		if((element.name == "face") && !face)
+		{
+			for(std::size_t j = 0; j < element.properties.size(); j++)
+			{
+				const Property& prop = element.properties[j];
+				if((prop.count_type != Value_Invalid) && ((prop.name == "vertex_indices") || (prop.name == "vertex_index")))
+					index_prop = &prop;
+			}
+			if(index_prop)
+				face = &element;
+		}
+
+		if(element.stride)
+		{
+			if((std::size_t)(end - p) / element.stride < element.count)
+				return false;
+			p += element.stride * element.count;
+			continue;
+		}
+		for(std::size_t j = 0; j < element.count; j++)
+		{
+			if((&element == face) && (j % K_FACES_PER_WORK == 0))
+			{
+				FaceBlock block = { p, 0, num_faces };
+				blocks.push_back(block);
+			}
+			std::size_t size, index_count = 0;
+			if(!get_element_size(size, index_count, element, index_prop, p, end, swap))
+				return false;
+			if(&element == face)
+			{
+				blocks.back().num_faces++;
+				if(index_count >= 3)
+					num_faces += index_count - 2;
+			}
+			p += size;
+		}
+	}
+	if(!vertex || !vertex_props[0] || !vertex_props[1] || !vertex_props[2] || (num_faces == 0))
+		return false;
+	const bool has_normals = (vertex_props[3] && vertex_props[4] && vertex_props[5]);
+
+	const std::size_t num_vertices = vertex->count;
+	const std::size_t p_base = mesh.GetPositions().size();
+	const std::size_t n_base = mesh.GetNormals().size();
+	const std::size_t f_base = mesh.GetFaces().size();
+	// 面の番号は PrimitiveArray::Id に収まること
+	if(f_base + num_faces > PrimitiveArray::K_INDEX_MASK)
+		return false;
+	const std::size_t m_base = mesh.GetMaterials().size();
+	const unsigned int mtrl_index = mesh.AddMaterial(mtrl);
+	mesh.GetPositions().resize(p_base + num_vertices);
+	if(has_normals)
+		mesh.GetNormals().resize(n_base + num_vertices);
+	mesh.GetFaces().resize(f_base + num_faces);
+
+	WorkPile pile(max_thread);
+	std::vector<VertexWork> vertex_works((num_vertices + K_VERTICES_PER_WORK - 1) / K_VERTICES_PER_WORK);
+	for(std::size_t i = 0; i < vertex_works.size(); i++)
+	{
+		const std::size_t begin = i * K_VERTICES_PER_WORK;
+		const std::size_t block_end = (begin + K_VERTICES_PER_WORK < num_vertices)? begin + K_VERTICES_PER_WORK : num_vertices;
+		vertex_works[i].Set(vertex_data, vertex, vertex_props, swap,
+							&mesh.GetPositions()[p_base], has_normals? &mesh.GetNormals()[n_base] : NULL, begin, block_end);
+		pile.request(&vertex_works[i]);
+	}
+	std::vector<FaceWork> face_works(blocks.size());
+	for(std::size_t i = 0; i < blocks.size(); i++)
+	{
+		face_works[i].Set(&blocks[i], face, index_prop, swap, &mesh.GetFaces()[f_base], mtrl_index,
+						  p_base, n_base, has_normals, num_vertices);
+		pile.request(&face_works[i]);
+	}
+	pile.run();
+
+	bool error = false;
+	for(std::size_t i = 0; i < face_works.size(); i++)
+		error |= face_works[i].HasError();
+	if(error)
+	{
+		mesh.GetPositions().resize(p_base);
+		mesh.GetNormals().resize(n_base);
+		mesh.GetFaces().resize(f_base);
+		mesh.GetMaterials().resize(m_base);
+		return false;
+	}
+
+	mesh.CalcMissingNormals(p_base, f_base);
+	return true;
+}
+
+}
@@ -0,0 +1,33 @@
+//==============================================================================
+/*!
+	@file	ply.h
+	@brief	PLY ファイル操作
+ */
+//==============================================================================
+#ifndef __PLY_H_
+#define __PLY_H_
+
+#include <string>
+#include "primitive.h"
+
+#define CONVERT_RHCS	// right handed coordinate system
+
+namespace _ply
+{
+
+/*!
+	@brief		読み込み
+	@param[io]	mesh: 追加先のメッシュ
+	@param[i]	mtrl: 全ての面の材質
+	@param[i]	filename: ファイル名
+	@param[i]	max_thread: スレッド数(0 ならハードウェアの並列数)
+	@retval		false: 開けなかった、バイナリでない、または範囲外のインデックスを含む(mesh は呼ぶ前の状態に戻す)
+	@note		バイナリ形式(リトルエンディアン、ビッグエンディアン)の vertex の x, y, z, nx, ny, nz と
+				face の vertex_indices だけを読み、多角形は扇形に三角形分割する
+				頂点は固定長なので番号で分け、面は先頭から区切りの位置だけを求めてから、それぞれ並列に mesh に直接書き込む
+ */
+bool Load(TriangleMesh& mesh, Material* mtrl, const std::string& filename, std::size_t max_thread = 0);
+
+}
+
+#endif // __PLY_H_
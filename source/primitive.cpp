@@ -1,4 +1,5 @@
 
+#include <algorithm>
 #include "primitive.h"
 
 /*!
@@ -127,7 +128,90 @@ bool sph_intersect(float* t, const Vector3* p, float r, const Vector3* org, cons
 	return true;
 }
 
-bool Sphere::Intersect(const AABB& aabb)
+/*!
+	@brief		三角形の軸方向の範囲
+	@param[o]	min: 最小値
+	@param[o]	max: 最大値
+	@param[i]	axis: 軸
+	@param[i]	p: 頂点
+ */
+static void tri_calc_range(float& min, float& max, Axis axis, const Vector3* const p[3])
+{
+	min = max = p[0]->v[axis];
+	for(int i = 1; i < 3; i++)
+	{
+		float t = p[i]->v[axis];
+		if(t < min) min = t;
+		else if(t > max) max = t;
+	}
+}
+
+/*!
+	@brief		クリップ領域内の境界
+	@param[o]	out: 境界
+	@param[i]	clip: クリップ領域
+	@param[i]	p: 頂点
+	@retval		false: 領域外
+	@note		三角形を 6 平面でクリップ(Sutherland-Hodgman)した多角形の境界
+				1 平面で頂点は高々 1 つしか増えないので 3 + 6 = 9 頂点に収まる
+ */
+static bool tri_clipped_aabb(AABB& out, const AABB& clip, const Vector3* const p[3])
+{
+	Vector3 poly[2][9];
+	std::size_t num = 3;
+	std::size_t cur = 0;
+	for(int i = 0; i < 3; i++)
+		poly[cur][i] = *p[i];
+
+	for(int axis = Axis_X; axis < Axis_Max; axis++)
+	{
+		for(int side = 0; side < 2; side++)
+		{
+			const float plane = (side == 0)? clip.min.v[axis] : clip.max.v[axis];
+			const float sign = (side == 0)? 1.0f : -1.0f;
+			const Vector3* in = poly[cur];
+			Vector3* out_poly = poly[cur^1];
+			std::size_t n = 0;
+			for(std::size_t i = 0; i < num; i++)
+			{
+				const Vector3& a = in[i];
+				const Vector3& b = in[(i+1) % num];
+				const float da = (a.v[axis] - plane) * sign;
+				const float db = (b.v[axis] - plane) * sign;
+				if(da >= 0.0f)
+					out_poly[n++] = a;
+				if((da >= 0.0f) != (db >= 0.0f))
+				{
+					// 辺と平面の交点
+					const float t = da / (da - db);
+					Vector3 e;
+					Vec3Subtract(&e, &b, &a);
+					Vec3Scale(&e, &e, t);
+					Vec3Add(&out_poly[n], &a, &e);
+					out_poly[n].v[axis] = plane;
+					n++;
+				}
+			}
+			num = n;
+			cur ^= 1;
+			if(num == 0)
+				return false;
+		}
+	}
+
+	out.min = out.max = poly[cur][0];
+	for(std::size_t i = 1; i < num; i++)
+	{
+		Vec3Minimize(&out.min, &out.min, &poly[cur][i]);
+		Vec3Maximize(&out.max, &out.max, &poly[cur][i]);
+	}
+	// 計算誤差ではみ出さないように
+	Vec3Maximize(&out.min, &out.min, &clip.min);
+	Vec3Minimize(&out.max, &out.max, &clip.max);
+	return true;
+}
+
+bool Sphere::Intersect(const AABB& aabb) const
 {
 	float dist = 0.0f;
 	for(int i = Axis_X; i < Axis_Max; i++)
@@ -145,7 +229,7 @@ bool Sphere::Intersect(const AABB& aabb)
 	return (dist <= (r*r))? true : false;
 }
 
-bool Sphere::Intersect(Param& param, const Ray& ray)
+bool Sphere::Intersect(Param& param, const Ray& ray) const
 {
 	float t;
 	if(sph_intersect(&t, &p, r, &ray.org, &ray.dir))
@@ -156,7 +240,7 @@ bool Sphere::Intersect(Param& param, const Ray& ray)
 	return false;
 }
 
-void Sphere::CalcVertex(Vertex& v, const Param& param, const Ray& ray)
+void Sphere::CalcVertex(Vertex& v, const Param& param, const Ray& ray) const
 {
 	// 位置
 	Vec3Scale(&v.p, &ray.dir, param.t);
@@ -166,19 +250,38 @@ void Sphere::CalcVertex(Vertex& v, const Param& param, const Ray& ray)
 	Vec3Normalize(&v.n, &v.n);
 }
 
-void Sphere::CalcRange(float& min, float& max, Axis axis)
+void Sphere::CalcRange(float& min, float& max, Axis axis) const
 {
 	min = p.v[axis] - r;
 	max = p.v[axis] + r;
 }
 
+/*!
+	@brief		クリップ領域内の境界
+	@param[o]	out: 境界
+	@param[i]	clip: クリップ領域
+	@retval		false: 領域外
+	@note		球の境界とクリップ領域の積なので厳密ではない
+ */
+bool Sphere::CalcClippedAABB(AABB& out, const AABB& clip) const
+{
+	for(int i = Axis_X; i < Axis_Max; i++)
+	{
+		out.min.v[i] = ((p.v[i] - r) > clip.min.v[i])? (p.v[i] - r) : clip.min.v[i];
+		out.max.v[i] = ((p.v[i] + r) < clip.max.v[i])? (p.v[i] + r) : clip.max.v[i];
+		if(out.min.v[i] > out.max.v[i])
+			return false;
+	}
+	return true;
+}
+
 /*!
 	@brief		
 	@param[i]	aabb:
 	@note		"Fast 3D Triangle-Box Overlap Testing"
 				Tomas Akenine Moeller
  */
-bool Triangle::Intersect(const AABB& aabb)
+bool Triangle::Intersect(const AABB& aabb) const
 {
 	Vector3 c, h;
 	Vec3Subtract(&h, &aabb.max, &aabb.min);
@@ -293,7 +396,7 @@ bool Triangle::Intersect(const AABB& aabb)
 	return true;
 }
 
-bool Triangle::Intersect(Param& param, const Ray& ray)
+bool Triangle::Intersect(Param& param, const Ray& ray) const
 {
 	float t, u, v;
 	if(tri_intersect(&t, &u, &v, &this->v[0].p, &this->v[1].p, &this->v[2].p, &ray.org, &ray.dir))
@@ -309,7 +412,7 @@ bool Triangle::Intersect(Param& param, const Ray& ray)
 	return false;
 }
 
-void Triangle::CalcVertex(Vertex& v, const Param& param, const Ray& ray)
+void Triangle::CalcVertex(Vertex& v, const Param& param, const Ray& ray) const
 {
 	// 位置
 	Vec3Scale(&v.p, &ray.dir, param.t);
@@ -318,13 +421,680 @@ void Triangle::CalcVertex(Vertex& v, const Param& param, const Ray& ray)
 	tri_lerp_normal(&v.n, &this->v[0].n, &this->v[1].n, &this->v[2].n, param.u, param.v);
 }
 
-void Triangle::CalcRange(float& min, float& max, Axis axis)
+void Triangle::CalcRange(float& min, float& max, Axis axis) const
 {
-	min = max = v[0].p.v[axis];
-	for(int i = 1; i < 3; i++)
+	const Vector3* p[3] = { &v[0].p, &v[1].p, &v[2].p };
+	tri_calc_range(min, max, axis, p);
+}
+
+bool Triangle::CalcClippedAABB(AABB& out, const AABB& clip) const
+{
+	const Vector3* p[3] = { &v[0].p, &v[1].p, &v[2].p };
+	return tri_clipped_aabb(out, clip, p);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*!
+	@brief		予約
+	@param[i]	num_positions: 位置の数
+	@param[i]	num_normals: 法線の数
+	@param[i]	num_faces: 面の数
+ */
+void TriangleMesh::Reserve(std::size_t num_positions, std::size_t num_normals, std::size_t num_faces)
+{
+	positions.reserve(num_positions);
+	normals.reserve(num_normals);
+	faces.reserve(num_faces);
+}
+
+void TriangleMesh::Clear()
+{
+	positions.release();
+	normals.release();
+	faces.release();
+	std::vector<Material*>().swap(materials);
+}
+
+/*!
+	@brief		材質の登録
+	@param[i]	mtrl: 材質
+	@return		Face::mtrl に入れる番号(登録済みならその番号)
+ */
+unsigned int TriangleMesh::AddMaterial(Material* mtrl)
+{
+	for(std::size_t i = 0; i < materials.size(); i++)
 	{
-		float t = v[i].p.v[axis];
-		if(t < min) min = t;
-		else if(t > max) max = t;
+		if(materials[i] == mtrl)
+			return (unsigned int)i;
 	}
+	materials.push_back(mtrl);
+	return (unsigned int)(materials.size() - 1);
+}
+
+/*!
+	@brief		ポインタの配列の中の番号
+	@param[i]	array: 配列
+	@param[i]	p: 探すポインタ
+	@return		見つからなければ配列の要素数
+ */
+template <class T>
+static unsigned int find_index(const std::vector<T*>& array, const T* p)
+{
+	return (unsigned int)(std::find(array.begin(), array.end(), p) - array.begin());
+}
+
+/*!
+	@brief		キャッシュへの書き出し
+	@param[io]	writer: キャッシュ
+	@param[i]	mtrls: シーンの材質(材質はこの中の番号で書く)
+ */
+void TriangleMesh::Save(CacheWriter& writer, const std::vector<Material*>& mtrls) const
+{
+	std::vector<unsigned int> mtrl_indices(materials.size());
+	for(std::size_t i = 0; i < materials.size(); i++)
+		mtrl_indices[i] = find_index(mtrls, materials[i]);
+	writer.WriteArray(positions);
+	writer.WriteArray(normals);
+	writer.WriteArray(faces);
+	writer.WriteArray(mtrl_indices);
+}
+
+/*!
+	@brief		キャッシュからの読み込み
+	@param[io]	reader: キャッシュ
+	@param[i]	mtrls: シーンの材質
+	@note		位置、法線、面はキャッシュの領域を直接参照する
+ */
+bool TriangleMesh::Load(CacheReader& reader, const std::vector<Material*>& mtrls)
+{
+	std::vector<unsigned int> mtrl_indices;
+	if(!reader.ReadArray(positions) || !reader.ReadArray(normals) || !reader.ReadArray(faces) || !reader.ReadArray(mtrl_indices))
+		return false;
+	materials.resize(mtrl_indices.size());
+	for(std::size_t i = 0; i < mtrl_indices.size(); i++)
+	{
+		if(mtrl_indices[i] >= mtrls.size())
+			return false;
+		materials[i] = mtrls[mtrl_indices[i]];
+	}
+	return true;
+}
+
+/*!
+	@brief		法線を持たない角の法線の算出
+	@param[i]	first_position: 対象の位置の先頭
+	@param[i]	first_face: 対象の面の先頭
+	@note		first_face 以降の面の法線のインデックスが K_NO_NORMAL の角に、位置毎の法線を割り当てる
+				位置毎の法線は面積で重み付けした面法線の和で、必要なときだけ位置の数だけ追加する
+				対象の面は first_position 以降の位置だけを参照していること
+ */
+void TriangleMesh::CalcMissingNormals(std::size_t first_position, std::size_t first_face)
+{
+	bool missing = false;
+	for(std::size_t i = first_face; (i < faces.size()) && !missing; i++)
+		missing = (faces[i].n[0] == K_NO_NORMAL) || (faces[i].n[1] == K_NO_NORMAL) || (faces[i].n[2] == K_NO_NORMAL);
+	if(!missing)
+		return;
+
+	const std::size_t num_positions = positions.size() - first_position;
+	std::vector<Vector3> sums(num_positions, Vector3(0.0f, 0.0f, 0.0f));
+	for(std::size_t i = first_face; i < faces.size(); i++)
+	{
+		const Face& f = faces[i];
+		Vector3 e0, e1, n;
+		Vec3Subtract(&e0, &positions[f.p[1]], &positions[f.p[0]]);
+		Vec3Subtract(&e1, &positions[f.p[2]], &positions[f.p[0]]);
+		Vec3OuterProduct(&n, &e0, &e1);
+		for(int j = 0; j < 3; j++)
+			Vec3Add(&sums[f.p[j] - first_position], &sums[f.p[j] - first_position], &n);
+	}
+
+	const unsigned int n_base = (unsigned int)normals.size();
+	normals.resize(n_base + num_positions);
+	for(std::size_t i = 0; i < num_positions; i++)
+	{
+		Vector3& n = sums[i];
+		if(Vec3Length(&n) > 0.0f)
+			Vec3Normalize(&n, &n);
+		else
+			n.set(0.0f, 1.0f, 0.0f);	// 縮退した面だけが参照する位置
+		EncodeNormal(normals[n_base + i], n);
+	}
+	for(std::size_t i = first_face; i < faces.size(); i++)
+	{
+		Face& f = faces[i];
+		for(int j = 0; j < 3; j++)
+		{
+			if(f.n[j] == K_NO_NORMAL)
+				f.n[j] = n_base + (unsigned int)(f.p[j] - first_position);
+		}
+	}
+}
+
+/*!
+	@brief		法線の圧縮
+	@param[o]	out: 圧縮した法線
+	@param[i]	n: 単位法線
+	@note		USE_COMPACT_VERTEX では八面体に射影して下半分を折り返し、(u, v) を 16 ビットの符号付き正規化整数にする
+				"A Survey of Efficient Representations for Independent Unit Vectors" Cigolle et al.
+ */
+void TriangleMesh::EncodeNormal(Normal& out, const Vector3& n)
+{
+ #ifdef USE_COMPACT_VERTEX
+	const float l1 = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+	float u = (l1 > 0.0f)? n.x / l1 : 0.0f;
+	float v = (l1 > 0.0f)? n.y / l1 : 0.0f;
+	if(n.z < 0.0f)
+	{
+		const float t = u;
+		u = (1.0f - fabsf(v)) * ((t >= 0.0f)? 1.0f : -1.0f);
+		v = (1.0f - fabsf(t)) * ((v >= 0.0f)? 1.0f : -1.0f);
+	}
+	const int qu = (int)floorf(u * 32767.0f + 0.5f);
+	const int qv = (int)floorf(v * 32767.0f + 0.5f);
+	out = (unsigned int)(unsigned short)qu | ((unsigned int)(unsigned short)qv << 16);
+ #else
+	out = n;
+ #endif // USE_COMPACT_VERTEX
+}
+
+/*!
+	@brief		法線の展開
+	@param[o]	out: 単位法線
+	@param[i]	n: 圧縮した法線
+ */
+void TriangleMesh::DecodeNormal(Vector3& out, const Normal& n)
+{
+ #ifdef USE_COMPACT_VERTEX
+	float u = (float)(short)(n & 0xffff) / 32767.0f;
+	float v = (float)(short)(n >> 16) / 32767.0f;
+	const float z = 1.0f - fabsf(u) - fabsf(v);
+	if(z < 0.0f)
+	{
+		// 折り返した下半分を戻す
+		u += (u >= 0.0f)? z : -z;
+		v += (v >= 0.0f)? z : -z;
+	}
+	out.set(u, v, z);
+	Vec3Normalize(&out, &out);
+ #else
+	out = n;
+ #endif // USE_COMPACT_VERTEX
+}
+
+bool TriangleMesh::Intersect(Primitive::Param& param, const Ray& ray, std::size_t face) const
+{
+	const Face& f = faces[face];
+	float t, u, v;
+	if(tri_intersect(&t, &u, &v, &positions[f.p[0]], &positions[f.p[1]], &positions[f.p[2]], &ray.org, &ray.dir))
+	{
+		if(t >= 0.0f)
+		{
+			param.t = t;
+			param.u = u;
+			param.v = v;
+			return true;
+		}
+	}
+	return false;
+}
+
+void TriangleMesh::CalcVertex(Vertex& v, const Primitive::Param& param, const Ray& ray, std::size_t face) const
+{
+	const Face& f = faces[face];
+	// 位置
+	Vec3Scale(&v.p, &ray.dir, param.t);
+	Vec3Add(&v.p, &ray.org, &v.p);
+	// 法線
+ #ifdef USE_COMPACT_VERTEX
+	Vector3 n[3];
+	for(int i = 0; i < 3; i++)
+		DecodeNormal(n[i], normals[f.n[i]]);
+	tri_lerp_normal(&v.n, &n[0], &n[1], &n[2], param.u, param.v);
+ #else
+	tri_lerp_normal(&v.n, &normals[f.n[0]], &normals[f.n[1]], &normals[f.n[2]], param.u, param.v);
+ #endif // USE_COMPACT_VERTEX
+}
+
+void TriangleMesh::CalcRange(float& min, float& max, Axis axis, std::size_t face) const
+{
+	const Vector3* p[3];
+	GetPoints(p, face);
+	tri_calc_range(min, max, axis, p);
+}
+
+bool TriangleMesh::CalcClippedAABB(AABB& out, const AABB& clip, std::size_t face) const
+{
+	const Vector3* p[3];
+	GetPoints(p, face);
+	return tri_clipped_aabb(out, clip, p);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*!
+	@brief		同じ種類が続く区間の終わり
+	@param[i]	begin: 区間の先頭
+	@param[i]	end: 区間の終わり
+ */
+static const PrimitiveArray::Id* find_type_end(const PrimitiveArray::Id* begin, const PrimitiveArray::Id* end)
+{
+	const PrimitiveArray::Type type = PrimitiveArray::GetType(*begin);
+	while((begin != end) && (PrimitiveArray::GetType(*begin) == type))
+		begin++;
+	return begin;
+}
+
+/*!
+	@brief		同じ種類の区間から最も近い交差を探す
+	@param[i]	intersect: 配列内の番号を受け取る交差判定
+	@note		intersect は種類毎のラムダなので仮想関数を介さずに展開される
+ */
+template <class F>
+static bool intersect_nearest(F intersect, PrimitiveArray::Id& hit, Primitive::Param& param, float& t_hit,
+							  const PrimitiveArray::Id* begin, const PrimitiveArray::Id* end)
+{
+	bool found = false;
+	Primitive::Param temp;
+	for(; begin != end; begin++)
+	{
+		if(intersect(temp, PrimitiveArray::GetIndex(*begin)) && (temp.t < t_hit))
+		{
+			hit = *begin;
+			param = temp;
+			t_hit = temp.t;
+			found = true;
+		}
+	}
+	return found;
+}
+
+/*!
+	@brief		同じ種類の区間に [0, t_max] の交差があるか
+	@param[i]	intersect: 配列内の番号を受け取る交差判定
+ */
+template <class F>
+static bool intersect_any(F intersect, const PrimitiveArray::Id* begin, const PrimitiveArray::Id* end, float t_max)
+{
+	Primitive::Param temp;
+	for(; begin != end; begin++)
+	{
+		if(intersect(temp, PrimitiveArray::GetIndex(*begin)) && (temp.t <= t_max))
+			return true;
+	}
+	return false;
+}
+
+/*!
+	@brief		予約
+	@param[i]	type: 種類
+	@param[i]	num: 予約する数
+	@note		メッシュは TriangleMesh::Reserve() で予約する
+ */
+void PrimitiveArray::Reserve(Type type, std::size_t num)
+{
+	switch(type)
+	{
+	case Type_Sphere:	spheres.reserve(num);	break;
+	case Type_Triangle:	triangles.reserve(num);	break;
+	case Type_Instance:	instances.reserve(num);	break;
+	default:
+		break;
+	}
+}
+
+void PrimitiveArray::Clear()
+{
+	std::vector<Sphere>().swap(spheres);
+	std::vector<Triangle>().swap(triangles);
+	mesh.Clear();
+	std::vector<Instance>().swap(instances);
+}
+
+/*!
+	@brief	キャッシュに書く球
+ */
+struct SphereRecord
+{
+	Vector3			p;
+	float			r;
+	unsigned int	mtrl;	//!< シーンの材質の番号
+};
+
+/*!
+	@brief	キャッシュに書く三角形
+ */
+struct TriangleRecord
+{
+	Vertex			v[3];
+	unsigned int	mtrl;
+};
+
+/*!
+	@brief	キャッシュに書くインスタンス
+ */
+struct InstanceRecord
+{
+	Matrix44		world;
+	Matrix44		inv_world;
+	AABB			aabb;
+	unsigned int	object;	//!< シーンのオブジェクトの番号
+};
+
+/*!
+	@brief		キャッシュへの書き出し
+	@param[io]	writer: キャッシュ
+	@param[i]	mtrls: シーンの材質
+	@param[i]	objs: シーンのオブジェクト
+	@note		球、三角形、インスタンスは仮想関数テーブルやポインタを持つので、番号に置き換えて書く
+ */
+void PrimitiveArray::Save(CacheWriter& writer, const std::vector<Material*>& mtrls, const std::vector<Object*>& objs) const
+{
+	std::vector<SphereRecord> sphere_records(spheres.size());
+	for(std::size_t i = 0; i < spheres.size(); i++)
+	{
+		sphere_records[i].p = spheres[i].p;
+		sphere_records[i].r = spheres[i].r;
+		sphere_records[i].mtrl = find_index(mtrls, spheres[i].GetMaterial());
+	}
+	std::vector<TriangleRecord> triangle_records(triangles.size());
+	for(std::size_t i = 0; i < triangles.size(); i++)
+	{
+		for(int j = 0; j < 3; j++)
+			triangle_records[i].v[j] = triangles[i].v[j];
+		triangle_records[i].mtrl = find_index(mtrls, triangles[i].GetMaterial());
+	}
+	std::vector<InstanceRecord> instance_records(instances.size());
+	for(std::size_t i = 0; i < instances.size(); i++)
+	{
+		const Instance& inst = instances[i];
+		instance_records[i].world = inst.GetWorld();
+		instance_records[i].inv_world = inst.GetInvWorld();
+		instance_records[i].aabb = inst.GetAABB();
+		instance_records[i].object = find_index(objs, inst.GetBaseObject());
+	}
+	writer.WriteArray(sphere_records);
+	writer.WriteArray(triangle_records);
+	mesh.Save(writer, mtrls);
+	writer.WriteArray(instance_records);
+}
+
+/*!
+	@brief		キャッシュからの読み込み
+	@param[io]	reader: キャッシュ
+	@param[i]	mtrls: シーンの材質
+	@param[i]	objs: シーンのオブジェクト
+ */
+bool PrimitiveArray::Load(CacheReader& reader, const std::vector<Material*>& mtrls, const std::vector<Object*>& objs)
+{
+	Clear();
+	MappedArray<SphereRecord> sphere_records;
+	MappedArray<TriangleRecord> triangle_records;
+	MappedArray<InstanceRecord> instance_records;
+	if(!reader.ReadArray(sphere_records) || !reader.ReadArray(triangle_records) ||
+	   !mesh.Load(reader, mtrls) || !reader.ReadArray(instance_records))
+		return false;
+
+	spheres.resize(sphere_records.size());
+	for(std::size_t i = 0; i < spheres.size(); i++)
+	{
+		const SphereRecord& r = sphere_records[i];
+		if(r.mtrl >= mtrls.size())
+			return false;
+		spheres[i].p = r.p;
+		spheres[i].r = r.r;
+		spheres[i].SetMaterial(mtrls[r.mtrl]);
+	}
+	triangles.resize(triangle_records.size());
+	for(std::size_t i = 0; i < triangles.size(); i++)
+	{
+		const TriangleRecord& r = triangle_records[i];
+		if(r.mtrl >= mtrls.size())
+			return false;
+		for(int j = 0; j < 3; j++)
+			triangles[i].v[j] = r.v[j];
+		triangles[i].SetMaterial(mtrls[r.mtrl]);
+	}
+	instances.resize(instance_records.size());
+	for(std::size_t i = 0; i < instances.size(); i++)
+	{
+		const InstanceRecord& r = instance_records[i];
+		if(r.object >= objs.size())
+			return false;
+		instances[i].Init(objs[r.object], r.world, r.inv_world, r.aabb);
+	}
+	return true;
+}
+
+PrimitiveArray::Id PrimitiveArray::GetId(std::size_t n) const
+{
+	if(n < spheres.size())
+		return MakeId(Type_Sphere, n);
+	n -= spheres.size();
+	if(n < triangles.size())
+		return MakeId(Type_Triangle, n);
+	n -= triangles.size();
+	if(n < mesh.GetFaces().size())
+		return MakeId(Type_Mesh, n);
+	return MakeId(Type_Instance, n - mesh.GetFaces().size());
+}
+
+/*!
+	@brief		全プリミティブの境界
+	@param[o]	out: 境界
+ */
+void PrimitiveArray::CalcAABB(AABB& out) const
+{
+	out.min.set( FLT_MAX, FLT_MAX, FLT_MAX);
+	out.max.set(-FLT_MAX,-FLT_MAX,-FLT_MAX);
+	float _min, _max;
+	const std::size_t num_prims = size();
+	for(std::size_t i = 0; i < num_prims; i++)
+	{
+		const Id id = GetId(i);
+		for(int axis = Axis_X; axis < Axis_Max; axis++)
+		{
+			CalcRange(_min, _max, (Axis)axis, id);
+			if(_min < out.min.v[axis])
+				out.min.v[axis] = _min;
+			if(_max > out.max.v[axis])
+				out.max.v[axis] = _max;
+		}
+	}
+}
+
+/*!
+	@brief		材質
+	@param[i]	param: 交差情報(インスタンスの場合に使う)
+	@param[i]	id: プリミティブ
+ */
+Material* PrimitiveArray::GetMaterial(const Primitive::Param& param, Id id) const
+{
+	switch(GetType(id))
+	{
+	case Type_Sphere:	return spheres[GetIndex(id)].GetMaterial();
+	case Type_Triangle:	return triangles[GetIndex(id)].GetMaterial();
+	case Type_Mesh:		return mesh.GetMaterial(GetIndex(id));
+	case Type_Instance:	return instances[GetIndex(id)].GetMaterial(param);
+	default:
+		break;
+	}
+	ASSERT_MSG(false, "invalid primitive id");
+	return NULL;
+}
+
+/*!
+	@brief		三角形の頂点
+	@param[o]	p: 頂点
+	@param[i]	id: プリミティブ
+	@retval		false: 三角形ではない
+ */
+bool PrimitiveArray::GetTrianglePoints(const Vector3* p[3], Id id) const
+{
+	switch(GetType(id))
+	{
+	case Type_Triangle:
+		{
+			const Triangle& tri = triangles[GetIndex(id)];
+			for(int i = 0; i < 3; i++)
+				p[i] = &tri.v[i].p;
+		}
+		return true;
+	case Type_Mesh:
+		mesh.GetPoints(p, GetIndex(id));
+		return true;
+	default:
+		break;
+	}
+	return false;
+}
+
+/*!
+	@brief		三角形の面法線
+	@param[o]	n: 単位面法線(光線が当たる表側)
+	@param[i]	param: 交差のパラメータ(インスタンスの場合に中身を調べる)
+	@param[i]	id: プリミティブ
+	@retval		false: 三角形、メッシュの面、インスタンス内のそれらのいずれでもない
+ */
+bool PrimitiveArray::CalcFaceNormal(Vector3& n, const Primitive::Param& param, Id id) const
+{
+	if(GetType(id) == Type_Instance)
+		return instances[GetIndex(id)].CalcFaceNormal(n, param);
+
+	const Vector3* p[3];
+	if(!GetTrianglePoints(p, id))
+		return false;
+	Vector3 e0, e1;
+	Vec3Subtract(&e0, p[1], p[0]);
+	Vec3Subtract(&e1, p[2], p[0]);
+	Vec3OuterProduct(&n, &e0, &e1);
+	Vec3Normalize(&n, &n);
+	return true;
+}
+
+void PrimitiveArray::CalcVertex(Vertex& v, const Primitive::Param& param, const Ray& ray, Id id) const
+{
+	switch(GetType(id))
+	{
+	case Type_Sphere:	spheres[GetIndex(id)].CalcVertex(v, param, ray);	break;
+	case Type_Triangle:	triangles[GetIndex(id)].CalcVertex(v, param, ray);	break;
+	case Type_Mesh:		mesh.CalcVertex(v, param, ray, GetIndex(id));		break;
+	case Type_Instance:	instances[GetIndex(id)].CalcVertex(v, param, ray);	break;
+	default:
+		ASSERT_MSG(false, "invalid primitive id");
+		break;
+	}
+}
+
+void PrimitiveArray::CalcRange(float& min, float& max, Axis axis, Id id) const
+{
+	switch(GetType(id))
+	{
+	case Type_Sphere:	spheres[GetIndex(id)].CalcRange(min, max, axis);	break;
+	case Type_Triangle:	triangles[GetIndex(id)].CalcRange(min, max, axis);	break;
+	case Type_Mesh:		mesh.CalcRange(min, max, axis, GetIndex(id));		break;
+	case Type_Instance:	instances[GetIndex(id)].CalcRange(min, max, axis);	break;
+	default:
+		ASSERT_MSG(false, "invalid primitive id");
+		break;
+	}
+}
+
+bool PrimitiveArray::CalcClippedAABB(AABB& out, const AABB& clip, Id id) const
+{
+	switch(GetType(id))
+	{
+	case Type_Sphere:	return spheres[GetIndex(id)].CalcClippedAABB(out, clip);
+	case Type_Triangle:	return triangles[GetIndex(id)].CalcClippedAABB(out, clip);
+	case Type_Mesh:		return mesh.CalcClippedAABB(out, clip, GetIndex(id));
+	case Type_Instance:	return instances[GetIndex(id)].CalcClippedAABB(out, clip);
+	default:
+		break;
+	}
+	ASSERT_MSG(false, "invalid primitive id");
+	return false;
+}
+
+/*!
+	@brief		Id の区間から最も近い交差を探す
+	@param[o]	hit: 交差したプリミティブ
+	@param[o]	param: 交差情報
+	@param[io]	t_hit: これより近い交差だけを採用し、見つかれば更新する
+	@param[i]	begin: Id の区間(種類毎にまとまっていること)
+	@param[i]	end: Id の区間
+	@param[i]	ray: 光線
+	@retval		true: t_hit より近い交差があった
+	@note		種類の分岐は区間毎に 1 回だけ
+ */
+bool PrimitiveArray::IntersectNearest(Id& hit, Primitive::Param& param, float& t_hit, const Id* begin, const Id* end, const Ray& ray) const
+{
+	bool found = false;
+	while(begin != end)
+	{
+		const Id* run = find_type_end(begin, end);
+		switch(GetType(*begin))
+		{
+		case Type_Sphere:
+			found |= intersect_nearest([&](Primitive::Param& p, std::size_t i){ return spheres[i].Intersect(p, ray); }, hit, param, t_hit, begin, run);
+			break;
+		case Type_Triangle:
+			found |= intersect_nearest([&](Primitive::Param& p, std::size_t i){ return triangles[i].Intersect(p, ray); }, hit, param, t_hit, begin, run);
+			break;
+		case Type_Mesh:
+			found |= intersect_nearest([&](Primitive::Param& p, std::size_t i){ return mesh.Intersect(p, ray, i); }, hit, param, t_hit, begin, run);
+			break;
+		case Type_Instance:
+			found |= intersect_nearest([&](Primitive::Param& p, std::size_t i){ return instances[i].Intersect(p, ray); }, hit, param, t_hit, begin, run);
+			break;
+		default:
+			ASSERT_MSG(false, "invalid primitive id");
+			break;
+		}
+		begin = run;
+	}
+	return found;
+}
+
+/*!
+	@brief		Id の区間に遮蔽物があるか
+	@param[i]	begin: Id の区間(種類毎にまとまっていること)
+	@param[i]	end: Id の区間
+	@param[i]	ray: 光線
+	@param[i]	t_max: 調べる区間の終点
+	@retval		true: [0, t_max] に交差がある
+ */
+bool PrimitiveArray::IntersectAny(const Id* begin, const Id* end, const Ray& ray, float t_max) const
+{
+	while(begin != end)
+	{
+		const Id* run = find_type_end(begin, end);
+		bool hit = false;
+		switch(GetType(*begin))
+		{
+		case Type_Sphere:
+			hit = intersect_any([&](Primitive::Param& p, std::size_t i){ return spheres[i].Intersect(p, ray); }, begin, run, t_max);
+			break;
+		case Type_Triangle:
+			hit = intersect_any([&](Primitive::Param& p, std::size_t i){ return triangles[i].Intersect(p, ray); }, begin, run, t_max);
+			break;
+		case Type_Mesh:
+			hit = intersect_any([&](Primitive::Param& p, std::size_t i){ return mesh.Intersect(p, ray, i); }, begin, run, t_max);
+			break;
+		case Type_Instance:
+			for(; begin != run; begin++)
+			{
+				if(instances[GetIndex(*begin)].Occluded(ray, t_max))
+					return true;
+			}
+			break;
+		default:
+			ASSERT_MSG(false, "invalid primitive id");
+			break;
+		}
+		if(hit)
+			return true;
+		begin = run;
+	}
+	return false;
 }
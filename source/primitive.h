@@ -9,16 +9,21 @@
 #ifndef __PRIMITIVE_H_
 #define __PRIMITIVE_H_
 
-#include <list>
+#include <vector>
+#include "config.h"
 #include "lib/math/vector.h"
+#include "lib/math/matrix.h"
 #include "geometry.h"
 #include "material.h"
 #include "ray.h"
+#include "cache.h"
+#include "lib/system/mapped_array.h"
 
 /*!
 	@brief	プリミティブ
 	@class	Primitive
 	@note	abstract class
+			交差判定の高速化構造からは PrimitiveArray を通して仮想関数を介さずに呼ばれる
  */
 class Primitive
 {
@@ -26,18 +31,16 @@ public:
 	struct Param
 	{
 		float t, u, v;
+		unsigned int prim;	//!< インスタンスと交差した場合のオブジェクト内のプリミティブ
 	};
 public:
-	virtual bool Intersect(const AABB& aabb) = 0;
-	virtual bool Intersect(Param& param, const Ray& ray) = 0;
-	virtual void CalcVertex(Vertex& v, const Param& param, const Ray& ray) = 0;
-	virtual void CalcRange(float& min, float& max, Axis axis) = 0;
+	virtual bool Intersect(Param& param, const Ray& ray) const = 0;
+	virtual void CalcVertex(Vertex& v, const Param& param, const Ray& ray) const = 0;
+	virtual void CalcRange(float& min, float& max, Axis axis) const = 0;
+	virtual bool CalcClippedAABB(AABB& out, const AABB& clip) const = 0;
 
 	void SetMaterial(Material* mtrl){ ref_mtrl = mtrl; }
-	Material* GetMaterial(){ return ref_mtrl; }
-
-	virtual std::size_t GetNumPoints() = 0;
-	virtual float GetPoint(Axis axis, std::size_t idx) = 0;
+	Material* GetMaterial() const { return ref_mtrl; }
 
 private:
 	Material*	ref_mtrl;
@@ -47,16 +50,14 @@ private:
 	@brief	球
 	@class	Sphere
  */
-class Sphere : public Primitive
+class Sphere final : public Primitive
 {
 public:
-	bool Intersect(const AABB& aabb);
-	bool Intersect(Param& param, const Ray& ray);
-	void CalcVertex(Vertex& v, const Param& param, const Ray& ray);
-	void CalcRange(float& min, float& max, Axis axis);
-
-	std::size_t GetNumPoints(){ return 2; }
-	float GetPoint(Axis axis, std::size_t idx){ return (idx == 0)? (p.v[axis] - r) : (p.v[axis] + r); }
+	bool Intersect(const AABB& aabb) const;
+	bool Intersect(Param& param, const Ray& ray) const;
+	void CalcVertex(Vertex& v, const Param& param, const Ray& ray) const;
+	void CalcRange(float& min, float& max, Axis axis) const;
+	bool CalcClippedAABB(AABB& out, const AABB& clip) const;
 
 public:
 	Vector3	p;		//!< position
@@ -67,22 +68,199 @@ public:
 	@brief	三角形
 	@class	Triangle
  */
-class Triangle : public Primitive
+class Triangle final : public Primitive
 {
 public:
-	bool Intersect(const AABB& aabb);
-	bool Intersect(Param& param, const Ray& ray);
-	void CalcVertex(Vertex& v, const Param& param, const Ray& ray);
-	void CalcRange(float& min, float& max, Axis axis);
-
-	std::size_t GetNumPoints(){ return 3; }
-	float GetPoint(Axis axis, std::size_t idx){ return v[idx].p.v[axis]; }
+	bool Intersect(const AABB& aabb) const;
+	bool Intersect(Param& param, const Ray& ray) const;
+	void CalcVertex(Vertex& v, const Param& param, const Ray& ray) const;
+	void CalcRange(float& min, float& max, Axis axis) const;
+	bool CalcClippedAABB(AABB& out, const AABB& clip) const;
 
 public:
 	Vertex	v[3];	//!< vertices
-	Vector3	n;		//!< face normal
 };
 
-typedef std::list<Primitive*> PrimitiveList;
+/*!
+	@brief	頂点を共有する三角形メッシュ
+	@class	TriangleMesh
+	@note	位置と法線は 1 度だけ持ち、面はそれぞれを 32 ビットのインデックス 3 つで参照する
+			スムージンググループの境界では同じ位置に複数の法線があるので、法線は位置と別に索引を持つ
+			Primitive ではないので、面は PrimitiveArray の Id でだけ参照する
+			USE_COMPACT_VERTEX では法線を八面体マッピングで 32 ビットに詰め、CalcVertex() で展開する
+			面は材質をポインタでなく番号で持つので、位置、法線、面の配列はそのままキャッシュに書き出して割り当てられる
+ */
+class TriangleMesh
+{
+public:
+ #ifdef USE_COMPACT_VERTEX
+	typedef unsigned int Normal;	//!< 八面体マッピングした (u, v) を 16 ビットずつ
+ #else
+	typedef Vector3 Normal;
+ #endif // USE_COMPACT_VERTEX
+
+	struct Face
+	{
+		unsigned int	p[3];	//!< 位置のインデックス
+		unsigned int	n[3];	//!< 法線のインデックス
+		unsigned int	mtrl;	//!< 材質の番号(GetMaterials() の添字)
+	};
+
+	static const unsigned int K_NO_NORMAL	= 0xffffffff;	//!< 法線を持たない角の法線のインデックス
+
+public:
+	void Reserve(std::size_t num_positions, std::size_t num_normals, std::size_t num_faces);
+	void Clear();
+	void CalcMissingNormals(std::size_t first_position, std::size_t first_face);
+
+	static void EncodeNormal(Normal& out, const Vector3& n);
+	static void DecodeNormal(Vector3& out, const Normal& n);
+
+	unsigned int AddMaterial(Material* mtrl);
+	Material* GetMaterial(std::size_t face) const { return materials[faces[face].mtrl]; }
+
+	void Save(CacheWriter& writer, const std::vector<Material*>& mtrls) const;
+	bool Load(CacheReader& reader, const std::vector<Material*>& mtrls);
+
+	MappedArray<Vector3>& GetPositions(){ return positions; }
+	MappedArray<Normal>& GetNormals(){ return normals; }
+	MappedArray<Face>& GetFaces(){ return faces; }
+	std::vector<Material*>& GetMaterials(){ return materials; }
+	const MappedArray<Vector3>& GetPositions() const { return positions; }
+	const MappedArray<Normal>& GetNormals() const { return normals; }
+	const MappedArray<Face>& GetFaces() const { return faces; }
+	const std::vector<Material*>& GetMaterials() const { return materials; }
+
+	void GetPoints(const Vector3* p[3], std::size_t face) const
+	{
+		const Face& f = faces[face];
+		p[0] = &positions[f.p[0]];
+		p[1] = &positions[f.p[1]];
+		p[2] = &positions[f.p[2]];
+	}
+
+	bool Intersect(Primitive::Param& param, const Ray& ray, std::size_t face) const;
+	void CalcVertex(Vertex& v, const Primitive::Param& param, const Ray& ray, std::size_t face) const;
+	void CalcRange(float& min, float& max, Axis axis, std::size_t face) const;
+	bool CalcClippedAABB(AABB& out, const AABB& clip, std::size_t face) const;
+
+private:
+	MappedArray<Vector3>	positions;
+	MappedArray<Normal>		normals;
+	MappedArray<Face>		faces;
+	std::vector<Material*>	materials;
+};
+
+class Object;
+
+/*!
+	@brief	オブジェクトの配置
+	@class	Instance
+	@note	形状と高速化構造(下位構造)は Object で共有し、インスタンス毎には変換行列だけを持つ
+			光線をローカル座標に変換してから Object の高速化構造を辿る
+			交差した Object 内のプリミティブは Primitive::Param::prim に入る
+			インスタンスを入れ子にはできない
+ */
+class Instance
+{
+public:
+	bool Init(const Object* object, const Matrix44& world);
+	void Init(const Object* object, const Matrix44& world, const Matrix44& inv_world, const AABB& aabb);
+
+	const Object* GetBaseObject() const { return object; }
+	const Matrix44& GetWorld() const { return world; }
+	const Matrix44& GetInvWorld() const { return inv_world; }
+	const AABB& GetAABB() const { return aabb; }
+
+	bool Intersect(Primitive::Param& param, const Ray& ray) const;
+	bool Occluded(const Ray& ray, float t_max) const;
+	void CalcVertex(Vertex& v, const Primitive::Param& param, const Ray& ray) const;
+	Material* GetMaterial(const Primitive::Param& param) const;
+	bool CalcFaceNormal(Vector3& n, const Primitive::Param& param) const;
+	void CalcRange(float& min, float& max, Axis axis) const;
+	bool CalcClippedAABB(AABB& out, const AABB& clip) const;
+
+private:
+	float ToLocal(Ray& out, const Ray& ray) const;
+
+private:
+	const Object*	object;
+	Matrix44		world;		//!< ローカル座標からワールド座標
+	Matrix44		inv_world;	//!< ワールド座標からローカル座標
+	AABB			aabb;		//!< ワールド座標の境界
+};
+
+/*!
+	@brief	種類毎の配列に並べたプリミティブ
+	@class	PrimitiveArray
+	@note	高速化構造のリーフは (種類, 番号) を 1 つにまとめた Id を持つ
+			Id を種類の順に並べておけば、リーフ内の交差判定は種類毎の連続した区間になり
+			仮想関数を介さずに具象クラスを直接呼べる
+			Add*() が返すポインタは次に追加するまでの間だけ有効
+ */
+class PrimitiveArray
+{
+public:
+	enum Type
+	{
+		Type_Sphere,
+		Type_Triangle,
+		Type_Mesh,		//!< TriangleMesh の面
+		Type_Instance,
+		Type_Max
+	};
+
+	typedef unsigned int Id;	//!< 上位 4 ビットが種類、残りが種類毎の配列の番号
+
+	static const unsigned int K_TYPE_SHIFT	= 28;
+	static const unsigned int K_INDEX_MASK	= (1u << K_TYPE_SHIFT) - 1;
+
+	static Id MakeId(Type type, std::size_t index){ ASSERT_MSG(index <= K_INDEX_MASK, "PrimitiveArray::MakeId(): index overflow"); return ((Id)type << K_TYPE_SHIFT) | (Id)index; }
+	static Type GetType(Id id){ return (Type)(id >> K_TYPE_SHIFT); }
+	static std::size_t GetIndex(Id id){ return id & K_INDEX_MASK; }
+
+public:
+	Sphere* AddSphere(){ spheres.push_back(Sphere()); return &spheres.back(); }
+	Triangle* AddTriangle(){ triangles.push_back(Triangle()); return &triangles.back(); }
+	Instance* AddInstance(){ instances.push_back(Instance()); return &instances.back(); }
+	void Reserve(Type type, std::size_t num);
+	void Clear();
+
+	std::size_t size() const { return spheres.size() + triangles.size() + mesh.GetFaces().size() + instances.size(); }
+	bool empty() const { return size() == 0; }
+
+	/*!
+		@brief		n 番目のプリミティブの Id
+		@note		球、三角形、メッシュの面、インスタンスの順に数えるので n の昇順は Id の昇順と一致する
+	 */
+	Id GetId(std::size_t n) const;
+
+	const std::vector<Sphere>& GetSpheres() const { return spheres; }
+	const std::vector<Triangle>& GetTriangles() const { return triangles; }
+	const std::vector<Instance>& GetInstances() const { return instances; }
+	Instance& GetInstance(std::size_t index){ return instances[index]; }
+	TriangleMesh& GetMesh(){ return mesh; }
+	const TriangleMesh& GetMesh() const { return mesh; }
+
+	void Save(CacheWriter& writer, const std::vector<Material*>& mtrls, const std::vector<Object*>& objs) const;
+	bool Load(CacheReader& reader, const std::vector<Material*>& mtrls, const std::vector<Object*>& objs);
+
+	void CalcAABB(AABB& out) const;
+	Material* GetMaterial(const Primitive::Param& param, Id id) const;
+	bool GetTrianglePoints(const Vector3* p[3], Id id) const;
+	bool CalcFaceNormal(Vector3& n, const Primitive::Param& param, Id id) const;
+	void CalcVertex(Vertex& v, const Primitive::Param& param, const Ray& ray, Id id) const;
+	void CalcRange(float& min, float& max, Axis axis, Id id) const;
+	bool CalcClippedAABB(AABB& out, const AABB& clip, Id id) const;
+
+	bool IntersectNearest(Id& hit, Primitive::Param& param, float& t_hit, const Id* begin, const Id* end, const Ray& ray) const;
+	bool IntersectAny(const Id* begin, const Id* end, const Ray& ray, float t_max) const;
+
+private:
+	std::vector<Sphere>		spheres;
+	std::vector<Triangle>	triangles;
+	TriangleMesh			mesh;
+	std::vector<Instance>	instances;
+};
 
 #endif // !__PRIMITIVE_H_
\ No newline at end of file
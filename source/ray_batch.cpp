@@ -0,0 +1,101 @@
+#include "ray_batch.h"
+
+
+/*!
+	@brief		全て破棄
+	@note		領域は解放せずに次の列で使い回す
+ */
+void RayBatch::Clear()
+{
+	for(int axis = Axis_X; axis < Axis_Max; axis++)
+	{
+		org[axis].clear();
+		dir[axis].clear();
+	}
+	t_max.clear();
+	order.clear();
+}
+
+/*!
+	@brief		領域の確保
+	@param[i]	size: 光線の数
+ */
+void RayBatch::Reserve(std::size_t size)
+{
+	for(int axis = Axis_X; axis < Axis_Max; axis++)
+	{
+		org[axis].reserve(size);
+		dir[axis].reserve(size);
+	}
+	t_max.reserve(size);
+	order.reserve(size);
+}
+
+/*!
+	@brief		光線の追加
+	@param[i]	ray: 光線
+	@param[i]	t_max: 調べる区間の終点(遮蔽判定のみ)
+ */
+void RayBatch::Add(const Ray& ray, float t_max)
+{
+	for(int axis = Axis_X; axis < Axis_Max; axis++)
+	{
+		org[axis].push_back(ray.org.v[axis]);
+		dir[axis].push_back(ray.dir.v[axis]);
+	}
+	this->t_max.push_back(t_max);
+}
+
+/*!
+	@brief		光線の取り出し
+	@param[o]	ray: 光線
+	@param[i]	i: 番号
+ */
+void RayBatch::GetRay(Ray& ray, std::size_t i) const
+{
+	for(int axis = Axis_X; axis < Axis_Max; axis++)
+	{
+		ray.org.v[axis] = org[axis][i];
+		ray.dir.v[axis] = dir[axis][i];
+	}
+}
+
+/*!
+	@brief		方向の象限
+	@param[i]	i: 番号
+	@return		軸毎に方向が負なら立てたビット(bit 0 が x)
+ */
+unsigned int RayBatch::GetOctant(std::size_t i) const
+{
+	return ((dir[Axis_X][i] < 0.0f)? 1 : 0) | ((dir[Axis_Y][i] < 0.0f)? 2 : 0) | ((dir[Axis_Z][i] < 0.0f)? 4 : 0);
+}
+
+/*!
+	@brief		方向の象限順に並べる
+	@note		光線自体は動かさずに番号だけを並べ替える
+				同じ象限の中では追加した順を保つ(計数ソート)
+ */
+void RayBatch::SortByOctant()
+{
+	const std::size_t num = size();
+	unsigned int offset[K_NUM_OCTANTS + 1] = { 0 };
+	for(std::size_t i = 0; i < num; i++)
+		offset[GetOctant(i) + 1]++;
+	for(unsigned int i = 0; i < K_NUM_OCTANTS; i++)
+		offset[i + 1] += offset[i];
+
+	order.resize(num);
+	for(std::size_t i = 0; i < num; i++)
+		order[offset[GetOctant(i)]++] = (unsigned int)i;
+}
+
+/*!
+	@brief		要素数の変更
+	@param[i]	size: 光線の数
+ */
+void HitBatch::Resize(std::size_t size)
+{
+	found.resize(size);
+	id.resize(size);
+	param.resize(size);
+}
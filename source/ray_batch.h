@@ -0,0 +1,67 @@
+//==============================================================================
+/*!
+	@file	ray_batch.h
+	@brief	まとめて交差判定する光線の列
+	@note	Accelerator::IntersectStream(), OccludedStream() でまとめて判定する
+			成分毎に別の配列に持つ(SoA)ので、走査では同じ成分を続けて読める
+ */
+//==============================================================================
+#ifndef __RAY_BATCH_H_
+#define __RAY_BATCH_H_
+
+#include <vector>
+#include <cfloat>
+#include "ray.h"
+#include "primitive.h"
+
+/*!
+	@brief	光線の列
+	@class	RayBatch
+ */
+class RayBatch
+{
+public:
+	static const unsigned int K_NUM_OCTANTS = 8;	//!< 方向の象限の数(軸毎の符号の組み合わせ)
+
+public:
+	void Clear();
+	void Reserve(std::size_t size);
+	void Add(const Ray& ray, float t_max = FLT_MAX);
+
+	std::size_t size() const { return t_max.size(); }
+	bool empty() const { return t_max.empty(); }
+
+	void GetRay(Ray& ray, std::size_t i) const;
+	unsigned int GetOctant(std::size_t i) const;
+
+	void SortByOctant();
+	const std::vector<unsigned int>& GetOrder() const { return order; }
+
+public:
+	std::vector<float>	org[3];		//!< 始点の軸毎の成分
+	std::vector<float>	dir[3];		//!< 方向の軸毎の成分
+	std::vector<float>	t_max;		//!< 調べる区間の終点(遮蔽判定のみ)
+
+private:
+	std::vector<unsigned int>	order;	//!< 方向の象限順に並べた光線の番号(SortByOctant() で作る)
+};
+
+/*!
+	@brief	交差判定の結果の列
+	@class	HitBatch
+	@note	RayBatch と同じ順に並ぶ
+			OccludedStream() は found だけを使い、遮蔽物があれば 0 以外にする
+ */
+class HitBatch
+{
+public:
+	void Resize(std::size_t size);
+	std::size_t size() const { return found.size(); }
+
+public:
+	std::vector<unsigned char>		found;	//!< 交差した
+	std::vector<PrimitiveArray::Id>	id;		//!< 交差したプリミティブ
+	std::vector<Primitive::Param>	param;	//!< 交差情報
+};
+
+#endif // !__RAY_BATCH_H_
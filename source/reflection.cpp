@@ -1,5 +1,4 @@
 
-#include "lib/math/random.h"
 #include "reflection.h"
 
 /*!
@@ -40,11 +39,12 @@ void calc_tangent_binormal(Vector3* t, Vector3* b, const Vector3* n)
 	@brief		半球内のランダムベクトル
 	@param[o]	v: ランダムベクトル
 	@param[i]	n: 法線ベクトル
+	@param[i]	rng: 乱数生成器
  */
-void random_vector_cosweight(Vector3* v, const Vector3* n)
+void random_vector_cosweight(Vector3* v, const Vector3* n, Random& rng)
 {
-	float r1 = (float)genrand_real1();	// 0.0 ～ 1.0
-	float r2 = (float)genrand_real1();	// 0.0 ～ 1.0
+	float r1 = rng.gen_real1();	// 0.0 ～ 1.0
+	float r2 = rng.gen_real1();	// 0.0 ～ 1.0
 	float theta = acosf(sqrtf(r1));
 	float phi = PI2 * r2;
 
@@ -78,11 +78,12 @@ void calc_reflection(Vector3* r, const Vector3* in, const Vector3* n)
 	@param[i]	in:入射ベクトル(予め反転しておくこと)
 	@param[i]	n: 法線ベクトル
 	@param[i]	shine: 
+	@param[i]	rng: 乱数生成器
  */
-void random_vector_cosweight(Vector3* v, const Vector3* in, const Vector3* n, float shine)
+void random_vector_cosweight(Vector3* v, const Vector3* in, const Vector3* n, float shine, Random& rng)
 {
-	float r1 = (float)genrand_real1();	// 0.0 ～ 1.0
-	float r2 = (float)genrand_real1();	// 0.0 ～ 1.0
+	float r1 = rng.gen_real1();	// 0.0 ～ 1.0
+	float r2 = rng.gen_real1();	// 0.0 ～ 1.0
 	
 	float cos_theta = powf(r1, 1.0f / (shine + 1.0f));
 	float sin_theta = sqrtf(1.0f - cos_theta * cos_theta);
@@ -101,3 +102,32 @@ void random_vector_cosweight(Vector3* v, const Vector3* in, const Vector3* n, fl
 
 	calc_reflection(v, &rin, n);
 }
+
+/*!
+	@brief		random_vector_cosweight() で v を選ぶ確率密度
+	@param[i]	v: 方向
+	@param[i]	n: 法線ベクトル
+	@note		立体角当たり
+ */
+float pdf_cosweight(const Vector3* v, const Vector3* n)
+{
+	const float cos_theta = Vec3InnerProduct(v, n);
+	return (cos_theta > 0.0f)? cos_theta / PI : 0.0f;
+}
+
+/*!
+	@brief		random_vector_cosweight() で v を選ぶ確率密度
+	@param[i]	v: 方向
+	@param[i]	in:入射ベクトル(予め反転しておくこと)
+	@param[i]	n: 法線ベクトル
+	@param[i]	shine: 
+	@note		立体角当たり
+				反射は角度を変えないので、in の周りに選んだ方向と正反射ベクトルの周りの v は同じ密度になる
+ */
+float pdf_cosweight(const Vector3* v, const Vector3* in, const Vector3* n, float shine)
+{
+	Vector3 r;
+	calc_reflection(&r, in, n);
+	const float cos_theta = Vec3InnerProduct(v, &r);
+	return (cos_theta > 0.0f)? (shine + 1.0f) / PI2 * powf(cos_theta, shine) : 0.0f;
+}
@@ -8,10 +8,13 @@
 #define __REFLECTION_H_
 
 #include "lib/math/vector.h"
+#include "lib/math/random.h"
 
 void calc_tangent_binormal(Vector3* t, Vector3* b, const Vector3* n);
 void calc_reflection(Vector3* r, const Vector3* in, const Vector3* n);
-void random_vector_cosweight(Vector3* v, const Vector3* n);
-void random_vector_cosweight(Vector3* v, const Vector3* in, const Vector3* n, float shine);
+void random_vector_cosweight(Vector3* v, const Vector3* n, Random& rng);
+void random_vector_cosweight(Vector3* v, const Vector3* in, const Vector3* n, float shine, Random& rng);
+float pdf_cosweight(const Vector3* v, const Vector3* n);
+float pdf_cosweight(const Vector3* v, const Vector3* in, const Vector3* n, float shine);
 
 #endif // !__REFLECTION_H_
\ No newline at end of file
@@ -1,5 +1,7 @@
 
-#include "lib/math/random.h"
+#include <vector>
+#include <algorithm>
+#include <functional>
 #include "common.h"
 #include "renderer.h"
 #include "reflection.h"
@@ -10,6 +12,7 @@
 /*!
 	@brief	描画スレッド用ワーク
 	@class	RenderWork
+	@note	フレームバッファを TILE_SIZE 四方に分割したタイル 1 枚分
  */
 class RenderWork : public Work
 {
@@ -22,13 +25,69 @@ public:
 		this->h = h;
 		ref_renderer = renderer;
 	}
+	void execute(std::size_t)
+	{
+		ref_renderer->Render(x, y, x + w, y + h);
+	}
 public:
 	std::size_t x, y, w, h;
 	Renderer* ref_renderer;
 };
 #endif // USE_MULTI_THREAD
 
-Renderer::Renderer() : scene(NULL), camera(NULL), max_sampling(1), max_depth(3)
+#ifdef USE_MIS
+/*!
+	@brief		MIS の重み
+	@param[i]	pdf: 重みを求めるサンプリング方法で選ぶ確率密度
+	@param[i]	other_pdf: 同じ方向をもう一方のサンプリング方法で選ぶ確率密度
+	@note		MIS_HEURISTIC で切り替える(パワーヒューリスティックは指数 2)
+ */
+static float mis_weight(float pdf, float other_pdf)
+{
+ #if MIS_HEURISTIC == 0
+	return pdf / (pdf + other_pdf);
+ #else
+	return (pdf * pdf) / (pdf * pdf + other_pdf * other_pdf);
+ #endif // MIS_HEURISTIC == 0
+}
+#endif // USE_MIS
+
+#ifdef USE_WAVEFRONT
+/*!
+	@brief	ウェーブフロントで辿る経路
+ */
+struct WavefrontPath
+{
+	Ray			ray;
+	Color		throughput;
+	Color		radiance;	//!< ここまでに集めた輝度
+	Random		rng;
+	float		pdf;		//!< ray を反射方向のサンプリングで選んだ確率密度(視線は 0)
+	std::size_t	pixel;		//!< タイル内の画素
+	std::size_t	depth;
+};
+
+/*!
+	@brief	ウェーブフロントの交差判定の結果
+	@note	材質の順に並べて陰影計算する
+ */
+struct WavefrontHit
+{
+	const Material*		mtrl;	//!< 当たらなければ NULL
+	PrimitiveArray::Id	id;
+	Primitive::Param	param;
+	std::size_t			path;
+
+	bool operator < (const WavefrontHit& hit) const
+	{
+		if(mtrl != hit.mtrl)
+			return std::less<const Material*>()(mtrl, hit.mtrl);
+		return path < hit.path;
+	}
+};
+#endif // USE_WAVEFRONT
+
+Renderer::Renderer() : scene(NULL), camera(NULL), max_sampling(1), max_depth(3), max_thread(0), seed(0)
 {
 }
 
@@ -66,24 +125,24 @@ void Renderer::Render()
 	FrameBufferFP32& fb = camera->GetFrameBuffer();
 	const std::size_t w = fb.width();
 	const std::size_t h = fb.height();
+	const std::size_t num_x = (w + TILE_SIZE - 1) / TILE_SIZE;
+	const std::size_t num_y = (h + TILE_SIZE - 1) / TILE_SIZE;
 
-	RenderWork work[4];
-	work[0].Set(0,   0,   w/2, h/2, this);
-	work[1].Set(w/2, 0,   w/2, h/2, this);
-	work[2].Set(0,   h/2, w/2, h/2, this);
-	work[3].Set(w/2, h/2, w/2, h/2, this);
-
-	WorkPile* wp = new WorkPile();
-	wp->request(&work[0]);
-	wp->request(&work[1]);
-	wp->request(&work[2]);
-	wp->request(&work[3]);
-
-	wp->start(Renderer::worker_thread, 4);
-	while(wp->get_left_work() > 0)
-		::Sleep(10);
-
-	delete wp;
+	// 端のタイルは画面内に収まるように切り詰める
+	std::vector<RenderWork> works(num_x * num_y);
+	WorkPile wp(max_thread);
+	for(std::size_t ty = 0; ty < num_y; ty++)
+	{
+		for(std::size_t tx = 0; tx < num_x; tx++)
+		{
+			const std::size_t x = tx * TILE_SIZE;
+			const std::size_t y = ty * TILE_SIZE;
+			RenderWork& work = works[ty * num_x + tx];
+			work.Set(x, y, std::min(w - x, (std::size_t)TILE_SIZE), std::min(h - y, (std::size_t)TILE_SIZE), this);
+			wp.request(&work);
+		}
+	}
+	wp.run();
  #endif // !USE_MULTI_THREAD
 }
 
@@ -93,9 +152,13 @@ void Renderer::Render()
 	@param[i]	by: 開始座標
 	@param[i]	ex: 終了座標
 	@param[i]	yx: 終了座標
+	@note		乱数系列は画素毎に独立させているので、スレッド数や描画順によらず同じ結果になる
  */
 void Renderer::Render(std::size_t bx, std::size_t by, std::size_t ex, std::size_t ey)
 {
+ #ifdef USE_WAVEFRONT
+	RenderWavefront(bx, by, ex, ey);
+ #else
 	FrameBufferFP32& fb = camera->GetFrameBuffer();
 	const std::size_t w = fb.width();
 	const std::size_t h = fb.height();
@@ -106,19 +169,21 @@ void Renderer::Render(std::size_t bx, std::size_t by, std::size_t ex, std::size_
 	Ray ray;
 	ray.org = camera->GetPosture().row_vector3(3);
 
+	Random rng;
 	Color col, accum;
 	for(std::size_t y = by; y < ey; y++)
 	{
 		FrameBufferFP32::Data* p = fb.ptr(y) + bx;
 		for(std::size_t x = bx; x < ex; x++)
 		{
+			rng.init(seed, (unsigned long long)(y * w + x));
 			ColorSet(&accum, 0.0f, 0.0f, 0.0f);
 			for(std::size_t s = 0; s < smapling; s++)
 			{
-				const float sub_x = ((float)x + ((float)genrand_real1() - 0.5f)) * inv_w;
-				const float sub_y = ((float)y + ((float)genrand_real1() - 0.5f)) * inv_h;
-				camera->ShootRay(ray, sub_x, sub_y);
-				Trace(col, ray, 0);
+				const float sub_x = ((float)x + (rng.gen_real1() - 0.5f)) * inv_w;
+				const float sub_y = ((float)y + (rng.gen_real1() - 0.5f)) * inv_h;
+				camera->ShootRay(ray, sub_x, sub_y, rng);
+				Trace(col, ray, rng);
 				ColorAdd3(&accum, &accum, &col);
 			}
 			ColorScale3(&col, &accum, 1.0f/(float)smapling);
@@ -129,102 +194,362 @@ void Renderer::Render(std::size_t bx, std::size_t by, std::size_t ex, std::size_
 			p++;		
 		}
 	}
+ #endif // USE_WAVEFRONT
 }
 
+#ifdef USE_WAVEFRONT
+/*!
+	@brief		幅優先の描画
+	@param[i]	bx: 開始座標
+	@param[i]	by: 開始座標
+	@param[i]	ex: 終了座標
+	@param[i]	yx: 終了座標
+	@note		タイル内の WAVEFRONT_SIZE 本の経路を反射の段毎にまとめて進める
+				交差判定 -> 材質順の陰影計算 -> 光源方向の遮蔽判定 の順に段を処理し、続く経路だけを次の段に残す
+				交差判定と遮蔽判定は段の光線をまとめて高速化構造に渡す
+				乱数系列は経路毎に独立させ、輝度は経路の順に足すので、処理の順によらず同じ結果になる
+ */
+void Renderer::RenderWavefront(std::size_t bx, std::size_t by, std::size_t ex, std::size_t ey)
+{
+	const PrimitiveArray& prims = scene->GetPrimitiveArray();
+	FrameBufferFP32& fb = camera->GetFrameBuffer();
+	const std::size_t w = fb.width();
+	const std::size_t h = fb.height();
+	const float inv_w = 1.0f / (float)w;
+	const float inv_h = 1.0f / (float)h;
+	const std::size_t tile_w = ex - bx;
+	const std::size_t num_pixels = tile_w * (ey - by);
+	const std::size_t num_paths = num_pixels * max_sampling;
+
+	std::vector<Color> accum(num_pixels);
+	for(std::size_t i = 0; i < num_pixels; i++)
+		ColorSet(&accum[i], 0.0f, 0.0f, 0.0f);
+
+	std::vector<WavefrontPath> paths;
+	std::vector<WavefrontHit> hits;
+	std::vector<ShadowRay> shadows;
+	std::vector<std::size_t> active, next;
+	RayBatch rays;
+	HitBatch results;
+	for(std::size_t first = 0; first < num_paths; first += WAVEFRONT_SIZE)
+	{
+		// 視線(隣の画素の視線が並ぶように、サンプル番号毎にタイル内の画素を順に作る)
+		const std::size_t num = std::min(num_paths - first, (std::size_t)WAVEFRONT_SIZE);
+		paths.resize(num);
+		active.resize(num);
+		for(std::size_t i = 0; i < num; i++)
+		{
+			WavefrontPath& path = paths[i];
+			const std::size_t sample = (first + i) / num_pixels;
+			path.pixel = (first + i) % num_pixels;
+			const std::size_t x = bx + path.pixel % tile_w;
+			const std::size_t y = by + path.pixel / tile_w;
+			path.rng.init(seed, (unsigned long long)((y * w + x) * max_sampling + sample));
+			const float sub_x = ((float)x + (path.rng.gen_real1() - 0.5f)) * inv_w;
+			const float sub_y = ((float)y + (path.rng.gen_real1() - 0.5f)) * inv_h;
+			camera->ShootRay(path.ray, sub_x, sub_y, path.rng);
+			ColorSet(&path.throughput, 1.0f, 1.0f, 1.0f);
+			ColorSet(&path.radiance, 0.0f, 0.0f, 0.0f);
+			path.pdf = 0.0f;
+			path.depth = 0;
+			active[i] = i;
+		}
+
+		while(!active.empty())
+		{
+			// 交差判定(最大深度に達した経路は判定せずに背景を足す)
+			rays.Clear();
+			for(std::size_t i = 0; i < active.size(); i++)
+			{
+				if(paths[active[i]].depth < max_depth)
+					rays.Add(paths[active[i]].ray);
+			}
+			FindNearest(rays, results);
+			hits.resize(active.size());
+			for(std::size_t i = 0, j = 0; i < active.size(); i++)
+			{
+				WavefrontHit& hit = hits[i];
+				hit.path = active[i];
+				hit.mtrl = NULL;
+				if(paths[hit.path].depth >= max_depth)
+					continue;
+				if(results.found[j])
+				{
+					hit.id = results.id[j];
+					hit.param = results.param[j];
+					hit.mtrl = prims.GetMaterial(hit.param, hit.id);
+				}
+				j++;
+			}
+
+			// 陰影計算(同じ材質をまとめて処理する)
+			std::sort(hits.begin(), hits.end());
+			shadows.clear();
+			next.clear();
+			for(std::size_t i = 0; i < hits.size(); i++)
+			{
+				const WavefrontHit& hit = hits[i];
+				WavefrontPath& path = paths[hit.path];
+				Color col;
+				if(!hit.mtrl)
+				{
+					ColorModulate3(&col, &path.throughput, &scene->GetBGColor());
+					ColorAdd3(&path.radiance, &path.radiance, &col);
+					continue;
+				}
+
+				Vertex v;
+				prims.CalcVertex(v, hit.param, path.ray, hit.id);
+				Emittance(col, path.ray, path.pdf, hit.param, hit.id, *hit.mtrl);
+ #ifdef USE_LOCAL_ILLUMINATION
+				const std::size_t num_shadows = shadows.size();
+				Color direct;
+				DirectLighting(direct, path.ray, v, *hit.mtrl, path.depth, path.rng, &shadows);
+				ColorAdd3(&col, &col, &direct);
+				for(std::size_t j = num_shadows; j < shadows.size(); j++)
+				{
+					ColorModulate3(&shadows[j].col, &shadows[j].col, &path.throughput);
+					shadows[j].path = hit.path;
+				}
+ #endif // USE_LOCAL_ILLUMINATION
+				ColorModulate3(&col, &col, &path.throughput);
+				ColorAdd3(&path.radiance, &path.radiance, &col);
+
+				if(NextRay(path.ray, path.throughput, path.pdf, path.depth, v, *hit.mtrl, path.rng))
+				{
+					path.depth++;
+					next.push_back(hit.path);
+				}
+			}
+
+			// 光源方向の遮蔽判定
+			rays.Clear();
+			for(std::size_t i = 0; i < shadows.size(); i++)
+				rays.Add(shadows[i].ray, shadows[i].t_max);
+			FindOccluder(rays, results);
+			for(std::size_t i = 0; i < shadows.size(); i++)
+			{
+				const ShadowRay& shadow = shadows[i];
+				if(!results.found[i])
+					ColorAdd3(&paths[shadow.path].radiance, &paths[shadow.path].radiance, &shadow.col);
+			}
+			active.swap(next);
+		}
+
+		for(std::size_t i = 0; i < num; i++)
+			ColorAdd3(&accum[paths[i].pixel], &accum[paths[i].pixel], &paths[i].radiance);
+	}
+
+	const float inv_sampling = 1.0f / (float)max_sampling;
+	for(std::size_t y = by; y < ey; y++)
+	{
+		FrameBufferFP32::Data* p = fb.ptr(y) + bx;
+		for(std::size_t x = bx; x < ex; x++)
+		{
+			Color col;
+			ColorScale3(&col, &accum[(y - by) * tile_w + (x - bx)], inv_sampling);
+			p->ch[0] = col.r;
+			p->ch[1] = col.g;
+			p->ch[2] = col.b;
+			p++;
+		}
+	}
+}
+#endif // USE_WAVEFRONT
+
 /*!
 	@brief		トレース
 	@param[o]	out: 出力輝度
-	@param[i]	ray: 光線
-	@param[i]	depth: 深度
+	@param[i]	ray: 視線
+	@param[i]	rng: 乱数生成器
+	@note		反射の度に再帰せず、経路の寄与(スループット)を掛けながら 1 本の経路を辿る
+				RR_DEPTH 以降はスループットに比例する確率で打ち切り、残った経路はその確率で割って補う
  */
-void Renderer::Trace(Color& out, const Ray& ray, std::size_t depth)
+void Renderer::Trace(Color& out, const Ray& ray, Random& rng)
 {
-	Primitive* prim = NULL;
+	const PrimitiveArray& prims = scene->GetPrimitiveArray();
+	PrimitiveArray::Id id;
 	Primitive::Param param;
 
-	if((depth >= max_depth) || !FindNearest(&prim, param, ray))
+	Ray cur = ray;
+	float pdf = 0.0f;	// 反射方向のサンプリングで cur を選んだ確率密度(立体角当たり、視線は 0)
+	Color throughput, col;
+	ColorSet(&throughput, 1.0f, 1.0f, 1.0f);
+	ColorSet(&out, 0.0f, 0.0f, 0.0f);
+	for(std::size_t depth = 0; ; depth++)
 	{
-		out = scene->GetBGColor();
-		return;
-	}
+		if((depth >= max_depth) || !FindNearest(id, param, cur))
+		{
+			ColorModulate3(&col, &throughput, &scene->GetBGColor());
+			ColorAdd3(&out, &out, &col);
+			return;
+		}
 
-	Vertex v;
-	prim->CalcVertex(v, param, ray);
-	Material* mtrl = prim->GetMaterial();
+		Vertex v;
+		prims.CalcVertex(v, param, cur, id);
+		const Material* mtrl = prims.GetMaterial(param, id);
 
-	// emittance
-	out = mtrl->e;
+		Emittance(col, cur, pdf, param, id, *mtrl);
  #ifdef USE_LOCAL_ILLUMINATION
-	// direct lighting
-	Color direct;
-	DirectLighting(direct, ray, v, *mtrl);
-	ColorAdd3(&out, &out, &direct);
+		Color direct;
+		DirectLighting(direct, cur, v, *mtrl, depth, rng);
+		ColorAdd3(&col, &col, &direct);
  #endif // USE_LOCAL_ILLUMINATION
- #ifdef USE_GLOBAL_ILLUMINATION
-	// indirect lighting
-	Color indirect;
-	IndirectLighting(indirect, ray, v, *mtrl, depth);
-	ColorAdd3(&out, &out, &indirect);
- #endif // USE_GLOBAL_ILLUMINATION
+		ColorModulate3(&col, &col, &throughput);
+		ColorAdd3(&out, &out, &col);
+
+		if(!NextRay(cur, throughput, pdf, depth, v, *mtrl, rng))
+			return;
+	}
 }
 
 /*!
 	@brief		最近傍チェック
-	@param[o]	prim: プリミティブ
+	@param[o]	id: プリミティブ
 	@param[o]	param: パラメータ
 	@param[i]	ray: 光線
  */
-bool Renderer::FindNearest(Primitive** prim, Primitive::Param& param, const Ray& ray)
+bool Renderer::FindNearest(PrimitiveArray::Id& id, Primitive::Param& param, const Ray& ray)
 {
- #ifdef USE_KDTREE
-	const KdTree* kdtree = scene->GetKdTree();
-	return kdtree->Traverse(prim, param, ray);
+ #ifdef USE_ACCELERATOR
+	const Accelerator* accel = scene->GetAccelerator();
+	return accel->Traverse(id, param, ray);
  #else
 	float t = FLT_MAX;
-	Primitive::Param par;
-
-	(*prim) = NULL;
+	bool found = false;
 
-	const PrimitiveList& list = scene->GetPrimitiveList();
-	for(PrimitiveList::const_iterator it = list.begin(); it != list.end(); it++)
+	const PrimitiveArray& prims = scene->GetPrimitiveArray();
+	const std::size_t num_prims = prims.size();
+	for(std::size_t i = 0; i < num_prims; i++)
 	{
-		if((*it)->Intersect(par, ray))
-		{
-			if(par.t < t)
-			{
-				(*prim) = (*it);
-				param = par;
-				t = par.t;
-			}
-		}
+		const PrimitiveArray::Id n = prims.GetId(i);
+		if(prims.IntersectNearest(id, param, t, &n, &n + 1, ray))
+			found = true;
 	}
-	return (*prim)? true : false;
- #endif // USE_KDTREE
+	return found;
+ #endif // USE_ACCELERATOR
 }
 
 /*!
 	@brief		光源方向への遮蔽物チェック
-	@param[o]	t: 最近傍
 	@param[i]	ray: 光線
+	@param[i]	t_max: 光源までの距離
+	@note		最も近い交差は求めず、[0, t_max] に何かあった時点で戻る
  */
-bool Renderer::FindOccluder(float& t, const Ray& ray)
+bool Renderer::FindOccluder(const Ray& ray, float t_max)
 {
-	Primitive* prim = NULL;
-	Primitive::Param param;
-
- #ifdef USE_KDTREE
-	const KdTree* kdtree = scene->GetKdTree();
-	bool ret = kdtree->Traverse(&prim, param, ray);
-	t = param.t;
-	return ret;
+ #ifdef USE_ACCELERATOR
+	const Accelerator* accel = scene->GetAccelerator();
+	return accel->Occluded(ray, t_max);
  #else
-	if(FindNearest(&prim, param, ray))
+	const PrimitiveArray& prims = scene->GetPrimitiveArray();
+	const std::size_t num_prims = prims.size();
+	for(std::size_t i = 0; i < num_prims; i++)
 	{
-		t = param.t;
-		return true;
+		const PrimitiveArray::Id id = prims.GetId(i);
+		if(prims.IntersectAny(&id, &id + 1, ray, t_max))
+			return true;
 	}
 	return false;
- #endif // USE_KDTREE
+ #endif // USE_ACCELERATOR
+}
+
+/*!
+	@brief		光線の列の最近傍チェック
+	@param[io]	rays: 光線の列(判定の順に番号を並べ替える)
+	@param[o]	hits: 光線毎の交差
+ */
+void Renderer::FindNearest(RayBatch& rays, HitBatch& hits)
+{
+ #ifdef USE_ACCELERATOR
+	const Accelerator* accel = scene->GetAccelerator();
+	accel->IntersectStream(rays, hits);
+ #else
+	hits.Resize(rays.size());
+	Ray ray;
+	for(std::size_t i = 0; i < rays.size(); i++)
+	{
+		rays.GetRay(ray, i);
+		hits.found[i] = FindNearest(hits.id[i], hits.param[i], ray)? 1 : 0;
+	}
+ #endif // USE_ACCELERATOR
+}
+
+/*!
+	@brief		光線の列の遮蔽物チェック
+	@param[io]	rays: 光線の列(判定の順に番号を並べ替える)
+	@param[o]	hits: 光線毎の遮蔽の有無(found のみ)
+ */
+void Renderer::FindOccluder(RayBatch& rays, HitBatch& hits)
+{
+ #ifdef USE_ACCELERATOR
+	const Accelerator* accel = scene->GetAccelerator();
+	accel->OccludedStream(rays, hits);
+ #else
+	hits.Resize(rays.size());
+	Ray ray;
+	for(std::size_t i = 0; i < rays.size(); i++)
+	{
+		rays.GetRay(ray, i);
+		hits.found[i] = FindOccluder(ray, rays.t_max[i])? 1 : 0;
+	}
+ #endif // USE_ACCELERATOR
+}
+
+/*!
+	@brief		遮蔽判定
+	@param[i]	ray: 光源方向の光線
+	@param[i]	t_max: 光源までの距離
+	@param[i]	col: 遮蔽されなければ足す寄与
+	@param[io]	queue: 遮蔽判定を後でまとめて行う場合の積み先(NULL ならすぐに判定する)
+	@retval		true: 寄与を足さない(遮蔽されたか、queue に積んだ)
+ */
+bool Renderer::TestOcclusion(const Ray& ray, float t_max, const Color& col, std::vector<ShadowRay>* queue)
+{
+	if(!queue)
+		return FindOccluder(ray, t_max);
+
+	ShadowRay shadow;
+	shadow.ray = ray;
+	shadow.t_max = t_max;
+	shadow.col = col;
+	shadow.path = 0;
+	queue->push_back(shadow);
+	return true;
+}
+
+/*!
+	@brief		当たった点の発光
+	@param[o]	out: 出力輝度
+	@param[i]	ray: 当たった光線
+	@param[i]	pdf: ray を反射方向のサンプリングで選んだ確率密度(視線は 0)
+	@param[i]	param: パラメータ
+	@param[i]	id: プリミティブ
+	@param[i]	mtrl: マテリアル
+	@note		発光三角形は直接照明でも選ぶので、反射方向のサンプリングで当たった分は重みを掛ける
+ */
+void Renderer::Emittance(Color& out, const Ray& ray, float pdf, const Primitive::Param& param, PrimitiveArray::Id id, const Material& mtrl)
+{
+	out = mtrl.e;
+ #ifdef USE_LOCAL_ILLUMINATION
+	Vector3 face_n;
+	if((pdf > 0.0f) && scene->GetPrimitiveArray().CalcFaceNormal(face_n, param, id))
+	{
+  #ifdef USE_MIS
+		const float cos_l = -Vec3InnerProduct(&face_n, &ray.dir);
+		const float light_pdf = (cos_l > 0.0f)? scene->GetEmitterTable().CalcPdf(mtrl.e) * param.t * param.t / cos_l : 0.0f;
+		ColorScale3(&out, &out, mis_weight(pdf, light_pdf));
+  #else
+		(void)ray;
+		ColorSet(&out, 0.0f, 0.0f, 0.0f);
+  #endif // USE_MIS
+	}
+ #else
+	(void)ray;
+	(void)pdf;
+	(void)param;
+	(void)id;
+ #endif // USE_LOCAL_ILLUMINATION
 }
 
 /*!
@@ -232,8 +557,14 @@ bool Renderer::FindOccluder(float& t, const Ray& ray)
 	@param[o]	out: 出力輝度
 	@param[i]	v: 着目点
 	@param[i]	mtrl: マテリアル	
+	@param[i]	depth: 深度
+	@param[i]	rng: 乱数生成器
+	@param[io]	queue: 遮蔽判定を後でまとめて行う場合の積み先(NULL ならすぐに判定する)
+	@note		発光三角形は放射束に比例して 1 点を選ぶ
+			USE_MIS では拡散反射と鏡面反射をそれぞれ反射方向のサンプリングと MIS で合成する
+			そうでなければ拡散反射の分だけを数え、鏡面反射の分は間接照明の光線が当たったときに数える
  */
-void Renderer::DirectLighting(Color& out, const Ray& ray, const Vertex& v, const Material& mtrl)
+void Renderer::DirectLighting(Color& out, const Ray& ray, const Vertex& v, const Material& mtrl, std::size_t depth, Random& rng, std::vector<ShadowRay>* queue)
 {
 	// 自己遮蔽で引っかかるため法線方向に押し出す
 	const float epsilon = 0.001f;
@@ -243,6 +574,11 @@ void Renderer::DirectLighting(Color& out, const Ray& ray, const Vertex& v, const
 	const LightList& list = scene->GetLightList();
 	for(LightList::const_iterator it = list.begin(); it != list.end(); it++)
 	{
+		// lighting
+		Color col;
+		(*it)->Lighting(col, ray, v, mtrl);
+		if(ColorLuminance(&col) <= 0.0f)
+			continue;
 		// occlusion test
  #ifdef USE_OCCLUSION_TEST
 		if((*it)->type == Light::Type_Point)
@@ -254,8 +590,7 @@ void Renderer::DirectLighting(Color& out, const Ray& ray, const Vertex& v, const
 			Vec3Scale(&to_lig.dir, &to_lig.dir, 1.0f/d);
 			Vec3Scale(&to_lig.org, &to_lig.dir, epsilon);
 			Vec3Add(&to_lig.org, &v.p, &to_lig.org);
-			float t;
-			if(FindOccluder(t, to_lig) && (t <= (d + epsilon)))
+			if(TestOcclusion(to_lig, d + epsilon, col, queue))
 				continue;
 		}
 		else
@@ -263,86 +598,164 @@ void Renderer::DirectLighting(Color& out, const Ray& ray, const Vertex& v, const
 			to_lig.dir = -(*it)->dir;
 			Vec3Scale(&to_lig.org, &to_lig.dir, epsilon);
 			Vec3Add(&to_lig.org, &v.p, &to_lig.org);
-			float t;
-			if(FindOccluder(t, to_lig))
+			if(TestOcclusion(to_lig, FLT_MAX, col, queue))
 				continue;
 		}
  #endif // USE_OCCLUSION_TEST
-		// lighting
-		Color col;
-		(*it)->Lighting(col, ray, v, mtrl);
 		ColorAdd3(&out, &out, &col);
 	}
+
+	// emitter
+	const EmitterTable& emitters = scene->GetEmitterTable();
+ #ifdef USE_MIS
+	if(emitters.empty() || ((ColorLuminance(&mtrl.pd) <= 0.0f) && (ColorLuminance(&mtrl.ps) <= 0.0f)))
+		return;
+ #else
+	if(emitters.empty() || (ColorLuminance(&mtrl.pd) <= 0.0f))
+		return;
+ #endif // USE_MIS
+	Vector3 p;
+	const EmitterTable::Emitter& emitter = emitters.Sample(p, rng);
+	Vec3Subtract(&to_lig.dir, &p, &v.p);
+	const float d_sq = Vec3InnerProduct(&to_lig.dir, &to_lig.dir);
+	const float d = sqrtf(d_sq);
+	if(d < epsilon * 2.0f)
+		return;
+	Vec3Scale(&to_lig.dir, &to_lig.dir, 1.0f/d);
+	const float cos_v = Vec3InnerProduct(&v.n, &to_lig.dir);
+	const float cos_l = -Vec3InnerProduct(&emitter.n, &to_lig.dir);	// 三角形は裏から当たらないので表側だけ光る
+	if((cos_v <= 0.0f) || (cos_l <= 0.0f))
+		return;
+	// 立体角当たりの確率密度
+	const float light_pdf = emitters.CalcPdf(emitter.e) * d_sq / cos_l;
+	Color brdf;
+ #ifdef USE_MIS
+	// 次の反射が無ければ反射方向のサンプリングでは当たらないので、直接照明だけで数える
+  #ifdef USE_GLOBAL_ILLUMINATION
+	const bool combine = (depth + 1 < max_depth);
+  #else
+	(void)depth;
+	const bool combine = false;
+  #endif // USE_GLOBAL_ILLUMINATION
+	ColorScale3(&brdf, &mtrl.pd, (combine? mis_weight(light_pdf, mtrl.kd * pdf_cosweight(&to_lig.dir, &v.n)) : 1.0f) / PI);
+	// 鏡面反射の brdf は ps * (shine + 2) / (shine + 1) * (反射方向のサンプリングの確率密度)
+	const Vector3 in = -ray.dir;
+	const float spec_pdf = pdf_cosweight(&to_lig.dir, &in, &v.n, mtrl.shine);
+	if(spec_pdf > 0.0f)
+	{
+		Color spec;
+		ColorScale3(&spec, &mtrl.ps, (mtrl.shine + 2.0f)/(mtrl.shine + 1.0f) * spec_pdf * (combine? mis_weight(light_pdf, mtrl.ks * spec_pdf) : 1.0f));
+		ColorAdd3(&brdf, &brdf, &spec);
+	}
+ #else
+	(void)depth;
+	ColorScale3(&brdf, &mtrl.pd, 1.0f / PI);
+ #endif // USE_MIS
+	// col = (brdf * e * cosθ) / pdf
+	Color col;
+	ColorModulate3(&col, &brdf, &emitter.e);
+	ColorScale3(&col, &col, cos_v / light_pdf);
+ #ifdef USE_OCCLUSION_TEST
+	// 選んだ点の三角形自身に当たらないように手前で止める
+	Vec3Scale(&to_lig.org, &to_lig.dir, epsilon);
+	Vec3Add(&to_lig.org, &v.p, &to_lig.org);
+	if(TestOcclusion(to_lig, d - epsilon * 2.0f, col, queue))
+		return;
+ #else
+	(void)queue;
+ #endif // USE_OCCLUSION_TEST
+	ColorAdd3(&out, &out, &col);
 }
 
 /*!
-	@brief		間接照明計算
-	@param[o]	out: 出力輝度
+	@brief		経路を次の反射に進める
+	@param[io]	ray: 当たった光線(反射した光線に置き換える)
+	@param[io]	throughput: 経路のスループット
+	@param[o]	pdf: 反射方向を選んだ確率密度
+	@param[i]	depth: 深度
+	@param[i]	v: 着目点
+	@param[i]	mtrl: マテリアル
+	@param[i]	rng: 乱数生成器
+	@retval		false: 経路が終わった
+ */
+bool Renderer::NextRay(Ray& ray, Color& throughput, float& pdf, std::size_t depth, const Vertex& v, const Material& mtrl, Random& rng)
+{
+ #ifdef USE_GLOBAL_ILLUMINATION
+	// russian roulette
+	if(depth >= RR_DEPTH)
+	{
+		const float q = std::min(std::max(throughput.r, std::max(throughput.g, throughput.b)), 1.0f);
+		if(rng.gen_real1() >= q)
+			return false;
+		ColorScale3(&throughput, &throughput, 1.0f / q);
+	}
+	// indirect lighting
+	Ray next;
+	Color weight;
+	if(!SampleReflection(next, weight, pdf, ray, v, mtrl, rng))
+		return false;
+	ColorModulate3(&throughput, &throughput, &weight);
+	ray = next;
+	return true;
+ #else
+	(void)ray;
+	(void)throughput;
+	(void)pdf;
+	(void)depth;
+	(void)v;
+	(void)mtrl;
+	(void)rng;
+	return false;
+ #endif // USE_GLOBAL_ILLUMINATION
+}
+
+/*!
+	@brief		次の反射方向
+	@param[o]	next: 反射した光線
+	@param[o]	weight: 経路のスループットに掛ける値(brdf * cosθ / 確率密度)
+	@param[o]	pdf: next を選んだ確率密度(立体角当たり、拡散反射か鏡面反射を選ぶ確率を含む)
+	@param[i]	ray: 入射した光線
 	@param[i]	v: 着目点
 	@param[i]	mtrl: マテリアル	
-	@param[i]	depth: 深度
+	@param[i]	rng: 乱数生成器
+	@retval		false: 吸収された
+	@note		拡散反射と鏡面反射を kd, ks の確率で選ぶ
+				pdf は発光三角形に当たった場合の重みに使い、直接照明で数えない鏡面反射では 0 にする
  */
-void Renderer::IndirectLighting(Color& out, const Ray& ray, const Vertex& v, const Material& mtrl, std::size_t depth)
+bool Renderer::SampleReflection(Ray& next, Color& weight, float& pdf, const Ray& ray, const Vertex& v, const Material& mtrl, Random& rng)
 {
-	ColorSet(&out, 0.0f, 0.0f, 0.0f);
+	// 自己遮蔽で引っかかるため法線方向に押し出す
+	const float epsilon = 0.001f;
+	Vec3Scale(&next.org, &v.n, epsilon);
+	Vec3Add(&next.org, &v.p, &next.org);
 
-	const float e = (float)genrand_real1();
+	const float e = rng.gen_real1();
 	if(e < mtrl.kd)
 	{
-		Ray ray2;	// 2nd ray
-		ray2.org = v.p;
-		random_vector_cosweight(&ray2.dir, &v.n);
-
-		Color ref;
-		Trace(ref, ray2, depth+1);
+		random_vector_cosweight(&next.dir, &v.n, rng);
+		pdf = mtrl.kd * pdf_cosweight(&next.dir, &v.n);
 
-		// out += (brdf * ref * cosθ) / (pdf * kd)
-		Color temp;
-		ColorModulate3(&temp, &mtrl.pd, &ref);
-		ColorScale3(&out, &temp, 1.0f / mtrl.kd);
+		// weight = (brdf * cosθ) / (pdf * kd)
+		ColorScale3(&weight, &mtrl.pd, 1.0f / mtrl.kd);
+		return true;
 	}
 	else
 	if(e < (mtrl.kd + mtrl.ks))
 	{
-		// 
-		Vector3 in = -ray.dir;
-		Ray ray2;
-		ray2.org = v.p;
-		random_vector_cosweight(&ray2.dir, &in, &v.n, mtrl.shine);
-		float cost= Vec3InnerProduct(&ray2.dir, &v.n);
+		const Vector3 in = -ray.dir;
+		random_vector_cosweight(&next.dir, &in, &v.n, mtrl.shine, rng);
+		float cost= Vec3InnerProduct(&next.dir, &v.n);
 		if(cost <= 0.0f)
-			return;
-
-		Color ref;
-		Trace(ref, ray2, depth+1);
-
-		// out += (brdf * ref * cosθ) / (pdf * ks)
-		Color temp;
-		ColorScale3(&temp, &mtrl.ps, (mtrl.shine + 2.0f)/(mtrl.shine + 1.0f) * cost);
-		ColorScale3(&out, &temp, 1.0f / mtrl.ks);
-	}
-}
-
-#ifdef USE_MULTI_THREAD
-/*!
-	@brief		描画用ワーカースレッド
-	@param[i]	arg
- */
-unsigned __stdcall Renderer::worker_thread(void* arg)
-{
-	WorkPile* wp = (WorkPile*)arg;
-	RenderWork* work;
+			return false;
+ #ifdef USE_MIS
+		pdf = mtrl.ks * pdf_cosweight(&next.dir, &in, &v.n, mtrl.shine);
+ #else
+		pdf = 0.0f;	// 鏡面反射の分は直接照明で数えていない
+ #endif // USE_MIS
 
-	while(wp->is_enable())
-	{
-		while((work = dynamic_cast<RenderWork*>(wp->get_work())))
-		{
-			work->set_status(Work::Status_Start);
-			work->ref_renderer->Render(work->x, work->y, work->x + work->w, work->y + work->h);
-			work->set_status(Work::Status_Completed);
-		}
-		::Sleep(10);
+		// weight = (brdf * cosθ) / (pdf * ks)
+		ColorScale3(&weight, &mtrl.ps, (mtrl.shine + 2.0f)/(mtrl.shine + 1.0f) * cost / mtrl.ks);
+		return true;
 	}
-	return 0;	
+	return false;
 }
-#endif // USE_MULTI_THREAD
@@ -12,6 +12,8 @@
 #include "scene.h"
 #include "camera.h"
 #include "config.h"
+#include "ray_batch.h"
+#include "lib/math/random.h"
 #ifdef USE_MULTI_THREAD
 #include "lib/system/thread.h"
 #endif	// USE_MULTI_THREAD
@@ -38,17 +40,35 @@ public:
 
 	void SetMaxSampling(std::size_t sampling){ max_sampling = sampling; }
 	void SetMaxDepth(std::size_t depth){ max_depth = depth; }
+	void SetMaxThread(std::size_t thread){ max_thread = thread; }
+	void SetSeed(unsigned long long seed){ this->seed = seed; }
 
 private:
-	void Trace(Color& out, const Ray& ray, std::size_t depth);
-	bool FindNearest(Primitive** prim, Primitive::Param& param, const Ray& ray);
-	bool FindOccluder(float& t, const Ray& ray);
-	void DirectLighting(Color& out, const Ray& ray, const Vertex& v, const Material& mtrl);
-	void IndirectLighting(Color& out, const Ray& ray, const Vertex& v, const Material& mtrl, std::size_t depth);
+	/*!
+		@brief	後でまとめて遮蔽判定する光源方向の光線
+	 */
+	struct ShadowRay
+	{
+		Ray			ray;
+		float		t_max;	//!< 光源までの距離
+		Color		col;	//!< 遮蔽されなければ足す寄与
+		std::size_t	path;	//!< 寄与を足す経路
+	};
 
- #ifdef USE_MULTI_THREAD
-	static unsigned __stdcall worker_thread(void*);
- #endif	// USE_MULTI_THREAD
+private:
+#ifdef USE_WAVEFRONT
+	void RenderWavefront(std::size_t bx, std::size_t by, std::size_t ex, std::size_t ey);
+#endif // USE_WAVEFRONT
+	void Trace(Color& out, const Ray& ray, Random& rng);
+	bool FindNearest(PrimitiveArray::Id& id, Primitive::Param& param, const Ray& ray);
+	bool FindOccluder(const Ray& ray, float t_max);
+	void FindNearest(RayBatch& rays, HitBatch& hits);
+	void FindOccluder(RayBatch& rays, HitBatch& hits);
+	bool TestOcclusion(const Ray& ray, float t_max, const Color& col, std::vector<ShadowRay>* queue);
+	void Emittance(Color& out, const Ray& ray, float pdf, const Primitive::Param& param, PrimitiveArray::Id id, const Material& mtrl);
+	void DirectLighting(Color& out, const Ray& ray, const Vertex& v, const Material& mtrl, std::size_t depth, Random& rng, std::vector<ShadowRay>* queue = NULL);
+	bool NextRay(Ray& ray, Color& throughput, float& pdf, std::size_t depth, const Vertex& v, const Material& mtrl, Random& rng);
+	bool SampleReflection(Ray& next, Color& weight, float& pdf, const Ray& ray, const Vertex& v, const Material& mtrl, Random& rng);
 
 private:
 	Scene*	scene;
@@ -56,6 +76,8 @@ private:
 
 	std::size_t max_sampling;
 	std::size_t max_depth;
+	std::size_t max_thread;		//!< 0 ならハードウェアの並列数
+	unsigned long long seed;	//!< 乱数の種
 };
 
 #endif // !__RENDERER_H_
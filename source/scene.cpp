@@ -3,62 +3,243 @@
 #include "scene.h"
 
 
-Scene::Scene()
+Scene::Scene() : accel_type(Accelerator::Type_KdTree)
 {
- #ifdef USE_KDTREE
-	kdtree = NULL;
- #endif // USE_KDTREE
+ #ifdef USE_ACCELERATOR
+	accel = NULL;
+ #endif // USE_ACCELERATOR
 	ColorSet(&back_ground, 0.0f, 0.0f, 0.0f);
 }
 
 Scene::~Scene()
 {
- #ifdef USE_KDTREE
-	if(kdtree)
-		delete kdtree;
- #endif // USE_KDTREE
-	for(PrimitiveList::iterator it = prim_list.begin(); it != prim_list.end(); it++)
-	{
-		if((*it))
-			delete (*it);
-	}
-	for(MaterialList::iterator it = mtrl_list.begin(); it != mtrl_list.end(); it++)
+	Clear();
+}
+
+/*!
+	@brief		全て破棄
+ */
+void Scene::Clear()
+{
+ #ifdef USE_ACCELERATOR
+	SAFE_DELETE(accel);
+ #endif // USE_ACCELERATOR
+	prim_array.Clear();
+	MaterialList().swap(mtrl_list);
+	LightList().swap(light_list);
+	ObjectList().swap(obj_list);
+	std::vector<PrimitiveArray::Id>().swap(moved);
+	emitters.Clear();
+	obj_arena.clear();
+	mtrl_arena.clear();
+	light_arena.clear();
+	cache.close();
+}
+
+/*!
+	@brief		材質の作成
+	@note		シーンが破棄するので delete しないこと
+ */
+Material* Scene::CreateMaterial()
+{
+	Material* mtrl = mtrl_arena.create();
+	mtrl_list.push_back(mtrl);
+	return mtrl;
+}
+
+/*!
+	@brief		光源の作成
+	@note		シーンが破棄するので delete しないこと
+ */
+Light* Scene::CreateLight()
+{
+	Light* lig = light_arena.create();
+	light_list.push_back(lig);
+	return lig;
+}
+
+/*!
+	@brief		オブジェクトの作成
+	@note		シーンが破棄するので delete しないこと
+ */
+Object* Scene::CreateObject()
+{
+	Object* obj = obj_arena.create();
+	obj_list.push_back(obj);
+	return obj;
+}
+
+/*!
+	@brief		作成する数の予約
+	@param[i]	num_mtrls: 追加で作成する材質の数
+	@param[i]	num_lights: 追加で作成する光源の数
+	@param[i]	num_objs: 追加で作成するオブジェクトの数
+	@note		数が分かっていれば 1 度の確保で連続して並ぶ
+ */
+void Scene::Reserve(std::size_t num_mtrls, std::size_t num_lights, std::size_t num_objs)
+{
+	mtrl_arena.reserve(num_mtrls);
+	light_arena.reserve(num_lights);
+	obj_arena.reserve(num_objs);
+	mtrl_list.reserve(mtrl_list.size() + num_mtrls);
+	light_list.reserve(light_list.size() + num_lights);
+	obj_list.reserve(obj_list.size() + num_objs);
+}
+
+/*!
+	@brief		構築
+	@param[i]	type: 高速化構造の種類
+	@param[i]	max_thread: 構築に使うスレッド数(0 ならハードウェアの並列数)
+ */
+void Scene::Build(Accelerator::Type type, std::size_t max_thread)
+{
+ #ifndef USE_MULTI_THREAD
+	max_thread = 1;
+ #endif // !USE_MULTI_THREAD
+	accel_type = type;
+	// インスタンスが参照する下位構造を先に作る
+	for(ObjectList::iterator it = obj_list.begin(); it != obj_list.end(); it++)
+		(*it)->Build(type, max_thread);
+
+	prim_array.CalcAABB(aabb);
+ #ifdef USE_ACCELERATOR
+	SAFE_DELETE(accel);
+	accel = Accelerator::Create(type);
+	ASSERT_MSG(accel != NULL, "Scene::Build(): alloc failed");
+	accel->SetMaxThread(max_thread);
+	accel->Build(prim_array, aabb);
+ #endif // USE_ACCELERATOR
+	emitters.Build(prim_array);
+}
+
+/*!
+	@brief		インスタンスの移動
+	@param[i]	index: インスタンスの番号
+	@param[i]	world: ローカル座標からワールド座標への変換(行ベクトル)
+	@retval		false: 番号が範囲外、または変換が逆変換を持たない
+	@note		高速化構造は Update() を呼ぶまで更新しない
+ */
+bool Scene::MoveInstance(std::size_t index, const Matrix44& world)
+{
+	if(index >= prim_array.GetInstances().size())
+		return false;
+	Instance& inst = prim_array.GetInstance(index);
+	if(!inst.Init(inst.GetBaseObject(), world))
+		return false;
+	moved.push_back(PrimitiveArray::MakeId(PrimitiveArray::Type_Instance, index));
+	return true;
+}
+
+/*!
+	@brief		移動したインスタンスに合わせた更新
+	@note		オブジェクトの下位構造は形状が変わらないのでそのまま使う
+				上位構造は境界を更新し、更新できないか品質が落ちた場合だけ作り直す
+				シーンの境界は移動先を含むように広げるだけにする(全プリミティブを辿らない)
+ */
+void Scene::Update()
+{
+	if(moved.empty())
+		return;
+	for(std::size_t i = 0; i < moved.size(); i++)
 	{
-		if((*it))
-			delete (*it);
+		const AABB& box = prim_array.GetInstances()[PrimitiveArray::GetIndex(moved[i])].GetAABB();
+		Vec3Minimize(&aabb.min, &aabb.min, &box.min);
+		Vec3Maximize(&aabb.max, &aabb.max, &box.max);
 	}
-	for(LightList::iterator it = light_list.begin(); it != light_list.end(); it++)
+ #ifdef USE_ACCELERATOR
+	if(!accel->Refit(moved))
 	{
-		if((*it))
-			delete (*it);
+		prim_array.CalcAABB(aabb);
+		accel->Build(prim_array, aabb);
 	}
+ #endif // USE_ACCELERATOR
+	// 移動したインスタンスの発光三角形だけを変換し直す
+	emitters.Update(prim_array, moved);
+	moved.clear();
 }
 
-void Scene::MakeAABB()
+/*!
+	@brief		キャッシュへの書き出し
+	@param[i]	filename: ファイル名
+	@param[i]	key: 入力と構築設定のハッシュ(LoadCache() で照合する)
+	@note		Build() 済みであること
+				材質、光源、オブジェクト、プリミティブ、高速化構造の順に書く
+ */
+bool Scene::SaveCache(const std::string& filename, unsigned long long key) const
 {
-	aabb.min.set( FLT_MAX, FLT_MAX, FLT_MAX); 
-	aabb.max.set(-FLT_MAX,-FLT_MAX,-FLT_MAX);
-	float _min, _max;
-	for(PrimitiveList::const_iterator it = prim_list.begin(); it != prim_list.end(); it++)
+	CacheWriter writer;
+	if(!writer.Open(filename, key))
+		return false;
+
+	std::vector<Material> mtrl_records(mtrl_list.size());
+	for(std::size_t i = 0; i < mtrl_list.size(); i++)
+		mtrl_records[i] = *mtrl_list[i];
+	std::vector<Light> light_records;
+	for(LightList::const_iterator it = light_list.begin(); it != light_list.end(); it++)
+		light_records.push_back(**it);
+	const unsigned int type = accel_type;
+	writer.Write(type);
+	writer.WriteArray(mtrl_records);
+	writer.WriteArray(light_records);
+
+	const unsigned int num_objs = (unsigned int)obj_list.size();
+	writer.Write(num_objs);
+	for(std::size_t i = 0; i < obj_list.size(); i++)
+		obj_list[i]->Save(writer, mtrl_list);
+	prim_array.Save(writer, mtrl_list, obj_list);
+	writer.Write(aabb);
+ #ifdef USE_ACCELERATOR
+	accel->Save(writer);
+ #endif // USE_ACCELERATOR
+	return writer.Close();
+}
+
+/*!
+	@brief		キャッシュからの読み込み
+	@param[i]	filename: ファイル名
+	@param[i]	key: 入力と構築設定のハッシュ
+	@retval		false: 無い、またはキーや内容が合わない(シーンは空に戻す)
+	@note		Build() の代わりに呼ぶ
+ */
+bool Scene::LoadCache(const std::string& filename, unsigned long long key)
+{
+	Clear();
+	if(!cache.open(filename.c_str(), false))
+		return false;
+
+	CacheReader reader;
+	unsigned int type = 0;
+	std::vector<Material> mtrl_records;
+	std::vector<Light> light_records;
+	unsigned int num_objs = 0;
+	bool loaded = reader.Open(cache.data(), cache.size(), key) &&
+				  reader.Read(type) && (type < Accelerator::Type_Max) &&
+				  reader.ReadArray(mtrl_records) && reader.ReadArray(light_records) &&
+				  reader.Read(num_objs) && (num_objs < cache.size());
+	if(loaded)
 	{
-		for(int axis = Axis_X; axis < Axis_Max; axis++)
+		accel_type = (Accelerator::Type)type;
+		Reserve(mtrl_records.size(), light_records.size(), num_objs);
+		for(std::size_t i = 0; i < mtrl_records.size(); i++)
+			*CreateMaterial() = mtrl_records[i];
+		for(std::size_t i = 0; i < light_records.size(); i++)
+			*CreateLight() = light_records[i];
+		for(std::size_t i = 0; (i < num_objs) && loaded; i++)
+			loaded = CreateObject()->Load(reader, accel_type, mtrl_list);
+		loaded = loaded && prim_array.Load(reader, mtrl_list, obj_list) && reader.Read(aabb);
+ #ifdef USE_ACCELERATOR
+		if(loaded)
 		{
-			(*it)->CalcRange(_min, _max, (Axis)axis);
-			if(_min < aabb.min.v[axis])
-				aabb.min.v[axis] = _min;
-			if(_max > aabb.max.v[axis])
-				aabb.max.v[axis] = _max;
+			accel = Accelerator::Create(accel_type);
+			ASSERT_MSG(accel != NULL, "Scene::LoadCache(): alloc failed");
+			loaded = accel->Load(reader, prim_array);
 		}
+ #endif // USE_ACCELERATOR
+		loaded = loaded && reader.IsEnd();
 	}
-}
-
-void Scene::Build()
-{
-	MakeAABB();
- #ifdef USE_KDTREE
-	SAFE_DELETE(kdtree);
-	kdtree = new KdTree();
-	ASSERT_MSG(kdtree != NULL, "Scene::Build(): alloc failed");
-	kdtree->Build(prim_list, aabb, MAX_KDTREE_DEPTH);
- #endif // USE_KDTREE
+	if(!loaded)
+		Clear();
+	else
+		emitters.Build(prim_array);
+	return loaded;
 }
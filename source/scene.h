@@ -13,11 +13,19 @@
 #include "primitive.h"
 #include "light.h"
 #include "material.h"
-#include "kdtree.h"
+#include "accelerator.h"
+#include "object.h"
+#include "emitter.h"
+#include "lib/system/arena.h"
+#include "lib/system/mapped_file.h"
 
 /*!
 	@brief	シーン
 	@class	Scene
+	@note	材質、光源、オブジェクトは Create*() で種類毎の Arena に作り、シーンの破棄でまとめて解放する
+			アニメーションでは MoveInstance() で配置を変えてから Update() で高速化構造を更新する
+			LoadCache() したシーンのメッシュと高速化構造の配列はキャッシュファイルの割り当てを直接参照する
+			読み込み専用で割り当てるので、同じキャッシュを読む複数のプロセスでページを共有できる
  */
 class Scene
 {
@@ -25,29 +33,50 @@ public:
 	Scene();
 	~Scene();
 
-	PrimitiveList& GetPrimitiveList(){ return prim_list; }
-	MaterialList& GetMaterialList(){ return mtrl_list; }
-	LightList& GetLightList(){ return light_list; }
+	Material* CreateMaterial();
+	Light* CreateLight();
+	Object* CreateObject();
+	void Reserve(std::size_t num_mtrls, std::size_t num_lights, std::size_t num_objs);
+
+	PrimitiveArray& GetPrimitiveArray(){ return prim_array; }
+	const PrimitiveArray& GetPrimitiveArray() const { return prim_array; }
+	const ObjectList& GetObjectList() const { return obj_list; }
+	const MaterialList& GetMaterialList() const { return mtrl_list; }
+	const LightList& GetLightList() const { return light_list; }
+	const EmitterTable& GetEmitterTable() const { return emitters; }
 	Color& GetBGColor(){ return back_ground; }
 	AABB& GetAABB(){ return aabb; }
- #ifdef USE_KDTREE
-	KdTree* GetKdTree(){ return kdtree; }
-	const KdTree* GetKdTree() const { return (const KdTree*)kdtree; }
- #endif // USE_KDTREE
-	void Build();
+ #ifdef USE_ACCELERATOR
+	Accelerator* GetAccelerator(){ return accel; }
+	const Accelerator* GetAccelerator() const { return (const Accelerator*)accel; }
+ #endif // USE_ACCELERATOR
+	void Build(Accelerator::Type type, std::size_t max_thread = 0);
+	bool MoveInstance(std::size_t index, const Matrix44& world);
+	void Update();
+
+	bool SaveCache(const std::string& filename, unsigned long long key) const;
+	bool LoadCache(const std::string& filename, unsigned long long key);
 
 private:
-	void MakeAABB();
+	void Clear();
 
 private:
-	PrimitiveList	prim_list;
+	MappedFile		cache;		//!< LoadCache() で割り当てたファイル(参照する配列より先に作り、後に破棄する)
+	Accelerator::Type	accel_type;
+	Arena<Material>	mtrl_arena;
+	Arena<Light>	light_arena;
+	Arena<Object>	obj_arena;
+	PrimitiveArray	prim_array;
+	ObjectList		obj_list;	//!< prim_array のインスタンスが参照する
 	MaterialList	mtrl_list;
 	LightList		light_list;
+	EmitterTable	emitters;	//!< 直接照明で選ぶ発光三角形
 	Color			back_ground;
 	AABB			aabb;
- #ifdef USE_KDTREE
-	KdTree*			kdtree;
- #endif // USE_KDTREE
+	std::vector<PrimitiveArray::Id>	moved;	//!< 前回の Update() から移動したインスタンス
+ #ifdef USE_ACCELERATOR
+	Accelerator*	accel;
+ #endif // USE_ACCELERATOR
 };
 
 #endif // !__SCENE_H_
\ No newline at end of file
@@ -0,0 +1,898 @@
+
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+#include "wide_bvh.h"
+#include "lib/system/cpu.h"
+#ifdef CPU_X86
+#include <immintrin.h>
+#endif // CPU_X86
+
+
+static const std::size_t K_STACK_SIZE	= 512;	//!< 走査スタックの大きさ(Bvh の最大深度 * (N - 1) を超えない)
+static const float K_TRAVERSAL_COST		= 1.0f;	//!< Refit() で評価する SAH コストの重み(Bvh と同じ値)
+static const float K_INTERSECTION_COST	= 1.5f;
+static const unsigned int K_NO_LEAF		= 0xffffffff;
+
+/*!
+	@brief		子の境界
+	@param[o]	aabb: 境界
+	@param[i]	node: ノード
+	@param[i]	i: 子の番号
+ */
+template <int N>
+static void get_child_aabb(AABB& aabb, const WideBvhNode<N>& node, int i)
+{
+	for(int axis = Axis_X; axis < Axis_Max; axis++)
+	{
+		aabb.min.v[axis] = node.bounds[axis][0][i];
+		aabb.max.v[axis] = node.bounds[axis][1][i];
+	}
+}
+
+/*!
+	@brief		ノード全体の境界
+	@param[o]	aabb: 境界
+	@param[i]	node: ノード
+	@note		空きの子は境界を反転させてあるので、そのまま合わせてよい
+ */
+template <int N>
+static void get_node_aabb(AABB& aabb, const WideBvhNode<N>& node)
+{
+	for(int axis = Axis_X; axis < Axis_Max; axis++)
+	{
+		float min = node.bounds[axis][0][0];
+		float max = node.bounds[axis][1][0];
+		for(int i = 1; i < N; i++)
+		{
+			min = std::min(min, node.bounds[axis][0][i]);
+			max = std::max(max, node.bounds[axis][1][i]);
+		}
+		aabb.min.v[axis] = min;
+		aabb.max.v[axis] = max;
+	}
+}
+
+/*!
+	@brief		子の境界の判定(スカラー)
+	@param[i]	node: ノード
+	@param[i]	ray: 光線
+	@param[i]	t_max: 調べる区間の終点
+	@param[o]	t_near: 子毎の入り点
+	@return		交差した子のビットマスク
+ */
+template <int N>
+static int box_test_scalar(const WideBvhNode<N>& node, const typename WideBvh<N>::RayData& ray, float t_max, float* t_near)
+{
+	int mask = 0;
+	for(int i = 0; i < N; i++)
+	{
+		float t0 = 0.0f;
+		float t1 = t_max;
+		for(int axis = Axis_X; axis < Axis_Max; axis++)
+		{
+			const int side = ray.near_side[axis];
+			const float t_in = (node.bounds[axis][side][i] - ray.org.v[axis]) * ray.inv_dir.v[axis];
+			const float t_out = (node.bounds[axis][1-side][i] - ray.org.v[axis]) * ray.inv_dir.v[axis];
+			if(t_in > t0)
+				t0 = t_in;
+			if(t_out < t1)
+				t1 = t_out;
+		}
+		t_near[i] = t0;
+		if(t0 <= t1)
+			mask |= (1 << i);
+	}
+	return mask;
+}
+
+/*!
+	@brief		三角形ブロックの判定(スカラー)
+	@param[i]	block: 三角形ブロック
+	@param[i]	ray: 光線
+	@param[i]	t_max: これより近い交差だけを探す
+	@param[o]	param: 交差情報
+	@return		最も近い交差の要素番号(なければ -1)
+	@note		Moller-Trumbore 法、背面は判定しない
+				演算の順序は primitive.cpp の tri_intersect() と揃えている
+ */
+template <int N>
+static int triangle_test_scalar(const TriangleBlock<N>& block, const typename WideBvh<N>::RayData& ray, float t_max, Primitive::Param& param)
+{
+	int hit = -1;
+	for(int i = 0; i < N; i++)
+	{
+		const Vector3 e0(block.e0[Axis_X][i], block.e0[Axis_Y][i], block.e0[Axis_Z][i]);
+		const Vector3 e1(block.e1[Axis_X][i], block.e1[Axis_Y][i], block.e1[Axis_Z][i]);
+		const Vector3 p0(block.p0[Axis_X][i], block.p0[Axis_Y][i], block.p0[Axis_Z][i]);
+
+		Vector3 pvec;
+		Vec3OuterProduct(&pvec, &ray.dir, &e1);
+		const float det = Vec3InnerProduct(&e0, &pvec);
+		if(det <= FLT_EPSILON)
+			continue;
+		Vector3 tvec;
+		Vec3Subtract(&tvec, &ray.org, &p0);
+		const float u = Vec3InnerProduct(&tvec, &pvec);
+		if((u < 0.0f) || (u > det))
+			continue;
+		Vector3 qvec;
+		Vec3OuterProduct(&qvec, &tvec, &e0);
+		const float v = Vec3InnerProduct(&ray.dir, &qvec);
+		if((v < 0.0f) || (u + v > det))
+			continue;
+		const float inv_det = 1.0f / det;
+		const float t = Vec3InnerProduct(&e1, &qvec) * inv_det;
+		if((t < 0.0f) || !(t < t_max))
+			continue;
+		t_max = t;
+		param.t = t;
+		param.u = u * inv_det;
+		param.v = v * inv_det;
+		hit = i;
+	}
+	return hit;
+}
+
+/*!
+	@brief		SIMD 判定結果から最も近い要素を選ぶ
+	@param[i]	mask: 交差した要素のビットマスク
+	@param[i]	t, u, v: 要素毎の交差情報(u, v は det で割る前)
+	@param[i]	inv_det: 要素毎の 1 / det
+	@param[o]	param: 交差情報
+	@note		同じ距離なら番号の小さい方を選ぶ(スカラー版と同じ)
+ */
+template <int N>
+static int select_nearest(int mask, const float* t, const float* u, const float* v, const float* inv_det, Primitive::Param& param)
+{
+	int hit = -1;
+	for(int i = 0; i < N; i++)
+	{
+		if(!(mask & (1 << i)))
+			continue;
+		if((hit < 0) || (t[i] < t[hit]))
+			hit = i;
+	}
+	if(hit >= 0)
+	{
+		param.t = t[hit];
+		param.u = u[hit] * inv_det[hit];
+		param.v = v[hit] * inv_det[hit];
+	}
+	return hit;
+}
+
+#ifdef CPU_X86
+/*!
+	@brief		子の境界の判定(SSE4, 4 分岐)
+ */
+TARGET_SSE4 static int box_test_sse4(const WideBvhNode<4>& node, const WideBvh<4>::RayData& ray, float t_max, float* t_near)
+{
+	__m128 t0 = _mm_setzero_ps();
+	__m128 t1 = _mm_set1_ps(t_max);
+	for(int axis = Axis_X; axis < Axis_Max; axis++)
+	{
+		const int side = ray.near_side[axis];
+		const __m128 org = _mm_set1_ps(ray.org.v[axis]);
+		const __m128 inv_dir = _mm_set1_ps(ray.inv_dir.v[axis]);
+		const __m128 t_in = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds[axis][side]), org), inv_dir);
+		const __m128 t_out = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds[axis][1-side]), org), inv_dir);
+		t0 = _mm_max_ps(t0, t_in);
+		t1 = _mm_min_ps(t1, t_out);
+	}
+	_mm_storeu_ps(t_near, t0);
+	return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+}
+
+/*!
+	@brief		子の境界の判定(AVX2, 8 分岐)
+ */
+TARGET_AVX2 static int box_test_avx2(const WideBvhNode<8>& node, const WideBvh<8>::RayData& ray, float t_max, float* t_near)
+{
+	__m256 t0 = _mm256_setzero_ps();
+	__m256 t1 = _mm256_set1_ps(t_max);
+	for(int axis = Axis_X; axis < Axis_Max; axis++)
+	{
+		const int side = ray.near_side[axis];
+		const __m256 org = _mm256_set1_ps(ray.org.v[axis]);
+		const __m256 inv_dir = _mm256_set1_ps(ray.inv_dir.v[axis]);
+		const __m256 t_in = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[axis][side]), org), inv_dir);
+		const __m256 t_out = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[axis][1-side]), org), inv_dir);
+		t0 = _mm256_max_ps(t0, t_in);
+		t1 = _mm256_min_ps(t1, t_out);
+	}
+	_mm256_storeu_ps(t_near, t0);
+	return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+}
+
+/*!
+	@brief		三角形ブロックの判定(SSE4, 4 要素)
+ */
+TARGET_SSE4 static int triangle_test_sse4(const TriangleBlock<4>& block, const WideBvh<4>::RayData& ray, float t_max, Primitive::Param& param)
+{
+	const __m128 dx = _mm_set1_ps(ray.dir.x);
+	const __m128 dy = _mm_set1_ps(ray.dir.y);
+	const __m128 dz = _mm_set1_ps(ray.dir.z);
+	const __m128 e0x = _mm_loadu_ps(block.e0[Axis_X]);
+	const __m128 e0y = _mm_loadu_ps(block.e0[Axis_Y]);
+	const __m128 e0z = _mm_loadu_ps(block.e0[Axis_Z]);
+	const __m128 e1x = _mm_loadu_ps(block.e1[Axis_X]);
+	const __m128 e1y = _mm_loadu_ps(block.e1[Axis_Y]);
+	const __m128 e1z = _mm_loadu_ps(block.e1[Axis_Z]);
+
+	// pvec = dir x e1, det = e0 . pvec
+	const __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e1z), _mm_mul_ps(dz, e1y));
+	const __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e1x), _mm_mul_ps(dx, e1z));
+	const __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e1y), _mm_mul_ps(dy, e1x));
+	const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e0x, px), _mm_mul_ps(e0y, py)), _mm_mul_ps(e0z, pz));
+
+	// tvec = org - p0, u = tvec . pvec
+	const __m128 tx = _mm_sub_ps(_mm_set1_ps(ray.org.x), _mm_loadu_ps(block.p0[Axis_X]));
+	const __m128 ty = _mm_sub_ps(_mm_set1_ps(ray.org.y), _mm_loadu_ps(block.p0[Axis_Y]));
+	const __m128 tz = _mm_sub_ps(_mm_set1_ps(ray.org.z), _mm_loadu_ps(block.p0[Axis_Z]));
+	const __m128 u = _mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz));
+
+	// qvec = tvec x e0, v = dir . qvec
+	const __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e0z), _mm_mul_ps(tz, e0y));
+	const __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e0x), _mm_mul_ps(tx, e0z));
+	const __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e0y), _mm_mul_ps(ty, e0x));
+	const __m128 v = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz));
+
+	const __m128 inv_det = _mm_div_ps(_mm_set1_ps(1.0f), det);
+	const __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, qx), _mm_mul_ps(e1y, qy)), _mm_mul_ps(e1z, qz)), inv_det);
+
+	const __m128 zero = _mm_setzero_ps();
+	__m128 mask = _mm_cmpgt_ps(det, _mm_set1_ps(FLT_EPSILON));
+	mask = _mm_and_ps(mask, _mm_cmpge_ps(u, zero));
+	mask = _mm_and_ps(mask, _mm_cmple_ps(u, det));
+	mask = _mm_and_ps(mask, _mm_cmpge_ps(v, zero));
+	mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(u, v), det));
+	mask = _mm_and_ps(mask, _mm_cmpge_ps(t, zero));
+	mask = _mm_and_ps(mask, _mm_cmplt_ps(t, _mm_set1_ps(t_max)));
+	const int bits = _mm_movemask_ps(mask);
+	if(!bits)
+		return -1;
+
+	float t_[4], u_[4], v_[4], inv_det_[4];
+	_mm_storeu_ps(t_, t);
+	_mm_storeu_ps(u_, u);
+	_mm_storeu_ps(v_, v);
+	_mm_storeu_ps(inv_det_, inv_det);
+	return select_nearest<4>(bits, t_, u_, v_, inv_det_, param);
+}
+
+/*!
+	@brief		三角形ブロックの判定(AVX2, 8 要素)
+ */
+TARGET_AVX2 static int triangle_test_avx2(const TriangleBlock<8>& block, const WideBvh<8>::RayData& ray, float t_max, Primitive::Param& param)
+{
+	const __m256 dx = _mm256_set1_ps(ray.dir.x);
+	const __m256 dy = _mm256_set1_ps(ray.dir.y);
+	const __m256 dz = _mm256_set1_ps(ray.dir.z);
+	const __m256 e0x = _mm256_loadu_ps(block.e0[Axis_X]);
+	const __m256 e0y = _mm256_loadu_ps(block.e0[Axis_Y]);
+	const __m256 e0z = _mm256_loadu_ps(block.e0[Axis_Z]);
+	const __m256 e1x = _mm256_loadu_ps(block.e1[Axis_X]);
+	const __m256 e1y = _mm256_loadu_ps(block.e1[Axis_Y]);
+	const __m256 e1z = _mm256_loadu_ps(block.e1[Axis_Z]);
+
+	// pvec = dir x e1, det = e0 . pvec
+	const __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e1z), _mm256_mul_ps(dz, e1y));
+	const __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e1x), _mm256_mul_ps(dx, e1z));
+	const __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e1y), _mm256_mul_ps(dy, e1x));
+	const __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e0x, px), _mm256_mul_ps(e0y, py)), _mm256_mul_ps(e0z, pz));
+
+	// tvec = org - p0, u = tvec . pvec
+	const __m256 tx = _mm256_sub_ps(_mm256_set1_ps(ray.org.x), _mm256_loadu_ps(block.p0[Axis_X]));
+	const __m256 ty = _mm256_sub_ps(_mm256_set1_ps(ray.org.y), _mm256_loadu_ps(block.p0[Axis_Y]));
+	const __m256 tz = _mm256_sub_ps(_mm256_set1_ps(ray.org.z), _mm256_loadu_ps(block.p0[Axis_Z]));
+	const __m256 u = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)), _mm256_mul_ps(tz, pz));
+
+	// qvec = tvec x e0, v = dir . qvec
+	const __m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e0z), _mm256_mul_ps(tz, e0y));
+	const __m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e0x), _mm256_mul_ps(tx, e0z));
+	const __m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e0y), _mm256_mul_ps(ty, e0x));
+	const __m256 v = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz));
+
+	const __m256 inv_det = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+	const __m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, qx), _mm256_mul_ps(e1y, qy)), _mm256_mul_ps(e1z, qz)), inv_det);
+
+	const __m256 zero = _mm256_setzero_ps();
+	__m256 mask = _mm256_cmp_ps(det, _mm256_set1_ps(FLT_EPSILON), _CMP_GT_OQ);
+	mask = _mm256_and_ps(mask, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+	mask = _mm256_and_ps(mask, _mm256_cmp_ps(u, det, _CMP_LE_OQ));
+	mask = _mm256_and_ps(mask, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+	mask = _mm256_and_ps(mask, _mm256_cmp_ps(_mm256_add_ps(u, v), det, _CMP_LE_OQ));
+	mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, zero, _CMP_GE_OQ));
+	mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, _mm256_set1_ps(t_max), _CMP_LT_OQ));
+	const int bits = _mm256_movemask_ps(mask);
+	if(!bits)
+		return -1;
+
+	float t_[8], u_[8], v_[8], inv_det_[8];
+	_mm256_storeu_ps(t_, t);
+	_mm256_storeu_ps(u_, u);
+	_mm256_storeu_ps(v_, v);
+	_mm256_storeu_ps(inv_det_, inv_det);
+	return select_nearest<8>(bits, t_, u_, v_, inv_det_, param);
+}
+#endif // CPU_X86
+
+////////////////////////////////////////////////////////////////////////////////
+
+template <>
+WideBvh<4>::WideBvh() : box_test(box_test_scalar<4>), triangle_test(triangle_test_scalar<4>), sah_cost(0.0), build_cost(0.0)
+{
+ #ifdef CPU_X86
+	if(cpu_has_sse4())
+	{
+		box_test = box_test_sse4;
+		triangle_test = triangle_test_sse4;
+	}
+ #endif // CPU_X86
+}
+
+template <>
+WideBvh<8>::WideBvh() : box_test(box_test_scalar<8>), triangle_test(triangle_test_scalar<8>), sah_cost(0.0), build_cost(0.0)
+{
+ #ifdef CPU_X86
+	if(cpu_has_avx2())
+	{
+		box_test = box_test_avx2;
+		triangle_test = triangle_test_avx2;
+	}
+ #endif // CPU_X86
+}
+
+template <int N>
+WideBvh<N>::~WideBvh()
+{
+}
+
+/*!
+	@brief		構築
+	@param[i]	prims: プリミティブ
+	@param[i]	aabb: シーンの境界
+ */
+template <int N>
+void WideBvh<N>::Build(const PrimitiveArray& prims, const AABB& aabb)
+{
+	this->prims = &prims;
+	nodes.release();
+	leaves.release();
+	blocks.release();
+	indices.release();
+	std::vector<unsigned int>().swap(parents);
+	std::vector<unsigned int>().swap(leaf_parents);
+	std::vector<unsigned int>().swap(instance_leaves);
+	if(prims.empty())
+		return;
+
+	Bvh bvh;
+	bvh.SetMaxThread(max_thread);
+	bvh.Build(prims, aabb);
+	const MappedArray<BvhNode>& bin_nodes = bvh.GetNodes();
+	nodes.reserve(bin_nodes.size() / (N - 1) + 1);
+	Collapse(bin_nodes, bvh.GetIndices(), 0);
+}
+
+/*!
+	@brief		2 分岐の部分木を N 分岐のノードにまとめる
+	@param[i]	bin_nodes: 2 分岐 BVH のノード
+	@param[i]	bin_indices: 2 分岐 BVH のインデックス配列
+	@param[i]	root: まとめる部分木の根
+	@return		作成したノード番号
+	@note		子の中で表面積が最も大きい節を展開することを N 個になるまで繰り返す
+ */
+template <int N>
+unsigned int WideBvh<N>::Collapse(const MappedArray<BvhNode>& bin_nodes, const MappedArray<PrimitiveArray::Id>& bin_indices, unsigned int root)
+{
+	const unsigned int node = (unsigned int)nodes.size();
+	nodes.push_back(Node());
+	AABB empty;
+	empty.min.set( FLT_MAX, FLT_MAX, FLT_MAX);
+	empty.max.set(-FLT_MAX,-FLT_MAX,-FLT_MAX);
+	for(int i = 0; i < N; i++)
+		SetChild(node, i, empty, Node::K_EMPTY);
+
+	unsigned int kids[N];
+	int num_kids = 0;
+	if(bin_nodes[root].IsLeaf())
+	{
+		kids[num_kids++] = root;
+	}
+	else
+	{
+		kids[num_kids++] = root + 1;
+		kids[num_kids++] = bin_nodes[root].GetRight();
+	}
+	while(num_kids < N)
+	{
+		int best = -1;
+		float best_area = -1.0f;
+		for(int i = 0; i < num_kids; i++)
+		{
+			const BvhNode& n = bin_nodes[kids[i]];
+			if(n.IsLeaf())
+				continue;
+			const float area = n.GetAABB().GetSurfaceArea();
+			if(area > best_area)
+			{
+				best = i;
+				best_area = area;
+			}
+		}
+		if(best < 0)
+			break;
+		const unsigned int expand = kids[best];
+		kids[best] = expand + 1;
+		kids[num_kids++] = bin_nodes[expand].GetRight();
+	}
+
+	for(int i = 0; i < num_kids; i++)
+	{
+		const BvhNode& n = bin_nodes[kids[i]];
+		if(n.IsLeaf())
+		{
+			Leaf leaf;
+			MakeLeaf(leaf, bin_indices, n);
+			SetChild(node, i, n.GetAABB(), Node::K_LEAF | (unsigned int)leaves.size());
+			leaves.push_back(leaf);
+		}
+		else
+		{
+			const unsigned int child = Collapse(bin_nodes, bin_indices, kids[i]);
+			SetChild(node, i, n.GetAABB(), child);
+		}
+	}
+	return node;
+}
+
+/*!
+	@brief		リーフの作成
+	@param[o]	leaf: リーフ
+	@param[i]	bin_indices: 2 分岐 BVH のインデックス配列
+	@param[i]	node: 2 分岐 BVH のリーフ
+	@note		三角形はブロックに詰め、それ以外は従来どおりインデックスで参照する
+ */
+template <int N>
+void WideBvh<N>::MakeLeaf(Leaf& leaf, const MappedArray<PrimitiveArray::Id>& bin_indices, const BvhNode& node)
+{
+	leaf.offset = (unsigned int)indices.size();
+	leaf.block = (unsigned int)blocks.size();
+	int lane = N;
+	const unsigned int end = node.GetOffset() + node.GetNumPrims();
+	for(unsigned int i = node.GetOffset(); i < end; i++)
+	{
+		const PrimitiveArray::Id id = bin_indices[i];
+		const Vector3* p[3];
+		if(!prims->GetTrianglePoints(p, id))
+		{
+			indices.push_back(id);
+			continue;
+		}
+		if(lane == N)
+		{
+			Block block;
+			memset(&block, 0, sizeof(block));
+			for(int j = 0; j < N; j++)
+				block.index[j] = Node::K_EMPTY;
+			blocks.push_back(block);
+			lane = 0;
+		}
+		Block& block = blocks.back();
+		for(int axis = Axis_X; axis < Axis_Max; axis++)
+		{
+			block.p0[axis][lane] = p[0]->v[axis];
+			block.e0[axis][lane] = p[1]->v[axis] - p[0]->v[axis];
+			block.e1[axis][lane] = p[2]->v[axis] - p[0]->v[axis];
+		}
+		block.index[lane] = id;
+		lane++;
+	}
+	leaf.num_prims = (unsigned int)indices.size() - leaf.offset;
+	leaf.num_blocks = (unsigned int)blocks.size() - leaf.block;
+}
+
+template <int N>
+void WideBvh<N>::SetChild(unsigned int node, int slot, const AABB& aabb, unsigned int child)
+{
+	Node& n = nodes[node];
+	for(int axis = Axis_X; axis < Axis_Max; axis++)
+	{
+		n.bounds[axis][0][slot] = aabb.min.v[axis];
+		n.bounds[axis][1][slot] = aabb.max.v[axis];
+	}
+	n.child[slot] = child;
+}
+
+template <int N>
+void WideBvh<N>::InitRay(RayData& data, const Ray& ray) const
+{
+	data.org = ray.org;
+	data.dir = ray.dir;
+	for(int axis = Axis_X; axis < Axis_Max; axis++)
+	{
+		// 軸に平行な成分はスラブと交わらないので十分大きな値にしておく
+		data.inv_dir.v[axis] = (ray.dir.v[axis] != 0.0f)? 1.0f / ray.dir.v[axis] : FLT_MAX;
+		data.near_side[axis] = (data.inv_dir.v[axis] < 0.0f)? 1 : 0;
+	}
+}
+
+/*!
+	@brief		最も近い交差を探す
+	@param[o]	id: 交差したプリミティブ
+	@param[o]	param: 交差情報
+	@param[i]	ray: 光線
+	@note		交差した子を入り点の遠い順に積み、近いものから取り出す
+				取り出した時点で入り点が交差距離より遠ければ省く
+ */
+template <int N>
+bool WideBvh<N>::Traverse(PrimitiveArray::Id& id, Primitive::Param& param, const Ray& ray) const
+{
+	struct StackEntry
+	{
+		unsigned int	child;
+		float			t;
+	};
+
+	if(nodes.empty())
+		return false;
+
+	RayData data;
+	InitRay(data, ray);
+
+	StackEntry stack[K_STACK_SIZE];
+	std::size_t top = 0;
+	stack[top].child = 0;
+	stack[top].t = 0.0f;
+	top++;
+
+	float t_hit = FLT_MAX;
+	float t_near[N];
+	bool found = false;
+	Primitive::Param temp;
+	while(top > 0)
+	{
+		const StackEntry e = stack[--top];
+		if(e.t > t_hit)
+			continue;
+
+		if(e.child & Node::K_LEAF)
+		{
+			const Leaf& leaf = leaves[e.child & ~Node::K_LEAF];
+			const Block* block = blocks.data() + leaf.block;
+			const Block* block_end = block + leaf.num_blocks;
+			for(; block != block_end; block++)
+			{
+				const int lane = triangle_test(*block, data, t_hit, temp);
+				if(lane >= 0)
+				{
+					id = block->index[lane];
+					param = temp;
+					t_hit = temp.t;
+					found = true;
+				}
+			}
+			const PrimitiveArray::Id* it = indices.data() + leaf.offset;
+			if(prims->IntersectNearest(id, param, t_hit, it, it + leaf.num_prims, ray))
+				found = true;
+			continue;
+		}
+
+		const Node& n = nodes[e.child];
+		const int mask = box_test(n, data, t_hit, t_near);
+		const std::size_t base = top;
+		for(int i = 0; i < N; i++)
+		{
+			if(!(mask & (1 << i)))
+				continue;
+			StackEntry entry;
+			entry.child = n.child[i];
+			entry.t = t_near[i];
+			std::size_t j = top++;
+			while((j > base) && (stack[j-1].t < entry.t))
+			{
+				stack[j] = stack[j-1];
+				j--;
+			}
+			stack[j] = entry;
+		}
+	}
+	return found;
+}
+
+/*!
+	@brief		遮蔽物の有無
+	@param[i]	ray: 光線
+	@param[i]	t_max: 調べる区間の終点(光源までの距離など)
+	@retval		true: [0, t_max] に交差がある
+	@note		最も近い交差は求めないので子の順序は気にしない
+ */
+template <int N>
+bool WideBvh<N>::Occluded(const Ray& ray, float t_max) const
+{
+	if(nodes.empty())
+		return false;
+
+	RayData data;
+	InitRay(data, ray);
+	// ブロックの判定は t < t_max なので、t_max ちょうどの交差も含むように 1 ulp 広げる
+	const float t_limit = nextafterf(t_max, FLT_MAX);
+
+	unsigned int stack[K_STACK_SIZE];
+	std::size_t top = 0;
+	stack[top++] = 0;
+
+	float t_near[N];
+	Primitive::Param temp;
+	while(top > 0)
+	{
+		const unsigned int child = stack[--top];
+		if(child & Node::K_LEAF)
+		{
+			const Leaf& leaf = leaves[child & ~Node::K_LEAF];
+			const Block* block = blocks.data() + leaf.block;
+			const Block* block_end = block + leaf.num_blocks;
+			for(; block != block_end; block++)
+			{
+				if(triangle_test(*block, data, t_limit, temp) >= 0)
+					return true;
+			}
+			const PrimitiveArray::Id* it = indices.data() + leaf.offset;
+			if(prims->IntersectAny(it, it + leaf.num_prims, ray, t_max))
+				return true;
+			continue;
+		}
+
+		const Node& n = nodes[child];
+		const int mask = box_test(n, data, t_max, t_near);
+		for(int i = 0; i < N; i++)
+		{
+			if(mask & (1 << i))
+				stack[top++] = n.child[i];
+		}
+	}
+	return false;
+}
+
+/*!
+	@brief		移動したプリミティブに合わせた境界の更新
+	@param[i]	ids: 境界が変わったプリミティブ(インスタンスのみ)
+	@retval		false: インスタンス以外を含む、または SAH コストが構築時の K_REFIT_LIMIT 倍を超えた
+	@note		子は親より後ろに並ぶので、番号の大きいノードから順に処理すれば子の境界は確定している
+				ノードの境界は親の子の境界として持つので、リーフの境界を親のスロットに書き、
+				変わったノードは子の境界を合わせて更に親のスロットに書く
+ */
+template <int N>
+bool WideBvh<N>::Refit(const std::vector<PrimitiveArray::Id>& ids)
+{
+	if(nodes.empty())
+		return false;
+	if(parents.empty())
+		InitRefit();
+
+	std::vector<unsigned int> leaf_list;
+	leaf_list.reserve(ids.size());
+	for(std::size_t i = 0; i < ids.size(); i++)
+	{
+		const std::size_t index = PrimitiveArray::GetIndex(ids[i]);
+		if((PrimitiveArray::GetType(ids[i]) != PrimitiveArray::Type_Instance) ||
+		   (index >= instance_leaves.size()) || (instance_leaves[index] == K_NO_LEAF))
+			return false;
+		leaf_list.push_back(instance_leaves[index]);
+	}
+	std::sort(leaf_list.begin(), leaf_list.end());
+	leaf_list.erase(std::unique(leaf_list.begin(), leaf_list.end()), leaf_list.end());
+
+	const MappedArray<Leaf>& const_leaves = leaves;
+	std::vector<unsigned int> heap;
+	for(std::size_t i = 0; i < leaf_list.size(); i++)
+	{
+		AABB aabb;
+		CalcLeafAABB(aabb, const_leaves[leaf_list[i]]);
+		const unsigned int slot = leaf_parents[leaf_list[i]];
+		if(SetChildAABB(slot, aabb))
+			heap.push_back(slot / N);
+	}
+	std::make_heap(heap.begin(), heap.end());
+
+	const MappedArray<Node>& const_nodes = nodes;
+	while(!heap.empty())
+	{
+		const unsigned int node = heap.front();
+		do
+		{
+			std::pop_heap(heap.begin(), heap.end());
+			heap.pop_back();
+		}while(!heap.empty() && (heap.front() == node));
+		if(node == 0)
+			continue;
+
+		AABB aabb;
+		get_node_aabb(aabb, const_nodes[node]);
+		const unsigned int slot = parents[node];
+		if(SetChildAABB(slot, aabb))
+		{
+			heap.push_back(slot / N);
+			std::push_heap(heap.begin(), heap.end());
+		}
+	}
+
+	AABB root;
+	get_node_aabb(root, const_nodes[0]);
+	const float area = root.GetSurfaceArea();
+	return (area > 0.0f) && (sah_cost / area <= build_cost * K_REFIT_LIMIT);
+}
+
+/*!
+	@brief		Refit() の準備
+	@note		ノードとリーフの親、インスタンス毎のリーフ、更新前の SAH コストを求める
+				構築や読み込みの後、最初の Refit() でだけ呼ぶ
+ */
+template <int N>
+void WideBvh<N>::InitRefit()
+{
+	const MappedArray<Node>& const_nodes = nodes;
+	const MappedArray<Leaf>& const_leaves = leaves;
+	const MappedArray<PrimitiveArray::Id>& const_indices = indices;
+	parents.assign(const_nodes.size(), 0);
+	leaf_parents.assign(const_leaves.size(), 0);
+	instance_leaves.assign(prims->GetInstances().size(), K_NO_LEAF);
+	sah_cost = 0.0;
+	for(unsigned int i = 0; i < const_nodes.size(); i++)
+	{
+		const Node& n = const_nodes[i];
+		for(int j = 0; j < N; j++)
+		{
+			const unsigned int child = n.child[j];
+			if(child == Node::K_EMPTY)
+				continue;
+			AABB aabb;
+			get_child_aabb(aabb, n, j);
+			sah_cost += GetChildWeight(child) * aabb.GetSurfaceArea();
+			if(child & Node::K_LEAF)
+				leaf_parents[child & ~Node::K_LEAF] = i * N + j;
+			else
+				parents[child] = i * N + j;
+		}
+	}
+	for(unsigned int i = 0; i < const_leaves.size(); i++)
+	{
+		const Leaf& leaf = const_leaves[i];
+		for(unsigned int j = leaf.offset; j < leaf.offset + leaf.num_prims; j++)
+		{
+			if(PrimitiveArray::GetType(const_indices[j]) == PrimitiveArray::Type_Instance)
+				instance_leaves[PrimitiveArray::GetIndex(const_indices[j])] = i;
+		}
+	}
+	AABB root;
+	get_node_aabb(root, const_nodes[0]);
+	const float area = root.GetSurfaceArea();
+	build_cost = (area > 0.0f)? sah_cost / area : 0.0;
+}
+
+/*!
+	@brief		リーフの境界
+	@param[o]	aabb: 境界
+	@param[i]	leaf: リーフ
+ */
+template <int N>
+void WideBvh<N>::CalcLeafAABB(AABB& aabb, const Leaf& leaf) const
+{
+	aabb.min.set( FLT_MAX, FLT_MAX, FLT_MAX);
+	aabb.max.set(-FLT_MAX,-FLT_MAX,-FLT_MAX);
+	for(unsigned int i = leaf.block; i < leaf.block + leaf.num_blocks; i++)
+	{
+		const Block& block = blocks[i];
+		for(int lane = 0; lane < N; lane++)
+		{
+			if(block.index[lane] == Node::K_EMPTY)
+				continue;
+			for(int axis = Axis_X; axis < Axis_Max; axis++)
+			{
+				const float p0 = block.p0[axis][lane];
+				const float p1 = p0 + block.e0[axis][lane];
+				const float p2 = p0 + block.e1[axis][lane];
+				aabb.min.v[axis] = std::min(aabb.min.v[axis], std::min(p0, std::min(p1, p2)));
+				aabb.max.v[axis] = std::max(aabb.max.v[axis], std::max(p0, std::max(p1, p2)));
+			}
+		}
+	}
+	for(unsigned int i = leaf.offset; i < leaf.offset + leaf.num_prims; i++)
+	{
+		for(int axis = Axis_X; axis < Axis_Max; axis++)
+		{
+			float min, max;
+			prims->CalcRange(min, max, (Axis)axis, indices[i]);
+			aabb.min.v[axis] = std::min(aabb.min.v[axis], min);
+			aabb.max.v[axis] = std::max(aabb.max.v[axis], max);
+		}
+	}
+}
+
+/*!
+	@brief		子の SAH コストの重み
+	@param[i]	child: 子(ノード番号か K_LEAF | リーフ番号)
+ */
+template <int N>
+float WideBvh<N>::GetChildWeight(unsigned int child) const
+{
+	if(!(child & Node::K_LEAF))
+		return K_TRAVERSAL_COST;
+	const Leaf& leaf = leaves[child & ~Node::K_LEAF];
+	unsigned int num_prims = leaf.num_prims;
+	for(unsigned int i = leaf.block; i < leaf.block + leaf.num_blocks; i++)
+	{
+		for(int lane = 0; lane < N; lane++)
+			num_prims += (blocks[i].index[lane] != Node::K_EMPTY)? 1 : 0;
+	}
+	return K_INTERSECTION_COST * (float)num_prims;
+}
+
+/*!
+	@brief		子の境界の更新
+	@param[i]	slot: 親ノード * N + 子の番号
+	@param[i]	aabb: 新しい境界
+	@retval		false: 変わらなかった
+	@note		SAH コストの和も差分で更新する
+ */
+template <int N>
+bool WideBvh<N>::SetChildAABB(unsigned int slot, const AABB& aabb)
+{
+	const MappedArray<Node>& const_nodes = nodes;
+	const Node& n = const_nodes[slot / N];
+	const int i = (int)(slot % N);
+	AABB old;
+	get_child_aabb(old, n, i);
+	if((old.min.x == aabb.min.x) && (old.min.y == aabb.min.y) && (old.min.z == aabb.min.z) &&
+	   (old.max.x == aabb.max.x) && (old.max.y == aabb.max.y) && (old.max.z == aabb.max.z))
+		return false;
+	const unsigned int child = n.child[i];
+	sah_cost += GetChildWeight(child) * (aabb.GetSurfaceArea() - old.GetSurfaceArea());
+	SetChild(slot / N, i, aabb, child);
+	return true;
+}
+
+/*!
+	@brief		キャッシュへの書き出し
+	@param[io]	writer: キャッシュ
+	@note		ノードとブロックの大きさは N で変わるので、幅の違う環境で読むと Load() が失敗して構築し直す
+ */
+template <int N>
+void WideBvh<N>::Save(CacheWriter& writer) const
+{
+	writer.WriteArray(nodes);
+	writer.WriteArray(leaves);
+	writer.WriteArray(blocks);
+	writer.WriteArray(indices);
+}
+
+/*!
+	@brief		キャッシュからの読み込み
+	@param[io]	reader: キャッシュ
+	@param[i]	prims: プリミティブ
+ */
+template <int N>
+bool WideBvh<N>::Load(CacheReader& reader, const PrimitiveArray& prims)
+{
+	this->prims = &prims;
+	std::vector<unsigned int>().swap(parents);
+	std::vector<unsigned int>().swap(leaf_parents);
+	std::vector<unsigned int>().swap(instance_leaves);
+	return reader.ReadArray(nodes) && reader.ReadArray(leaves) && reader.ReadArray(blocks) && reader.ReadArray(indices);
+}
+
+template class WideBvh<4>;
+template class WideBvh<8>;
+
+/*!
+	@brief		多分岐 BVH の作成
+	@note		AVX2 が使えれば 8 分岐、使えなければ 4 分岐
+ */
+Accelerator* CreateWideBvh()
+{
+	if(cpu_has_avx2())
+		return new WideBvh<8>();
+	return new WideBvh<4>();
+}
@@ -0,0 +1,119 @@
+
+#ifndef __WIDE_BVH_H_
+#define __WIDE_BVH_H_
+
+#include <vector>
+#include "accelerator.h"
+#include "bvh.h"
+
+
+/*!
+	@brief	多分岐 BVH ノード
+	@class	WideBvhNode
+	@note	N 個の子の境界を軸、最小/最大毎に並べて(SoA)、1 回の SIMD 演算でまとめて判定する
+			child は節ならばノード番号、リーフならば K_LEAF | リーフ番号
+			空きは K_EMPTY で、境界を反転させておくので判定には引っかからない
+ */
+template <int N>
+struct WideBvhNode
+{
+	static const unsigned int K_LEAF	= 0x80000000;
+	static const unsigned int K_EMPTY	= 0xffffffff;
+
+	float			bounds[Axis_Max][2][N];	//!< [軸][0: 最小, 1: 最大][子]
+	unsigned int	child[N];
+};
+
+/*!
+	@brief	三角形ブロック
+	@struct	TriangleBlock
+	@note	リーフの三角形を N 個ずつ、交差判定に使う頂点と辺だけ SoA で並べたもの
+			法線などのシェーディング用のデータは Triangle 側に残し、交差が確定してから参照する
+			余った要素は辺を 0 にしておくので判定には引っかからない
+ */
+template <int N>
+struct TriangleBlock
+{
+	float			p0[Axis_Max][N];	//!< 頂点 0
+	float			e0[Axis_Max][N];	//!< 頂点 1 - 頂点 0
+	float			e1[Axis_Max][N];	//!< 頂点 2 - 頂点 0
+	unsigned int	index[N];			//!< プリミティブの Id
+};
+
+/*!
+	@brief	多分岐 BVH
+	@class	WideBvh
+	@note	2 分岐の Bvh を構築してから、表面積の大きい節を展開して N 分岐にまとめ直す
+			N = 4 は SSE4、N = 8 は AVX2 で子の境界を判定し、使えなければスカラーで判定する
+			どちらの幅を使うかは CreateWideBvh() が実行時に選ぶ
+			リーフの三角形は TriangleBlock にまとめ、1 本の光線と N 個の三角形を同時に判定する
+ */
+template <int N>
+class WideBvh : public Accelerator
+{
+public:
+	typedef WideBvhNode<N> Node;
+	typedef TriangleBlock<N> Block;
+
+	/*!
+		@brief	走査用の光線情報
+	 */
+	struct RayData
+	{
+		Vector3	org;
+		Vector3	dir;
+		Vector3	inv_dir;
+		int		near_side[Axis_Max];	//!< 光線の入り側(0: 最小, 1: 最大)
+	};
+	typedef int (*BoxTest)(const Node& node, const RayData& ray, float t_max, float* t_near);
+	typedef int (*TriangleTest)(const Block& block, const RayData& ray, float t_max, Primitive::Param& param);
+
+public:
+	WideBvh();
+	~WideBvh();
+
+	void Build(const PrimitiveArray& prims, const AABB& aabb);
+	bool Traverse(PrimitiveArray::Id& id, Primitive::Param& param, const Ray& ray) const;
+	bool Occluded(const Ray& ray, float t_max) const;
+	bool Refit(const std::vector<PrimitiveArray::Id>& ids);
+	void Save(CacheWriter& writer) const;
+	bool Load(CacheReader& reader, const PrimitiveArray& prims);
+
+private:
+	/*!
+		@brief	リーフ
+	 */
+	struct Leaf
+	{
+		unsigned int	offset;		//!< 三角形以外のプリミティブ
+		unsigned int	num_prims;
+		unsigned int	block;		//!< 三角形ブロック
+		unsigned int	num_blocks;
+	};
+
+	unsigned int Collapse(const MappedArray<BvhNode>& bin_nodes, const MappedArray<PrimitiveArray::Id>& bin_indices, unsigned int root);
+	void MakeLeaf(Leaf& leaf, const MappedArray<PrimitiveArray::Id>& bin_indices, const BvhNode& node);
+	void SetChild(unsigned int node, int slot, const AABB& aabb, unsigned int child);
+	void InitRay(RayData& data, const Ray& ray) const;
+	void InitRefit();
+	void CalcLeafAABB(AABB& aabb, const Leaf& leaf) const;
+	float GetChildWeight(unsigned int child) const;
+	bool SetChildAABB(unsigned int slot, const AABB& aabb);
+
+private:
+	MappedArray<Node>				nodes;		//!< 0 番がルート
+	MappedArray<Leaf>				leaves;
+	MappedArray<Block>				blocks;
+	MappedArray<PrimitiveArray::Id>	indices;	//!< リーフが参照するプリミティブ(三角形以外)
+	BoxTest							box_test;
+	TriangleTest					triangle_test;
+	std::vector<unsigned int>		parents;	//!< Refit() 用のノード毎の親のスロット(親ノード * N + 子の番号)
+	std::vector<unsigned int>		leaf_parents;		//!< Refit() 用のリーフ毎の親のスロット
+	std::vector<unsigned int>		instance_leaves;	//!< Refit() 用のインスタンス毎のリーフ
+	double							sah_cost;	//!< 面積で重み付けした子のコストの和
+	double							build_cost;	//!< Refit() する前の SAH コスト(sah_cost / ルートの面積)
+};
+
+Accelerator* CreateWideBvh();
+
+#endif // !__WIDE_BVH_H_